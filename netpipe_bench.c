@@ -0,0 +1,797 @@
+// Loopback benchmark for netpipe_forwarder and netpipe_connector.
+//
+// Runs a stand-in TCP server in-process, starts the forwarder against it in
+// each transport mode, and drives the FIFOs (or a connector's stdin/stdout)
+// with messages from 1 B to 1 MB. For every mode and size it reports:
+//   echo  round-trip throughput through an echo server, in MB/s and msg/s
+//   rtt   p50/p99/p999 ping-pong latency of one message at a time
+//   up    app->net throughput into a sink server
+//   down  net->app throughput from a source server
+//
+// `netpipe_bench server <port> <echo|sink|source>` runs the stand-in server
+// on its own for manual testing.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "netpipe_shm.h"
+#include "netpipe_metrics.h"
+
+#define PIPE_NET_TO_APP_NAME "/tmp/net_to_pipe" // FIFOs of the forwarder's -h/-p route
+#define PIPE_APP_TO_NET_NAME "/tmp/pipe_to_net"
+#define BENCH_HANDOFF_PATH "/tmp/netpipe_bench.sock"
+#define CONNECTOR_READY "Press Ctrl+D on stdin to exit.\n\n" // Last line of the connector's banner
+#define STARTUP_TIMEOUT_MS 5000
+#define STALL_TIMEOUT_MS 5000    // A phase with no progress for this long fails the mode
+#define DEFAULT_DURATION_MS 250  // Per phase, per message size
+#define MAX_PINGS 10000
+#define IO_CHUNK (256 * 1024)    // Largest single read/write issued by the driver
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long now_ms(void) {
+    return now_ns() / 1000000;
+}
+
+static void sleep_ms(int ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+// --- Stand-in TCP server ---
+// One thread per connection. The mode is global and re-read on every pass, so
+// the driver can switch an established connection between phases.
+
+#define SERVER_ECHO 0
+#define SERVER_SINK 1
+#define SERVER_SOURCE 2
+#define SERVER_IDLE 3
+
+typedef struct {
+    int listen_fd;
+    int port;
+    int mode;            // SERVER_*, set by the driver
+    int mode_ack;        // Last mode a connection thread acted on
+    size_t msg_size;     // Write size in source mode
+    uint64_t sunk;       // Bytes discarded in sink mode
+    uint64_t sourced;    // Bytes sent in source mode
+} server_t;
+
+static server_t server;
+
+static void *server_conn_thread(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    char *buf = malloc(IO_CHUNK);
+    size_t pending = 0; // Echo bytes read but not yet written back
+    size_t pending_off = 0;
+
+    while (buf != NULL) {
+        int mode = __atomic_load_n(&server.mode, __ATOMIC_ACQUIRE);
+        struct pollfd pfd = { .fd = fd, .events = 0 };
+        ssize_t n;
+
+        if (mode == SERVER_SOURCE) {
+            pfd.events = POLLOUT;
+        } else if (mode == SERVER_ECHO && pending > 0) {
+            pfd.events = POLLOUT;
+        } else if (mode != SERVER_IDLE) {
+            pfd.events = POLLIN;
+        }
+        __atomic_store_n(&server.mode_ack, mode, __ATOMIC_RELEASE);
+        if (poll(&pfd, 1, 10) <= 0) {
+            continue; // Also how a mode change is noticed
+        }
+        if (pfd.revents & (POLLERR | POLLNVAL)) {
+            break;
+        }
+        if (mode == SERVER_SOURCE) {
+            size_t size = server.msg_size < IO_CHUNK ? server.msg_size : IO_CHUNK;
+            memset(buf, 's', size);
+            n = send(fd, buf, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n > 0) {
+                __atomic_add_fetch(&server.sourced, n, __ATOMIC_RELEASE);
+            } else if (n == -1 && errno != EAGAIN) {
+                break;
+            }
+        } else if (mode == SERVER_ECHO && pending > 0) {
+            n = send(fd, buf + pending_off, pending - pending_off, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n > 0) {
+                pending_off += n;
+                if (pending_off == pending) {
+                    pending = pending_off = 0;
+                }
+            } else if (n == -1 && errno != EAGAIN) {
+                break;
+            }
+        } else if (pfd.revents & (POLLIN | POLLHUP)) {
+            n = recv(fd, buf, IO_CHUNK, MSG_DONTWAIT);
+            if (n == 0 || (n == -1 && errno != EAGAIN)) {
+                break;
+            }
+            if (n > 0 && mode == SERVER_ECHO) {
+                pending = n;
+            } else if (n > 0) {
+                __atomic_add_fetch(&server.sunk, n, __ATOMIC_RELEASE);
+            }
+        }
+    }
+    free(buf);
+    close(fd);
+    return NULL;
+}
+
+static void *server_accept_thread(void *arg) {
+    (void)arg;
+    for (;;) {
+        int fd = accept4(server.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        pthread_t tid;
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("accept");
+            return NULL;
+        }
+        if (pthread_create(&tid, NULL, server_conn_thread, (void *)(intptr_t)fd) != 0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+}
+
+// Listen on 127.0.0.1:'port' (0 picks a free port). Returns the accept thread's start status.
+static int server_start(int port, int mode, size_t msg_size, pthread_t *tid) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int one = 1;
+
+    server.mode = mode;
+    server.msg_size = msg_size;
+    server.listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server.listen_fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    setsockopt(server.listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(server.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(server.listen_fd, 16) == -1 ||
+        getsockname(server.listen_fd, (struct sockaddr *)&addr, &len) == -1) {
+        perror("bind/listen");
+        return -1;
+    }
+    server.port = ntohs(addr.sin_port);
+    return pthread_create(tid, NULL, server_accept_thread, NULL) == 0 ? 0 : -1;
+}
+
+// Switch the server and wait until the connection thread has seen the change
+static void server_set_mode(int mode) {
+    long long deadline = now_ms() + 1000;
+
+    __atomic_store_n(&server.mode, mode, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&server.mode_ack, __ATOMIC_ACQUIRE) != mode && now_ms() < deadline) {
+        sleep_ms(1);
+    }
+}
+
+// --- Forwarder and connector sessions ---
+
+#define CONN_NONE 0    // Driver uses the forwarder's FIFOs directly
+#define CONN_FIFO 1    // netpipe_connector over the FIFOs
+#define CONN_SHM 2     // netpipe_connector --shm
+#define CONN_HANDOFF 3 // netpipe_connector --handoff
+
+typedef struct {
+    const char *name;
+    const char *args[3];  // Extra forwarder arguments
+    int connector;
+} bench_mode_t;
+
+static const bench_mode_t bench_modes[] = {
+    { "epoll", { NULL }, CONN_NONE },
+    { "splice", { "--splice", NULL }, CONN_NONE },
+    { "autotune", { "--autotune", NULL }, CONN_NONE },
+    { "threads", { "--threads", NULL }, CONN_NONE },
+    { "uring", { "--uring", NULL }, CONN_NONE },
+    { "connector", { NULL }, CONN_FIFO },
+    { "shm", { "--shm", NULL }, CONN_SHM },
+    { "handoff", { "--handoff", BENCH_HANDOFF_PATH, NULL }, CONN_HANDOFF },
+};
+#define NUM_BENCH_MODES (int)(sizeof(bench_modes) / sizeof(bench_modes[0]))
+
+typedef struct {
+    pid_t forwarder;
+    pid_t connector;
+    int wfd;              // Data towards the network (FIFO or connector stdin)
+    int rfd;              // Data from the network (FIFO or connector stdout)
+} session_t;
+
+static const char *bin_dir = ".";
+static int verbose = 0;
+static char *payload; // Message contents
+
+// fork/exec with the given stdin/stdout (-1 = /dev/null). Output is discarded unless -v.
+static pid_t spawn(char *const argv[], int in_fd, int out_fd) {
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_RDWR);
+        dup2(in_fd != -1 ? in_fd : null_fd, STDIN_FILENO);
+        dup2(out_fd != -1 ? out_fd : (verbose ? STDERR_FILENO : null_fd), STDOUT_FILENO);
+        if (!verbose) {
+            dup2(null_fd, STDERR_FILENO);
+        }
+        execv(argv[0], argv);
+        perror("execv");
+        _exit(127);
+    }
+    return pid;
+}
+
+static void reap(pid_t *pid, int sig) {
+    if (*pid > 0) {
+        long long deadline = now_ms() + 2000;
+        kill(*pid, sig);
+        while (waitpid(*pid, NULL, WNOHANG) == 0) {
+            if (now_ms() > deadline) {
+                kill(*pid, SIGKILL);
+                waitpid(*pid, NULL, 0);
+                break;
+            }
+            sleep_ms(5);
+        }
+        *pid = -1;
+    }
+}
+
+// Keep retrying a non-blocking open until the forwarder has created (and, for
+// writing, opened) the FIFO
+static int open_fifo_wait(const char *path, int flags) {
+    long long deadline = now_ms() + STARTUP_TIMEOUT_MS;
+    int fd;
+
+    while ((fd = open(path, flags | O_NONBLOCK | O_CLOEXEC)) == -1) {
+        if (now_ms() > deadline) {
+            fprintf(stderr, "Timed out opening '%s': %s\n", path, strerror(errno));
+            return -1;
+        }
+        sleep_ms(5);
+    }
+    return fd;
+}
+
+static int wait_for_path(const char *path) {
+    long long deadline = now_ms() + STARTUP_TIMEOUT_MS;
+    struct stat st;
+
+    while (stat(path, &st) == -1) {
+        if (now_ms() > deadline) {
+            fprintf(stderr, "Timed out waiting for '%s'.\n", path);
+            return -1;
+        }
+        sleep_ms(5);
+    }
+    return 0;
+}
+
+// Read and drop the connector's start-up banner, which shares stdout with the data
+static int skip_connector_banner(int fd) {
+    const char *marker = CONNECTOR_READY;
+    size_t matched = 0, len = strlen(marker);
+    long long deadline = now_ms() + STARTUP_TIMEOUT_MS;
+
+    while (matched < len) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        char c;
+        if (poll(&pfd, 1, 100) > 0) {
+            if (read(fd, &c, 1) != 1) {
+                fprintf(stderr, "Connector exited during start-up.\n");
+                return -1;
+            }
+            matched = c == marker[matched] ? matched + 1 : (c == marker[0] ? 1 : 0);
+        } else if (now_ms() > deadline) {
+            fprintf(stderr, "Timed out waiting for the connector.\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Send one payload of 'len' bytes and read 'len' bytes back into 'buf' at the
+// same time, so a message larger than the pipes in between cannot deadlock
+static int exchange(session_t *s, size_t len, char *buf) {
+    size_t sent = 0, received = 0;
+
+    while (received < len) {
+        struct pollfd pfds[2] = {
+            { .fd = s->rfd, .events = POLLIN },
+            { .fd = sent < len ? s->wfd : -1, .events = POLLOUT },
+        };
+        if (poll(pfds, 2, STALL_TIMEOUT_MS) <= 0) {
+            fprintf(stderr, "  stalled (no progress for %d ms)\n", STALL_TIMEOUT_MS);
+            return -1;
+        }
+        if (pfds[1].revents & (POLLOUT | POLLERR)) {
+            ssize_t n = write(s->wfd, payload + sent, len - sent < IO_CHUNK ? len - sent : IO_CHUNK);
+            if (n > 0) {
+                sent += n;
+            } else if (n == -1 && errno != EAGAIN) {
+                perror("write");
+                return -1;
+            }
+        }
+        if (pfds[0].revents & (POLLIN | POLLHUP)) {
+            ssize_t n = read(s->rfd, buf + received, len - received < IO_CHUNK ? len - received : IO_CHUNK);
+            if (n > 0) {
+                received += n;
+            } else if (n == 0 || errno != EAGAIN) {
+                fprintf(stderr, "  read: %s\n", n == 0 ? "unexpected EOF" : strerror(errno));
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void session_close(session_t *s) {
+    if (s->wfd != -1) {
+        close(s->wfd);
+    }
+    if (s->rfd != -1) {
+        close(s->rfd);
+    }
+    s->wfd = s->rfd = -1;
+    reap(&s->connector, SIGTERM);
+    reap(&s->forwarder, SIGINT);
+}
+
+static int session_open(session_t *s, const bench_mode_t *mode) {
+    char forwarder[512], connector[512], port[16];
+    char *argv[12];
+    int argc = 0;
+
+    s->forwarder = s->connector = -1;
+    s->wfd = s->rfd = -1;
+    snprintf(forwarder, sizeof(forwarder), "%s/netpipe_forwarder", bin_dir);
+    snprintf(connector, sizeof(connector), "%s/netpipe_connector", bin_dir);
+    snprintf(port, sizeof(port), "%d", server.port);
+    unlink(PIPE_NET_TO_APP_NAME);
+    unlink(PIPE_APP_TO_NET_NAME);
+    unlink(BENCH_HANDOFF_PATH);
+
+    argv[argc++] = forwarder;
+    argv[argc++] = "-h";
+    argv[argc++] = "127.0.0.1";
+    argv[argc++] = "-p";
+    argv[argc++] = port;
+    for (int i = 0; mode->args[i]; i++) {
+        argv[argc++] = (char *)mode->args[i];
+    }
+    argv[argc] = NULL;
+    s->forwarder = spawn(argv, -1, -1);
+
+    if (mode->connector == CONN_NONE) {
+        // Reader first: the forwarder cannot open its write end without one.
+        // O_RDWR keeps reads from returning EOF before the forwarder opens it.
+        s->rfd = open_fifo_wait(PIPE_NET_TO_APP_NAME, O_RDWR);
+        s->wfd = s->rfd == -1 ? -1 : open_fifo_wait(PIPE_APP_TO_NET_NAME, O_WRONLY);
+    } else {
+        int to_conn[2], from_conn[2];
+        char shm_path[NETPIPE_SHM_MAX_NAME + 16];
+
+        if (mode->connector == CONN_SHM) {
+            snprintf(shm_path, sizeof(shm_path), "/dev/shm%s", NETPIPE_SHM_DEFAULT_NAME);
+            if (wait_for_path(shm_path) == -1) {
+                goto fail;
+            }
+            sleep_ms(20); // Created before its header is filled in
+        } else if (mode->connector == CONN_HANDOFF && wait_for_path(BENCH_HANDOFF_PATH) == -1) {
+            goto fail;
+        } else if (mode->connector == CONN_FIFO &&
+                   (wait_for_path(PIPE_NET_TO_APP_NAME) == -1 || wait_for_path(PIPE_APP_TO_NET_NAME) == -1)) {
+            goto fail; // The connector gives up if they do not exist yet
+        }
+        if (pipe2(to_conn, O_CLOEXEC) == -1 || pipe2(from_conn, O_CLOEXEC) == -1) {
+            perror("pipe2");
+            goto fail;
+        }
+        argc = 0;
+        argv[argc++] = connector;
+        if (mode->connector == CONN_SHM) {
+            argv[argc++] = "--shm";
+        } else if (mode->connector == CONN_HANDOFF) {
+            argv[argc++] = "--handoff";
+            argv[argc++] = BENCH_HANDOFF_PATH;
+        }
+        argv[argc] = NULL;
+        s->connector = spawn(argv, to_conn[0], from_conn[1]);
+        close(to_conn[0]);
+        close(from_conn[1]);
+        s->wfd = to_conn[1];
+        s->rfd = from_conn[0];
+        if (skip_connector_banner(s->rfd) == -1) {
+            goto fail;
+        }
+        fcntl(s->wfd, F_SETFL, O_NONBLOCK);
+        fcntl(s->rfd, F_SETFL, O_NONBLOCK);
+    }
+    if (s->rfd != -1 && s->wfd != -1) {
+        // First round trip waits out the forwarder's FIFO and socket retries
+        char byte;
+        server_set_mode(SERVER_ECHO);
+        if (exchange(s, 1, &byte) == 0) {
+            return 0;
+        }
+    }
+fail:
+    session_close(s);
+    return -1;
+}
+
+// --- Measurements ---
+
+typedef struct {
+    double echo_mbps, echo_msgs;
+    uint64_t rtt_p50, rtt_p99, rtt_p999; // ns
+    double up_mbps, down_mbps;
+    int failed;
+} bench_result_t;
+
+// Wait for 'events' on fd, failing after STALL_TIMEOUT_MS
+static int wait_fd(int fd, short events) {
+    struct pollfd pfd = { .fd = fd, .events = events };
+    int rc = poll(&pfd, 1, STALL_TIMEOUT_MS);
+
+    if (rc <= 0) {
+        fprintf(stderr, "  stalled (no progress for %d ms)\n", STALL_TIMEOUT_MS);
+        return -1;
+    }
+    return 0;
+}
+
+// Write 'len' bytes of the payload, waiting as needed
+static int write_all(int fd, size_t len) {
+    size_t off = 0;
+
+    while (off < len) {
+        size_t chunk = len - off < IO_CHUNK ? len - off : IO_CHUNK;
+        ssize_t n = write(fd, payload + off, chunk);
+        if (n > 0) {
+            off += n;
+        } else if (n == -1 && errno == EAGAIN) {
+            if (wait_fd(fd, POLLOUT) == -1) {
+                return -1;
+            }
+        } else {
+            perror("write");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Read exactly 'len' bytes into 'buf' (or discard them when buf is NULL)
+static int read_all(int fd, char *buf, size_t len) {
+    static char scratch[IO_CHUNK];
+    size_t off = 0;
+
+    while (off < len) {
+        size_t chunk = len - off < IO_CHUNK ? len - off : IO_CHUNK;
+        ssize_t n = read(fd, buf ? buf + off : scratch, chunk);
+        if (n > 0) {
+            off += n;
+        } else if (n == -1 && errno == EAGAIN) {
+            if (wait_fd(fd, POLLIN) == -1) {
+                return -1;
+            }
+        } else {
+            fprintf(stderr, "  read: %s\n", n == 0 ? "unexpected EOF" : strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// One message at a time through the echo server
+static int measure_rtt(session_t *s, size_t size, int duration_ms, bench_result_t *r) {
+    metrics_hist_t *hist = calloc(1, sizeof(*hist));
+    char *echo = malloc(size);
+    long long end = now_ns() + (long long)duration_ms * 1000000;
+    int rc = 0;
+
+    server_set_mode(SERVER_ECHO);
+    for (int i = 0; hist && echo && i < MAX_PINGS && (i < 5 || now_ns() < end); i++) {
+        long long start = now_ns();
+        if (exchange(s, size, echo) == -1) {
+            rc = -1;
+            break;
+        }
+        metrics_hist_record(hist, now_ns() - start);
+        if (memcmp(echo, payload, size) != 0) {
+            fprintf(stderr, "  echo corrupted at %zu bytes\n", size);
+            rc = -1;
+            break;
+        }
+    }
+    if (hist) {
+        r->rtt_p50 = metrics_hist_quantile(hist, 0.5);
+        r->rtt_p99 = metrics_hist_quantile(hist, 0.99);
+        r->rtt_p999 = metrics_hist_quantile(hist, 0.999);
+    }
+    free(hist);
+    free(echo);
+    return rc;
+}
+
+// Stream messages through the echo server while reading the echoes back
+static int measure_echo(session_t *s, size_t size, int duration_ms, bench_result_t *r) {
+    static char scratch[IO_CHUNK];
+    uint64_t sent = 0, received = 0;
+    size_t msg_off = 0;
+    long long start = now_ns(), stop = start + (long long)duration_ms * 1000000;
+
+    server_set_mode(SERVER_ECHO);
+    while (received < sent || now_ns() < stop) {
+        int sending = now_ns() < stop;
+        struct pollfd pfds[2] = {
+            { .fd = s->rfd, .events = POLLIN },
+            { .fd = sending ? s->wfd : -1, .events = POLLOUT },
+        };
+        if (poll(pfds, 2, STALL_TIMEOUT_MS) <= 0) {
+            fprintf(stderr, "  stalled (no progress for %d ms)\n", STALL_TIMEOUT_MS);
+            return -1;
+        }
+        if (pfds[1].revents & POLLOUT) {
+            // Whole messages, so small sizes cost one write each
+            ssize_t n = write(s->wfd, payload + msg_off, size - msg_off < IO_CHUNK ? size - msg_off : IO_CHUNK);
+            if (n > 0) {
+                sent += n;
+                msg_off = (msg_off + n) % size;
+            } else if (n == -1 && errno != EAGAIN) {
+                perror("write");
+                return -1;
+            }
+        }
+        if (pfds[0].revents & (POLLIN | POLLHUP)) {
+            ssize_t n = read(s->rfd, scratch, sizeof(scratch));
+            if (n > 0) {
+                received += n;
+            } else if (n == 0 || errno != EAGAIN) {
+                fprintf(stderr, "  read: %s\n", n == 0 ? "unexpected EOF" : strerror(errno));
+                return -1;
+            }
+        }
+    }
+    double secs = (now_ns() - start) / 1e9;
+    r->echo_mbps = sent / secs / 1e6;
+    r->echo_msgs = sent / (double)size / secs;
+    return 0;
+}
+
+// app->net only: write into a sink server until the duration is up, then wait for it to arrive
+static int measure_up(session_t *s, size_t size, int duration_ms, bench_result_t *r) {
+    uint64_t base, sent = 0;
+    long long start, stop, deadline;
+
+    server_set_mode(SERVER_SINK);
+    base = __atomic_load_n(&server.sunk, __ATOMIC_ACQUIRE);
+    start = now_ns();
+    stop = start + (long long)duration_ms * 1000000;
+    while (now_ns() < stop) {
+        if (write_all(s->wfd, size) == -1) {
+            return -1;
+        }
+        sent += size;
+    }
+    deadline = now_ms() + STALL_TIMEOUT_MS;
+    while (__atomic_load_n(&server.sunk, __ATOMIC_ACQUIRE) - base < sent) {
+        if (now_ms() > deadline) {
+            fprintf(stderr, "  sink stalled\n");
+            return -1;
+        }
+        sched_yield();
+    }
+    r->up_mbps = sent / ((now_ns() - start) / 1e9) / 1e6;
+    return 0;
+}
+
+// net->app only: let a source server send for the duration, then read what it sent
+static int measure_down(session_t *s, size_t size, int duration_ms, bench_result_t *r) {
+    static char scratch[IO_CHUNK];
+    uint64_t base, received = 0, total;
+    long long start, stop;
+
+    server.msg_size = size;
+    base = __atomic_load_n(&server.sourced, __ATOMIC_ACQUIRE);
+    server_set_mode(SERVER_SOURCE);
+    start = now_ns();
+    stop = start + (long long)duration_ms * 1000000;
+    while (now_ns() < stop) {
+        if (wait_fd(s->rfd, POLLIN) == -1) {
+            return -1;
+        }
+        ssize_t n = read(s->rfd, scratch, sizeof(scratch));
+        if (n > 0) {
+            received += n;
+        } else if (n == 0 || errno != EAGAIN) {
+            fprintf(stderr, "  read: %s\n", n == 0 ? "unexpected EOF" : strerror(errno));
+            return -1;
+        }
+    }
+    server_set_mode(SERVER_IDLE);
+    total = __atomic_load_n(&server.sourced, __ATOMIC_ACQUIRE) - base;
+    if (read_all(s->rfd, NULL, total - received) == -1) {
+        return -1;
+    }
+    r->down_mbps = total / ((now_ns() - start) / 1e9) / 1e6;
+    return 0;
+}
+
+static void print_result(const char *mode, size_t size, const bench_result_t *r) {
+    if (r->failed) {
+        printf("%-10s %8zu  FAILED\n", mode, size);
+    } else {
+        printf("%-10s %8zu %10.2f %11.0f %9.1f %9.1f %9.1f %10.2f %10.2f\n", mode, size, r->echo_mbps, r->echo_msgs,
+               r->rtt_p50 / 1e3, r->rtt_p99 / 1e3, r->rtt_p999 / 1e3, r->up_mbps, r->down_mbps);
+    }
+    fflush(stdout);
+}
+
+static void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--modes m1,m2,...] [--sizes s1,s2,...] [--duration ms] [--bin-dir dir] [-v]\n", prog);
+    fprintf(stderr, "       %s server <port> <echo|sink|source> [msg_size]\n\n", prog);
+    fprintf(stderr, "Benchmarks netpipe_forwarder (and netpipe_connector) on loopback against a built-in\n");
+    fprintf(stderr, "TCP server. Uses the default FIFOs %s and %s.\n\n", PIPE_NET_TO_APP_NAME, PIPE_APP_TO_NET_NAME);
+    fprintf(stderr, "  --modes     Transports to run (default: all):");
+    for (int i = 0; i < NUM_BENCH_MODES; i++) {
+        fprintf(stderr, " %s", bench_modes[i].name);
+    }
+    fprintf(stderr, "\n  --sizes     Message sizes in bytes (default 1,16,256,4096,65536,1048576).\n");
+    fprintf(stderr, "  --duration  Milliseconds per measurement (default %d).\n", DEFAULT_DURATION_MS);
+    fprintf(stderr, "  --bin-dir   Where the forwarder and connector binaries are (default .).\n");
+    fprintf(stderr, "  -v          Show forwarder and connector output.\n");
+}
+
+static int run_server(int argc, char *argv[]) {
+    pthread_t tid;
+    int mode;
+
+    if (argc < 4) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (strcmp(argv[3], "echo") == 0) {
+        mode = SERVER_ECHO;
+    } else if (strcmp(argv[3], "sink") == 0) {
+        mode = SERVER_SINK;
+    } else if (strcmp(argv[3], "source") == 0) {
+        mode = SERVER_SOURCE;
+    } else {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (server_start(atoi(argv[2]), mode, argc > 4 ? (size_t)atol(argv[4]) : 4096, &tid) == -1) {
+        return EXIT_FAILURE;
+    }
+    printf("Serving %s on 127.0.0.1:%d\n", argv[3], server.port);
+    fflush(stdout);
+    pthread_join(tid, NULL);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+    size_t sizes[32] = { 1, 16, 256, 4096, 65536, 1048576 };
+    int num_sizes = 6;
+    int duration_ms = DEFAULT_DURATION_MS;
+    const char *mode_list = NULL;
+    size_t max_size = 0;
+    pthread_t server_tid;
+    int failures = 0;
+
+    signal(SIGPIPE, SIG_IGN);
+    if (argc > 1 && strcmp(argv[1], "server") == 0) {
+        return run_server(argc, argv);
+    }
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--modes") == 0 && i + 1 < argc) {
+            mode_list = argv[++i];
+        } else if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+            char *list = argv[++i], *tok, *save = NULL;
+            num_sizes = 0;
+            for (tok = strtok_r(list, ",", &save); tok && num_sizes < 32; tok = strtok_r(NULL, ",", &save)) {
+                sizes[num_sizes] = strtoul(tok, NULL, 10);
+                if (sizes[num_sizes] > 0) {
+                    num_sizes++;
+                }
+            }
+        } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+            duration_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bin-dir") == 0 && i + 1 < argc) {
+            bin_dir = argv[++i];
+        } else if (strcmp(argv[i], "-v") == 0) {
+            verbose = 1;
+        } else {
+            print_usage(argv[0]);
+            return strcmp(argv[i], "--help") == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (num_sizes == 0 || duration_ms <= 0) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < num_sizes; i++) {
+        max_size = sizes[i] > max_size ? sizes[i] : max_size;
+    }
+    payload = malloc(max_size);
+    if (payload == NULL) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < max_size; i++) {
+        payload[i] = 'a' + i % 26;
+    }
+    if (server_start(0, SERVER_IDLE, 4096, &server_tid) == -1) {
+        return EXIT_FAILURE;
+    }
+
+    printf("%-10s %8s %10s %11s %9s %9s %9s %10s %10s\n", "mode", "bytes", "echo MB/s", "echo msg/s",
+           "p50 us", "p99 us", "p999 us", "up MB/s", "down MB/s");
+    for (int m = 0; m < NUM_BENCH_MODES; m++) {
+        const bench_mode_t *mode = &bench_modes[m];
+        session_t session;
+
+        if (mode_list) {
+            size_t len = strlen(mode->name);
+            const char *hit = strstr(mode_list, mode->name);
+            if (hit == NULL || (hit != mode_list && hit[-1] != ',') || (hit[len] != '\0' && hit[len] != ',')) {
+                continue;
+            }
+        }
+        if (session_open(&session, mode) == -1) {
+            printf("%-10s failed to start\n", mode->name);
+            failures++;
+            continue;
+        }
+        for (int i = 0; i < num_sizes; i++) {
+            bench_result_t r;
+            memset(&r, 0, sizeof(r));
+            r.failed = measure_rtt(&session, sizes[i], duration_ms, &r) == -1 ||
+                       measure_echo(&session, sizes[i], duration_ms, &r) == -1 ||
+                       measure_up(&session, sizes[i], duration_ms, &r) == -1 ||
+                       measure_down(&session, sizes[i], duration_ms, &r) == -1;
+            print_result(mode->name, sizes[i], &r);
+            if (r.failed) {
+                failures++;
+                break; // The session's streams are out of step now
+            }
+        }
+        server_set_mode(SERVER_IDLE);
+        session_close(&session);
+    }
+    unlink(BENCH_HANDOFF_PATH);
+    free(payload);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,382 @@
+// Traffic capture for netpipe_forwarder, replayed by netpipe_connector --replay.
+//
+// A capture log is a file preallocated to its full size, mapped, and filled
+// front to back: a header, then one record per chunk the forwarder read,
+// {timestamp, length, route, direction} followed by the payload and padded to
+// 8 bytes. Workers never touch the file. Each copies its chunks into its own
+// lock-free single-producer/single-consumer byte ring and carries on; when
+// the ring is full the chunk is counted as dropped instead of stalling the
+// data path. One writer thread drains every ring into the mapping and sleeps
+// on a doorbell (see netpipe_shm.h) while they are all empty, so a worker
+// pays a memcpy and a fence per chunk and a futex wake only when the writer
+// was idle.
+//
+// The header's 'used' length is published after every drain, so a log can be
+// read while it grows or after a crash. On a clean stop the file is truncated
+// to the records actually written.
+
+#ifndef NETPIPE_CAPTURE_H
+#define NETPIPE_CAPTURE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "netpipe_shm.h"
+
+#define NETPIPE_CAPTURE_MAGIC 0x4e504341u // "NPCA"
+#define NETPIPE_CAPTURE_VERSION 1
+#define CAPTURE_DEFAULT_SIZE (1024ULL * 1024 * 1024) // Log file size (sparse until written)
+#define CAPTURE_QUEUE_SIZE (4 * 1024 * 1024)          // Ring per worker; a power of two
+#define CAPTURE_MAX_PAYLOAD (CAPTURE_QUEUE_SIZE / 4)  // Longer chunks are split
+
+// Record directions, numbered like the forwarder's DIR_* constants
+#define CAPTURE_NET_TO_APP 0
+#define CAPTURE_APP_TO_NET 1
+
+#define CAPTURE_FLAG_ROUTE 1 // Payload is the route's "address:port fifo" name, not traffic
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t start_unix_ns;    // Wall clock when capture began
+    uint64_t used;             // Bytes of records after the header (written last)
+    uint64_t dropped_chunks;   // Lost because a queue or the log was full
+    uint64_t dropped_bytes;
+    uint64_t reserved[3];
+} capture_header_t;
+
+typedef struct {
+    uint64_t ts_ns;            // Since the capture started
+    uint32_t len;              // Payload bytes; the record is padded to 8
+    uint16_t route;            // Route id, named by an earlier CAPTURE_FLAG_ROUTE record
+    uint8_t dir;               // CAPTURE_NET_TO_APP or CAPTURE_APP_TO_NET
+    uint8_t flags;
+} capture_record_t;
+
+// One worker's queue. head and tail count every byte ever written and read;
+// only the worker stores head and drops, only the writer stores tail.
+typedef struct {
+    _Alignas(64) uint64_t head;
+    uint64_t dropped_chunks;
+    uint64_t dropped_bytes;
+    _Alignas(64) uint64_t tail;
+    char *data;
+} capture_queue_t;
+
+typedef struct {
+    int fd;
+    char *map;                 // Header followed by records
+    uint64_t size;             // Length of the file and the mapping
+    uint64_t start_ns;         // CLOCK_MONOTONIC at start; record timestamps count from here
+    capture_queue_t *queues;
+    int queue_count;
+    shm_bell_t bell;           // Rung by workers, slept on by the writer
+    int stop;
+    pthread_t tid;
+    // Writer thread only (read relaxed for stats)
+    uint64_t used;
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t log_dropped_chunks; // The file filled up
+    uint64_t log_dropped_bytes;
+} capture_t;
+
+static inline uint64_t capture_record_size(uint32_t len) {
+    return sizeof(capture_record_t) + (((uint64_t)len + 7) & ~(uint64_t)7);
+}
+
+static inline uint64_t capture_clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Copy into / out of a queue at absolute position 'pos', wrapping at the end
+static inline void capture_queue_put(capture_queue_t *q, uint64_t pos, const void *src, size_t len) {
+    size_t off = pos & (CAPTURE_QUEUE_SIZE - 1);
+    size_t first = CAPTURE_QUEUE_SIZE - off < len ? CAPTURE_QUEUE_SIZE - off : len;
+
+    memcpy(q->data + off, src, first);
+    memcpy(q->data, (const char *)src + first, len - first);
+}
+
+static inline void capture_queue_get(capture_queue_t *q, uint64_t pos, void *dst, size_t len) {
+    size_t off = pos & (CAPTURE_QUEUE_SIZE - 1);
+    size_t first = CAPTURE_QUEUE_SIZE - off < len ? CAPTURE_QUEUE_SIZE - off : len;
+
+    memcpy(dst, q->data + off, first);
+    memcpy((char *)dst + first, q->data, len - first);
+}
+
+// Worker: queue one record whose payload is bytes [skip, skip + n) of 'iov'.
+// Never blocks; returns -1 (and counts the loss) if the queue is full.
+static inline int capture_push(capture_t *cap, int queue, uint16_t route, int dir, int flags,
+                               const struct iovec *iov, int cnt, size_t skip, size_t n) {
+    capture_queue_t *q = &cap->queues[queue];
+    uint64_t head = q->head; // Only we write it
+    uint64_t total = capture_record_size(n);
+    uint64_t pos;
+    capture_record_t rec;
+
+    if (total > CAPTURE_QUEUE_SIZE - (head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE))) {
+        __atomic_store_n(&q->dropped_chunks, q->dropped_chunks + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&q->dropped_bytes, q->dropped_bytes + n, __ATOMIC_RELAXED);
+        return -1;
+    }
+    memset(&rec, 0, sizeof(rec));
+    rec.ts_ns = capture_clock_ns(CLOCK_MONOTONIC) - cap->start_ns;
+    rec.len = n;
+    rec.route = route;
+    rec.dir = dir;
+    rec.flags = flags;
+    capture_queue_put(q, head, &rec, sizeof(rec));
+    pos = head + sizeof(rec);
+    for (int i = 0; i < cnt && n > 0; i++) {
+        size_t len = iov[i].iov_len;
+
+        if (skip >= len) {
+            skip -= len;
+            continue;
+        }
+        len = len - skip < n ? len - skip : n;
+        capture_queue_put(q, pos, (char *)iov[i].iov_base + skip, len);
+        pos += len;
+        n -= len;
+        skip = 0;
+    }
+    __atomic_store_n(&q->head, head + total, __ATOMIC_RELEASE);
+    shm_bell_ring(&cap->bell);
+    return 0;
+}
+
+// Worker: record the first 'n' bytes of 'iov', split so no record outgrows the queue
+static inline void capture_chunk(capture_t *cap, int queue, uint16_t route, int dir,
+                                 const struct iovec *iov, int cnt, size_t n) {
+    for (size_t off = 0; off < n; off += CAPTURE_MAX_PAYLOAD) {
+        size_t len = n - off < CAPTURE_MAX_PAYLOAD ? n - off : CAPTURE_MAX_PAYLOAD;
+        capture_push(cap, queue, route, dir, 0, iov, cnt, off, len);
+    }
+}
+
+// Worker: name a route id for the replay tool
+static inline void capture_route_name(capture_t *cap, int queue, uint16_t route, const char *name) {
+    struct iovec iov = { (void *)name, strlen(name) };
+    capture_push(cap, queue, route, CAPTURE_NET_TO_APP, CAPTURE_FLAG_ROUTE, &iov, 1, 0, iov.iov_len);
+}
+
+static inline uint64_t capture_queue_pending(capture_queue_t *q) {
+    return __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) - q->tail;
+}
+
+// Any thread: chunks and payload bytes lost so far, to full queues or a full log
+static inline void capture_dropped(capture_t *cap, uint64_t *chunks, uint64_t *bytes) {
+    *chunks = __atomic_load_n(&cap->log_dropped_chunks, __ATOMIC_RELAXED);
+    *bytes = __atomic_load_n(&cap->log_dropped_bytes, __ATOMIC_RELAXED);
+    for (int i = 0; i < cap->queue_count; i++) {
+        *chunks += __atomic_load_n(&cap->queues[i].dropped_chunks, __ATOMIC_RELAXED);
+        *bytes += __atomic_load_n(&cap->queues[i].dropped_bytes, __ATOMIC_RELAXED);
+    }
+}
+
+// Writer: move everything queued into the log. Returns the bytes consumed.
+static inline uint64_t capture_drain(capture_t *cap) {
+    capture_header_t *hdr = (capture_header_t *)cap->map;
+    uint64_t room = cap->size - sizeof(capture_header_t);
+    uint64_t moved = 0;
+
+    for (int i = 0; i < cap->queue_count; i++) {
+        capture_queue_t *q = &cap->queues[i];
+        uint64_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = q->tail;
+
+        while (tail != head) {
+            capture_record_t rec;
+            uint64_t total;
+
+            capture_queue_get(q, tail, &rec, sizeof(rec));
+            total = capture_record_size(rec.len);
+            if (cap->used + total <= room) {
+                capture_queue_get(q, tail, cap->map + sizeof(capture_header_t) + cap->used, total);
+                __atomic_store_n(&cap->used, cap->used + total, __ATOMIC_RELAXED);
+                __atomic_store_n(&cap->records, cap->records + 1, __ATOMIC_RELAXED);
+                __atomic_store_n(&cap->bytes, cap->bytes + rec.len, __ATOMIC_RELAXED);
+            } else {
+                __atomic_store_n(&cap->log_dropped_chunks, cap->log_dropped_chunks + 1, __ATOMIC_RELAXED);
+                __atomic_store_n(&cap->log_dropped_bytes, cap->log_dropped_bytes + rec.len, __ATOMIC_RELAXED);
+            }
+            tail += total;
+            moved += total;
+        }
+        __atomic_store_n(&q->tail, tail, __ATOMIC_RELEASE);
+    }
+    capture_dropped(cap, &hdr->dropped_chunks, &hdr->dropped_bytes);
+    __atomic_store_n(&hdr->used, cap->used, __ATOMIC_RELEASE);
+    return moved;
+}
+
+static inline void *capture_writer_thread(void *arg) {
+    capture_t *cap = (capture_t *)arg;
+
+    while (!__atomic_load_n(&cap->stop, __ATOMIC_ACQUIRE)) {
+        uint32_t seen = __atomic_load_n(&cap->bell.seq, __ATOMIC_ACQUIRE);
+        int pending = 0;
+
+        if (capture_drain(cap) > 0) {
+            continue;
+        }
+        shm_bell_arm(&cap->bell);
+        for (int i = 0; i < cap->queue_count && !pending; i++) {
+            pending = capture_queue_pending(&cap->queues[i]) > 0;
+        }
+        if (!pending && !__atomic_load_n(&cap->stop, __ATOMIC_ACQUIRE)) {
+            shm_futex(&cap->bell.seq, FUTEX_WAIT, seen); // Returns at once if rung meanwhile
+        }
+        shm_bell_disarm(&cap->bell);
+    }
+    capture_drain(cap); // Whatever the workers queued before they stopped
+    return NULL;
+}
+
+// Create the log at 'path' (replacing any old one), 'size' bytes including
+// the header, with one queue per worker, and start the writer thread.
+static inline capture_t *capture_open(const char *path, uint64_t size, int queue_count) {
+    capture_t *cap = calloc(1, sizeof(*cap));
+    capture_header_t *hdr;
+
+    if (cap == NULL || (cap->queues = calloc(queue_count, sizeof(*cap->queues))) == NULL) {
+        perror("calloc capture");
+        free(cap);
+        return NULL;
+    }
+    cap->queue_count = queue_count;
+    for (int i = 0; i < queue_count; i++) {
+        cap->queues[i].data = mmap(NULL, CAPTURE_QUEUE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (cap->queues[i].data == MAP_FAILED) {
+            perror("mmap capture queue");
+            cap->queue_count = i;
+            goto fail;
+        }
+    }
+    cap->size = size;
+    cap->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (cap->fd == -1 || ftruncate(cap->fd, size) == -1) {
+        fprintf(stderr, "Error creating capture log '%s': %s\n", path, strerror(errno));
+        goto fail;
+    }
+    cap->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, cap->fd, 0);
+    if (cap->map == MAP_FAILED) {
+        perror("mmap capture log");
+        cap->map = NULL;
+        goto fail;
+    }
+    hdr = (capture_header_t *)cap->map;
+    hdr->version = NETPIPE_CAPTURE_VERSION;
+    hdr->start_unix_ns = capture_clock_ns(CLOCK_REALTIME);
+    cap->start_ns = capture_clock_ns(CLOCK_MONOTONIC);
+    __atomic_store_n(&hdr->magic, NETPIPE_CAPTURE_MAGIC, __ATOMIC_RELEASE);
+    if (pthread_create(&cap->tid, NULL, capture_writer_thread, cap) != 0) {
+        perror("Error creating capture writer thread");
+        goto fail;
+    }
+    return cap;
+
+fail:
+    if (cap->map) {
+        munmap(cap->map, size);
+    }
+    if (cap->fd > 0) {
+        close(cap->fd);
+    }
+    for (int i = 0; i < cap->queue_count; i++) {
+        munmap(cap->queues[i].data, CAPTURE_QUEUE_SIZE);
+    }
+    free(cap->queues);
+    free(cap);
+    return NULL;
+}
+
+// Stop the writer once the workers have stopped, and trim the file to what was written
+static inline void capture_close(capture_t *cap) {
+    __atomic_store_n(&cap->stop, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&cap->bell.seq, 1, __ATOMIC_RELEASE);
+    shm_futex(&cap->bell.seq, FUTEX_WAKE, INT_MAX);
+    pthread_join(cap->tid, NULL);
+    msync(cap->map, sizeof(capture_header_t) + cap->used, MS_SYNC);
+    munmap(cap->map, cap->size);
+    if (ftruncate(cap->fd, sizeof(capture_header_t) + cap->used) == -1) {
+        perror("ftruncate capture log");
+    }
+    close(cap->fd);
+    for (int i = 0; i < cap->queue_count; i++) {
+        munmap(cap->queues[i].data, CAPTURE_QUEUE_SIZE);
+    }
+    free(cap->queues);
+    free(cap);
+}
+
+// Reader: map a log for replay. Returns the header, or NULL after printing why.
+// *used is the length of records to read: 'used' as the header had it when
+// mapped (a live log keeps growing), checked to hold only whole records, so
+// a walk that stops at it never leaves the mapping even if the file is
+// truncated or corrupt.
+static inline capture_header_t *capture_map(const char *path, size_t *map_size, uint64_t *used) {
+    struct stat st;
+    capture_header_t *hdr;
+    const char *records;
+    uint64_t off, size;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "Error opening capture log '%s': %s\n", path, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return NULL;
+    }
+    if ((size_t)st.st_size < sizeof(capture_header_t)) {
+        fprintf(stderr, "'%s' is not a capture log.\n", path);
+        close(fd);
+        return NULL;
+    }
+    hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        perror("mmap capture log");
+        return NULL;
+    }
+    if (hdr->magic != NETPIPE_CAPTURE_MAGIC || hdr->version != NETPIPE_CAPTURE_VERSION) {
+        fprintf(stderr, "'%s' is not a capture log this version can read.\n", path);
+        munmap(hdr, st.st_size);
+        return NULL;
+    }
+    *used = __atomic_load_n(&hdr->used, __ATOMIC_ACQUIRE);
+    if (*used > (uint64_t)st.st_size - sizeof(capture_header_t)) {
+        fprintf(stderr, "'%s': truncated capture log (%llu bytes of records claimed, %llu in the file).\n", path,
+                (unsigned long long)*used, (unsigned long long)(st.st_size - sizeof(capture_header_t)));
+        munmap(hdr, st.st_size);
+        return NULL;
+    }
+    records = (const char *)(hdr + 1);
+    for (off = 0; off < *used; off += size) {
+        size = *used - off < sizeof(capture_record_t) ? 0 : capture_record_size(((const capture_record_t *)(records + off))->len);
+        if (size == 0 || size > *used - off) {
+            fprintf(stderr, "'%s': truncated capture log (the record at offset %llu runs past the %llu bytes written).\n",
+                    path, (unsigned long long)off, (unsigned long long)*used);
+            munmap(hdr, st.st_size);
+            return NULL;
+        }
+    }
+    *map_size = st.st_size;
+    return hdr;
+}
+
+#endif // NETPIPE_CAPTURE_H
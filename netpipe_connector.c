@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // For splice()
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -6,30 +7,1065 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/select.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <limits.h>
+#include <time.h>
+
+#include "netpipe_shm.h"
+#include "netpipe_metrics.h"
+#include "netpipe_capture.h"
 
 #define PIPE_NET_TO_APP_NAME "/tmp/net_to_pipe"  // Data from network to application (this connector reads from here)
 #define PIPE_APP_TO_NET_NAME "/tmp/pipe_to_net" // Data from application to network (this connector writes here)
 #define BUFFER_SIZE 4096
+#define COPY_BUFFER_SIZE (64 * 1024)    // Copy paths: FIFO mode where splice() is refused, and --handoff
+#define SPLICE_CHUNK_SIZE (1024 * 1024) // Upper bound on bytes moved per splice() call
+#define PROBE_DEFAULT_PORT 12345
+#define PROBE_DEFAULT_COUNT 10000
+#define PROBE_DEFAULT_RATE 1000         // Pings per second
+#define PROBE_DEFAULT_SIZE 64
+#define PROBE_MAGIC 0x4e505052          // "NPPR"
 
 void print_usage(const char *prog_name) {
-    fprintf(stderr, "Usage: %s\n", prog_name);
+    fprintf(stderr, "Usage: %s [--control <fifo>] [--shm [segment] | --handoff <path> [address:port]]\n", prog_name);
+    fprintf(stderr, "       %s --stats <path> [prometheus]\n", prog_name);
+    fprintf(stderr, "       %s --replay <log> [--speed <x> | --fast] [--dir app|net] [--route <id>] [--to host:port] [--linger <ms>]\n", prog_name);
+    fprintf(stderr, "       %s --probe [--port <n>] [--count <n>] [--rate <n>] [--size <bytes>] [--linger <ms>]\n", prog_name);
     fprintf(stderr, "This program connects to the named pipes created by netpipe_forwarder.\n");
     fprintf(stderr, "It forwards data from its standard input to the network via one pipe,\n");
-    fprintf(stderr, "and forwards data from the network to its standard output via the other pipe.\n\n");
+    fprintf(stderr, "and forwards data from the network to its standard output via the other pipe.\n");
+    fprintf(stderr, "Data moves with splice(2) when stdin/stdout allow it (pipes, files, sockets), else it is copied.\n\n");
+    fprintf(stderr, "  --control <fifo> Take commands from this FIFO (created if missing): 'quit' ends the\n");
+    fprintf(stderr, "                   session, e.g. echo quit > <fifo>. The data itself is never inspected.\n");
+    fprintf(stderr, "  --shm [segment]  Attach to the shared-memory rings of a forwarder started with --shm\n");
+    fprintf(stderr, "                   instead of the named pipes (default segment %s).\n", NETPIPE_SHM_DEFAULT_NAME);
+    fprintf(stderr, "  --handoff <path> [address:port]\n");
+    fprintf(stderr, "                   Take over the TCP socket of a forwarder started with --handoff <path>\n");
+    fprintf(stderr, "                   and talk to the network directly (default: its first route).\n");
+    fprintf(stderr, "  --stats <path> [prometheus]\n");
+    fprintf(stderr, "                   Print the metrics of a forwarder started with --stats <path> and exit.\n");
+    fprintf(stderr, "  --replay <log>   Play back a log written by netpipe_forwarder --capture and report\n");
+    fprintf(stderr, "                   throughput, schedule lag and response latency. By default the\n");
+    fprintf(stderr, "                   app->net chunks of the first route go into %s at\n", PIPE_APP_TO_NET_NAME);
+    fprintf(stderr, "                   their recorded pace. --speed <x> plays x times faster, --fast without\n");
+    fprintf(stderr, "                   pauses. --dir net plays the network instead, into %s.\n", PIPE_NET_TO_APP_NAME);
+    fprintf(stderr, "                   --to host:port sends to a server directly instead of the FIFOs.\n");
+    fprintf(stderr, "                   --linger <ms> waits for responses after the last chunk (default 1000).\n");
+    fprintf(stderr, "  --probe          Measure round trips through the forwarder: act as a loopback echo\n");
+    fprintf(stderr, "                   server on 127.0.0.1:<port> (default %d; start the forwarder with\n", PROBE_DEFAULT_PORT);
+    fprintf(stderr, "                   -h 127.0.0.1 -p <port>), send --count timestamped pings of --size\n");
+    fprintf(stderr, "                   bytes (default %d, %d) at --rate per second (default %d) into\n",
+            PROBE_DEFAULT_COUNT, PROBE_DEFAULT_SIZE, PROBE_DEFAULT_RATE);
+    fprintf(stderr, "                   %s and print RTT percentiles of the echoes.\n\n", PIPE_APP_TO_NET_NAME);
     fprintf(stderr, "Ensure netpipe_forwarder is running before starting this connector.\n");
 }
 
-int main(int argc, char *argv[]) {
-    if (argc > 1 && strcmp(argv[1], "-h") == 0) {
-        print_usage(argv[0]);
-        exit(EXIT_SUCCESS);
+// --- Control channel (--control) ---
+// Commands arrive on a FIFO of their own, one per line, so the data streams
+// are never scanned for them. It is opened read-write: writers may come and
+// go without us ever seeing end-of-file.
+
+static int control_fd = -1;
+
+static int control_open(const char *path) {
+    if (mkfifo(path, 0600) == -1 && errno != EEXIST) {
+        perror("Failed to create control FIFO");
+        return -1;
+    }
+    control_fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (control_fd == -1) {
+        perror("Failed to open control FIFO");
+        return -1;
+    }
+    printf("Control FIFO '%s' ready; write 'quit' to it to end the session.\n", path);
+    return 0;
+}
+
+// Read pending commands. Returns 1 once 'quit' has arrived.
+static int control_quit_requested(void) {
+    static char line[256];
+    static size_t len;
+    ssize_t n;
+
+    while ((n = read(control_fd, line + len, sizeof(line) - 1 - len)) > 0) {
+        char *start = line, *nl;
+
+        len += n;
+        line[len] = '\0';
+        while ((nl = memchr(start, '\n', line + len - start)) != NULL) {
+            *nl = '\0';
+            if (nl > start && nl[-1] == '\r') {
+                nl[-1] = '\0';
+            }
+            if (strcmp(start, "quit") == 0) {
+                printf("Quit command received. Shutting down.\n");
+                return 1;
+            }
+            if (*start) {
+                fprintf(stderr, "Unknown control command '%s' (only 'quit' is understood).\n", start);
+            }
+            start = nl + 1;
+        }
+        len -= start - line;
+        memmove(line, start, len);
+        if (len == sizeof(line) - 1) {
+            len = 0; // Overlong line: discard it
+        }
     }
+    return 0;
+}
+
+// Shared-memory equivalent of run_fifo_connector(): stdin goes straight
+// into the app->net ring and the net->app ring goes straight to stdout.
+static int run_shm_connector(const char *name) {
+    shm_header_t *hdr;
+    shm_bridge_t bridge;
+    struct iovec iov[2];
+    int bell_fd;
+    int status = EXIT_SUCCESS;
+
+    printf("Attaching to shared-memory segment '%s'...\n", name);
+    hdr = shm_segment_attach(name);
+    if (hdr == NULL) {
+        fprintf(stderr, "Is the netpipe_forwarder running with --shm?\n");
+        return EXIT_FAILURE;
+    }
+    bell_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (bell_fd == -1 || shm_bridge_start(&bridge, &hdr->connector_bell, bell_fd) == -1) {
+        perror("Failed to start shared-memory bridge");
+        shm_segment_detach(hdr);
+        return EXIT_FAILURE;
+    }
+    __atomic_store_n(&hdr->connector_attached, 1, __ATOMIC_RELEASE);
+
+    printf("\nRings attached. Forwarding data. Press Ctrl+D on stdin to exit.\n\n");
+    fflush(stdout);
+
+    while (1) {
+        // Drain everything the forwarder has produced
+        int cnt;
+        while ((cnt = shm_ring_used_iov(hdr, &hdr->net_to_app, iov)) > 0) {
+            ssize_t n = writev(STDOUT_FILENO, iov, cnt);
+            if (n == -1) {
+                perror("Error writing to stdout");
+                status = EXIT_FAILURE;
+                goto done;
+            }
+            shm_ring_consume(&hdr->net_to_app, n);
+            shm_bell_ring(&hdr->forwarder_bell);
+        }
+        if (__atomic_load_n(&hdr->forwarder_closed, __ATOMIC_ACQUIRE)) {
+            printf("Network pipe closed by forwarder. Exiting.\n");
+            break;
+        }
+
+        // Arm our bell before sleeping, then re-check so no wakeup is lost
+        int have_space = shm_ring_free_iov(hdr, &hdr->app_to_net, iov, UINT64_MAX) > 0;
+        shm_bell_arm(&hdr->connector_bell);
+        if (shm_ring_used(&hdr->net_to_app) > 0 || __atomic_load_n(&hdr->forwarder_closed, __ATOMIC_ACQUIRE) ||
+            (!have_space && shm_ring_free_iov(hdr, &hdr->app_to_net, iov, UINT64_MAX) > 0)) {
+            shm_bell_disarm(&hdr->connector_bell);
+            continue;
+        }
+
+        struct pollfd pfds[3] = {
+            { .fd = bell_fd, .events = POLLIN },
+            { .fd = have_space ? STDIN_FILENO : -1, .events = POLLIN }, // Full ring: leave stdin unread
+            { .fd = control_fd, .events = POLLIN },
+        };
+        int activity = poll(pfds, 3, -1);
+        shm_bell_disarm(&hdr->connector_bell);
+        if (activity < 0 && errno != EINTR) {
+            perror("poll error");
+            status = EXIT_FAILURE;
+            break;
+        }
+        if (activity <= 0) {
+            continue;
+        }
+        if ((pfds[2].revents & POLLIN) && control_quit_requested()) {
+            break;
+        }
+        if (pfds[0].revents & POLLIN) {
+            uint64_t counter;
+            if (read(bell_fd, &counter, sizeof(counter)) == -1 && errno != EAGAIN) {
+                perror("Error reading eventfd");
+            }
+        }
 
+        // If stdin has data, read it straight into the ring going to the network
+        if (pfds[1].revents & (POLLIN | POLLHUP)) {
+            cnt = shm_ring_free_iov(hdr, &hdr->app_to_net, iov, UINT64_MAX);
+            ssize_t bytes_read = readv(STDIN_FILENO, iov, cnt);
+            if (bytes_read > 0) {
+                shm_ring_produce(&hdr->app_to_net, bytes_read);
+                shm_bell_ring(&hdr->forwarder_bell);
+            } else if (bytes_read == 0) { // EOF from stdin (Ctrl+D)
+                printf("Stdin closed. Detaching from the rings.\n");
+                break; // Exit the loop
+            } else {
+                perror("Error reading from stdin");
+                status = EXIT_FAILURE;
+                break;
+            }
+        }
+    }
+
+done:
+    __atomic_store_n(&hdr->connector_attached, 0, __ATOMIC_RELEASE);
+    shm_bridge_stop(&bridge);
+    close(bell_fd);
+    shm_segment_detach(hdr);
+    printf("Connector finished.\n");
+    return status;
+}
+
+// Connect to a forwarder's Unix socket. Returns the fd or -1.
+static int connect_unix(const char *path) {
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("Failed to connect to forwarder socket");
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+// Ask the forwarder's control socket for a route's TCP socket and wait for it.
+// 'request' is "GET ...\n" or "DEAD\n". Returns the received fd or -1.
+static int handoff_request(int handoff_fd, const char *request) {
+    char reply[300];
+    struct msghdr msg;
+    struct iovec iov = { .iov_base = reply, .iov_len = sizeof(reply) - 1 };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctrl;
+    ssize_t n;
+    int fd = -1;
+
+    if (write(handoff_fd, request, strlen(request)) == -1) {
+        perror("Error writing to control socket");
+        return -1;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+    // Blocks until the forwarder has a connected socket for us
+    n = recvmsg(handoff_fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0) {
+        fprintf(stderr, "Control socket closed by forwarder.\n");
+        return -1;
+    }
+    reply[n] = '\0';
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    if (strncmp(reply, "OK ", 3) != 0 || fd == -1) {
+        fprintf(stderr, "Forwarder refused the request: %s", reply);
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    printf("Received socket for %s", reply + 3);
+    return fd;
+}
+
+// Same loop as main() but against the TCP socket itself, with the forwarder
+// only consulted to replace a socket that died.
+static int run_handoff_connector(const char *path, const char *route) {
+    char buffer[COPY_BUFFER_SIZE];
+    char request[300];
+    int handoff_fd, sock_fd;
+    int status = EXIT_SUCCESS;
+
+    printf("Connecting to control socket '%s'...\n", path);
+    handoff_fd = connect_unix(path);
+    if (handoff_fd == -1) {
+        fprintf(stderr, "Is the netpipe_forwarder running with --handoff?\n");
+        return EXIT_FAILURE;
+    }
+    snprintf(request, sizeof(request), route ? "GET %s\n" : "GET\n", route);
+    sock_fd = handoff_request(handoff_fd, request);
+    if (sock_fd == -1) {
+        close(handoff_fd);
+        return EXIT_FAILURE;
+    }
+
+    printf("\nSocket connected. Forwarding data. Press Ctrl+D on stdin to exit.\n\n");
+    fflush(stdout);
+
+    while (1) {
+        fd_set read_fds;
+        int dead = 0;
+
+        FD_ZERO(&read_fds);
+        FD_SET(STDIN_FILENO, &read_fds);
+        FD_SET(sock_fd, &read_fds);
+        FD_SET(handoff_fd, &read_fds);
+        if (control_fd != -1) {
+            FD_SET(control_fd, &read_fds);
+        }
+        int max_fd = sock_fd > handoff_fd ? sock_fd : handoff_fd;
+        max_fd = control_fd > max_fd ? control_fd : max_fd;
+        int activity = select(max_fd + 1, &read_fds, NULL, NULL, NULL);
+        if (activity < 0 && errno != EINTR) {
+            perror("select error");
+            status = EXIT_FAILURE;
+            break;
+        }
+        if (activity <= 0) {
+            continue;
+        }
+        if (control_fd != -1 && FD_ISSET(control_fd, &read_fds) && control_quit_requested()) {
+            break;
+        }
+        if (FD_ISSET(handoff_fd, &read_fds)) {
+            // The forwarder only speaks when asked, so this is EOF or a parting
+            // message such as "ERR route removed": either way it is gone
+            char reply[300];
+            ssize_t n = read(handoff_fd, reply, sizeof(reply) - 1);
+            if (n > 0) {
+                reply[n] = '\0';
+                fprintf(stderr, "Forwarder ended the handoff: %s", reply);
+            } else {
+                fprintf(stderr, "Control socket closed by forwarder.\n");
+            }
+            status = EXIT_FAILURE;
+            break;
+        }
+
+        if (FD_ISSET(STDIN_FILENO, &read_fds)) {
+            ssize_t bytes_read = read(STDIN_FILENO, buffer, sizeof(buffer));
+            if (bytes_read > 0) {
+                // Anything the dead socket did not take is lost, as with the forwarder's own reconnect
+                if (send(sock_fd, buffer, bytes_read, MSG_NOSIGNAL) == -1) {
+                    perror("Error writing to socket");
+                    dead = 1;
+                }
+            } else if (bytes_read == 0) {
+                printf("Stdin closed. Shutting down.\n");
+                break;
+            } else {
+                perror("Error reading from stdin");
+                status = EXIT_FAILURE;
+                break;
+            }
+        }
+
+        if (!dead && FD_ISSET(sock_fd, &read_fds)) {
+            ssize_t bytes_read = recv(sock_fd, buffer, sizeof(buffer), 0);
+            if (bytes_read > 0) {
+                if (write(STDOUT_FILENO, buffer, bytes_read) == -1) {
+                    perror("Error writing to stdout");
+                    status = EXIT_FAILURE;
+                    break;
+                }
+            } else {
+                printf("Socket closed by peer. Asking forwarder to reconnect.\n");
+                dead = 1;
+            }
+        }
+
+        if (dead) {
+            close(sock_fd);
+            sock_fd = handoff_request(handoff_fd, "DEAD\n");
+            if (sock_fd == -1) {
+                status = EXIT_FAILURE;
+                break;
+            }
+            fflush(stdout);
+        }
+    }
+
+    if (sock_fd != -1) {
+        close(sock_fd);
+    }
+    close(handoff_fd); // Releases our lease on the route
+    printf("Connector finished.\n");
+    return status;
+}
+
+// One STATS request; the forwarder closes the connection after the reply
+static int run_stats_query(const char *path, const char *format) {
+    char buffer[BUFFER_SIZE];
+    char request[64];
+    ssize_t n;
+    int fd = connect_unix(path);
+
+    if (fd == -1) {
+        fprintf(stderr, "Is the netpipe_forwarder running with --stats?\n");
+        return EXIT_FAILURE;
+    }
+    snprintf(request, sizeof(request), "STATS %s\n", format);
+    if (write(fd, request, strlen(request)) == -1) {
+        perror("Error writing to stats socket");
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        if (write(STDOUT_FILENO, buffer, n) == -1) {
+            break;
+        }
+    }
+    close(fd);
+    return n == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// --- Replay (--replay) ---
+// Feed one route and direction of a forwarder capture log back in, either at
+// the recorded pace, N times faster, or as fast as the target takes it.
+// Replaying app->net plays the application: chunks go into the app->net FIFO
+// (or straight to a host:port) and whatever comes back is the response.
+// Replaying net->app plays the network: chunks go into the net->app FIFO for
+// the application to read, with no forwarder running.
+
+typedef struct {
+    const char *path;
+    double speed;              // 1 = recorded pace, N = N times faster, 0 = no pacing
+    int route;                 // Route id, or -1 for the first route with traffic in 'dir'
+    int dir;                   // CAPTURE_APP_TO_NET or CAPTURE_NET_TO_APP
+    const char *target;        // host:port, or NULL for the FIFOs
+    long linger_ms;            // Wait this long for responses after the last chunk
+} replay_options_t;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Connect to host:port or [v6addr]:port. Returns the fd or -1.
+static int connect_tcp(const char *target) {
+    char host[256];
+    const char *colon = strrchr(target, ':');
+    struct addrinfo hints, *res, *ai;
+    int fd = -1, rc;
+
+    if (colon == NULL || colon == target || (size_t)(colon - target) >= sizeof(host)) {
+        fprintf(stderr, "Replay target must be host:port, not '%s'.\n", target);
+        return -1;
+    }
+    if (target[0] == '[' && colon[-1] == ']') {
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - target - 2), target + 1);
+    } else {
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - target), target);
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rc = getaddrinfo(host, colon + 1, &hints, &res)) != 0) {
+        fprintf(stderr, "Cannot resolve '%s': %s\n", target, gai_strerror(rc));
+        return -1;
+    }
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd != -1 && connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        if (fd != -1) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (fd == -1) {
+        fprintf(stderr, "Failed to connect to '%s'.\n", target);
+    }
+    return fd;
+}
+
+// Read whatever the target has sent back. Closes (and forgets) it at EOF.
+static void replay_drain(int *in_fd, uint64_t *received, long long *unanswered_since, metrics_hist_t *latency) {
+    char buffer[65536];
+    ssize_t n;
+
+    while (*in_fd != -1 && (n = read(*in_fd, buffer, sizeof(buffer))) != 0) {
+        if (n == -1) {
+            if (errno != EAGAIN && errno != EINTR) {
+                perror("Error reading replay responses");
+                *in_fd = -1;
+            }
+            return;
+        }
+        if (*unanswered_since) {
+            metrics_hist_record(latency, now_ns() - *unanswered_since);
+            *unanswered_since = 0;
+        }
+        *received += n;
+    }
+    *in_fd = -1; // EOF; the descriptor stays open until the end
+}
+
+static int run_replay(const replay_options_t *ro) {
+    size_t map_size;
+    uint64_t used;
+    capture_header_t *hdr = capture_map(ro->path, &map_size, &used);
+    const char *records, *route_name = NULL;
+    uint64_t first_ts = 0, chunks = 0, bytes = 0, received = 0;
+    metrics_hist_t lag, latency;
+    long long start, unanswered_since = 0, finished;
+    int route = ro->route, out_fd = -1, in_fd = -1, resp_fd, status = EXIT_SUCCESS;
+
+    if (hdr == NULL) {
+        return EXIT_FAILURE;
+    }
+    records = (const char *)(hdr + 1);
+    memset(&lag, 0, sizeof(lag));
+    memset(&latency, 0, sizeof(latency));
+
+    // Pick the route and find its name and first timestamp
+    for (uint64_t off = 0; off < used; off += capture_record_size(((const capture_record_t *)(records + off))->len)) {
+        const capture_record_t *rec = (const capture_record_t *)(records + off);
+
+        if (rec->flags & CAPTURE_FLAG_ROUTE) {
+            continue;
+        }
+        if (rec->dir == ro->dir && (route == -1 || rec->route == route)) {
+            route = rec->route;
+            first_ts = rec->ts_ns;
+            break;
+        }
+    }
+    if (route == -1) {
+        fprintf(stderr, "'%s' holds no %s traffic.\n", ro->path, ro->dir == CAPTURE_APP_TO_NET ? "app->net" : "net->app");
+        munmap(hdr, map_size);
+        return EXIT_FAILURE;
+    }
+    for (uint64_t off = 0; off < used; off += capture_record_size(((const capture_record_t *)(records + off))->len)) {
+        const capture_record_t *rec = (const capture_record_t *)(records + off);
+        if ((rec->flags & CAPTURE_FLAG_ROUTE) && rec->route == route) {
+            route_name = (const char *)(rec + 1);
+            printf("Replaying route %d (%.*s) %s from '%s'.\n", route, (int)rec->len, route_name,
+                   ro->dir == CAPTURE_APP_TO_NET ? "app->net" : "net->app", ro->path);
+            break;
+        }
+    }
+    if (route_name == NULL) {
+        printf("Replaying route %d %s from '%s'.\n", route, ro->dir == CAPTURE_APP_TO_NET ? "app->net" : "net->app", ro->path);
+    }
+
+    if (ro->target) {
+        out_fd = in_fd = connect_tcp(ro->target);
+    } else {
+        const char *out_name = ro->dir == CAPTURE_APP_TO_NET ? PIPE_APP_TO_NET_NAME : PIPE_NET_TO_APP_NAME;
+        const char *in_name = ro->dir == CAPTURE_APP_TO_NET ? PIPE_NET_TO_APP_NAME : PIPE_APP_TO_NET_NAME;
+
+        // Standing in for the forwarder: the FIFOs may not exist yet
+        if (ro->dir == CAPTURE_NET_TO_APP) {
+            mkfifo(out_name, 0666);
+            mkfifo(in_name, 0666);
+        }
+        in_fd = open(in_name, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        printf("Opening '%s' for writing...\n", out_name);
+        out_fd = open(out_name, O_WRONLY | O_CLOEXEC); // Waits for the other side
+        if (in_fd == -1 || out_fd == -1) {
+            perror("Failed to open replay FIFOs");
+            fprintf(stderr, "Is the %s running?\n", ro->dir == CAPTURE_APP_TO_NET ? "netpipe_forwarder" : "application");
+            if (in_fd != -1) {
+                close(in_fd);
+            }
+            in_fd = -1;
+            if (out_fd != -1) {
+                close(out_fd);
+            }
+            out_fd = -1;
+        }
+    }
+    if (out_fd == -1) {
+        munmap(hdr, map_size);
+        return EXIT_FAILURE;
+    }
+    fcntl(out_fd, F_SETFL, fcntl(out_fd, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(in_fd, F_SETFL, fcntl(in_fd, F_GETFL, 0) | O_NONBLOCK);
+    resp_fd = in_fd;
+
+    start = now_ns();
+    for (uint64_t off = 0; off < used && status == EXIT_SUCCESS; off += capture_record_size(((const capture_record_t *)(records + off))->len)) {
+        const capture_record_t *rec = (const capture_record_t *)(records + off);
+        const char *data = (const char *)(rec + 1);
+        long long due, now;
+        size_t done = 0;
+
+        if ((rec->flags & CAPTURE_FLAG_ROUTE) || rec->route != route || rec->dir != ro->dir) {
+            continue;
+        }
+        due = ro->speed > 0 ? start + (long long)((rec->ts_ns - first_ts) / ro->speed) : 0;
+        // Wait for the chunk's moment, collecting responses meanwhile
+        while ((now = now_ns()) < due) {
+            struct pollfd pfd = { .fd = resp_fd, .events = POLLIN };
+            struct timespec wait = { 0, due - now };
+
+            if (due - now < 1000000) {
+                nanosleep(&wait, NULL); // poll() only counts whole milliseconds
+            } else if (poll(&pfd, resp_fd != -1, (int)((due - now) / 1000000)) > 0) {
+                replay_drain(&resp_fd, &received, &unanswered_since, &latency);
+            }
+        }
+        metrics_hist_record(&lag, due ? now - due : 0);
+        while (done < rec->len) {
+            struct pollfd pfds[2] = { { .fd = out_fd, .events = POLLOUT }, { .fd = resp_fd, .events = POLLIN } };
+            ssize_t n = write(out_fd, data + done, rec->len - done);
+
+            if (n > 0) {
+                done += n;
+                continue;
+            }
+            if (n == -1 && errno != EAGAIN && errno != EINTR) {
+                perror("Error writing replayed data");
+                status = EXIT_FAILURE;
+                break;
+            }
+            // Target is full; keep reading so it can make progress
+            if (poll(pfds, resp_fd != -1 ? 2 : 1, -1) > 0 && resp_fd != -1 && (pfds[1].revents & (POLLIN | POLLHUP))) {
+                replay_drain(&resp_fd, &received, &unanswered_since, &latency);
+            }
+        }
+        if (unanswered_since == 0) {
+            unanswered_since = now_ns();
+        }
+        chunks++;
+        bytes += rec->len;
+    }
+    finished = now_ns();
+
+    // Let the last responses arrive
+    for (long long deadline = finished + ro->linger_ms * 1000000LL; resp_fd != -1;) {
+        struct pollfd pfd = { .fd = resp_fd, .events = POLLIN };
+        long long now = now_ns();
+        if (now >= deadline || poll(&pfd, 1, (int)((deadline - now + 999999) / 1000000)) <= 0) {
+            break;
+        }
+        replay_drain(&resp_fd, &received, &unanswered_since, &latency);
+    }
+
+    double secs = (finished - start) / 1e9;
+    printf("Replayed %llu chunks (%llu bytes) in %.3f s: %.1f MB/s, %.0f chunks/s.\n",
+           (unsigned long long)chunks, (unsigned long long)bytes, secs,
+           secs > 0 ? bytes / secs / 1e6 : 0.0, secs > 0 ? chunks / secs : 0.0);
+    if (ro->speed > 0) {
+        printf("Schedule lag us p50 %.1f p99 %.1f p999 %.1f max %.1f\n", metrics_hist_quantile(&lag, 0.5) / 1e3,
+               metrics_hist_quantile(&lag, 0.99) / 1e3, metrics_hist_quantile(&lag, 0.999) / 1e3, metric_read(&lag.max) / 1e3);
+    }
+    printf("Received %llu response bytes; first-byte latency us p50 %.1f p99 %.1f p999 %.1f max %.1f (%llu samples)\n",
+           (unsigned long long)received, metrics_hist_quantile(&latency, 0.5) / 1e3,
+           metrics_hist_quantile(&latency, 0.99) / 1e3, metrics_hist_quantile(&latency, 0.999) / 1e3,
+           metric_read(&latency.max) / 1e3, (unsigned long long)metric_read(&latency.count));
+    if (hdr->dropped_chunks > 0) {
+        printf("Note: the capture dropped %llu chunks (%llu bytes) while recording.\n",
+               (unsigned long long)hdr->dropped_chunks, (unsigned long long)hdr->dropped_bytes);
+    }
+    close(out_fd);
+    if (in_fd != out_fd && in_fd != -1) {
+        close(in_fd);
+    }
+    munmap(hdr, map_size);
+    return status;
+}
+
+static int parse_replay_args(int argc, char *argv[]) {
+    replay_options_t ro = { argv[2], 1.0, -1, CAPTURE_APP_TO_NET, NULL, 1000 };
+
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--fast") == 0) {
+            ro.speed = 0;
+        } else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+            ro.speed = strtod(argv[++i], NULL);
+            if (ro.speed <= 0) {
+                fprintf(stderr, "Error: --speed must be positive.\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--route") == 0 && i + 1 < argc) {
+            ro.route = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "app") == 0) {
+                ro.dir = CAPTURE_APP_TO_NET;
+            } else if (strcmp(argv[i], "net") == 0) {
+                ro.dir = CAPTURE_NET_TO_APP;
+            } else {
+                fprintf(stderr, "Error: --dir must be app or net.\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--to") == 0 && i + 1 < argc) {
+            ro.target = argv[++i];
+        } else if (strcmp(argv[i], "--linger") == 0 && i + 1 < argc) {
+            ro.linger_ms = atol(argv[++i]);
+        } else {
+            fprintf(stderr, "Error: Unknown replay option '%s'\n", argv[i]);
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    return run_replay(&ro);
+}
+
+// --- Latency probe (--probe) ---
+// We play both ends of the bridge: the application, writing pings into
+// PIPE_APP_TO_NET_NAME and reading them back from PIPE_NET_TO_APP_NAME, and
+// the server, a loopback echo the forwarder connects to. Each ping carries its
+// send time, so an echo's round trip is taken from one clock. Pings are at
+// most PIPE_BUF bytes, which makes every write into the FIFO all-or-nothing.
+
+typedef struct {
+    int port;
+    long count;
+    long rate;                 // Pings per second
+    size_t size;               // Bytes per ping, header included
+    long linger_ms;            // Wait this long for echoes after the last ping
+} probe_options_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+    uint64_t sent_ns;
+} probe_ping_t;
+
+// Listen on 127.0.0.1:port. Returns the fd or -1.
+static int probe_listen(int port) {
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    int one = 1;
+
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 4) == -1) {
+        fprintf(stderr, "Cannot listen on 127.0.0.1:%d: %s\n", port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int run_probe(const probe_options_t *po) {
+    int listen_fd, echo_fd = -1, in_fd, out_fd, status = EXIT_SUCCESS, one = 1;
+    char *ping, *rx, echo_buf[65536];
+    size_t rx_len = 0, echo_off = 0, echo_len = 0;
+    unsigned char *seen;
+    uint64_t sent = 0, received = 0, duplicates = 0, corrupt = 0;
+    long long start = 0, next_due = 0, finished = 0;
+    metrics_hist_t rtt;
+
+    if ((listen_fd = probe_listen(po->port)) == -1) {
+        return EXIT_FAILURE;
+    }
+    printf("Echoing on 127.0.0.1:%d. Start the forwarder with: netpipe_forwarder -h 127.0.0.1 -p %d\n",
+           po->port, po->port);
+    // The forwarder may start after us: make the FIFOs and wait for it to open them
+    mkfifo(PIPE_NET_TO_APP_NAME, 0666);
+    mkfifo(PIPE_APP_TO_NET_NAME, 0666);
+    printf("Opening '%s' for reading...\n", PIPE_NET_TO_APP_NAME);
+    fflush(stdout);
+    in_fd = open(PIPE_NET_TO_APP_NAME, O_RDONLY | O_CLOEXEC);
+    if (in_fd == -1) {
+        perror("Failed to open pipe for reading (net_to_app)");
+        fprintf(stderr, "Is the netpipe_forwarder running?\n");
+        close(listen_fd);
+        return EXIT_FAILURE;
+    }
+    out_fd = open(PIPE_APP_TO_NET_NAME, O_WRONLY | O_CLOEXEC);
+    if (out_fd == -1) {
+        perror("Failed to open pipe for writing (app_to_net)");
+        close(in_fd);
+        close(listen_fd);
+        return EXIT_FAILURE;
+    }
+    fcntl(in_fd, F_SETFL, fcntl(in_fd, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(out_fd, F_SETFL, fcntl(out_fd, F_GETFL, 0) | O_NONBLOCK);
+
+    ping = calloc(1, po->size);
+    rx = malloc(po->size * 64);
+    seen = calloc(po->count, 1);
+    if (ping == NULL || rx == NULL || seen == NULL) {
+        perror("malloc");
+        free(ping);
+        free(rx);
+        free(seen);
+        close(in_fd);
+        close(out_fd);
+        close(listen_fd);
+        return EXIT_FAILURE;
+    }
+    memset(&rtt, 0, sizeof(rtt));
+    printf("Pipes connected. Waiting for the forwarder to connect...\n");
+    fflush(stdout);
+
+    while (1) {
+        struct pollfd pfds[3];
+        long long now = now_ns();
+        struct timespec wait, *timeout = NULL;
+
+        if (start && (long long)sent == po->count && (received == sent || now >= finished + po->linger_ms * 1000000LL)) {
+            break;
+        }
+        if (start && (long long)sent < po->count) {
+            long long gap = next_due > now ? next_due - now : 0;
+            wait = (struct timespec){ gap / 1000000000LL, gap % 1000000000LL };
+            timeout = &wait;
+        } else if (start) {
+            long long gap = finished + po->linger_ms * 1000000LL - now;
+            wait = (struct timespec){ gap / 1000000000LL, gap % 1000000000LL };
+            timeout = &wait;
+        }
+        // While an echo is half written, stop reading from the socket
+        pfds[0] = (struct pollfd){ .fd = echo_fd == -1 ? listen_fd : echo_fd,
+                                   .events = echo_len > echo_off ? POLLOUT : POLLIN };
+        pfds[1] = (struct pollfd){ .fd = in_fd, .events = POLLIN };
+        pfds[2] = (struct pollfd){ .fd = start && next_due <= now && (long long)sent < po->count ? out_fd : -1,
+                                   .events = POLLOUT };
+        if (ppoll(pfds, 3, timeout, NULL) < 0 && errno != EINTR) {
+            perror("poll error");
+            status = EXIT_FAILURE;
+            break;
+        }
+
+        if (echo_fd == -1 && (pfds[0].revents & POLLIN)) {
+            if ((echo_fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+                setsockopt(echo_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                if (!start) {
+                    printf("Forwarder connected. Sending %ld pings of %zu bytes at %ld/s.\n", po->count, po->size, po->rate);
+                    fflush(stdout);
+                    start = next_due = now_ns();
+                }
+            }
+        } else if (echo_fd != -1 && pfds[0].revents) {
+            ssize_t n;
+
+            if (echo_len == echo_off) {
+                echo_off = echo_len = 0;
+                n = read(echo_fd, echo_buf, sizeof(echo_buf));
+                if (n > 0) {
+                    echo_len = n;
+                } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+                    printf("Forwarder disconnected; waiting for it to reconnect.\n");
+                    close(echo_fd);
+                    echo_fd = -1;
+                }
+            }
+            if (echo_fd != -1 && echo_len > echo_off) {
+                n = send(echo_fd, echo_buf + echo_off, echo_len - echo_off, MSG_NOSIGNAL);
+                if (n > 0) {
+                    echo_off += n;
+                } else if (n == -1 && errno != EAGAIN && errno != EINTR) {
+                    close(echo_fd);
+                    echo_fd = -1;
+                    echo_off = echo_len = 0;
+                }
+            }
+        }
+
+        if (pfds[1].revents) {
+            ssize_t n = read(in_fd, rx + rx_len, po->size * 64 - rx_len);
+            if (n == 0) {
+                printf("Network pipe closed by forwarder. Stopping.\n");
+                break;
+            }
+            if (n > 0) {
+                long long arrived = now_ns();
+                size_t off = 0;
+
+                rx_len += n;
+                for (; rx_len - off >= po->size; off += po->size) {
+                    probe_ping_t hdr;
+
+                    memcpy(&hdr, rx + off, sizeof(hdr));
+                    if (hdr.magic != PROBE_MAGIC || hdr.seq >= (uint64_t)po->count) {
+                        corrupt++;
+                    } else if (seen[hdr.seq]) {
+                        duplicates++;
+                    } else {
+                        seen[hdr.seq] = 1;
+                        received++;
+                        metrics_hist_record(&rtt, arrived - (long long)hdr.sent_ns);
+                    }
+                }
+                memmove(rx, rx + off, rx_len - off);
+                rx_len -= off;
+            }
+        }
+
+        if (pfds[2].fd != -1 && (pfds[2].revents & POLLOUT)) {
+            probe_ping_t hdr = { PROBE_MAGIC, (uint32_t)sent, (uint64_t)now_ns() };
+
+            memcpy(ping, &hdr, sizeof(hdr));
+            if (write(out_fd, ping, po->size) == (ssize_t)po->size) {
+                sent++;
+                next_due = start + (long long)(sent * 1000000000.0 / po->rate);
+                if ((long long)sent == po->count) {
+                    finished = now_ns();
+                }
+            } else if (errno != EAGAIN && errno != EINTR) {
+                perror("Error writing to pipe (app_to_net)");
+                status = EXIT_FAILURE;
+                break;
+            }
+        }
+    }
+
+    printf("Sent %llu pings, received %llu, lost %llu, duplicates %llu, unrecognised %llu.\n",
+           (unsigned long long)sent, (unsigned long long)received, (unsigned long long)(sent - received),
+           (unsigned long long)duplicates, (unsigned long long)corrupt);
+    printf("RTT us p50 %.1f p90 %.1f p99 %.1f p999 %.1f max %.1f\n", metrics_hist_quantile(&rtt, 0.5) / 1e3,
+           metrics_hist_quantile(&rtt, 0.9) / 1e3, metrics_hist_quantile(&rtt, 0.99) / 1e3,
+           metrics_hist_quantile(&rtt, 0.999) / 1e3, metric_read(&rtt.max) / 1e3);
+    free(ping);
+    free(rx);
+    free(seen);
+    if (echo_fd != -1) {
+        close(echo_fd);
+    }
+    close(in_fd);
+    close(out_fd);
+    close(listen_fd);
+    return status == EXIT_SUCCESS && received < sent ? EXIT_FAILURE : status;
+}
+
+static int parse_probe_args(int argc, char *argv[]) {
+    probe_options_t po = { PROBE_DEFAULT_PORT, PROBE_DEFAULT_COUNT, PROBE_DEFAULT_RATE, PROBE_DEFAULT_SIZE, 1000 };
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            po.port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--count") == 0 && i + 1 < argc) {
+            po.count = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            po.rate = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            po.size = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--linger") == 0 && i + 1 < argc) {
+            po.linger_ms = atol(argv[++i]);
+        } else {
+            fprintf(stderr, "Error: Unknown probe option '%s'\n", argv[i]);
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (po.port <= 0 || po.port > 65535 || po.count <= 0 || po.count > UINT32_MAX || po.rate <= 0) {
+        fprintf(stderr, "Error: --port, --count and --rate must be positive (port up to 65535).\n");
+        return EXIT_FAILURE;
+    }
+    if (po.size < sizeof(probe_ping_t) || po.size > PIPE_BUF) {
+        fprintf(stderr, "Error: --size must be between %zu and %d bytes.\n", sizeof(probe_ping_t), PIPE_BUF);
+        return EXIT_FAILURE;
+    }
+    return run_probe(&po);
+}
+
+// --- FIFO mode (the default) ---
+// Each direction moves with splice() when the kernel can do it without a copy
+// through user space. One end is always a FIFO, so that works whenever the
+// other end (stdin or stdout) is a pipe, a regular file or a socket; a
+// terminal gets EINVAL, and that direction drops to copying for good. Only
+// the FIFO ends are made non-blocking: stdin and stdout are shared with
+// whoever started us.
+
+typedef struct {
+    const char *name;           // For messages
+    int in_fd;
+    int out_fd;
+    int splicing;               // Cleared for good when splice() returns EINVAL
+    char *buf;                  // Copy path: bytes read but not yet written
+    size_t off;
+    size_t len;
+    int out_blocked;            // out_fd is full; wait for POLLOUT before reading on
+    unsigned long long bytes;
+} stream_t;
+
+static int stream_write_pending(stream_t *st) {
+    while (st->off < st->len) {
+        ssize_t n = write(st->out_fd, st->buf + st->off, st->len - st->off);
+        if (n > 0) {
+            st->off += n;
+            st->bytes += n;
+        } else if (n == -1 && errno == EAGAIN) {
+            st->out_blocked = 1;
+            return 0;
+        } else if (n == -1 && errno != EINTR) {
+            fprintf(stderr, "Error writing %s: %s\n", st->name, strerror(errno));
+            return -1;
+        }
+    }
+    st->off = st->len = 0;
+    return 0;
+}
+
+// Move what in_fd has to out_fd. Returns 1 at end-of-file, -1 on error.
+static int stream_pump(stream_t *st) {
+    ssize_t n;
+
+    if (st->splicing) {
+        n = splice(st->in_fd, NULL, st->out_fd, NULL, SPLICE_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            st->bytes += n;
+            return 0;
+        }
+        if (n == 0) {
+            return 1;
+        }
+        if (errno == EAGAIN) {
+            st->out_blocked = 1; // The input was readable, so the output is full
+            return 0;
+        }
+        if (errno == EINTR) {
+            return 0;
+        }
+        if (errno != EINVAL) {
+            fprintf(stderr, "Error splicing %s: %s\n", st->name, strerror(errno));
+            return -1;
+        }
+        st->splicing = 0;
+        if ((st->buf = malloc(COPY_BUFFER_SIZE)) == NULL) {
+            perror("malloc");
+            return -1;
+        }
+    }
+    n = read(st->in_fd, st->buf, COPY_BUFFER_SIZE);
+    if (n == 0) {
+        return 1;
+    }
+    if (n == -1) {
+        if (errno == EAGAIN || errno == EINTR) {
+            return 0;
+        }
+        fprintf(stderr, "Error reading %s: %s\n", st->name, strerror(errno));
+        return -1;
+    }
+    st->off = 0;
+    st->len = n;
+    return stream_write_pending(st);
+}
+
+static int run_fifo_connector(void) {
     int pipe_net_to_app_fd; // We read from this (data from network)
     int pipe_app_to_net_fd; // We write to this (data to network)
-    char buffer[BUFFER_SIZE];
-    fd_set read_fds;
-    int max_fd;
+    stream_t streams[2];
+    int status = EXIT_SUCCESS;
 
     printf("Attempting to connect to pipes...\n");
 
@@ -40,7 +1076,7 @@ int main(int argc, char *argv[]) {
     if (pipe_net_to_app_fd == -1) {
         perror("Failed to open pipe for reading (net_to_app)");
         fprintf(stderr, "Is the netpipe_forwarder running?\n");
-        exit(EXIT_FAILURE);
+        return EXIT_FAILURE;
     }
     printf("Pipe '%s' opened successfully (FD: %d).\n", PIPE_NET_TO_APP_NAME, pipe_net_to_app_fd);
 
@@ -52,73 +1088,140 @@ int main(int argc, char *argv[]) {
         perror("Failed to open pipe for writing (app_to_net)");
         close(pipe_net_to_app_fd);
         fprintf(stderr, "Is the netpipe_forwarder running?\n");
-        exit(EXIT_FAILURE);
+        return EXIT_FAILURE;
     }
     printf("Pipe '%s' opened successfully (FD: %d).\n", PIPE_APP_TO_NET_NAME, pipe_app_to_net_fd);
+    fcntl(pipe_net_to_app_fd, F_SETFL, fcntl(pipe_net_to_app_fd, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(pipe_app_to_net_fd, F_SETFL, fcntl(pipe_app_to_net_fd, F_GETFL, 0) | O_NONBLOCK);
 
     printf("\nPipes connected. Forwarding data. Press Ctrl+D on stdin to exit.\n\n");
+    fflush(stdout); // Keep the banner ahead of the data when stdout is a pipe
 
-    // Determine the max file descriptor for select()
-    max_fd = (STDIN_FILENO > pipe_net_to_app_fd ? STDIN_FILENO : pipe_net_to_app_fd) + 1;
+    memset(streams, 0, sizeof(streams));
+    streams[0] = (stream_t){ .name = "stdin -> " PIPE_APP_TO_NET_NAME, .in_fd = STDIN_FILENO,
+                             .out_fd = pipe_app_to_net_fd, .splicing = 1 };
+    streams[1] = (stream_t){ .name = PIPE_NET_TO_APP_NAME " -> stdout", .in_fd = pipe_net_to_app_fd,
+                             .out_fd = STDOUT_FILENO, .splicing = 1 };
 
     while (1) {
-        FD_ZERO(&read_fds);
-        FD_SET(STDIN_FILENO, &read_fds);       // Watch stdin for user input
-        FD_SET(pipe_net_to_app_fd, &read_fds); // Watch pipe for data from network
+        struct pollfd pfds[5];
+        int nfds = 0, done = 0;
 
-        int activity = select(max_fd, &read_fds, NULL, NULL, NULL);
+        // A stream waits either for input or, while its output is full, for room
+        for (int i = 0; i < 2; i++) {
+            pfds[2 * i] = (struct pollfd){ .fd = streams[i].out_blocked ? -1 : streams[i].in_fd, .events = POLLIN };
+            pfds[2 * i + 1] = (struct pollfd){ .fd = streams[i].out_blocked ? streams[i].out_fd : -1, .events = POLLOUT };
+        }
+        pfds[4] = (struct pollfd){ .fd = control_fd, .events = POLLIN };
+        nfds = 5;
 
+        int activity = poll(pfds, nfds, -1);
         if (activity < 0 && errno != EINTR) {
-            perror("select error");
+            perror("poll error");
+            status = EXIT_FAILURE;
             break;
         }
-
-        // If stdin has data, read it and write to the pipe going to the network
-        if (FD_ISSET(STDIN_FILENO, &read_fds)) {
-            ssize_t bytes_read = read(STDIN_FILENO, buffer, sizeof(buffer));
-            if (bytes_read > 0) {
-                // Check for the quit command
-                if (bytes_read >= 5 && strncmp(buffer, "^quit", 5) == 0) {
-                    printf("Quit command received. Shutting down.\n");
-                    break; // Exit the loop
-                }
-                if (write(pipe_app_to_net_fd, buffer, bytes_read) == -1) {
-                    perror("Error writing to pipe (app_to_net)");
-                    break; // Exit on write error
-                }
-            } else if (bytes_read == 0) { // EOF from stdin (Ctrl+D)
-                printf("Stdin closed. Shutting down write-end of the pipe.\n");
-                break; // Exit the loop
-            } else {
-                perror("Error reading from stdin");
-                break;
-            }
+        if (activity <= 0) {
+            continue;
         }
+        if ((pfds[4].revents & POLLIN) && control_quit_requested()) {
+            break;
+        }
+        for (int i = 0; i < 2 && !done; i++) {
+            stream_t *st = &streams[i];
+            int rc = 0;
 
-        // If the pipe from the network has data, read it and write to stdout
-        if (FD_ISSET(pipe_net_to_app_fd, &read_fds)) {
-            ssize_t bytes_read = read(pipe_net_to_app_fd, buffer, sizeof(buffer));
-            if (bytes_read > 0) {
-                if (write(STDOUT_FILENO, buffer, bytes_read) == -1) {
-                    perror("Error writing to stdout");
-                    break; // Exit on write error
-                }
-            } else if (bytes_read == 0) { // EOF from pipe
-                printf("Network pipe closed by forwarder. Exiting.\n");
-                break; // The other end (forwarder) closed the pipe
-            } else {
-                perror("Error reading from pipe (net_to_app)");
-                break;
+            if (pfds[2 * i + 1].revents) {
+                st->out_blocked = 0;
+                rc = stream_write_pending(st);
+            } else if (pfds[2 * i].revents) {
+                rc = stream_pump(st);
+            }
+            if (rc == 1) {
+                printf(i == 0 ? "Stdin closed. Shutting down write-end of the pipe.\n"
+                              : "Network pipe closed by forwarder. Exiting.\n");
+                done = 1;
+            } else if (rc == -1) {
+                status = EXIT_FAILURE;
+                done = 1;
             }
         }
+        if (done) {
+            break;
+        }
     }
 
     // Cleanup
+    for (int i = 0; i < 2; i++) {
+        printf("%s: %s, %llu bytes.\n", streams[i].name, streams[i].splicing ? "splice" : "copy", streams[i].bytes);
+        free(streams[i].buf);
+    }
     printf("Closing pipes...\n");
     close(pipe_net_to_app_fd);
     close(pipe_app_to_net_fd);
 
     printf("Connector finished.\n");
+    return status;
+}
 
-    return 0;
+int main(int argc, char *argv[]) {
+    const char *control_path = NULL;
+
+    // --control may come before or after the mode; take it out of argv
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--control") == 0) {
+            if (i + 1 >= argc) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            control_path = argv[i + 1];
+            memmove(&argv[i], &argv[i + 2], (argc - i - 1) * sizeof(*argv)); // Keeps the NULL terminator
+            argc -= 2;
+            break;
+        }
+    }
+    if (control_path) {
+        if (argc > 1 && (strcmp(argv[1], "--stats") == 0 || strcmp(argv[1], "--replay") == 0 ||
+                         strcmp(argv[1], "--probe") == 0)) {
+            fprintf(stderr, "Error: --control applies to the interactive modes only.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (control_open(control_path) == -1) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc > 1 && strcmp(argv[1], "-h") == 0) {
+        print_usage(argv[0]);
+        exit(EXIT_SUCCESS);
+    }
+    if (argc > 1 && strcmp(argv[1], "--shm") == 0) {
+        return run_shm_connector(argc > 2 ? argv[2] : NETPIPE_SHM_DEFAULT_NAME);
+    }
+    if (argc > 1 && strcmp(argv[1], "--handoff") == 0) {
+        if (argc < 3) {
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        return run_handoff_connector(argv[2], argc > 3 ? argv[3] : NULL);
+    }
+    if (argc > 1 && strcmp(argv[1], "--stats") == 0) {
+        if (argc < 3) {
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        return run_stats_query(argv[2], argc > 3 ? argv[3] : "text");
+    }
+    if (argc > 1 && strcmp(argv[1], "--replay") == 0) {
+        if (argc < 3) {
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        return parse_replay_args(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "--probe") == 0) {
+        return parse_probe_args(argc, argv);
+    }
+
+    return run_fifo_connector();
 }
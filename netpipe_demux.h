@@ -0,0 +1,149 @@
+// Record scanning for netpipe_forwarder --demux.
+//
+// The inbound stream is cut into records and each record is sent to the first
+// output whose match value is a prefix of the record (or of one field of it).
+// Both hot loops work a vector at a time: the delimiter search compares 32
+// (AVX2) or 16 (SSE2) bytes per step, and a match value of up to
+// DEMUX_MAX_VALUE bytes is tested with masked vector compares instead of a
+// byte loop. Every x86-64 CPU has SSE2; AVX2 is chosen at run time when the
+// CPU has it, so one binary runs everywhere. Other architectures use the
+// scalar versions, which memchr/memcmp already make reasonably quick.
+//
+// Prefix tests load a full DEMUX_MAX_VALUE bytes from the candidate position,
+// so callers keep DEMUX_PAD readable bytes after the end of their data.
+
+#ifndef NETPIPE_DEMUX_H
+#define NETPIPE_DEMUX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <immintrin.h>
+#define DEMUX_X86 1
+#endif
+
+#define DEMUX_MAX_VALUE 32 // Longest match value
+#define DEMUX_PAD 64       // Readable slack callers keep after their data
+
+typedef struct {
+    char value[DEMUX_MAX_VALUE]; // Zero-padded
+    size_t len;
+    uint32_t mask;               // Low 'len' bits set: the bytes that must match
+} demux_rule_t;
+
+typedef size_t (*demux_find_fn)(const char *p, size_t n, char c);
+
+// Offset of the first 'c' in p[0..n), or n if there is none
+static inline size_t demux_find_scalar(const char *p, size_t n, char c) {
+    const char *hit = memchr(p, c, n);
+    return hit ? (size_t)(hit - p) : n;
+}
+
+#ifdef DEMUX_X86
+static inline size_t demux_find_sse2(const char *p, size_t n, char c) {
+    __m128i needle = _mm_set1_epi8(c);
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        int bits = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), needle));
+        if (bits) {
+            return i + __builtin_ctz(bits);
+        }
+    }
+    for (; i < n; i++) {
+        if (p[i] == c) {
+            return i;
+        }
+    }
+    return n;
+}
+
+__attribute__((target("avx2")))
+static inline size_t demux_find_avx2(const char *p, size_t n, char c) {
+    __m256i needle = _mm256_set1_epi8(c);
+    size_t i = 0;
+
+    for (; i + 64 <= n; i += 64) { // Two vectors per step keeps both load ports busy
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), needle);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i + 32)), needle);
+        if (!_mm256_testz_si256(_mm256_or_si256(a, b), _mm256_or_si256(a, b))) {
+            uint32_t lo = _mm256_movemask_epi8(a);
+            return lo ? i + __builtin_ctz(lo) : i + 32 + __builtin_ctz((uint32_t)_mm256_movemask_epi8(b));
+        }
+    }
+    for (; i + 32 <= n; i += 32) {
+        uint32_t bits = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), needle));
+        if (bits) {
+            return i + __builtin_ctz(bits);
+        }
+    }
+    return i + demux_find_sse2(p + i, n - i, c);
+}
+#endif
+
+// The fastest search this CPU supports
+static inline demux_find_fn demux_pick_find(const char **name) {
+#ifdef DEMUX_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        *name = "avx2";
+        return demux_find_avx2;
+    }
+    *name = "sse2";
+    return demux_find_sse2;
+#else
+    *name = "scalar";
+    return demux_find_scalar;
+#endif
+}
+
+static inline int demux_rule_init(demux_rule_t *rule, const char *value, size_t len) {
+    if (len == 0 || len > DEMUX_MAX_VALUE) {
+        return -1;
+    }
+    memset(rule, 0, sizeof(*rule));
+    memcpy(rule->value, value, len);
+    rule->len = len;
+    rule->mask = len == 32 ? 0xffffffffu : (1u << len) - 1;
+    return 0;
+}
+
+// Whether 'rule' is a prefix of p[0..avail). p must have DEMUX_PAD readable bytes beyond avail.
+static inline int demux_rule_matches(const demux_rule_t *rule, const char *p, size_t avail) {
+    if (avail < rule->len || p[0] != rule->value[0]) {
+        return 0; // Most records differ at the first byte; skip the vector compare
+    }
+#ifdef DEMUX_X86
+    __m128i lo = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), _mm_loadu_si128((const __m128i *)rule->value));
+    __m128i hi = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 16)), _mm_loadu_si128((const __m128i *)(rule->value + 16)));
+    uint32_t eq = (uint32_t)_mm_movemask_epi8(lo) | ((uint32_t)_mm_movemask_epi8(hi) << 16);
+    return (eq & rule->mask) == rule->mask;
+#else
+    return memcmp(p, rule->value, rule->len) == 0;
+#endif
+}
+
+// Index of the first of 'count' rules matching record rec[0..len), or -1.
+// field 0 matches the start of the record; field N (1-based) the start of the
+// Nth 'sep'-separated field.
+static inline int demux_classify(const demux_rule_t *rules, int count, demux_find_fn find,
+                                 const char *rec, size_t len, int field, char sep) {
+    for (int f = 1; f < field; f++) {
+        size_t at = find(rec, len, sep);
+        if (at == len) {
+            return -1; // Too few fields
+        }
+        rec += at + 1;
+        len -= at + 1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (demux_rule_matches(&rules[i], rec, len)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+#endif // NETPIPE_DEMUX_H
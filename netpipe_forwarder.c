@@ -1,35 +1,212 @@
+#define _GNU_SOURCE // For splice() and F_SETPIPE_SZ
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <linux/tcp.h> // Full struct tcp_info (bytes_acked) as well as the TCP_* options
 #include <arpa/inet.h>
+#include <netdb.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <pthread.h>
 #include <signal.h> // For signal handling
+#include <stdarg.h>
+#include <stddef.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sched.h>
+
+#include "netpipe_shm.h"
+#include "netpipe_metrics.h"
+#include "netpipe_uring.h"
+#include "netpipe_capture.h"
+#include "netpipe_demux.h"
 
 #define BUFFER_SIZE 4096
 #define PIPE_NET_TO_APP_NAME "/tmp/net_to_pipe"  // Data from network (socket) to application (written by forwarder, read by external tools)
 #define PIPE_APP_TO_NET_NAME "/tmp/pipe_to_net" // Data from application (external tools) to network (written by external tools, read by forwarder)
 
 // Reconnection settings
-#define RECONNECT_DELAY_SECONDS 5
+#define RECONNECT_DELAY_SECONDS 5 // --threads engine only
+#define RECONNECT_FIRST_MS 100    // Backoff before the first retry, doubled per failed dial...
+#define RECONNECT_MAX_MS 5000     // ...up to this (each delay is jittered down by up to half)
+#define DIAL_STAGGER_MS 250       // Head start each connect attempt gets before the next address joins
+#define DIAL_TIMEOUT_MS 10000     // Give up on a dial (every address) after this
+#define DIAL_MAX_ADDRS 16         // Resolved addresses tried per dial
+#define MAX_UPSTREAMS 8           // Entries in a route's -h list
+#define MAX_STANDBYS 8            // --standby limit
+#define STANDBY_KEEPIDLE_S 10     // Keepalive on parked standbys: first probe after...
+#define STANDBY_KEEPINTVL_S 5     // ...then every...
+#define STANDBY_KEEPCNT 3         // ...and declared dead after this many misses
 #define MAX_RECONNECT_ATTEMPTS 0 // 0 for infinite attempts
+#define FIFO_RETRY_MS 500        // How often to retry opening a FIFO that has no reader yet
+
+// Event loop settings
+#define MAX_EPOLL_EVENTS 64
+#define MAX_WORKERS 256
+
+// --low-latency settings
+#define DEFAULT_SPIN_US 50       // Poll without sleeping this long after the last event before blocking
+#define MAX_SPIN_US 1000000
+
+// Per-direction buffering between the socket and FIFO sides
+#define DEFAULT_RING_SIZE (256 * 1024) // In-memory ring per direction
+#define DEFAULT_SPILL_DIR "/tmp"        // Where mmap'd spill files are created
+
+// Splice settings
+#define SPLICE_CHUNK_SIZE (1024 * 1024) // Upper bound on bytes moved per splice() call
+#define DEFAULT_SPLICE_PIPE_SIZE (1024 * 1024) // FIFO capacity requested with F_SETPIPE_SZ
+
+// Self-tuning buffer sizes (--autotune)
+#define TUNE_TICK_MS 100                // How often each worker reviews its routes
+#define TUNE_MIN_CHUNK (16 * 1024)      // Buffer per direction of an idle route
+#define TUNE_MAX_RING (4 * 1024 * 1024) // Largest buffer unless --ring-size says otherwise
+#define TUNE_GROW_READS 8               // Consecutive reads that filled the buffer before it doubles
+#define TUNE_SHRINK_TICKS 20            // Ticks spent under a quarter full before it halves
+#define TUNE_MIN_PIPE (64 * 1024)       // FIFOs are not shrunk below the kernel's default
+#define TUNE_POOL_BYTES (4 * 1024 * 1024) // Released buffers a worker keeps for reuse
+#define TUNE_POOL_CLASSES 16            // Power-of-two sizes from TUNE_MIN_CHUNK up
+
+// Forwarding engines
+#define ENGINE_EPOLL 0   // Routes served by a pool of epoll worker threads (default)
+#define ENGINE_THREADS 1 // Legacy polling thread pair, kept for comparison
+#define ENGINE_URING 2   // One route on a single io_uring (--uring)
+
+// io_uring engine settings
+#define URING_DEFAULT_QUEUE_DEPTH 64  // SQ entries: the most operations submitted per batch
+#define URING_MAX_QUEUE_DEPTH 4096
+#define URING_CHUNK_SIZE (32 * 1024)  // Per registered buffer; --ring-size sets how many
+#define URING_MAX_CHUNKS 1024
+#define URING_BUF_GROUP 0             // Provided buffer group of the recv buffers
+#define URING_SLOT_SOCKET 0           // Fixed-file table slots
+#define URING_SLOT_NET_TO_APP 1
+#define URING_SLOT_APP_TO_NET 2
+#define URING_NUM_SLOTS 3
+#define URING_SOCKET_DOWN 0
+#define URING_SOCKET_CONNECTING 1
+#define URING_SOCKET_UP 2
+#define URING_OP_RECV 1               // user_data operation codes (the top 32 bits)
+#define URING_OP_READ 2
+#define URING_OP_POLL 3
+#define URING_OP_CONNECT 4
+#define URING_OP_TIMEOUT 5
+#define URING_OP_WRITE 6              // Plus the direction
 
-// Global flag to signal threads to stop
-volatile int keep_running = 1;
+// Record framing modes (--frame)
+#define FRAME_NONE 0   // Raw byte stream
+#define FRAME_LINE 1   // Records end with '\n'
+#define FRAME_U16LEN 2 // 2-byte big-endian length, then that many bytes
+#define FRAME_U32LEN 3 // 4-byte big-endian length, then that many bytes
+#define FRAME_SOCKET_BATCH (64 * 1024) // Most framed bytes sent per sendmsg()
+
+// Send coalescing policies for app->net data
+#define COALESCE_DEFAULT 0    // Send each FIFO read at once, Nagle left on
+#define COALESCE_LATENCY 1    // TCP_NODELAY, send at once
+#define COALESCE_THROUGHPUT 2 // TCP_NODELAY, gather up to coalesce_us / coalesce_bytes
+#define COALESCE_ADAPTIVE 3   // Switch between the two on the FIFO arrival rate
+#define DEFAULT_COALESCE_US 200
+#define DEFAULT_COALESCE_BYTES (16 * 1024)
+
+// Fan-out of the net->app stream to subscribers (--fanout)
+#define MAX_SUBSCRIBERS 16          // FIFOs plus connected Unix socket clients
+#define MAX_FANOUT_LISTENERS 4      // unix:<path> entries
+#define DEFAULT_FANOUT_LAG (1024 * 1024) // Per-subscriber pipe size: the most it may fall behind
+#define FANOUT_DROP 0       // A subscriber that is full misses data
+#define FANOUT_BLOCK 1      // The socket waits for the slowest subscriber
+#define FANOUT_DISCONNECT 2 // A subscriber that is full is closed
+#define SUB_NONE 0
+#define SUB_FIFO 1
+#define SUB_UNIX 2
+
+// Listen mode (-l)
+#define LISTEN_HEADER 8            // u32 record length, u32 client tag
+#define LISTEN_HASH_SIZE 4096      // Client lookup buckets per shard
+#define LISTEN_ACCEPT_BATCH 64     // Connections accepted per listen event
+#define LISTEN_KEEP_OUT (64 * 1024) // Larger client send buffers are freed once drained
+#define LISTEN_MAX_SEQ 0xffffff    // Client tags are seq << 8 | shard; seq wraps to 1 after this
+#define LISTEN_RETRY_MS 100        // Retry accepting this long after running out of fds
+
+// Content demux of the net->app stream (--demux)
+#define MAX_DEMUX_OUTPUTS 16
+#define DEMUX_STAGE_SIZE (256 * 1024) // Socket data read per pass and split into records
+#define DEMUX_NO_CARRY -2              // demux_t.carry: no record is being passed through
+#define DEMUX_MAIN -1                  // Target of unmatched records: the route's own FIFO
+
+// Global flag to signal threads to stop. Cleared by the SIGINT handler and
+// read by every thread, so it is only touched through running()/stop_running().
+static int keep_running = 1;
+// Set by SIGHUP; the scheduler reloads the route config file
+volatile sig_atomic_t reload_requested = 0;
+
+// eventfd used to wake the route scheduler in main (-1 when unused)
+static int main_wake_fd = -1;
+
+// --capture: per-worker queues and the thread writing them to the log (NULL when off)
+static capture_t *capture_log = NULL;
 
 typedef struct {
     int *socket_fd_ptr;       // Pointer to the socket_fd in main
+    int socket_in_use[2];     // Socket each thread is inside a call on (-1 = none); main closes a failed one when neither is
     int *pipe_app_to_net_fd_ptr; // Pointer to pipe_read_fd (from app to net) in main
     int *pipe_net_to_app_fd_ptr; // Pointer to pipe_write_fd (from net to app) in main
     int verbose;
+    long long spin_ns;        // --low-latency: poll this long before blocking (0 = off)
 } thread_data_t;
 
+// Settings shared by every route of the epoll engine
+typedef struct {
+    int verbose;
+    int use_splice;           // Move data with splice() instead of copying
+    int pipe_size;            // FIFO capacity to request in splice mode (0 = leave default)
+    size_t ring_size;         // In-memory ring per direction
+    size_t spill_size;        // mmap'd overflow file per direction (0 = no spilling)
+    size_t high_water;        // Stop reading the source once this much is buffered
+    size_t low_water;         // Resume reading once the buffer drains to this
+    const char *spill_dir;
+    int use_shm;              // Shared-memory rings instead of FIFOs on the application side
+    const char *handoff_path; // Control socket for passing TCP fds to clients (NULL = off)
+    const char *stats_path;   // Unix socket serving counters and histograms (NULL = off)
+    int frame_mode;           // FRAME_*: only write whole records
+    int coalesce_mode;        // COALESCE_*
+    long coalesce_us;         // Longest a held byte waits (throughput/adaptive)
+    size_t coalesce_bytes;    // Send as soon as this much is held
+    int standby_count;        // Pre-connected spare sockets per route (--standby)
+    size_t replay_size;       // Sent app->net bytes kept for resending after a reconnect (--replay)
+    unsigned queue_depth;     // io_uring SQ entries (--uring)
+    const char *fanout_spec;  // Subscribers of the -h/-p route's net->app stream (NULL = off)
+    int fanout_policy;        // FANOUT_*
+    size_t fanout_lag;        // Pipe size requested per subscriber
+    int listen_port;          // -l: accept clients instead of dialling (0 = off)
+    const char *capture_path; // Log every chunk read to this file (NULL = off)
+    uint64_t capture_size;    // Preallocated size of the capture log
+    int low_latency;          // Spin before blocking, busy-poll sockets, pin I/O threads
+    long spin_us;             // How long an idle I/O thread spins (also SO_BUSY_POLL)
+    int cpus[MAX_WORKERS];    // Cores to pin I/O threads to, in order (--cpus)
+    int cpu_count;
+    int sched_priority;       // SCHED_FIFO priority for I/O threads (0 = normal scheduling)
+    const char *demux_specs[MAX_DEMUX_OUTPUTS]; // --demux <value>=<fifo> entries, in order of precedence
+    int demux_count;
+    int demux_field;          // 0: match the start of each record; n: the start of its nth field
+    char demux_sep;           // Field separator
+    int autotune;             // Size buffers, FIFOs and socket buffers from observed traffic
+    int pipe_max;             // /proc/sys/fs/pipe-max-size: the most F_SETPIPE_SZ may ask for
+    int rmem_max;             // net.core.rmem_max / wmem_max: caps on SO_RCVBUF / SO_SNDBUF
+    int wmem_max;
+} options_t;
+
 void error_exit(const char *msg) {
     perror(msg);
     exit(EXIT_FAILURE);
@@ -42,15 +219,289 @@ void print_usage() {
     fprintf(stderr, "It attempts to automatically reconnect to both the network and named pipes if connections are lost.\n\n");
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  --help        Display this help message and exit.\n");
-    fprintf(stderr, "  -h <address>  Specify the address of the port to connect to (e.g., localhost, 127.0.0.1).\n");
+    fprintf(stderr, "  -h <address>  Specify the address of the port to connect to (e.g., localhost, 127.0.0.1, ::1).\n");
+    fprintf(stderr, "                A comma-separated list (host[:port],[v6addr]:port,...) gives upstreams in order\n");
+    fprintf(stderr, "                of preference; -p is the port for entries without one.\n");
     fprintf(stderr, "  -p <port>     Specify the port number to connect to.\n");
+    fprintf(stderr, "  -l <port>     Listen mode: accept any number of TCP clients on <port> instead of dialling,\n");
+    fprintf(stderr, "                and bridge them all to the FIFO pair. Each FIFO carries u32len records\n");
+    fprintf(stderr, "                (see --frame) whose body starts with a 4-byte client tag; towards the\n");
+    fprintf(stderr, "                network, tag 0 broadcasts and an empty record closes the client.\n");
+    fprintf(stderr, "  -c <file>     Load routes from a config file, one per line:\n");
+    fprintf(stderr, "                  <address> <port> <net_to_app_fifo> <app_to_net_fifo>\n");
+    fprintf(stderr, "                The file is re-read on SIGHUP; only changed routes are touched.\n");
+    fprintf(stderr, "  --workers <n> Number of worker threads serving routes (default: one per core).\n");
     fprintf(stderr, "  -v            Enable verbose output for debugging.\n");
+    fprintf(stderr, "  --threads     Use the legacy polling thread pair instead of the epoll workers (-h/-p only).\n");
+    fprintf(stderr, "  --uring       Serve the -h/-p route on one io_uring: multishot recv into provided buffers,\n");
+    fprintf(stderr, "                registered files and buffers, linked writes. Falls back to the epoll\n");
+    fprintf(stderr, "                workers if the kernel lacks io_uring support.\n");
+    fprintf(stderr, "  --queue-depth <n>  io_uring submission queue size, i.e. the most operations\n");
+    fprintf(stderr, "                submitted per batch (default %d).\n", URING_DEFAULT_QUEUE_DEPTH);
+    fprintf(stderr, "  --splice      Move data between socket and FIFOs with splice(2), without copying\n");
+    fprintf(stderr, "                through user space. Falls back to copying where splice is unsupported.\n");
+    fprintf(stderr, "  --pipe-size <bytes>  FIFO capacity to request in splice mode (default %d).\n", DEFAULT_SPLICE_PIPE_SIZE);
+    fprintf(stderr, "  --ring-size <bytes>  In-memory buffer per direction and route (default %d).\n", DEFAULT_RING_SIZE);
+    fprintf(stderr, "  --autotune    Size each direction's buffer (%d KB up to --ring-size, default %d MB here)\n",
+            TUNE_MIN_CHUNK / 1024, TUNE_MAX_RING / (1024 * 1024));
+    fprintf(stderr, "                and FIFO (up to pipe-max-size) from its traffic, and raise socket buffers\n");
+    fprintf(stderr, "                when the bandwidth-delay product needs it. Decisions show in --stats.\n");
+    fprintf(stderr, "  --spill-size <bytes> Overflow to an mmap'd spill file of this size when the ring is full\n");
+    fprintf(stderr, "                       (default 0, disabled).\n");
+    fprintf(stderr, "  --spill-dir <dir>    Directory for spill files (default %s).\n", DEFAULT_SPILL_DIR);
+    fprintf(stderr, "  --high-water <bytes> Stop reading a source once this much is buffered\n");
+    fprintf(stderr, "                       (default ring size + spill size).\n");
+    fprintf(stderr, "  --low-water <bytes>  Resume reading once the buffer drains to this (default half of high water).\n");
+    fprintf(stderr, "  --shm         Exchange data with netpipe_connector --shm through shared-memory rings\n");
+    fprintf(stderr, "                instead of FIFOs. The segment is /netpipe_<basename of net_to_app FIFO>\n");
+    fprintf(stderr, "                (%s for -h/-p) and each ring is --ring-size bytes.\n", NETPIPE_SHM_DEFAULT_NAME);
+    fprintf(stderr, "  --handoff <path>  Do not forward data. Instead pass each route's connected TCP socket to\n");
+    fprintf(stderr, "                clients of the Unix socket at <path> (netpipe_connector --handoff), and\n");
+    fprintf(stderr, "                reconnect whenever a client reports it dead.\n");
+    fprintf(stderr, "  --frame=<line|u16len|u32len>  Only deliver whole records: newline-terminated lines or\n");
+    fprintf(stderr, "                records with a big-endian length prefix. FIFO writes batch records\n");
+    fprintf(stderr, "                into PIPE_BUF-sized atomic writes.\n");
+    fprintf(stderr, "  --replay <bytes> Keep a copy of the last <bytes> sent to the socket and, after a\n");
+    fprintf(stderr, "                reconnect, resend whatever the lost connection never had acknowledged.\n");
+    fprintf(stderr, "  --fanout <list>  Also deliver the -h/-p route's net->app stream to each entry of a\n");
+    fprintf(stderr, "                comma-separated list: a FIFO path, or unix:<path> to accept any number of\n");
+    fprintf(stderr, "                Unix socket subscribers there (up to %d subscribers in all). Subscribers\n", MAX_SUBSCRIBERS);
+    fprintf(stderr, "                are fed with tee(2) without copying; the main FIFO is unaffected.\n");
+    fprintf(stderr, "  --fanout-policy <drop|block|disconnect>  What happens to a subscriber that falls more than\n");
+    fprintf(stderr, "                --fanout-lag behind: it misses data (default), the socket waits for it,\n");
+    fprintf(stderr, "                or it is disconnected.\n");
+    fprintf(stderr, "  --fanout-lag <bytes>  Pipe size per subscriber, i.e. how far it may fall behind\n");
+    fprintf(stderr, "                (default %d).\n", DEFAULT_FANOUT_LAG);
+    fprintf(stderr, "  --demux <value>=<fifo>  Send each net->app record of the -h/-p route that starts with\n");
+    fprintf(stderr, "                <value> (up to %d bytes) to <fifo> instead of the route's FIFO. Repeat for\n", DEMUX_MAX_VALUE);
+    fprintf(stderr, "                up to %d outputs; the first match wins. Records are --frame records,\n", MAX_DEMUX_OUTPUTS);
+    fprintf(stderr, "                lines by default.\n");
+    fprintf(stderr, "  --demux-field <n>  Match the start of the nth field of each record instead (1-based).\n");
+    fprintf(stderr, "  --demux-sep <c>    Field separator for --demux-field (default ',', \\t for tab).\n");
+    fprintf(stderr, "  --capture <file>  Record every chunk read in either direction, with a timestamp, to a\n");
+    fprintf(stderr, "                memory-mapped log for netpipe_connector --replay. Workers never wait\n");
+    fprintf(stderr, "                on the log; chunks it cannot keep up with are counted as dropped.\n");
+    fprintf(stderr, "  --capture-size <bytes>  Size the log is preallocated to; capture stops when it is\n");
+    fprintf(stderr, "                full (default %llu).\n", CAPTURE_DEFAULT_SIZE);
+    fprintf(stderr, "  --standby <n> Keep n spare connections open, spread over the -h upstreams, and switch\n");
+    fprintf(stderr, "                to one at once when the active socket fails (1-%d).\n", MAX_STANDBYS);
+    fprintf(stderr, "  --latency     Set TCP_NODELAY and send app->net data as soon as it is read.\n");
+    fprintf(stderr, "  --throughput  Set TCP_NODELAY and gather app->net data for up to --coalesce-us\n");
+    fprintf(stderr, "                microseconds or --coalesce-bytes bytes, whichever comes first.\n");
+    fprintf(stderr, "  --adaptive    Gather like --throughput while FIFO data arrives more often than once\n");
+    fprintf(stderr, "                per --coalesce-us, otherwise send at once like --latency.\n");
+    fprintf(stderr, "  --coalesce-us <usec>     Hold time for --throughput/--adaptive (default %d).\n", DEFAULT_COALESCE_US);
+    fprintf(stderr, "  --coalesce-bytes <bytes> Send threshold for --throughput/--adaptive (default %d).\n", DEFAULT_COALESCE_BYTES);
+    fprintf(stderr, "  --low-latency Trade CPU for wake-up latency: idle I/O threads (epoll workers or the\n");
+    fprintf(stderr, "                --threads pair) poll without sleeping for --spin-us before blocking,\n");
+    fprintf(stderr, "                sockets get SO_BUSY_POLL and TCP_NODELAY, and threads are pinned to\n");
+    fprintf(stderr, "                --cpus (default: the cores we may run on, in order). Compare the\n");
+    fprintf(stderr, "                wake-up latency histogram in --stats with and without it.\n");
+    fprintf(stderr, "  --spin-us <usec>  Spin time for --low-latency (default %d).\n", DEFAULT_SPIN_US);
+    fprintf(stderr, "  --cpus <list> Cores for the I/O threads, e.g. 2,3 or 4-7; thread i gets entry i mod n.\n");
+    fprintf(stderr, "  --sched-fifo <prio>  Also run the I/O threads as SCHED_FIFO at <prio> (1-99; needs\n");
+    fprintf(stderr, "                CAP_SYS_NICE). The spin is bounded, so other threads still get the core.\n");
+    fprintf(stderr, "  --stats <path>  Serve per-route counters and histograms on the Unix socket at <path>.\n");
+    fprintf(stderr, "                Send \"STATS\" or \"STATS prometheus\" (netpipe_connector --stats).\n");
+}
+
+// Read a single integer from a /proc file, or return 'fallback'
+static int read_proc_int(const char *path, int fallback) {
+    FILE *f = fopen(path, "r");
+    int value;
+
+    if (f == NULL) {
+        return fallback;
+    }
+    if (fscanf(f, "%d", &value) != 1 || value <= 0) {
+        value = fallback;
+    }
+    fclose(f);
+    return value;
+}
+
+// Bump an eventfd counter. write() is async-signal-safe, so this is usable from handlers.
+static void wake_fd(int fd) {
+    uint64_t one = 1;
+    if (fd != -1) {
+        ssize_t rc = write(fd, &one, sizeof(one));
+        (void)rc; // Counter saturation is harmless; the reader just wakes up
+    }
+}
+
+// Consume pending wakeups from an eventfd
+static void drain_wake_fd(int fd) {
+    uint64_t counter;
+    if (read(fd, &counter, sizeof(counter)) == -1 && errno != EAGAIN) {
+        perror("Error reading eventfd");
+    }
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline int running(void) {
+    return __atomic_load_n(&keep_running, __ATOMIC_ACQUIRE);
+}
+
+static inline void stop_running(void) {
+    __atomic_store_n(&keep_running, 0, __ATOMIC_RELEASE);
+}
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
 // Signal handler for graceful shutdown (e.g., Ctrl+C)
 void sigint_handler(int signum) {
-    fprintf(stderr, "\nSIGINT (%d) received. Shutting down...\n",signum);
-    keep_running = 0;
+    static const char msg[] = "\nSIGINT received. Shutting down...\n";
+    int saved_errno = errno; // The interrupted code may be about to look at it
+
+    (void)signum;
+    // write(), not stdio: the signal may land while a thread holds stderr's lock
+    ssize_t rc = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+    (void)rc;
+    stop_running();
+    wake_fd(main_wake_fd);
+    errno = saved_errno;
+}
+
+// Signal handler for config reload
+void sighup_handler(int signum) {
+    int saved_errno = errno;
+
+    (void)signum;
+    reload_requested = 1;
+    wake_fd(main_wake_fd);
+    errno = saved_errno;
+}
+
+// --- Low-latency tuning (--low-latency) ---
+
+// Parse a core list such as "2,3" or "4-7,9". Returns the count, or -1 if malformed.
+static int parse_cpu_list(const char *list, int *cpus, int max) {
+    const char *p = list;
+    int count = 0;
+
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10), last;
+
+        if (end == p || first < 0 || first >= CPU_SETSIZE) {
+            return -1;
+        }
+        last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first || last >= CPU_SETSIZE) {
+                return -1;
+            }
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (count == max) {
+                return -1;
+            }
+            cpus[count++] = cpu;
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return -1;
+        }
+        p = end;
+    }
+    return count > 0 ? count : -1;
+}
+
+// Pin I/O thread 'index' to its --cpus entry and apply --sched-fifo. Failures are reported, not fatal.
+static void tune_io_thread(pthread_t tid, int index, const options_t *opts, const char *name) {
+    int rc;
+
+    if (opts->cpu_count > 0) {
+        int cpu = opts->cpus[index % opts->cpu_count];
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if ((rc = pthread_setaffinity_np(tid, sizeof(set), &set)) != 0) {
+            fprintf(stderr, "Warning: cannot pin %s to CPU %d: %s\n", name, cpu, strerror(rc));
+        } else if (opts->verbose) {
+            printf("Pinned %s to CPU %d.\n", name, cpu);
+        }
+    }
+    if (opts->sched_priority > 0) {
+        struct sched_param param = { .sched_priority = opts->sched_priority };
+        if ((rc = pthread_setschedparam(tid, SCHED_FIFO, &param)) != 0) {
+            fprintf(stderr, "Warning: cannot make %s SCHED_FIFO: %s\n", name, strerror(rc));
+        }
+    }
+}
+
+// Send at once, and busy-poll the device queue while a read waits for data
+static void tune_socket_latency(int fd, const options_t *opts) {
+    int one = 1, usec = opts->spin_us;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) == -1 && opts->verbose) {
+        perror("SO_BUSY_POLL (needs CAP_NET_ADMIN above net.core.busy_read)");
+    }
+#ifdef SO_PREFER_BUSY_POLL
+    setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one));
+#endif
+}
+
+// Wake-up latency is measured whenever someone can look at it, so runs with
+// and without --low-latency can be compared
+static int wakeup_measured(const options_t *opts) {
+    return opts->low_latency || opts->stats_path != NULL;
+}
+
+// The threads engine shares its fds with main() through thread_data_t's
+// pointers: main() publishes a new fd with an atomic store once it is open,
+// and a thread that sees one fail sets it back to -1 for main() to reopen.
+// Each FIFO has only one thread using it, which closes it itself. The socket
+// is used by both, so it is closed by main(), and only once neither thread is
+// inside a call on it: otherwise the number could be reused by the next open
+// while the other thread still reads or writes it.
+static int thread_fd(int *slot) {
+    return __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+}
+
+// Mark FIFO 'fd' failed and close it, unless main() has already replaced it
+static void release_thread_fd(int *slot, int fd) {
+    if (__atomic_compare_exchange_n(slot, &fd, -1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        close(fd);
+    }
+}
+
+// The current socket, announced in socket_in_use[me] for main() to see before
+// it closes one; -1 when there is none. Pair with thread_done_socket().
+static int thread_use_socket(thread_data_t *data, int me) {
+    for (;;) {
+        int fd = __atomic_load_n(data->socket_fd_ptr, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&data->socket_in_use[me], fd, __ATOMIC_SEQ_CST);
+        if (fd == -1 || __atomic_load_n(data->socket_fd_ptr, __ATOMIC_SEQ_CST) == fd) {
+            return fd; // Still current after the announcement, so main() will wait for us
+        }
+    }
+}
+
+static void thread_done_socket(thread_data_t *data, int me) {
+    __atomic_store_n(&data->socket_in_use[me], -1, __ATOMIC_RELEASE);
+}
+
+// Mark socket 'fd' failed so main() reconnects, unless the other thread got
+// there first. Shutting it down wakes that thread if it is blocked on it.
+static void release_thread_socket(thread_data_t *data, int fd) {
+    if (__atomic_compare_exchange_n(data->socket_fd_ptr, &fd, -1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        shutdown(fd, SHUT_RDWR);
+    }
 }
 
 // Thread function to read from socket and write to named pipe (net -> app)
@@ -58,22 +509,40 @@ void *socket_to_pipe_thread(void *arg) {
     thread_data_t *data = (thread_data_t *)arg;
     char buffer[BUFFER_SIZE];
     ssize_t bytes_received;
+    long long idle_since = 0;
 
     if (data->verbose) {
         printf("[SocketToPipeThread] Starting...\n");
     }
 
-    while (keep_running) {
-        int current_socket_fd = *(data->socket_fd_ptr);
-        int current_pipe_fd = *(data->pipe_net_to_app_fd_ptr);
+    while (running()) {
+        int current_pipe_fd = thread_fd(data->pipe_net_to_app_fd_ptr);
+        int current_socket_fd = current_pipe_fd == -1 ? -1 : thread_use_socket(data, 0);
 
         // Wait for both socket and pipe to be valid
         if (current_socket_fd == -1 || current_pipe_fd == -1) {
+            thread_done_socket(data, 0);
             usleep(100000); // 100 ms
             continue;
         }
 
-        bytes_received = recv(current_socket_fd, buffer, sizeof(buffer), 0);
+        if (data->spin_ns > 0) {
+            // Spin on a non-blocking recv for a while before falling back to a blocking one
+            bytes_received = recv(current_socket_fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+            if (bytes_received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (idle_since == 0) {
+                    idle_since = now_ns();
+                }
+                if (now_ns() - idle_since < data->spin_ns) {
+                    continue;
+                }
+                bytes_received = recv(current_socket_fd, buffer, sizeof(buffer), 0);
+            }
+            idle_since = 0;
+        } else {
+            bytes_received = recv(current_socket_fd, buffer, sizeof(buffer), 0);
+        }
+        thread_done_socket(data, 0);
 
         if (bytes_received > 0) {
             if (data->verbose) {
@@ -82,7 +551,7 @@ void *socket_to_pipe_thread(void *arg) {
             if (write(current_pipe_fd, buffer, bytes_received) == -1) {
                 if (errno == EPIPE) { // No process has the pipe open for reading
                     if (data->verbose) printf("[SocketToPipeThread] Named pipe '%s' has no reader (EPIPE). Signalling main to reopen pipe.\n", PIPE_NET_TO_APP_NAME);
-                    *(data->pipe_net_to_app_fd_ptr) = -1; // Invalidate pipe FD to trigger reopen
+                    release_thread_fd(data->pipe_net_to_app_fd_ptr, current_pipe_fd); // Trigger reopen
                 } else {
                     perror("[SocketToPipeThread] Error writing to named pipe");
                 }
@@ -93,9 +562,9 @@ void *socket_to_pipe_thread(void *arg) {
             if (data->verbose) {
                 printf("[SocketToPipeThread] Socket closed by peer. Signalling main for reconnection.\n");
             }
-            *(data->socket_fd_ptr) = -1; // Invalidate socket to trigger reconnection
+            release_thread_socket(data, current_socket_fd); // Trigger reconnection
             // Wait for main thread to re-establish
-            while(*(data->socket_fd_ptr) == -1 && keep_running) {
+            while(thread_fd(data->socket_fd_ptr) == -1 && running()) {
                 usleep(100000);
             }
         } else if (bytes_received == -1) {
@@ -105,9 +574,9 @@ void *socket_to_pipe_thread(void *arg) {
             } else {
                 perror("[SocketToPipeThread] Error receiving from socket");
             }
-            *(data->socket_fd_ptr) = -1; // Invalidate socket to trigger reconnection
+            release_thread_socket(data, current_socket_fd); // Trigger reconnection
             // Wait for main thread to re-establish
-            while(*(data->socket_fd_ptr) == -1 && keep_running) {
+            while(thread_fd(data->socket_fd_ptr) == -1 && running()) {
                 usleep(100000);
             }
         }
@@ -125,14 +594,15 @@ void *pipe_to_socket_thread(void *arg) {
     char buffer[BUFFER_SIZE];
     ssize_t bytes_read;
     int original_flags;
+    long long idle_since = 0;
 
     if (data->verbose) {
         printf("[PipeToSocketThread] Starting...\n");
     }
 
-    while (keep_running) {
-        int current_socket_fd = *(data->socket_fd_ptr);
-        int current_pipe_fd = *(data->pipe_app_to_net_fd_ptr);
+    while (running()) {
+        int current_socket_fd = thread_fd(data->socket_fd_ptr);
+        int current_pipe_fd = thread_fd(data->pipe_app_to_net_fd_ptr);
 
         // Wait for both socket and pipe to be valid
         if (current_socket_fd == -1 || current_pipe_fd == -1) {
@@ -149,15 +619,31 @@ void *pipe_to_socket_thread(void *arg) {
         // Restore blocking mode (if it was blocking before)
         fcntl(current_pipe_fd, F_SETFL, original_flags);
 
+        if (bytes_read != -1 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            idle_since = 0;
+        }
         if (bytes_read > 0) {
             if (data->verbose) {
                 printf("[PipeToSocketThread] Read %zd bytes from named pipe '%s'. Writing to socket.\n", bytes_read, PIPE_APP_TO_NET_NAME);
             }
-            if (send(current_socket_fd, buffer, bytes_read, 0) == -1) {
-                perror("[PipeToSocketThread] Error sending to socket");
-                *(data->socket_fd_ptr) = -1; // Invalidate socket to trigger reconnection
+            // Keep what the socket has not taken and send it on the next connection
+            for (ssize_t sent = 0; sent < bytes_read && running();) {
+                ssize_t n = -1;
+                current_socket_fd = thread_use_socket(data, 1);
+                if (current_socket_fd != -1) {
+                    n = send(current_socket_fd, buffer + sent, bytes_read - sent, MSG_NOSIGNAL);
+                }
+                thread_done_socket(data, 1);
+                if (n > 0) {
+                    sent += n;
+                    continue;
+                }
+                if (current_socket_fd != -1) {
+                    perror("[PipeToSocketThread] Error sending to socket");
+                    release_thread_socket(data, current_socket_fd); // Trigger reconnection
+                }
                 // Wait for main thread to re-establish
-                while(*(data->socket_fd_ptr) == -1 && keep_running) {
+                while(thread_fd(data->socket_fd_ptr) == -1 && running()) {
                     usleep(100000);
                 }
             }
@@ -166,19 +652,30 @@ void *pipe_to_socket_thread(void *arg) {
             if (data->verbose) {
                 printf("[PipeToSocketThread] Named pipe '%s' writer closed (EOF). Signalling main to reopen pipe.\n", PIPE_APP_TO_NET_NAME);
             }
-            *(data->pipe_app_to_net_fd_ptr) = -1; // Invalidate pipe FD to trigger reopen
+            release_thread_fd(data->pipe_app_to_net_fd_ptr, current_pipe_fd); // Trigger reopen
             // Wait for main thread to re-establish
-            while(*(data->pipe_app_to_net_fd_ptr) == -1 && keep_running) {
+            while(thread_fd(data->pipe_app_to_net_fd_ptr) == -1 && running()) {
                 usleep(100000);
             }
         } else if (bytes_read == -1) {
             if (errno != EAGAIN && errno != EWOULDBLOCK) { // EAGAIN/EWOULDBLOCK for non-blocking read
                 perror("[PipeToSocketThread] Error reading from named pipe");
                 // Potentially a more serious pipe error, signal main to reopen
-                *(data->pipe_app_to_net_fd_ptr) = -1;
-                 while(*(data->pipe_app_to_net_fd_ptr) == -1 && keep_running) {
+                release_thread_fd(data->pipe_app_to_net_fd_ptr, current_pipe_fd);
+                 while(thread_fd(data->pipe_app_to_net_fd_ptr) == -1 && running()) {
                     usleep(100000);
                 }
+            } else if (data->spin_ns > 0) {
+                // Spin for a while, then block until the FIFO has data (rechecking the fds now and then)
+                struct pollfd pfd = { .fd = current_pipe_fd, .events = POLLIN };
+                if (idle_since == 0) {
+                    idle_since = now_ns();
+                }
+                if (now_ns() - idle_since >= data->spin_ns) {
+                    poll(&pfd, 1, 100);
+                    idle_since = 0;
+                }
+                continue;
             }
             usleep(100000); // Prevent busy-waiting if no data
         }
@@ -190,244 +687,6812 @@ void *pipe_to_socket_thread(void *arg) {
     return NULL;
 }
 
-// Helper to open a FIFO, handling EEXIST and blocking until both sides are open
-int open_fifo_robustly(const char *fifo_name, int flags, int verbose) {
-    int fd = -1;
-    if (mkfifo(fifo_name, 0666) == -1 && errno != EEXIST) {
-        perror("mkfifo");
-        return -1;
-    } else if (verbose && errno == EEXIST) {
-        printf("Named pipe '%s' already exists.\n", fifo_name);
-    }
+// --- Route engine ---
+// Each route is one host:port <-> FIFO pair. Routes are sharded across a fixed
+// pool of worker threads, each running one epoll loop over all of its routes.
+// The scheduler in main() opens and reconnects fds for every route, publishes
+// them through the route's shared ints and wakes the owning worker; a worker
+// closes an fd and sets it back to -1 when it fails, then wakes the scheduler.
 
-    int attempts = 0;
-    const int max_attempts_open = 10; // Avoid infinite loop if something is truly wrong
-    while (keep_running && fd == -1) {
-        if (verbose) {
-            printf("Opening '%s' with flags %d...\n", fifo_name, flags);
-        }
-        fd = open(fifo_name, flags);
-        if (fd == -1) {
-            if (errno == ENXIO) { // No readers/writers yet
-                if (verbose) printf("Waiting for other end of pipe '%s' to open (ENXIO).\n", fifo_name);
-                sleep(1); // Wait a second before retrying
-                attempts++;
-                if (max_attempts_open > 0 && attempts >= max_attempts_open) {
-                    fprintf(stderr, "Max open attempts for pipe '%s' reached. Giving up.\n", fifo_name);
-                    return -1;
-                }
-            } else {
-                perror("open fifo_name");
-                sleep(1); // Other error, wait and retry
-                attempts++;
-                 if (max_attempts_open > 0 && attempts >= max_attempts_open) {
-                    fprintf(stderr, "Max open attempts for pipe '%s' reached. Giving up.\n", fifo_name);
-                    return -1;
-                }
-            }
-        } else {
-            if (verbose) printf("Successfully opened '%s'. FD: %d\n", fifo_name, fd);
-        }
-    }
-    return fd;
-}
+// Per-route fd tags, stored alongside the route in the epoll handle
+#define TAG_SOCKET 0
+#define TAG_PIPE_APP_TO_NET 1
+#define TAG_PIPE_NET_TO_APP 2
+#define NUM_SHARED_TAGS 3 // Tags above are opened by the scheduler; the rest by the worker
+#define TAG_SHM_BELL 3    // eventfd fed by the shared-memory doorbell bridge
+#define TAG_COALESCE_TIMER 4 // timerfd that releases held app->net data (-l: retries a blocked accept)
+#define TAG_FANOUT_LISTEN 5  // --fanout: one per unix:<path> listener...
+#define TAG_SUBSCRIBER (TAG_FANOUT_LISTEN + MAX_FANOUT_LISTENERS) // ...and one per subscriber
+#define TAG_LISTEN (TAG_SUBSCRIBER + MAX_SUBSCRIBERS) // -l: the shard's listening socket
+#define TAG_DEMUX (TAG_LISTEN + 1) // --demux: one per output FIFO
+#define NUM_TAGS (TAG_DEMUX + MAX_DEMUX_OUTPUTS)
+#define TAG_CLIENT NUM_TAGS  // -l clients: the handle lives in listen_client_t, not route->handles
 
+// Data directions, used to index per-direction state
+#define DIR_NET_TO_APP 0
+#define DIR_APP_TO_NET 1
+#define NUM_DIRS 2
 
-int main(int argc, char *argv[]) {
-    int socket_fd = -1; // Initialize to -1 to indicate no connection
-    int pipe_app_to_net_fd = -1; // From app (external) to network (read by forwarder)
-    int pipe_net_to_app_fd = -1; // From network to app (written by forwarder)
-    char *address = NULL;
-    int port = -1;
-    int verbose = 0;
-    struct sockaddr_in serv_addr;
-    pthread_t tid1, tid2;
-    thread_data_t thread_data;
-    int reconnect_socket_attempts = 0;
+typedef struct route route_t;
+typedef struct worker worker_t;
 
-    // Register signal handler for graceful shutdown
-    signal(SIGINT, sigint_handler);
+// One entry of a route's ordered upstream list
+typedef struct {
+    char *host;
+    int port;
+} upstream_t;
 
-    // Parse command line arguments (same as before)
-    for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "--help") == 0) {
-            print_usage();
-            exit(EXIT_SUCCESS);
-        } else if (strcmp(argv[i], "-h") == 0) {
-            if (i + 1 < argc) {
-                address = argv[++i];
-            } else {
-                fprintf(stderr, "Error: -h requires an address argument.\n");
-                print_usage();
-                exit(EXIT_FAILURE);
-            }
-        } else if (strcmp(argv[i], "-p") == 0) {
-            if (i + 1 < argc) {
-                port = atoi(argv[++i]);
-                if (port <= 0 || port > 65535) {
-                    fprintf(stderr, "Error: Invalid port number.\n");
-                    print_usage();
-                    exit(EXIT_FAILURE);
-                }
-            } else {
-                fprintf(stderr, "Error: -p requires a port number argument.\n");
-                print_usage();
-                exit(EXIT_FAILURE);
-            }
-        } else if (strcmp(argv[i], "-v") == 0) {
-            verbose = 1;
-        } else {
-            fprintf(stderr, "Error: Unknown option '%s'\n", argv[i]);
-            print_usage();
-            exit(EXIT_FAILURE);
-        }
-    }
+// A non-blocking connect to one upstream, racing its resolved addresses
+typedef struct {
+    int upstream;               // Index into route->upstreams
+    struct sockaddr_storage addrs[DIAL_MAX_ADDRS]; // Resolved, families interleaved
+    socklen_t addr_lens[DIAL_MAX_ADDRS];
+    int fds[DIAL_MAX_ADDRS];    // Connect attempt per address (-1 if none)
+    int addr_count;
+    int next;                   // Next address to try
+    long long started_ns;       // 0 when idle
+    long long next_ms;          // When another address joins the race
+    long long deadline_ms;
+    int one_upstream;           // Back off after each upstream rather than walking the list
+    int attempts;               // Failed passes over the upstream list since the last success
+    long long retry_ms;         // Backoff: no new dial before this
+} dialer_t;
 
-    if (address == NULL || port == -1) {
-        fprintf(stderr, "Error: Both -h (address) and -p (port) are required.\n");
-        print_usage();
-        exit(EXIT_FAILURE);
-    }
+// What epoll_event.data.ptr points at
+typedef struct {
+    route_t *route; // NULL for the worker's wake eventfd
+    int tag;
+} fd_handle_t;
 
-    if (verbose) {
-        printf("Configuring: Address=%s, Port=%d, Verbose=%d\n", address, port, verbose);
-    }
+// Circular byte store over heap memory or an mmap'd spill file
+typedef struct {
+    char *base;
+    size_t cap;
+    size_t head; // Offset of the oldest byte
+    size_t len;  // Bytes held
+} ring_t;
 
-    // Prepare thread data - pass pointers to main's FDs
-    thread_data.socket_fd_ptr = &socket_fd;
-    thread_data.pipe_app_to_net_fd_ptr = &pipe_app_to_net_fd;
-    thread_data.pipe_net_to_app_fd_ptr = &pipe_net_to_app_fd;
-    thread_data.verbose = verbose;
+// When the bytes up to stream offset 'end' were read from the source
+typedef struct {
+    uint64_t end;
+    long long ns;
+} latency_mark_t;
 
-    // Create threads (they will continuously check the FD pointers)
-    if (verbose) {
-        printf("Creating communication threads...\n");
-    }
-    if (pthread_create(&tid1, NULL, socket_to_pipe_thread, (void *)&thread_data) != 0) {
-        error_exit("Error creating socket_to_pipe_thread");
-    }
-    if (pthread_create(&tid2, NULL, pipe_to_socket_thread, (void *)&thread_data) != 0) {
-        error_exit("Error creating pipe_to_socket_thread");
-    }
+#define LATENCY_MARKS 64 // Chunks in flight timed individually; later ones share the last mark
 
-    // Main loop for connection management (socket and pipes)
-    while (keep_running) {
-        // --- Manage Socket Connection ---
-        if (socket_fd == -1) {
-            if (reconnect_socket_attempts > 0) {
-                if (verbose) {
-                    printf("Socket connection lost. Attempting reconnect in %d seconds...\n", RECONNECT_DELAY_SECONDS);
-                }
-                sleep(RECONNECT_DELAY_SECONDS);
-            }
+// Everything read from one side and not yet accepted by the other. New data
+// goes to the memory ring until it is full, then to the spill ring; while the
+// spill ring holds anything, new data keeps going there so order is preserved
+// (all of 'mem' is older than all of 'spill').
+typedef struct {
+    ring_t mem;
+    ring_t spill;        // cap 0 when spilling is disabled
+    size_t high_water;
+    size_t low_water;
+    int paused;          // Source reads stopped until we drain to low_water
+    unsigned long pauses;
+    unsigned long long spilled_bytes;
+    uint64_t committed;  // Stream offsets of the newest and oldest held byte, for latency marks
+    uint64_t consumed;
+    latency_mark_t marks[LATENCY_MARKS];
+    int mark_head;
+    int mark_count;
+} dir_buffer_t;
 
-            if (!keep_running) break;
+// Which data path each direction took; printed when the route is torn down
+typedef struct {
+    unsigned long splice_calls;
+    unsigned long copy_calls;
+    unsigned long long splice_bytes;
+    unsigned long long copy_bytes;
+} path_stats_t;
 
-            if (MAX_RECONNECT_ATTEMPTS > 0 && reconnect_socket_attempts >= MAX_RECONNECT_ATTEMPTS) {
-                fprintf(stderr, "Maximum socket reconnect attempts (%d) reached. Exiting.\n", MAX_RECONNECT_ATTEMPTS);
-                keep_running = 0;
-                break;
-            }
+// Per-direction metrics, written only by the route's worker (netpipe_metrics.h)
+typedef struct {
+    uint64_t bytes_in;          // Read from the source
+    uint64_t bytes_out;         // Accepted by the sink
+    uint64_t chunks;            // Source reads that returned data
+    uint64_t syscalls;          // read/write/splice calls, whatever their result
+    uint64_t eagain;
+    uint64_t epipe;
+    uint64_t records;           // --frame: whole records delivered
+    uint64_t oversized;         // --frame: records delivered in pieces
+    uint64_t torn_bytes;        // --frame: partial records dropped when a side closed
+    uint64_t sends_now;         // Sends made as soon as data arrived
+    uint64_t sends_size;        // Coalesced sends released by coalesce_bytes
+    uint64_t sends_timer;       // Coalesced sends released by coalesce_us
+    uint64_t msg_more;          // Sends flagged MSG_MORE (more of the batch follows)
+    uint64_t coalesce_switches; // Adaptive mode turned coalescing on or off
+    uint64_t replayed;          // --replay: unacknowledged bytes sent again after a reconnect
+    uint64_t replay_lost;       // --replay: unacknowledged bytes older than the replay window
+    uint64_t queued;            // Gauge: bytes held between source and sink
+    uint64_t tune_grows;        // --autotune: buffer (and FIFO) doubled
+    uint64_t tune_shrinks;      // --autotune: buffer (and FIFO) halved
+    uint64_t sockbuf_sets;      // --autotune: SO_RCVBUF/SO_SNDBUF raised
+    uint64_t buffer_bytes;      // Gauge (--autotune): buffer size
+    uint64_t pipe_bytes;        // Gauge (--autotune): capacity of this direction's FIFO
+    uint64_t sockbuf_bytes;     // Gauge (--autotune): socket buffer as the kernel reports it
+    const char *tune_reason;    // --autotune: why the last decision was made (static string)
+    uint64_t tune_ns;           // When it was made
+    metrics_hist_t chunk_size;  // Bytes per source read
+    metrics_hist_t latency_ns;  // Source read to sink write
+} dir_metrics_t;
 
-            if (verbose) {
-                printf("Attempting to connect to %s:%d (Attempt %d)...\n", address, port, reconnect_socket_attempts + 1);
-            }
+// Sizing state for one direction (--autotune), kept by the route's worker
+typedef struct {
+    size_t chunk;               // Buffer capacity, and the FIFO capacity asked for
+    size_t pipe_size;           // Capacity the kernel granted the FIFO (0 while closed)
+    int sockbuf;                // SO_RCVBUF/SO_SNDBUF we set (0 = left to the kernel's autotuning)
+    int full_reads;             // Consecutive reads that filled all the space offered
+    size_t peak;                // Largest read or fill level since the last tick
+    int quiet_ticks;            // Consecutive ticks with peak under a quarter of chunk
+    uint64_t last_bytes;        // bytes_in at the last tick
+} tune_t;
 
-            if (socket_fd != -1) { // Close if it was left open from a previous attempt
-                close(socket_fd);
-                socket_fd = -1;
-            }
+// Released buffers by power-of-two size, linked through their first bytes
+typedef struct {
+    void *free[TUNE_POOL_CLASSES];
+    size_t bytes;
+} tune_pool_t;
 
-            socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-            if (socket_fd < 0) {
-                perror("ERROR creating socket for reconnection");
-                reconnect_socket_attempts++;
-                continue;
-            }
+// Record framing state for one direction (--frame)
+typedef struct {
+    size_t scanned;             // Line mode: bytes at the head already searched for '\n'
+    size_t record_left;         // Rest of a record whose start has been written
+    size_t discard_left;        // Rest of a record to drop as it arrives, its start having gone to a closed sink
+    uint64_t batch_records;     // Records in the batch from frame_next_write
+} framer_t;
 
-            memset(&serv_addr, 0, sizeof(serv_addr));
-            serv_addr.sin_family = AF_INET;
-            serv_addr.sin_port = htons(port);
-            if (inet_pton(AF_INET, address, &serv_addr.sin_addr) <= 0) {
-                close(socket_fd);
-                socket_fd = -1;
-                fprintf(stderr, "Invalid address/ Address not supported for reconnection.\n");
-                reconnect_socket_attempts++;
-                continue;
-            }
+// One consumer of a fanned-out stream; indexed like its TAG_SUBSCRIBER tag
+typedef struct {
+    int kind;                   // SUB_*
+    int spec;                   // Index into fanout_t.specs
+    int pipe[2];                // Unix client: private pipe tee() fills and splice() drains (-1 for a FIFO)
+    size_t capacity;            // Pipe size the kernel granted: the lag limit
+    char *backlog;              // Block policy: bytes a short tee() missed, sent before anything newer
+    size_t backlog_len;
+    size_t lag;                 // Bytes queued for the subscriber
+    long long retry_ms;         // FIFO: next open attempt
+    int out_blocked;            // Waiting for EPOLLOUT
+} subscriber_t;
 
-            if (connect(socket_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-                perror("ERROR connecting");
-                close(socket_fd);
-                socket_fd = -1;
-                reconnect_socket_attempts++;
-                continue;
-            }
+// Counters per --fanout entry, written only by the route's worker
+typedef struct {
+    uint64_t delivered;         // Bytes handed to subscribers
+    uint64_t dropped;           // Bytes subscribers missed (drop policy, or lost with a closed subscriber)
+    uint64_t disconnects;       // Subscribers closed for falling too far behind
+    uint64_t subscribers;       // Gauge: open subscribers
+    uint64_t lag;               // Gauge: bytes queued for the furthest-behind subscriber
+} fanout_stats_t;
 
-            if (verbose) {
-                printf("Successfully reconnected to %s:%d.\n", address, port);
-            }
-            reconnect_socket_attempts = 0;
-        }
+typedef struct {
+    char *specs[MAX_SUBSCRIBERS]; // FIFO paths and unix:<path> entries, as given
+    int spec_count;
+    int listen_spec[MAX_FANOUT_LISTENERS]; // Spec of each TAG_FANOUT_LISTEN tag
+    int pipe[2];                // Staging pipe the socket is spliced into
+    size_t pending;             // Staged bytes not yet delivered; the socket is not read meanwhile
+    subscriber_t subs[MAX_SUBSCRIBERS];
+    fanout_stats_t stats[MAX_SUBSCRIBERS]; // Indexed by spec
+} fanout_t;
 
-        // --- Manage Pipe Connections ---
-        // Pipe: Network to Application (Forwarder writes, external client reads)
-        if (pipe_net_to_app_fd == -1) {
-            if (pipe_net_to_app_fd != -1) { close(pipe_net_to_app_fd); } // Ensure closed
-            pipe_net_to_app_fd = open_fifo_robustly(PIPE_NET_TO_APP_NAME, O_WRONLY, verbose);
-            if (pipe_net_to_app_fd == -1) {
-                fprintf(stderr, "Failed to open FIFO for network to application (%s). Retrying...\n", PIPE_NET_TO_APP_NAME);
-                usleep(500000); // Wait before next retry
-                continue; // Loop again immediately to try both pipe and socket if needed
-            }
-        }
+// Counters per --demux output, written only by the route's worker
+typedef struct {
+    uint64_t records;           // Records routed to the output
+    uint64_t bytes;
+    uint64_t queued;            // Gauge: bytes waiting for the output's FIFO
+} demux_stats_t;
 
-        // Pipe: Application to Network (External client writes, forwarder reads)
-        if (pipe_app_to_net_fd == -1) {
-            if (pipe_app_to_net_fd != -1) { close(pipe_app_to_net_fd); } // Ensure closed
-            pipe_app_to_net_fd = open_fifo_robustly(PIPE_APP_TO_NET_NAME, O_RDONLY, verbose);
-            if (pipe_app_to_net_fd == -1) {
-                fprintf(stderr, "Failed to open FIFO for application to network (%s). Retrying...\n", PIPE_APP_TO_NET_NAME);
+typedef struct {
+    demux_rule_t rules[MAX_DEMUX_OUTPUTS]; // Output i takes records matching rules[i] (first match wins)
+    char *fifos[MAX_DEMUX_OUTPUTS];
+    int fds[MAX_DEMUX_OUTPUTS]; // Opened read-write by main, so they never lack a reader
+    int count;
+    demux_find_fn find;         // Newline/separator search chosen for this CPU
+    const char *find_name;
+    dir_buffer_t out[MAX_DEMUX_OUTPUTS]; // Records waiting for each output FIFO
+    int write_blocked[MAX_DEMUX_OUTPUTS];
+    char *stage;                // Socket data not yet routed, DEMUX_PAD spare bytes after it
+    size_t stage_len;
+    int carry;                  // Output (or DEMUX_MAIN) taking the rest of a record sent in pieces
+    size_t carry_left;          // Length-prefixed modes: bytes of it still to come
+    demux_stats_t stats[MAX_DEMUX_OUTPUTS];
+    demux_stats_t unmatched;    // Records left for the route's own FIFO
+} demux_t;
+
+// A TCP client of a listen shard
+typedef struct listen_client {
+    fd_handle_t handle;         // First: what epoll reports (tag TAG_CLIENT)
+    int fd;                     // -1 once closed
+    uint32_t tag;               // Sequence number << 8 | shard index
+    uint32_t mask;              // Interest currently registered
+    char *out;                  // App->net data not yet sent (NULL while idle)
+    size_t out_len;
+    size_t out_cap;
+    int closing;                // The application asked for a close once 'out' drains
+    int stalled;                // On the stalled list
+    struct listen_client *hash_next; // Bucket chain; the dead list once closed
+    struct listen_client *stalled_next;
+} listen_client_t;
+
+// An app->net record on its way to another shard
+typedef struct listen_msg {
+    uint32_t tag;
+    int close;
+    size_t len;
+    struct listen_msg *next;
+    char data[];
+} listen_msg_t;
+
+// One worker's share of listen mode, hung off its route
+typedef struct {
+    int index;                  // Shard number: the low 8 bits of its client tags
+    int fd;                     // SO_REUSEPORT listening socket, opened by main
+    route_t **shards;           // Every shard, for routing app->net records
+    int shard_count;
+    uint32_t next_seq;
+    int accept_blocked;         // Out of fds; wait for a client to leave or LISTEN_RETRY_MS
+    int accept_warned;          // Reported running out, not yet accepted since
+    listen_client_t *clients[LISTEN_HASH_SIZE];
+    listen_client_t *stalled;   // Waiting for room in the net->app buffer
+    listen_client_t *dead;      // Closed; freed after the current epoll batch
+    pthread_mutex_t inbox_lock;
+    listen_msg_t *inbox_head;   // Records posted by shard 0, oldest first
+    listen_msg_t *inbox_tail;
+    uint64_t open;              // Gauge: connected clients
+    uint64_t accepted;
+    uint64_t closed;
+    uint64_t overflows;         // Clients closed for not reading what they were sent
+} listen_shard_t;
+
+struct route {
+    // Configuration, fixed for the life of the route
+    char *address;
+    int port;
+    char *pipe_net_to_app_name;
+    char *pipe_app_to_net_name;
+    int from_config;            // Came from the -c file (reloadable) rather than -h/-p
+    const options_t *opts;
+    worker_t *worker;
+
+    // FD slots shared between the scheduler and the worker (atomic access)
+    int socket_fd;
+    int pipe_app_to_net_fd;
+    int pipe_net_to_app_fd;
+    int dirty;                  // Scheduler published an fd the worker has not adopted yet
+
+    // Scheduler state
+    dialer_t dial;              // Connects the active socket
+    long long next_pipe_attempt_ms;
+    int seen;                   // Mark used while diffing a reloaded config
+    route_t *next;              // Scheduler's route list
+    int handoff_fd;             // --handoff: connected socket not yet passed to a client
+    struct control_client *lease_holder; // --handoff: client holding this route
+    unsigned long handoffs;
+    uint64_t socket_lost_ns;    // --handoff: when the holder reported its socket dead
+    int connected_before;       // Later connects count as reconnects
+    uint64_t reconnects;
+    metrics_hist_t reconnect_ns; // Socket lost -> connected again
+    metrics_hist_t connect_ns;   // Dial start -> connected
+    upstream_t upstreams[MAX_UPSTREAMS]; // -h list in order of preference; [0] is address:port
+    int upstream_count;
+    char *upstream_spec;        // The list as given, for config diffs
+    int active_upstream;        // Upstream of the current socket (atomic)
+
+    // Standby sockets (--standby); slots shared with the worker (atomic access)
+    int standby_fds[MAX_STANDBYS];
+    int standby_upstream[MAX_STANDBYS]; // Written before the fd is released into the slot
+    dialer_t standby_dial;
+    unsigned standby_failed;    // Upstreams whose standby dial failed since the last success (bitmask)
+    uint64_t standbys_ready;    // Gauge
+    uint64_t standby_lost;      // Parked standbys that died (scheduler)
+    uint64_t failovers;         // Active socket replaced by a standby (worker)
+    long long failover_started_ns; // Worker: standby taken, not yet adopted
+    metrics_hist_t failover_ns; // Active socket lost -> standby adopted
+    metrics_hist_t wakeup_ns;   // Socket data arrived -> read by the worker (with --stats or --low-latency)
+    uint64_t down_since_ns[NUM_SHARED_TAGS]; // When the slot last went to -1 (0 while open)
+    uint64_t down_total_ns[NUM_SHARED_TAGS]; // Closed periods, not counting the current one
+
+    // Worker state
+    fd_handle_t handles[NUM_TAGS];
+    int fds[NUM_TAGS];          // FDs adopted by the worker (-1 if none)
+    uint32_t masks[NUM_TAGS];   // Interest currently registered (0 = not in epoll)
+    dir_buffer_t net_to_app;
+    dir_buffer_t app_to_net;
+    int splicing[NUM_DIRS];     // 1 while the direction uses splice(), 0 once fallen back to copying
+    int splice_blocked[NUM_DIRS]; // splice() hit EAGAIN; wait for the destination to drain
+    int write_blocked[NUM_DIRS]; // Sink returned EAGAIN or was just opened; wait for EPOLLOUT
+    int coalescing;             // Holding app->net data is allowed right now
+    long long coalesce_due_ns;  // Expiry the timer is armed for
+    long long last_arrival_ns;  // Last FIFO read (adaptive mode)
+    long long arrival_gap_ns;   // Smoothed gap between FIFO reads
+    ring_t replay_hist;         // --replay: the last replay_size bytes sent to the socket
+    uint64_t replay_left;       // Newest bytes of replay_hist still to be resent
+    uint64_t socket_sent;       // Bytes the current socket has accepted
+    path_stats_t paths[NUM_DIRS];
+    dir_metrics_t metrics[NUM_DIRS];
+    framer_t framers[NUM_DIRS];
+    tune_t tune[NUM_DIRS];      // --autotune
+    shm_header_t *shm;          // --shm: rings replacing the FIFOs and buffers
+    char shm_name[NETPIPE_SHM_MAX_NAME];
+    shm_bridge_t shm_bridge;
+    uint16_t capture_id;        // --capture: names this route's records in the log
+    fanout_t *fanout;           // --fanout (-h/-p route only)
+    listen_shard_t *listen;     // -l: this route is a listen shard rather than a dialled peer
+    demux_t *demux;             // --demux (-h/-p route only)
+    route_t *worker_next;       // Worker's route list, or its list of detached routes
+    int detached;               // Torn down mid-batch; freed once the batch is done
+};
+
+// Attach/detach requests handed from the scheduler to a worker
+typedef struct worker_cmd {
+    route_t *route;
+    int detach;
+    struct worker_cmd *next;
+} worker_cmd_t;
+
+struct worker {
+    int id;
+    pthread_t tid;
+    int epoll_fd;
+    int wake_fd;
+    fd_handle_t wake_handle;
+    pthread_mutex_t inbox_lock;
+    worker_cmd_t *inbox_head;   // Pending commands, oldest first
+    worker_cmd_t *inbox_tail;
+    route_t *routes;            // Routes owned by this worker thread
+    route_t *detached;          // Routes detached during the current epoll batch, freed after it
+    int route_count;            // Maintained by the scheduler, used for sharding
+    long long spin_ns;          // --low-latency: poll this long after the last event before blocking
+    int tune_fd;                // --autotune: timerfd firing every TUNE_TICK_MS (-1 when off)
+    fd_handle_t tune_handle;
+    tune_pool_t pool;           // --autotune: buffers released by shrinking or closed routes
+};
+
+static const char *dir_names[NUM_DIRS] = { "net->app", "app->net" };
+
+// Free space as up to two iovecs, capped at 'limit' bytes. Returns the count.
+static int ring_free_iov(const ring_t *ring, struct iovec *iov, size_t limit) {
+    size_t tail = (ring->head + ring->len) % (ring->cap ? ring->cap : 1);
+    size_t space = ring->cap - ring->len;
+    size_t first;
+    int cnt = 0;
+
+    if (space > limit) {
+        space = limit;
+    }
+    if (space == 0) {
+        return 0;
+    }
+    first = ring->cap - tail < space ? ring->cap - tail : space;
+    iov[cnt].iov_base = ring->base + tail;
+    iov[cnt++].iov_len = first;
+    if (space > first) {
+        iov[cnt].iov_base = ring->base;
+        iov[cnt++].iov_len = space - first;
+    }
+    return cnt;
+}
+
+// Held data as up to two iovecs, oldest first. Returns the count.
+static int ring_used_iov(const ring_t *ring, struct iovec *iov) {
+    size_t first;
+    int cnt = 0;
+
+    if (ring->len == 0) {
+        return 0;
+    }
+    first = ring->cap - ring->head < ring->len ? ring->cap - ring->head : ring->len;
+    iov[cnt].iov_base = ring->base + ring->head;
+    iov[cnt++].iov_len = first;
+    if (ring->len > first) {
+        iov[cnt].iov_base = ring->base;
+        iov[cnt++].iov_len = ring->len - first;
+    }
+    return cnt;
+}
+
+static void ring_consume(ring_t *ring, size_t n) {
+    ring->len -= n;
+    ring->head = ring->len == 0 ? 0 : (ring->head + n) % ring->cap;
+}
+
+static size_t buffer_used(const dir_buffer_t *buf) {
+    return buf->mem.len + buf->spill.len;
+}
+
+// Where the next read from the source should land, up to the high water mark.
+// Returns the iovec count (0 when paused or full).
+static int buffer_fill_iov(dir_buffer_t *buf, struct iovec *iov) {
+    size_t room = buf->high_water - buffer_used(buf);
+    int cnt = 0;
+
+    if (buf->paused || buffer_used(buf) >= buf->high_water) {
+        return 0;
+    }
+    if (buf->spill.len == 0) {
+        cnt = ring_free_iov(&buf->mem, iov, room);
+        for (int i = 0; i < cnt; i++) {
+            room -= iov[i].iov_len;
+        }
+    }
+    return cnt + ring_free_iov(&buf->spill, iov + cnt, room);
+}
+
+// Account for 'n' bytes the source wrote into the iovecs from buffer_fill_iov
+static void buffer_commit(dir_buffer_t *buf, size_t n) {
+    buf->committed += n;
+    if (buf->mark_count < LATENCY_MARKS) {
+        latency_mark_t *mark = &buf->marks[(buf->mark_head + buf->mark_count++) % LATENCY_MARKS];
+        mark->ns = now_ns();
+        mark->end = buf->committed;
+    } else {
+        buf->marks[(buf->mark_head + LATENCY_MARKS - 1) % LATENCY_MARKS].end = buf->committed;
+    }
+    if (buf->spill.len == 0) {
+        size_t to_mem = buf->mem.cap - buf->mem.len < n ? buf->mem.cap - buf->mem.len : n;
+        buf->mem.len += to_mem;
+        n -= to_mem;
+    }
+    buf->spill.len += n;
+    buf->spilled_bytes += n;
+    if (buffer_used(buf) >= buf->high_water && !buf->paused) {
+        buf->paused = 1;
+        buf->pauses++;
+    }
+}
+
+// Held data, oldest first, as up to four iovecs. Returns the count.
+static int buffer_drain_iov(const dir_buffer_t *buf, struct iovec *iov) {
+    int cnt = ring_used_iov(&buf->mem, iov);
+    return cnt + ring_used_iov(&buf->spill, iov + cnt);
+}
+
+// Drop 'n' bytes the sink accepted from the iovecs from buffer_drain_iov
+static void buffer_consume(dir_buffer_t *buf, size_t n) {
+    size_t from_mem = buf->mem.len < n ? buf->mem.len : n;
+
+    ring_consume(&buf->mem, from_mem);
+    ring_consume(&buf->spill, n - from_mem);
+    buf->consumed += n;
+    while (buf->mark_count > 0 && buf->marks[buf->mark_head].end <= buf->consumed) {
+        buf->mark_head = (buf->mark_head + 1) % LATENCY_MARKS;
+        buf->mark_count--;
+    }
+    if (buf->paused && buffer_used(buf) <= buf->low_water) {
+        buf->paused = 0;
+    }
+}
+
+// When the oldest held byte was read from the source
+static long long buffer_oldest_ns(const dir_buffer_t *buf) {
+    return buf->mark_count > 0 ? buf->marks[buf->mark_head].ns : 0;
+}
+
+// Back the spill ring with an unlinked, mmap'd file in spill_dir
+static int buffer_map_spill(dir_buffer_t *buf, const options_t *opts) {
+    char path[512];
+    int fd;
+    void *base;
+
+    snprintf(path, sizeof(path), "%s/netpipe-spill-XXXXXX", opts->spill_dir);
+    fd = mkstemp(path);
+    if (fd == -1) {
+        perror("mkstemp spill file");
+        return -1;
+    }
+    unlink(path); // Space is reclaimed automatically when we unmap
+    if (ftruncate(fd, opts->spill_size) == -1) {
+        perror("ftruncate spill file");
+        close(fd);
+        return -1;
+    }
+    base = mmap(NULL, opts->spill_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("mmap spill file");
+        return -1;
+    }
+    buf->spill.base = base;
+    buf->spill.cap = opts->spill_size;
+    return 0;
+}
+
+static void buffer_set_watermarks(dir_buffer_t *buf, const options_t *opts) {
+    buf->high_water = opts->high_water;
+    if (buf->high_water > buf->mem.cap + buf->spill.cap) {
+        buf->high_water = buf->mem.cap + buf->spill.cap;
+    }
+    buf->low_water = opts->low_water < buf->high_water ? opts->low_water : buf->high_water / 2;
+}
+
+// Set up 'buf' around a memory ring of 'cap' bytes at 'base' (NULL to fail)
+static int buffer_init_ring(dir_buffer_t *buf, const options_t *opts, char *base, size_t cap) {
+    memset(buf, 0, sizeof(*buf));
+    if (base == NULL) {
+        return -1;
+    }
+    buf->mem.base = base;
+    buf->mem.cap = cap;
+    if (opts->spill_size > 0 && buffer_map_spill(buf, opts) == -1) {
+        fprintf(stderr, "Spill file unavailable; buffering in memory only.\n");
+    }
+    buffer_set_watermarks(buf, opts);
+    return 0;
+}
+
+static int buffer_init(dir_buffer_t *buf, const options_t *opts) {
+    return buffer_init_ring(buf, opts, malloc(opts->ring_size), opts->ring_size);
+}
+
+// Move the memory ring to 'base' (cap bytes, room for everything it holds),
+// oldest byte first, and return the old block. Stream offsets, latency marks
+// and framing state are relative to the held data, so they stay valid.
+static char *buffer_move_ring(dir_buffer_t *buf, const options_t *opts, char *base, size_t cap) {
+    struct iovec iov[2];
+    int cnt = ring_used_iov(&buf->mem, iov);
+    char *old = buf->mem.base;
+    size_t off = 0;
+
+    for (int i = 0; i < cnt; i++) {
+        memcpy(base + off, iov[i].iov_base, iov[i].iov_len);
+        off += iov[i].iov_len;
+    }
+    buf->mem.base = base;
+    buf->mem.cap = cap;
+    buf->mem.head = 0;
+    buffer_set_watermarks(buf, opts);
+    if (buffer_used(buf) >= buf->high_water && !buf->paused) {
+        buf->paused = 1;
+        buf->pauses++;
+    } else if (buf->paused && buffer_used(buf) <= buf->low_water) {
+        buf->paused = 0;
+    }
+    return old;
+}
+
+static void buffer_free(dir_buffer_t *buf) {
+    free(buf->mem.base);
+    if (buf->spill.cap > 0) {
+        munmap(buf->spill.base, buf->spill.cap);
+    }
+    memset(buf, 0, sizeof(*buf));
+}
+
+// --- Record framing (--frame) ---
+// With a frame mode set, the held data of each direction is treated as a
+// sequence of records (newline-terminated lines, or records with a 2- or
+// 4-byte big-endian length prefix, prefix included) and writes only ever
+// carry whole records. Towards a FIFO, records are batched up to PIPE_BUF so
+// each writev() is atomic: it either lands entirely or fails with EAGAIN,
+// and never interleaves with other writers. A record that can never be
+// delivered whole (longer than PIPE_BUF, or than the buffer can hold) is
+// passed through in pieces and counted as oversized.
+//
+// When a source goes away mid-record the incomplete tail is dropped, and when
+// a sink goes away mid-record the rest of that record is dropped, so each
+// new connection or FIFO open starts on a record boundary.
+
+static dir_buffer_t *route_buffer(route_t *route, int dir) {
+    return dir == DIR_NET_TO_APP ? &route->net_to_app : &route->app_to_net;
+}
+
+// Copy 'len' held bytes starting 'offset' bytes after the oldest. Returns -1 if not all held.
+static int buffer_peek(const dir_buffer_t *buf, size_t offset, void *dst, size_t len) {
+    struct iovec iov[4];
+    int cnt = buffer_drain_iov(buf, iov);
+    char *out = dst;
+
+    if (offset + len > buffer_used(buf)) {
+        return -1;
+    }
+    for (int i = 0; i < cnt && len > 0; i++) {
+        if (offset >= iov[i].iov_len) {
+            offset -= iov[i].iov_len;
+            continue;
+        }
+        size_t take = iov[i].iov_len - offset < len ? iov[i].iov_len - offset : len;
+        memcpy(out, (char *)iov[i].iov_base + offset, take);
+        out += take;
+        len -= take;
+        offset = 0;
+    }
+    return 0;
+}
+
+// Offset of the first '\n' at or after 'offset', or -1
+static ssize_t buffer_find_newline(const dir_buffer_t *buf, size_t offset) {
+    struct iovec iov[4];
+    int cnt = buffer_drain_iov(buf, iov);
+    size_t base = 0;
+
+    for (int i = 0; i < cnt; base += iov[i].iov_len, i++) {
+        if (offset >= base + iov[i].iov_len) {
+            continue;
+        }
+        size_t skip = offset > base ? offset - base : 0;
+        char *nl = memchr((char *)iov[i].iov_base + skip, '\n', iov[i].iov_len - skip);
+        if (nl) {
+            return base + (nl - (char *)iov[i].iov_base);
+        }
+    }
+    return -1;
+}
+
+// Drop the newest bytes so that only 'keep' remain
+static void buffer_truncate(dir_buffer_t *buf, size_t keep) {
+    size_t drop = buffer_used(buf) - keep;
+    size_t from_spill = buf->spill.len < drop ? buf->spill.len : drop;
+
+    buf->spill.len -= from_spill;
+    buf->mem.len -= drop - from_spill;
+    buf->committed -= drop;
+    while (buf->mark_count > 0) {
+        latency_mark_t *last = &buf->marks[(buf->mark_head + buf->mark_count - 1) % LATENCY_MARKS];
+        if (last->end <= buf->committed) {
+            break;
+        }
+        if (buf->mark_count > 1 &&
+            buf->marks[(buf->mark_head + buf->mark_count - 2) % LATENCY_MARKS].end >= buf->committed) {
+            buf->mark_count--;
+        } else {
+            last->end = buf->committed;
+            break;
+        }
+    }
+    while (buf->mark_count > 0 && buf->marks[buf->mark_head].end <= buf->consumed) {
+        buf->mark_head = (buf->mark_head + 1) % LATENCY_MARKS;
+        buf->mark_count--;
+    }
+    if (buf->paused && buffer_used(buf) <= buf->low_water) {
+        buf->paused = 0;
+    }
+}
+
+// Length of the record starting 'offset' bytes into the held data. Sets
+// *complete when all of it is held; otherwise returns the declared length
+// (length-prefixed modes) or 0 when not yet known.
+static size_t frame_record_len(route_t *route, int dir, size_t offset, int *complete) {
+    dir_buffer_t *buf = route_buffer(route, dir);
+    framer_t *f = &route->framers[dir];
+    size_t used = buffer_used(buf);
+    unsigned char hdr[4];
+    size_t len;
+
+    *complete = 0;
+    switch (route->opts->frame_mode) {
+    case FRAME_LINE: {
+        // The head record is searched incrementally so a long line is not rescanned
+        ssize_t nl = buffer_find_newline(buf, offset == 0 ? f->scanned : offset);
+        if (nl < 0) {
+            if (offset == 0) {
+                f->scanned = used;
+            }
+            return 0;
+        }
+        *complete = 1;
+        return nl + 1 - offset;
+    }
+    case FRAME_U16LEN:
+        if (buffer_peek(buf, offset, hdr, 2) == -1) {
+            return 0;
+        }
+        len = 2 + ((size_t)hdr[0] << 8 | hdr[1]);
+        break;
+    case FRAME_U32LEN:
+        if (buffer_peek(buf, offset, hdr, 4) == -1) {
+            return 0;
+        }
+        len = 4 + ((size_t)hdr[0] << 24 | (size_t)hdr[1] << 16 | (size_t)hdr[2] << 8 | hdr[3]);
+        break;
+    default:
+        *complete = 1;
+        return used - offset;
+    }
+    *complete = offset + len <= used;
+    return len;
+}
+
+// How many held bytes the next write should carry: whole records up to
+// 'limit', or the next piece of a record already being passed through.
+// Returns 0 when no complete record is held.
+static size_t frame_next_write(route_t *route, int dir, size_t limit) {
+    dir_buffer_t *buf = route_buffer(route, dir);
+    framer_t *f = &route->framers[dir];
+    size_t used = buffer_used(buf);
+    size_t batch = 0;
+    int complete;
+
+    if (route->opts->frame_mode == FRAME_NONE) {
+        return used;
+    }
+    if (f->record_left > 0) {
+        return f->record_left < used ? f->record_left : used;
+    }
+    f->batch_records = 0;
+    while (batch < used) {
+        size_t rec = frame_record_len(route, dir, batch, &complete);
+        if (!complete) {
+            // Reading is paused and still no whole record: it can never fit
+            if (batch == 0 && buf->paused) {
+                f->record_left = rec > used ? rec : used;
+                metric_add(&route->metrics[dir].oversized, 1);
+                return used;
+            }
+            break;
+        }
+        if (batch + rec > limit) {
+            if (batch == 0) { // Longer than one write may be; send it on its own
+                f->record_left = rec;
+                if (dir == DIR_NET_TO_APP) { // Cannot be atomic
+                    metric_add(&route->metrics[dir].oversized, 1);
+                }
+                return rec;
+            }
+            break;
+        }
+        batch += rec;
+        f->batch_records++;
+    }
+    return batch;
+}
+
+// Drop 'n' written bytes of a 'batch' from frame_next_write, keeping track
+// of a record the write stopped inside
+static void frame_consume(route_t *route, int dir, size_t batch, size_t n) {
+    dir_buffer_t *buf = route_buffer(route, dir);
+    framer_t *f = &route->framers[dir];
+    int complete;
+
+    if (route->opts->frame_mode == FRAME_NONE) {
+        buffer_consume(buf, n);
+        return;
+    }
+    if (f->record_left > 0) {
+        f->record_left -= n;
+        if (f->record_left == 0) {
+            metric_add(&route->metrics[dir].records, 1);
+        }
+    } else if (n == batch) {
+        metric_add(&route->metrics[dir].records, f->batch_records);
+    } else {
+        // Partial write (sockets only; FIFO batches are atomic): find the record it ended in
+        size_t off = 0;
+        while (off < n) {
+            size_t rec = frame_record_len(route, dir, off, &complete);
+            if (off + rec > n) {
+                f->record_left = off + rec - n;
+                break;
+            }
+            off += rec;
+            metric_add(&route->metrics[dir].records, 1);
+        }
+    }
+    buffer_consume(buf, n);
+    f->scanned = f->scanned > n ? f->scanned - n : 0;
+}
+
+// Drop leading bytes of a record whose start went to a sink that has since closed
+static void frame_committed(route_t *route, int dir) {
+    dir_buffer_t *buf = route_buffer(route, dir);
+    framer_t *f = &route->framers[dir];
+    size_t drop = f->discard_left < buffer_used(buf) ? f->discard_left : buffer_used(buf);
+
+    if (drop > 0) {
+        buffer_consume(buf, drop);
+        f->discard_left -= drop;
+        metric_add(&route->metrics[dir].torn_bytes, drop);
+    }
+}
+
+// The source of 'dir' closed: nothing will complete its last record
+static void frame_source_closed(route_t *route, int dir) {
+    dir_buffer_t *buf = route_buffer(route, dir);
+    framer_t *f = &route->framers[dir];
+    size_t used = buffer_used(buf);
+    size_t off = f->record_left;
+    int complete;
+
+    if (off >= used) {
+        // All held data belongs to a record already partly written: finish
+        // writing what there is and start framing afresh after it
+        if (f->record_left > used) {
+            metric_add(&route->metrics[dir].torn_bytes, f->record_left - used);
+            f->record_left = used;
+        }
+        return;
+    }
+    while (off < used) {
+        size_t rec = frame_record_len(route, dir, off, &complete);
+        if (!complete) {
+            break;
+        }
+        off += rec;
+    }
+    if (off < used) {
+        metric_add(&route->metrics[dir].torn_bytes, used - off);
+        buffer_truncate(buf, off);
+        f->scanned = f->scanned < off ? f->scanned : off;
+    }
+}
+
+// The sink of 'dir' closed: the rest of a record it got the start of is useless
+static void frame_sink_closed(route_t *route, int dir) {
+    framer_t *f = &route->framers[dir];
+
+    if (f->record_left > 0) {
+        size_t have = buffer_used(route_buffer(route, dir));
+        size_t drop = f->record_left < have ? f->record_left : have;
+        buffer_consume(route_buffer(route, dir), drop);
+        metric_add(&route->metrics[dir].torn_bytes, drop);
+        f->discard_left = f->record_left - drop;
+        f->record_left = 0;
+        f->scanned = 0;
+    }
+}
+
+static void demux_socket_lost(route_t *route);
+
+static void frame_fd_closed(route_t *route, int tag) {
+    if (route->opts->frame_mode == FRAME_NONE) {
+        return;
+    }
+    switch (tag) {
+    case TAG_SOCKET:
+        frame_source_closed(route, DIR_NET_TO_APP);
+        frame_sink_closed(route, DIR_APP_TO_NET);
+        if (route->demux) {
+            demux_socket_lost(route);
+        }
+        break;
+    case TAG_PIPE_APP_TO_NET:
+        frame_source_closed(route, DIR_APP_TO_NET);
+        break;
+    case TAG_PIPE_NET_TO_APP:
+        frame_sink_closed(route, DIR_NET_TO_APP);
+        break;
+    }
+}
+
+// Trim iovecs to their first 'limit' bytes. Returns the new count.
+static int iov_trim(struct iovec *iov, int cnt, size_t limit) {
+    for (int i = 0; i < cnt; i++) {
+        if (iov[i].iov_len >= limit) {
+            iov[i].iov_len = limit;
+            return limit > 0 ? i + 1 : i;
+        }
+        limit -= iov[i].iov_len;
+    }
+    return cnt;
+}
+
+static int *shared_slot(route_t *route, int tag) {
+    switch (tag) {
+    case TAG_SOCKET: return &route->socket_fd;
+    case TAG_PIPE_APP_TO_NET: return &route->pipe_app_to_net_fd;
+    case TAG_PIPE_NET_TO_APP: return &route->pipe_net_to_app_fd;
+    }
+    return NULL;
+}
+
+// Register, modify or park an fd so that epoll reports exactly 'mask'.
+// An fd with no interest is removed entirely; otherwise EPOLLHUP would keep
+// firing for a half-closed FIFO we are not ready to drain.
+static void set_interest(route_t *route, int tag, uint32_t mask) {
+    struct epoll_event ev;
+    int fd = route->fds[tag];
+    int op;
+
+    if (fd == -1 || route->masks[tag] == mask) {
+        return;
+    }
+    if (mask == 0) {
+        op = EPOLL_CTL_DEL;
+    } else if (route->masks[tag] == 0) {
+        op = EPOLL_CTL_ADD;
+    } else {
+        op = EPOLL_CTL_MOD;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = mask;
+    ev.data.ptr = &route->handles[tag];
+    if (epoll_ctl(route->worker->epoll_fd, op, fd, &ev) == -1) {
+        perror("[Worker] epoll_ctl");
+        return;
+    }
+    route->masks[tag] = mask;
+}
+
+// --- Self-tuning buffer sizes (--autotune) ---
+// Each direction starts with a TUNE_MIN_CHUNK buffer and a default-sized FIFO.
+// When TUNE_GROW_READS reads in a row fill all the space offered to them, the
+// source has more than one buffer's worth waiting, so the buffer doubles (up
+// to --ring-size) and the direction's FIFO is asked for the same capacity
+// (within pipe-max-size). For a splicing direction the FIFO is the buffer, and
+// a splice that moves the whole pipe counts as a full read. A buffer that
+// stays under a quarter full for TUNE_SHRINK_TICKS is halved again, so idle
+// routes hand their memory back. Buffers come from a small per-worker pool.
+//
+// Socket buffers are left to the kernel's own autotuning unless it falls
+// short: once a tick's traffic shows that two bandwidth-delay products
+// (from TCP_INFO's RTT) exceed what the socket has, SO_RCVBUF or SO_SNDBUF is
+// raised to that, up to rmem_max/wmem_max. Every decision is counted and
+// reported in --stats.
+
+static int tune_pool_class(size_t size) {
+    int c = 0;
+
+    while (c < TUNE_POOL_CLASSES && ((size_t)TUNE_MIN_CHUNK << c) < size) {
+        c++;
+    }
+    return c < TUNE_POOL_CLASSES && ((size_t)TUNE_MIN_CHUNK << c) == size ? c : -1;
+}
+
+static char *tune_pool_get(tune_pool_t *pool, size_t size) {
+    int c = tune_pool_class(size);
+    void *block;
+
+    if (c == -1 || pool->free[c] == NULL) {
+        return malloc(size);
+    }
+    block = pool->free[c];
+    memcpy(&pool->free[c], block, sizeof(void *));
+    pool->bytes -= size;
+    return block;
+}
+
+static void tune_pool_put(tune_pool_t *pool, char *block, size_t size) {
+    int c = tune_pool_class(size);
+
+    if (block == NULL) {
+        return;
+    }
+    if (c == -1 || pool->bytes + size > TUNE_POOL_BYTES) {
+        free(block);
+        return;
+    }
+    memcpy(block, &pool->free[c], sizeof(void *));
+    pool->free[c] = block;
+    pool->bytes += size;
+}
+
+static void tune_pool_drain(tune_pool_t *pool) {
+    for (int c = 0; c < TUNE_POOL_CLASSES; c++) {
+        while (pool->free[c]) {
+            void *block = pool->free[c];
+            memcpy(&pool->free[c], block, sizeof(void *));
+            free(block);
+        }
+    }
+    pool->bytes = 0;
+}
+
+static size_t iov_total(const struct iovec *iov, int cnt) {
+    size_t total = 0;
+
+    for (int i = 0; i < cnt; i++) {
+        total += iov[i].iov_len;
+    }
+    return total;
+}
+
+// Smallest buffer a direction shrinks to. Framed routes keep the default ring
+// so records up to its size are still delivered whole.
+static size_t tune_min_chunk(const options_t *opts) {
+    return opts->frame_mode != FRAME_NONE ? DEFAULT_RING_SIZE : TUNE_MIN_CHUNK;
+}
+
+static void tune_note(route_t *route, int dir, const char *reason) {
+    dir_metrics_t *m = &route->metrics[dir];
+
+    __atomic_store_n(&m->tune_reason, reason, __ATOMIC_RELAXED);
+    metric_set(&m->tune_ns, now_ns());
+}
+
+// Ask for a FIFO capacity matching the direction's buffer, and record what the kernel granted
+static void tune_apply_pipe(route_t *route, int dir) {
+    tune_t *t = &route->tune[dir];
+    int fd = route->fds[dir == DIR_NET_TO_APP ? TAG_PIPE_NET_TO_APP : TAG_PIPE_APP_TO_NET];
+    size_t want = t->chunk < TUNE_MIN_PIPE ? TUNE_MIN_PIPE : t->chunk;
+    int got;
+
+    if (fd == -1) {
+        t->pipe_size = 0;
+        return;
+    }
+    if (want > (size_t)route->opts->pipe_max) {
+        want = route->opts->pipe_max;
+    }
+    got = fcntl(fd, F_GETPIPE_SZ);
+    if (got != -1 && (size_t)got != want) {
+        int set = fcntl(fd, F_SETPIPE_SZ, (int)want); // EBUSY if shrinking below what it holds; retried next time
+        if (set != -1) {
+            got = set;
+        } else if (route->opts->verbose) {
+            printf("[Route %s:%d] %s FIFO stays at %d bytes (F_SETPIPE_SZ %zu: %s).\n", route->address, route->port,
+                   dir_names[dir], got, want, strerror(errno));
+        }
+    }
+    t->pipe_size = got > 0 ? (size_t)got : 0;
+    metric_set(&route->metrics[dir].pipe_bytes, t->pipe_size);
+}
+
+// Resize a direction's buffer (and FIFO). Returns 0 if it was left alone.
+static int tune_set_chunk(route_t *route, int dir, size_t size, const char *reason) {
+    tune_t *t = &route->tune[dir];
+    dir_buffer_t *buf = route_buffer(route, dir);
+    tune_pool_t *pool = &route->worker->pool;
+    size_t old_size = t->chunk;
+
+    if (size == t->chunk || (size < t->chunk && buf->mem.len > size / 2)) {
+        return 0; // Shrinking must leave room to keep reading
+    }
+    if (!route->splicing[dir] || buf->mem.len > 0) {
+        char *block = tune_pool_get(pool, size);
+        if (block == NULL) {
+            return 0;
+        }
+        tune_pool_put(pool, buffer_move_ring(buf, route->opts, block, size), old_size);
+    }
+    t->chunk = size;
+    t->full_reads = 0;
+    t->quiet_ticks = 0;
+    metric_set(&route->metrics[dir].buffer_bytes, size);
+    metric_add(size > old_size ? &route->metrics[dir].tune_grows : &route->metrics[dir].tune_shrinks, 1);
+    tune_note(route, dir, reason);
+    tune_apply_pipe(route, dir);
+    if (route->opts->verbose) {
+        printf("[Route %s:%d] %s buffer %zu -> %zu bytes, FIFO %zu bytes (%s).\n", route->address, route->port,
+               dir_names[dir], old_size, size, t->pipe_size, reason);
+    }
+    return 1;
+}
+
+// Give both directions their smallest buffers. Returns -1 if out of memory.
+static int tune_buffers_init(route_t *route) {
+    size_t size = tune_min_chunk(route->opts);
+
+    for (int dir = 0; dir < NUM_DIRS; dir++) {
+        if (buffer_init_ring(route_buffer(route, dir), route->opts, tune_pool_get(&route->worker->pool, size), size) == -1) {
+            return -1;
+        }
+        memset(&route->tune[dir], 0, sizeof(route->tune[dir]));
+        route->tune[dir].chunk = size;
+        metric_set(&route->metrics[dir].buffer_bytes, size);
+    }
+    return 0;
+}
+
+// Hand the route's buffers back to its worker's pool before the route is freed
+static void tune_buffers_release(route_t *route) {
+    for (int dir = 0; dir < NUM_DIRS; dir++) {
+        dir_buffer_t *buf = route_buffer(route, dir);
+        tune_pool_put(&route->worker->pool, buf->mem.base, buf->mem.cap);
+        buf->mem.base = NULL;
+    }
+}
+
+// A read (or splice) moved 'n' bytes into 'offered' bytes of space
+static void tune_note_read(route_t *route, int dir, ssize_t n, size_t offered) {
+    tune_t *t = &route->tune[dir];
+
+    if (!route->opts->autotune || n <= 0) {
+        return;
+    }
+    if ((size_t)n > t->peak) {
+        t->peak = n;
+    }
+    // Space the sink has not freed yet says nothing about the source
+    if ((size_t)n < offered || offered < t->chunk / 2) {
+        t->full_reads = 0;
+    } else if (++t->full_reads >= TUNE_GROW_READS && t->chunk < route->opts->ring_size) {
+        size_t size = t->chunk * 2 < route->opts->ring_size ? t->chunk * 2 : route->opts->ring_size;
+        tune_set_chunk(route, dir, size, "reads filled the buffer");
+    }
+}
+
+// Raise the socket buffer of a direction whose bandwidth-delay product outgrew it
+static void tune_sockbuf(route_t *route, int dir, uint64_t rate) {
+    tune_t *t = &route->tune[dir];
+    int fd = route->fds[TAG_SOCKET];
+    int opt = dir == DIR_NET_TO_APP ? SO_RCVBUF : SO_SNDBUF;
+    int limit = dir == DIR_NET_TO_APP ? route->opts->rmem_max : route->opts->wmem_max;
+    int cur = 0;
+    socklen_t len = sizeof(cur);
+    struct tcp_info info;
+    socklen_t info_len = sizeof(info);
+    uint64_t want;
+
+    if (fd == -1 || getsockopt(fd, SOL_SOCKET, opt, &cur, &len) == -1) {
+        return;
+    }
+    metric_set(&route->metrics[dir].sockbuf_bytes, cur);
+    if (rate == 0 || getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &info_len) == -1) {
+        return;
+    }
+    want = 2 * rate * info.tcpi_rtt / 1000000;
+    if (want > (uint64_t)limit) {
+        want = limit;
+    }
+    // The kernel doubles what it is given; step in only where that beats what it already has
+    if (want * 2 <= (uint64_t)cur || want <= (uint64_t)t->sockbuf) {
+        return;
+    }
+    if (setsockopt(fd, SOL_SOCKET, opt, &(int){ (int)want }, sizeof(int)) == -1) {
+        return;
+    }
+    t->sockbuf = (int)want;
+    len = sizeof(cur);
+    getsockopt(fd, SOL_SOCKET, opt, &cur, &len);
+    metric_set(&route->metrics[dir].sockbuf_bytes, cur);
+    metric_add(&route->metrics[dir].sockbuf_sets, 1);
+    tune_note(route, dir, "bandwidth-delay product exceeded the socket buffer");
+    if (route->opts->verbose) {
+        printf("[Route %s:%d] %s %s set to %d (%llu B/s, RTT %u us); kernel reports %d.\n", route->address,
+               route->port, dir_names[dir], opt == SO_RCVBUF ? "SO_RCVBUF" : "SO_SNDBUF", t->sockbuf,
+               (unsigned long long)rate, info.tcpi_rtt, cur);
+    }
+}
+
+// A new socket or FIFO was adopted: carry the learned sizes over to it
+static void tune_fd_adopted(route_t *route, int tag) {
+    if (tag == TAG_SOCKET) {
+        for (int dir = 0; dir < NUM_DIRS; dir++) {
+            int opt = dir == DIR_NET_TO_APP ? SO_RCVBUF : SO_SNDBUF;
+            if (route->tune[dir].sockbuf > 0) {
+                setsockopt(route->fds[TAG_SOCKET], SOL_SOCKET, opt, &route->tune[dir].sockbuf, sizeof(int));
+            }
+        }
+    } else {
+        tune_apply_pipe(route, tag == TAG_PIPE_NET_TO_APP ? DIR_NET_TO_APP : DIR_APP_TO_NET);
+    }
+}
+
+// Periodic review of one route: shrink what has gone quiet, size socket buffers
+static void tune_route_tick(route_t *route) {
+    for (int dir = 0; dir < NUM_DIRS; dir++) {
+        tune_t *t = &route->tune[dir];
+        dir_buffer_t *buf = route_buffer(route, dir);
+        uint64_t bytes = metric_read(&route->metrics[dir].bytes_in);
+        size_t floor = tune_min_chunk(route->opts);
+
+        if (buffer_used(buf) > t->peak) {
+            t->peak = buffer_used(buf);
+        }
+        if (t->chunk > floor && t->peak < t->chunk / 4) {
+            if (++t->quiet_ticks >= TUNE_SHRINK_TICKS) {
+                tune_set_chunk(route, dir, t->chunk / 2 > floor ? t->chunk / 2 : floor, "under a quarter used");
+            }
+        } else {
+            t->quiet_ticks = 0;
+        }
+        tune_sockbuf(route, dir, (bytes - t->last_bytes) * 1000 / TUNE_TICK_MS);
+        t->last_bytes = bytes;
+        t->peak = 0;
+    }
+}
+
+// --- Replay across reconnects (--replay) ---
+// App->net data already accepted by a socket dies with it if the peer never
+// acknowledged it. With --replay N the worker keeps a copy of the last N bytes
+// sent. When the socket fails it asks the kernel how much of what that socket
+// carried was never acknowledged (TCP_INFO bytes_acked), and sends that much
+// of the copy again on the next connection, ahead of anything still queued.
+// The peer may see those bytes twice but, while fewer than N were in flight,
+// never loses them.
+
+// Bytes [offset, offset + len) of a ring, counted from its oldest byte, as up to two iovecs
+static int ring_range_iov(const ring_t *ring, size_t offset, size_t len, struct iovec *iov) {
+    size_t start = (ring->head + offset) % ring->cap;
+    size_t first = ring->cap - start < len ? ring->cap - start : len;
+    int cnt = 0;
+
+    if (len == 0) {
+        return 0;
+    }
+    iov[cnt].iov_base = ring->base + start;
+    iov[cnt++].iov_len = first;
+    if (len > first) {
+        iov[cnt].iov_base = ring->base;
+        iov[cnt++].iov_len = len - first;
+    }
+    return cnt;
+}
+
+// Append the first 'n' bytes of 'iov' to the history, dropping the oldest
+static void replay_record(route_t *route, const struct iovec *iov, int cnt, size_t n) {
+    ring_t *hist = &route->replay_hist;
+
+    for (int i = 0; i < cnt && n > 0; i++) {
+        const char *p = iov[i].iov_base;
+        size_t len = iov[i].iov_len < n ? iov[i].iov_len : n;
+        struct iovec room[2];
+
+        n -= len;
+        if (len >= hist->cap) {
+            p += len - hist->cap;
+            len = hist->cap;
+            hist->head = hist->len = 0;
+        } else if (hist->len + len > hist->cap) {
+            ring_consume(hist, hist->len + len - hist->cap);
+        }
+        int rc = ring_free_iov(hist, room, len);
+        for (int k = 0; k < rc; k++) {
+            memcpy(room[k].iov_base, p, room[k].iov_len);
+            p += room[k].iov_len;
+        }
+        hist->len += len;
+    }
+}
+
+// Called with the failed socket still open: work out what must be resent
+static void replay_socket_lost(route_t *route, int fd) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    uint64_t unacked = route->socket_sent; // Without TCP_INFO, assume none of it arrived
+    uint64_t want;
+
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 &&
+        len >= offsetof(struct tcp_info, tcpi_bytes_acked) + sizeof(info.tcpi_bytes_acked) && info.tcpi_bytes_acked > 0) {
+        uint64_t acked = info.tcpi_bytes_acked - 1; // The SYN counts as one
+        unacked = acked < route->socket_sent ? route->socket_sent - acked : 0;
+    }
+    // Unacknowledged bytes and any replay not yet resent form the newest part of the history
+    want = unacked + route->replay_left;
+    if (want > route->replay_hist.len) {
+        metric_add(&route->metrics[DIR_APP_TO_NET].replay_lost, want - route->replay_hist.len);
+        want = route->replay_hist.len;
+    }
+    route->replay_left = want;
+    route->socket_sent = 0;
+    if (route->opts->verbose && want > 0) {
+        printf("[Route %s:%d] %llu bytes sent on the lost socket were not acknowledged; replaying %llu.\n",
+               route->address, route->port, (unsigned long long)unacked, (unsigned long long)want);
+    }
+}
+
+static void invalidate_fd(route_t *route, int tag);
+
+// Resend the replay backlog. Returns 0 once it is all sent, -1 to stop for now.
+static int replay_flush(route_t *route) {
+    struct iovec iov[2];
+    struct msghdr msg;
+
+    while (route->replay_left > 0) {
+        if (route->fds[TAG_SOCKET] == -1) {
+            return -1;
+        }
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = ring_range_iov(&route->replay_hist, route->replay_hist.len - route->replay_left,
+                                        route->replay_left, iov);
+        ssize_t n = sendmsg(route->fds[TAG_SOCKET], &msg, MSG_NOSIGNAL);
+        metric_add(&route->metrics[DIR_APP_TO_NET].syscalls, 1);
+        if (n > 0) {
+            route->replay_left -= n;
+            route->socket_sent += n;
+            metric_add(&route->metrics[DIR_APP_TO_NET].replayed, n);
+        } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            metric_add(&route->metrics[DIR_APP_TO_NET].eagain, 1);
+            route->write_blocked[DIR_APP_TO_NET] = 1;
+            return -1;
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else {
+            perror("[Worker] Error replaying to socket");
+            invalidate_fd(route, TAG_SOCKET);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Replace a lost active socket with a standby the scheduler parked (--standby). Returns its fd or -1.
+static int standby_take(route_t *route) {
+    for (int i = 0; i < route->opts->standby_count; i++) {
+        int fd = __atomic_exchange_n(&route->standby_fds[i], -1, __ATOMIC_ACQ_REL);
+        if (fd != -1) {
+            __atomic_store_n(&route->active_upstream, route->standby_upstream[i], __ATOMIC_RELAXED);
+            return fd;
+        }
+    }
+    return -1;
+}
+
+// Close a failed fd and hand the slot back to the scheduler for reopening
+static void invalidate_fd(route_t *route, int tag) {
+    int fd = route->fds[tag];
+
+    if (fd == -1 || tag >= NUM_SHARED_TAGS) {
+        return;
+    }
+    set_interest(route, tag, 0);
+    if (tag == TAG_SOCKET && route->replay_hist.cap > 0) {
+        replay_socket_lost(route, fd);
+    }
+    close(fd);
+    route->fds[tag] = -1;
+    frame_fd_closed(route, tag);
+    if (tag == TAG_SOCKET && (fd = standby_take(route)) != -1) {
+        // Fail over without a scheduler round trip; it only has to replenish
+        route->failover_started_ns = now_ns();
+        metric_add(&route->failovers, 1);
+        if (route->opts->verbose) {
+            printf("[Route %s:%d] Socket lost. Failing over to standby FD %d.\n", route->address, route->port, fd);
+        }
+        __atomic_store_n(shared_slot(route, tag), fd, __ATOMIC_RELEASE);
+        __atomic_store_n(&route->dirty, 1, __ATOMIC_RELEASE);
+        wake_fd(route->worker->wake_fd);
+        wake_fd(main_wake_fd);
+        return;
+    }
+    metric_set(&route->down_since_ns[tag], now_ns());
+    __atomic_store_n(shared_slot(route, tag), -1, __ATOMIC_RELEASE);
+    wake_fd(main_wake_fd);
+}
+
+// Pick up any fds the scheduler has opened since the last pass
+static void adopt_new_fds(route_t *route) {
+    for (int tag = 0; tag < NUM_SHARED_TAGS; tag++) {
+        int fd = __atomic_load_n(shared_slot(route, tag), __ATOMIC_ACQUIRE);
+        if (fd == -1 || fd == route->fds[tag]) {
+            continue;
+        }
+        // Switch to non-blocking once here rather than around every read
+        int flags = fcntl(fd, F_GETFL, 0);
+        if (flags != -1) {
+            fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        }
+        if (route->opts->use_splice && route->opts->pipe_size > 0 && !route->opts->autotune && tag != TAG_SOCKET) {
+            if (fcntl(fd, F_SETPIPE_SZ, route->opts->pipe_size) == -1) {
+                perror("[Worker] F_SETPIPE_SZ");
+            } else if (route->opts->verbose) {
+                printf("[Route %s:%d] FIFO FD %d capacity now %d bytes.\n", route->address, route->port, fd, fcntl(fd, F_GETPIPE_SZ));
+            }
+        }
+        if (tag == TAG_SOCKET && wakeup_measured(route->opts)) {
+            int one = 1; // Kernel receive timestamps for socket_readv()
+            setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+        }
+        if (tag == TAG_SOCKET && route->opts->low_latency) {
+            tune_socket_latency(fd, route->opts);
+        } else if (tag == TAG_SOCKET && route->opts->coalesce_mode != COALESCE_DEFAULT) {
+            int one = 1; // We decide when to send; Nagle would only add delay
+            if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1) {
+                perror("[Worker] TCP_NODELAY");
+            }
+        }
+        route->fds[tag] = fd;
+        route->masks[tag] = 0;
+        if (route->opts->autotune) {
+            tune_fd_adopted(route, tag);
+        }
+        if (tag == TAG_SOCKET && route->failover_started_ns != 0) {
+            metrics_hist_record(&route->failover_ns, now_ns() - route->failover_started_ns);
+            route->failover_started_ns = 0;
+        }
+        if (tag == TAG_SOCKET) {
+            route->splice_blocked[DIR_APP_TO_NET] = 0;
+            route->write_blocked[DIR_APP_TO_NET] = 1; // Flush anything held once it is writable
+        } else {
+            route->splice_blocked[tag == TAG_PIPE_NET_TO_APP ? DIR_NET_TO_APP : DIR_APP_TO_NET] = 0;
+            if (tag == TAG_PIPE_NET_TO_APP) {
+                route->write_blocked[DIR_NET_TO_APP] = 1;
+            }
+        }
+        if (route->opts->verbose) {
+            printf("[Route %s:%d] Worker %d adopted FD %d (tag %d).\n", route->address, route->port, route->worker->id, fd, tag);
+        }
+    }
+}
+
+static void metrics_note_chunk(dir_metrics_t *m, size_t n) {
+    metric_add(&m->bytes_in, n);
+    metric_add(&m->chunks, 1);
+    metrics_hist_record(&m->chunk_size, n);
+}
+
+// Account for one source read that returned 'n' (errno intact on failure)
+static void metrics_note_read(route_t *route, int dir, ssize_t n) {
+    dir_metrics_t *m = &route->metrics[dir];
+
+    metric_add(&m->syscalls, 1);
+    if (n > 0) {
+        metrics_note_chunk(m, n);
+    } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        metric_add(&m->eagain, 1);
+    }
+}
+
+// Account for one sink write that returned 'n'. 'since_ns' is when the
+// oldest byte written was read from the source (0 if unknown).
+static void metrics_note_write(route_t *route, int dir, ssize_t n, long long since_ns) {
+    dir_metrics_t *m = &route->metrics[dir];
+
+    metric_add(&m->syscalls, 1);
+    if (n > 0) {
+        metric_add(&m->bytes_out, n);
+        if (since_ns > 0) {
+            metrics_hist_record(&m->latency_ns, now_ns() - since_ns);
+        }
+    } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        metric_add(&m->eagain, 1);
+    } else if (n == -1 && errno == EPIPE) {
+        metric_add(&m->epipe, 1);
+    }
+}
+
+// --- Send coalescing (--latency / --throughput / --adaptive) ---
+// Decides, each time app->net data could be sent, whether to send it now or
+// hold it briefly so that many small FIFO writes leave as one sendmsg().
+// Held data goes out once coalesce_bytes are buffered or the oldest byte is
+// coalesce_us old; a per-route timerfd covers the second case. Adaptive mode
+// holds only while FIFO reads arrive faster than one per coalesce_us.
+
+#define SEND_NOW 0   // Not coalescing
+#define SEND_SIZE 1  // Held data reached coalesce_bytes
+#define SEND_TIMER 2 // Held data reached coalesce_us
+#define SEND_HOLD 3  // Keep gathering
+
+static int coalesce_timer_open(route_t *route) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (fd == -1) {
+        perror("[Worker] timerfd_create");
+        return -1;
+    }
+    route->fds[TAG_COALESCE_TIMER] = fd;
+    set_interest(route, TAG_COALESCE_TIMER, EPOLLIN);
+    return 0;
+}
+
+static void coalesce_timer_close(route_t *route) {
+    if (route->fds[TAG_COALESCE_TIMER] != -1) {
+        set_interest(route, TAG_COALESCE_TIMER, 0);
+        close(route->fds[TAG_COALESCE_TIMER]);
+        route->fds[TAG_COALESCE_TIMER] = -1;
+    }
+}
+
+// Track how closely FIFO reads follow each other (adaptive mode)
+static void coalesce_note_arrival(route_t *route) {
+    long long now = now_ns();
+    long long gap = now - route->last_arrival_ns;
+    long long limit = route->opts->coalesce_us * 1000;
+    int busy;
+
+    if (route->opts->coalesce_mode != COALESCE_ADAPTIVE) {
+        return;
+    }
+    route->last_arrival_ns = now;
+    if (gap > 8 * limit) {
+        gap = 8 * limit; // One long pause should not take many reads to forget
+    }
+    // EWMA over the last ~8 reads
+    route->arrival_gap_ns = route->arrival_gap_ns - route->arrival_gap_ns / 8 + gap / 8;
+    busy = route->arrival_gap_ns < limit;
+    if (busy != route->coalescing) {
+        route->coalescing = busy;
+        metric_add(&route->metrics[DIR_APP_TO_NET].coalesce_switches, 1);
+        if (route->opts->verbose) {
+            printf("[Route %s:%d] Coalescing %s (mean gap between FIFO reads %lld us).\n", route->address, route->port,
+                   busy ? "on" : "off", route->arrival_gap_ns / 1000);
+        }
+    }
+}
+
+// Whether the held app->net data should be sent now, and why
+static int coalesce_decide(route_t *route) {
+    const options_t *opts = route->opts;
+    dir_buffer_t *buf = &route->app_to_net;
+    long long oldest, due;
+
+    if (!route->coalescing || buffer_used(buf) == 0) {
+        return SEND_NOW;
+    }
+    if (buffer_used(buf) >= opts->coalesce_bytes || buf->paused) {
+        return SEND_SIZE; // Paused: an --autotune buffer can be smaller than coalesce_bytes
+    }
+    oldest = buffer_oldest_ns(buf);
+    due = oldest + opts->coalesce_us * 1000;
+    if (oldest == 0 || now_ns() >= due) {
+        return SEND_TIMER;
+    }
+    if (route->coalesce_due_ns != due) {
+        struct itimerspec its;
+        memset(&its, 0, sizeof(its));
+        its.it_value.tv_sec = due / 1000000000LL;
+        its.it_value.tv_nsec = due % 1000000000LL;
+        if (timerfd_settime(route->fds[TAG_COALESCE_TIMER], TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+            perror("[Worker] timerfd_settime");
+            return SEND_TIMER;
+        }
+        route->coalesce_due_ns = due;
+    }
+    return SEND_HOLD;
+}
+
+static void coalesce_note_send(route_t *route, int reason, int more) {
+    dir_metrics_t *m = &route->metrics[DIR_APP_TO_NET];
+
+    metric_add(reason == SEND_SIZE ? &m->sends_size : reason == SEND_TIMER ? &m->sends_timer : &m->sends_now, 1);
+    if (more) {
+        metric_add(&m->msg_more, 1);
+    }
+}
+
+// Work out what each fd should be watched for given the staged data
+static void shm_update_interest(route_t *route);
+static void fanout_update_interest(route_t *route);
+static void listen_update_interest(route_t *route);
+static void listen_flush_app_to_net(route_t *route);
+static void demux_update_interest(route_t *route);
+
+static void update_interest(route_t *route) {
+    if (route->opts->use_shm) {
+        shm_update_interest(route);
+        return;
+    }
+    int have_socket = route->fds[TAG_SOCKET] != -1;
+    int have_pipe_out = route->fds[TAG_PIPE_NET_TO_APP] != -1;
+    uint32_t socket_mask = 0;
+    int net_to_app_held = buffer_used(&route->net_to_app) > 0;
+    int app_to_net_held = buffer_used(&route->app_to_net) > 0 || route->replay_left > 0;
+    int net_to_app_readable, app_to_net_readable;
+
+    // Splicing needs both ends and an empty buffer; the copy path only needs
+    // buffer space, so socket data keeps arriving while the FIFO is reopened,
+    // and FIFO data keeps being queued while the socket reconnects.
+    if (route->splicing[DIR_NET_TO_APP] && !net_to_app_held) {
+        net_to_app_readable = have_pipe_out && !route->splice_blocked[DIR_NET_TO_APP];
+    } else {
+        net_to_app_readable = !route->net_to_app.paused;
+    }
+    if (route->fanout && route->fanout->pending > 0) {
+        net_to_app_readable = 0; // Staged data goes out first
+    }
+    if (route->demux) {
+        net_to_app_readable = route->demux->stage_len < DEMUX_STAGE_SIZE; // Records wait there for a full output
+    }
+    if (route->splicing[DIR_APP_TO_NET] && !app_to_net_held) {
+        app_to_net_readable = have_socket && !route->splice_blocked[DIR_APP_TO_NET];
+    } else {
+        app_to_net_readable = !route->app_to_net.paused;
+    }
+
+    if (net_to_app_readable) {
+        socket_mask |= EPOLLIN;
+    }
+    // Only wait for writability once a write has been refused; held data that
+    // cannot go yet (a partial record, or coalescing) must not poll a writable sink
+    if ((app_to_net_held && route->write_blocked[DIR_APP_TO_NET]) || route->splice_blocked[DIR_APP_TO_NET]) {
+        socket_mask |= EPOLLOUT;
+    }
+    set_interest(route, TAG_SOCKET, socket_mask);
+    set_interest(route, TAG_PIPE_APP_TO_NET, app_to_net_readable ? EPOLLIN : 0);
+    set_interest(route, TAG_PIPE_NET_TO_APP,
+                 ((net_to_app_held && route->write_blocked[DIR_NET_TO_APP]) || route->splice_blocked[DIR_NET_TO_APP]) ? EPOLLOUT : 0);
+    if (route->fanout) {
+        fanout_update_interest(route);
+    }
+    if (route->listen) {
+        listen_update_interest(route);
+    }
+    if (route->demux) {
+        demux_update_interest(route);
+    }
+}
+
+// Move up to SPLICE_CHUNK_SIZE bytes from 'in_tag' to 'out_tag' inside the kernel.
+// Returns the splice() result; on EINVAL the direction drops to the copy path
+// for good and -1 is returned with errno left as EINVAL.
+static ssize_t splice_direction(route_t *route, int dir, int in_tag, int out_tag) {
+    long long start_ns = now_ns();
+    ssize_t n = splice(route->fds[in_tag], NULL, route->fds[out_tag], NULL,
+                       SPLICE_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+    // One call is both the read and the write, so its duration is the latency
+    if (n > 0) {
+        metrics_note_chunk(&route->metrics[dir], n);
+    }
+    metrics_note_write(route, dir, n, start_ns);
+    if (n > 0) {
+        route->paths[dir].splice_calls++;
+        route->paths[dir].splice_bytes += n;
+        tune_note_read(route, dir, n, route->tune[dir].pipe_size); // The pipe is the buffer
+    } else if (n == -1 && errno == EAGAIN) {
+        // Either the source is empty or the destination is full. Wait for the
+        // destination; if it was the source, EPOLLOUT fires at once and we retry.
+        route->splice_blocked[dir] = 1;
+    } else if (n == -1 && errno == EINVAL) {
+        fprintf(stderr, "[Route %s:%d] splice() unsupported for %s (EINVAL). Falling back to copying.\n", route->address, route->port, dir_names[dir]);
+        route->splicing[dir] = 0;
+    }
+    return n;
+}
+
+// --- Shared-memory transport (--shm) ---
+// The rings in the segment stand in for both the FIFOs and the per-direction
+// buffers: socket data is read straight into the net->app ring and app->net
+// data is sent straight out of the other ring.
+
+// Create the route's segment and start the doorbell bridge. Returns 0 on success.
+static int shm_route_open(route_t *route) {
+    const char *base = strrchr(route->pipe_net_to_app_name, '/');
+    int bell_fd;
+
+    snprintf(route->shm_name, sizeof(route->shm_name), "/netpipe_%s",
+             base ? base + 1 : route->pipe_net_to_app_name);
+    route->shm = shm_segment_create(route->shm_name, route->opts->ring_size);
+    if (route->shm == NULL) {
+        return -1;
+    }
+    bell_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (bell_fd == -1 || shm_bridge_start(&route->shm_bridge, &route->shm->forwarder_bell, bell_fd) == -1) {
+        perror("[Worker] Error starting shared-memory bridge");
+        if (bell_fd != -1) {
+            close(bell_fd);
+        }
+        shm_segment_detach(route->shm);
+        shm_unlink(route->shm_name);
+        route->shm = NULL;
+        return -1;
+    }
+    route->fds[TAG_SHM_BELL] = bell_fd;
+    set_interest(route, TAG_SHM_BELL, EPOLLIN);
+    if (route->opts->verbose) {
+        printf("[Route %s:%d] Shared-memory segment '%s' ready (%llu bytes per ring).\n", route->address, route->port,
+               route->shm_name, (unsigned long long)route->shm->net_to_app.cap);
+    }
+    return 0;
+}
+
+// Tell the connector we are gone, then release the segment
+static void shm_route_close(route_t *route) {
+    __atomic_store_n(&route->shm->forwarder_closed, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&route->shm->connector_bell.sleeping, 1, __ATOMIC_RELAXED); // Force the ring below
+    shm_bell_ring(&route->shm->connector_bell);
+    shm_bridge_stop(&route->shm_bridge);
+    set_interest(route, TAG_SHM_BELL, 0);
+    close(route->fds[TAG_SHM_BELL]);
+    route->fds[TAG_SHM_BELL] = -1;
+    shm_segment_detach(route->shm);
+    shm_unlink(route->shm_name);
+    route->shm = NULL;
+}
+
+static void shm_update_interest(route_t *route) {
+    shm_header_t *shm = route->shm;
+    uint32_t socket_mask = 0;
+    int ring_full, ring_empty;
+
+    if (shm == NULL) {
+        return;
+    }
+    ring_full = shm_ring_used(&shm->net_to_app) == shm->net_to_app.cap;
+    ring_empty = shm_ring_used(&shm->app_to_net) == 0;
+    if (!ring_full) {
+        socket_mask |= EPOLLIN;
+    }
+    if (!ring_empty) {
+        socket_mask |= EPOLLOUT;
+    }
+    set_interest(route, TAG_SOCKET, socket_mask);
+
+    // Waiting on the connector for space or data: arm our bell, then look
+    // again in case it made progress before it could see the bell armed.
+    if (ring_full || (ring_empty && route->fds[TAG_SOCKET] != -1)) {
+        shm_bell_arm(&shm->forwarder_bell);
+        if (shm_ring_used(&shm->net_to_app) != shm->net_to_app.cap ||
+            (route->fds[TAG_SOCKET] != -1 && shm_ring_used(&shm->app_to_net) != 0)) {
+            wake_fd(route->fds[TAG_SHM_BELL]);
+        }
+    }
+}
+
+// readv() from the socket. When wake-up latency is measured the kernel's
+// receive timestamp comes along, and its age is how long the data waited for us.
+static ssize_t socket_readv(route_t *route, struct iovec *iov, int cnt) {
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t n;
+
+    if (!wakeup_measured(route->opts)) {
+        return readv(route->fds[TAG_SOCKET], iov, cnt);
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = cnt;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    n = recvmsg(route->fds[TAG_SOCKET], &msg, 0);
+    for (cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL; cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec stamp, now;
+            long long waited;
+
+            memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+            clock_gettime(CLOCK_REALTIME, &now);
+            waited = (now.tv_sec - stamp.tv_sec) * 1000000000LL + (now.tv_nsec - stamp.tv_nsec);
+            if (waited >= 0) {
+                metrics_hist_record(&route->wakeup_ns, waited);
+            }
+        }
+    }
+    return n;
+}
+
+static void shm_read_socket(route_t *route) {
+    shm_header_t *shm = route->shm;
+    struct iovec iov[2];
+    int cnt = shm_ring_free_iov(shm, &shm->net_to_app, iov, UINT64_MAX);
+    ssize_t n;
+
+    if (cnt == 0) {
+        return; // Ring full; the connector's bell will wake us
+    }
+    n = socket_readv(route, iov, cnt);
+    metrics_note_read(route, DIR_NET_TO_APP, n);
+    if (n > 0) {
+        if (route->opts->verbose) {
+            printf("[Route %s:%d] Received %zd bytes from socket into ring '%s'.\n", route->address, route->port, n, route->shm_name);
+        }
+        metrics_note_write(route, DIR_NET_TO_APP, n, 0); // Delivered once in the ring
+        shm_ring_produce(&shm->net_to_app, n);
+        shm_bell_ring(&shm->connector_bell);
+        route->paths[DIR_NET_TO_APP].copy_calls++;
+        route->paths[DIR_NET_TO_APP].copy_bytes += n;
+    } else if (n == 0) {
+        if (route->opts->verbose) {
+            printf("[Route %s:%d] Socket closed by peer. Signalling scheduler for reconnection.\n", route->address, route->port);
+        }
+        invalidate_fd(route, TAG_SOCKET);
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("[Worker] Error receiving from socket");
+        invalidate_fd(route, TAG_SOCKET);
+    }
+}
+
+static void shm_flush_app_to_net(route_t *route) {
+    shm_header_t *shm = route->shm;
+    struct iovec iov[2];
+    struct msghdr msg;
+
+    while (route->fds[TAG_SOCKET] != -1) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = shm_ring_used_iov(shm, &shm->app_to_net, iov);
+        if (msg.msg_iovlen == 0) {
+            return;
+        }
+        ssize_t n = sendmsg(route->fds[TAG_SOCKET], &msg, MSG_NOSIGNAL);
+        metrics_note_write(route, DIR_APP_TO_NET, n, 0);
+        if (n > 0) {
+            metrics_note_chunk(&route->metrics[DIR_APP_TO_NET], n); // The connector's writes are not visible to us
+            shm_ring_consume(&shm->app_to_net, n);
+            shm_bell_ring(&shm->connector_bell);
+            route->paths[DIR_APP_TO_NET].copy_calls++;
+            route->paths[DIR_APP_TO_NET].copy_bytes += n;
+        } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return; // Socket send buffer full; wait for EPOLLOUT
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else {
+            perror("[Worker] Error sending to socket");
+            invalidate_fd(route, TAG_SOCKET);
+            return;
+        }
+    }
+}
+
+// Write buffered net->app data to the FIFO. Whatever the FIFO does not take
+// stays buffered, including across a reopen when the reader goes away.
+static void flush_net_to_app(route_t *route) {
+    dir_buffer_t *buf = &route->net_to_app;
+    struct iovec iov[4];
+
+    while (buffer_used(buf) > 0 && route->fds[TAG_PIPE_NET_TO_APP] != -1) {
+        size_t batch = frame_next_write(route, DIR_NET_TO_APP, PIPE_BUF);
+        route->write_blocked[DIR_NET_TO_APP] = 0;
+        if (batch == 0) {
+            return; // Only part of a record so far
+        }
+        int cnt = iov_trim(iov, buffer_drain_iov(buf, iov), batch);
+        ssize_t n = writev(route->fds[TAG_PIPE_NET_TO_APP], iov, cnt);
+        metrics_note_write(route, DIR_NET_TO_APP, n, buffer_oldest_ns(buf));
+        if (n > 0) {
+            frame_consume(route, DIR_NET_TO_APP, batch, n);
+            route->paths[DIR_NET_TO_APP].copy_calls++;
+            route->paths[DIR_NET_TO_APP].copy_bytes += n;
+        } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            route->write_blocked[DIR_NET_TO_APP] = 1;
+            return; // FIFO full; wait for EPOLLOUT
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else {
+            if (errno == EPIPE) { // No process has the pipe open for reading
+                if (route->opts->verbose) printf("[Route %s:%d] Named pipe '%s' has no reader (EPIPE). Keeping %zu bytes until it is reopened.\n", route->address, route->port, route->pipe_net_to_app_name, buffer_used(buf));
+            } else {
+                perror("[Worker] Error writing to named pipe");
+            }
+            invalidate_fd(route, TAG_PIPE_NET_TO_APP);
+            return;
+        }
+    }
+}
+
+// Send buffered app->net data. Unsent bytes are kept for the next connection.
+static void flush_app_to_net(route_t *route) {
+    dir_buffer_t *buf = &route->app_to_net;
+    struct iovec iov[4];
+    struct msghdr msg;
+
+    if (route->shm) {
+        shm_flush_app_to_net(route);
+        return;
+    }
+    if (route->listen) {
+        listen_flush_app_to_net(route);
+        return;
+    }
+
+    if (route->replay_left > 0 && replay_flush(route) == -1) {
+        return; // Replayed bytes go first
+    }
+    int reason = coalesce_decide(route);
+    if (reason == SEND_HOLD) {
+        return; // The coalescing timer or more data will bring us back
+    }
+    while (buffer_used(buf) > 0 && route->fds[TAG_SOCKET] != -1) {
+        size_t batch = frame_next_write(route, DIR_APP_TO_NET, FRAME_SOCKET_BATCH);
+        route->write_blocked[DIR_APP_TO_NET] = 0;
+        if (batch == 0) {
+            return; // Only part of a record so far
+        }
+        // More of what we hold follows straight away: let the kernel fill segments
+        int more = route->coalescing && batch < buffer_used(buf);
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iov_trim(iov, buffer_drain_iov(buf, iov), batch);
+        ssize_t n = sendmsg(route->fds[TAG_SOCKET], &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        metrics_note_write(route, DIR_APP_TO_NET, n, buffer_oldest_ns(buf));
+        if (n > 0) {
+            coalesce_note_send(route, reason, more);
+            if (route->replay_hist.cap > 0) {
+                replay_record(route, iov, msg.msg_iovlen, n);
+                route->socket_sent += n;
+            }
+            frame_consume(route, DIR_APP_TO_NET, batch, n);
+            route->paths[DIR_APP_TO_NET].copy_calls++;
+            route->paths[DIR_APP_TO_NET].copy_bytes += n;
+        } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            route->write_blocked[DIR_APP_TO_NET] = 1;
+            return; // Socket send buffer full; wait for EPOLLOUT
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else {
+            perror("[Worker] Error sending to socket");
+            invalidate_fd(route, TAG_SOCKET);
+            return;
+        }
+    }
+}
+
+// --- Fan-out to subscribers (--fanout) ---
+// With --fanout, socket data is spliced into a staging pipe rather than read
+// into the route's buffer. Each pass tees the staged bytes, without copying
+// them, into every subscriber's own pipe: its FIFO, or for a Unix socket client
+// a private pipe that is then spliced to the socket. Then the same bytes are
+// read into the buffer for the main FIFO, which stays as lossless as before.
+// A subscriber's lag is what sits unread in its pipe, so it is bounded by the
+// pipe size (--fanout-lag). When a tee does not fit:
+//  - drop: the subscriber misses the rest of this pass (counted);
+//  - disconnect: the subscriber is closed;
+//  - block: passes shrink to what the slowest subscriber can take and the
+//    socket waits for it. A pipe's free space is counted in pages, so a tee
+//    can still come up short; the rest is then copied to a backlog that goes
+//    out ahead of anything newer for that subscriber.
+
+static int open_fifo_nonblocking(const char *fifo_name, int flags, int verbose);
+
+static int fanout_spec_is_unix(const char *spec) {
+    return strncmp(spec, "unix:", 5) == 0;
+}
+
+// Where tee() delivers for subscriber 'i'
+static int fanout_target(route_t *route, int i) {
+    subscriber_t *sub = &route->fanout->subs[i];
+    return sub->pipe[1] != -1 ? sub->pipe[1] : route->fds[TAG_SUBSCRIBER + i];
+}
+
+static void fanout_free(fanout_t *fo) {
+    if (fo) {
+        for (int s = 0; s < fo->spec_count; s++) {
+            free(fo->specs[s]);
+        }
+        free(fo);
+    }
+}
+
+// Parse a --fanout list. Returns NULL (after an error message) if it is invalid.
+static fanout_t *fanout_new(const char *list) {
+    fanout_t *fo = calloc(1, sizeof(*fo));
+    char *copy = strdup(list), *save = NULL, *tok;
+    int fifos = 0, listeners = 0;
+
+    if (fo == NULL || copy == NULL) {
+        error_exit("calloc fanout");
+    }
+    for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        int is_unix = fanout_spec_is_unix(tok);
+        if (tok[is_unix ? 5 : 0] == '\0' || (is_unix ? ++listeners > MAX_FANOUT_LISTENERS : ++fifos > MAX_SUBSCRIBERS)) {
+            fprintf(stderr, "Error: --fanout takes up to %d FIFO paths and %d unix:<path> entries.\n", MAX_SUBSCRIBERS,
+                    MAX_FANOUT_LISTENERS);
+            free(copy);
+            fanout_free(fo);
+            return NULL;
+        }
+        fo->specs[fo->spec_count++] = strdup(tok);
+    }
+    free(copy);
+    if (fo->spec_count == 0) {
+        fprintf(stderr, "Error: --fanout needs at least one FIFO path or unix:<path>.\n");
+        fanout_free(fo);
+        return NULL;
+    }
+    fo->pipe[0] = fo->pipe[1] = -1;
+    for (int i = 0; i < MAX_SUBSCRIBERS; i++) {
+        fo->subs[i].pipe[0] = fo->subs[i].pipe[1] = -1;
+    }
+    return fo;
+}
+
+// Size a subscriber's pipe to the lag limit and remember what the kernel granted
+static void fanout_size_pipe(route_t *route, subscriber_t *sub, int fd) {
+    int size;
+
+    if (fcntl(fd, F_SETPIPE_SZ, (int)route->opts->fanout_lag) == -1 && route->opts->verbose) {
+        perror("[Worker] F_SETPIPE_SZ subscriber");
+    }
+    size = fcntl(fd, F_GETPIPE_SZ);
+    sub->capacity = size > 0 ? (size_t)size : 0;
+}
+
+// Worker: create the staging pipe, the subscriber FIFOs and the Unix listeners.
+// A FIFO is opened by fanout_pump once it has a reader.
+static void fanout_open(route_t *route) {
+    fanout_t *fo = route->fanout;
+    int listener = 0, slot = 0;
+
+    if (pipe2(fo->pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+        error_exit("Error creating fan-out pipe");
+    }
+    fcntl(fo->pipe[1], F_SETPIPE_SZ, (int)route->opts->fanout_lag);
+    for (int s = 0; s < fo->spec_count; s++) {
+        if (!fanout_spec_is_unix(fo->specs[s])) {
+            if (mkfifo(fo->specs[s], 0666) == -1 && errno != EEXIST) {
+                perror("[Worker] mkfifo subscriber");
+            }
+            fo->subs[slot].kind = SUB_FIFO; // FIFOs keep the low slots for good
+            fo->subs[slot++].spec = s;
+            continue;
+        }
+        struct sockaddr_un addr;
+        const char *path = fo->specs[s] + 5;
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+        unlink(path);
+        if (fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 16) == -1) {
+            fprintf(stderr, "[Route %s:%d] Cannot listen for subscribers on '%s': %s\n", route->address, route->port,
+                    path, strerror(errno));
+            if (fd != -1) {
+                close(fd);
+            }
+            continue;
+        }
+        fo->listen_spec[listener] = s;
+        route->fds[TAG_FANOUT_LISTEN + listener] = fd;
+        set_interest(route, TAG_FANOUT_LISTEN + listener++, EPOLLIN);
+    }
+}
+
+// Close subscriber 'i'. A FIFO is retried later; a Unix client's slot is freed.
+static void fanout_close_sub(route_t *route, int i, int disconnected) {
+    fanout_t *fo = route->fanout;
+    subscriber_t *sub = &fo->subs[i];
+    fanout_stats_t *st = &fo->stats[sub->spec];
+    int tag = TAG_SUBSCRIBER + i;
+
+    if (route->fds[tag] != -1) {
+        set_interest(route, tag, 0);
+        close(route->fds[tag]);
+        route->fds[tag] = -1;
+    }
+    metric_add(&st->dropped, sub->backlog_len);
+    if (disconnected) {
+        metric_add(&st->disconnects, 1);
+    }
+    if (route->opts->verbose || disconnected) {
+        printf("[Route %s:%d] Subscriber %s (slot %d) %s.\n", route->address, route->port, fo->specs[sub->spec], i,
+               disconnected ? "fell behind by more than its lag limit and was disconnected" : "went away");
+    }
+    free(sub->backlog);
+    sub->backlog = NULL;
+    sub->backlog_len = 0;
+    sub->lag = 0;
+    sub->out_blocked = 0;
+    if (sub->pipe[0] != -1) {
+        close(sub->pipe[0]);
+        close(sub->pipe[1]);
+        sub->pipe[0] = sub->pipe[1] = -1;
+        sub->kind = SUB_NONE;
+    } else {
+        sub->retry_ms = now_ms() + FIFO_RETRY_MS;
+    }
+}
+
+// Worker: close everything fanout_open and the subscribers created, and remove their paths
+static void fanout_close(route_t *route) {
+    fanout_t *fo = route->fanout;
+
+    for (int i = 0; i < MAX_SUBSCRIBERS; i++) {
+        int kind = fo->subs[i].kind;
+        if (kind != SUB_NONE) {
+            fanout_close_sub(route, i, 0);
+        }
+        if (kind == SUB_FIFO) {
+            unlink(fo->specs[fo->subs[i].spec]);
+        }
+    }
+    for (int l = 0; l < MAX_FANOUT_LISTENERS; l++) {
+        int tag = TAG_FANOUT_LISTEN + l;
+        if (route->fds[tag] != -1) {
+            set_interest(route, tag, 0);
+            close(route->fds[tag]);
+            route->fds[tag] = -1;
+            unlink(fo->specs[fo->listen_spec[l]] + 5);
+        }
+    }
+    if (fo->pipe[0] != -1) {
+        close(fo->pipe[0]);
+        close(fo->pipe[1]);
+        fo->pipe[0] = fo->pipe[1] = -1;
+    }
+}
+
+// Open FIFO subscribers that have gained a reader (tried at most every FIFO_RETRY_MS)
+static void fanout_open_fifos(route_t *route) {
+    fanout_t *fo = route->fanout;
+    long long now = now_ms();
+
+    for (int i = 0; i < MAX_SUBSCRIBERS; i++) {
+        subscriber_t *sub = &fo->subs[i];
+        int fd;
+
+        if (sub->kind != SUB_FIFO || route->fds[TAG_SUBSCRIBER + i] != -1 || now < sub->retry_ms) {
+            continue;
+        }
+        fd = open_fifo_nonblocking(fo->specs[sub->spec], O_WRONLY, 0);
+        if (fd == -1) {
+            sub->retry_ms = now + FIFO_RETRY_MS;
+            continue;
+        }
+        fanout_size_pipe(route, sub, fd);
+        route->fds[TAG_SUBSCRIBER + i] = fd;
+        if (route->opts->verbose) {
+            printf("[Route %s:%d] Subscriber FIFO '%s' opened (lag limit %zu bytes).\n", route->address, route->port,
+                   fo->specs[sub->spec], sub->capacity);
+        }
+    }
+}
+
+static void fanout_accept(route_t *route, int listener) {
+    fanout_t *fo = route->fanout;
+    int fd;
+
+    while ((fd = accept4(route->fds[TAG_FANOUT_LISTEN + listener], NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+        int i = 0;
+        while (i < MAX_SUBSCRIBERS && fo->subs[i].kind != SUB_NONE) {
+            i++;
+        }
+        if (i == MAX_SUBSCRIBERS || pipe2(fo->subs[i].pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+            fprintf(stderr, "[Route %s:%d] No room for another subscriber on '%s'.\n", route->address, route->port,
+                    fo->specs[fo->listen_spec[listener]] + 5);
+            close(fd);
+            continue;
+        }
+        subscriber_t *sub = &fo->subs[i];
+        fanout_size_pipe(route, sub, sub->pipe[1]);
+        sub->kind = SUB_UNIX;
+        sub->spec = fo->listen_spec[listener];
+        route->fds[TAG_SUBSCRIBER + i] = fd;
+        if (route->opts->verbose) {
+            printf("[Route %s:%d] Subscriber connected on '%s' (slot %d).\n", route->address, route->port,
+                   fo->specs[sub->spec] + 5, i);
+        }
+    }
+}
+
+// Move a subscriber's data along: its backlog into its pipe and, for a Unix
+// client, the pipe into the socket. Returns -1 if the subscriber went away.
+static int fanout_flush_sub(route_t *route, int i) {
+    subscriber_t *sub = &route->fanout->subs[i];
+    fanout_stats_t *st = &route->fanout->stats[sub->spec];
+    int queued = 0;
+
+    sub->out_blocked = 0;
+    while (sub->backlog_len > 0) {
+        ssize_t n = write(fanout_target(route, i), sub->backlog, sub->backlog_len);
+        if (n > 0) {
+            memmove(sub->backlog, sub->backlog + n, sub->backlog_len - n);
+            sub->backlog_len -= n;
+            metric_add(&st->delivered, n);
+        } else if (n == -1 && errno == EAGAIN) {
+            sub->out_blocked = sub->pipe[0] == -1; // A Unix client's pipe is drained below
+            break;
+        } else if (n == -1 && errno != EINTR) {
+            fanout_close_sub(route, i, 0); // EPIPE: the reader went away
+            return -1;
+        }
+    }
+    while (sub->pipe[0] != -1) {
+        ssize_t n = splice(sub->pipe[0], NULL, route->fds[TAG_SUBSCRIBER + i], NULL, SPLICE_CHUNK_SIZE,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            continue;
+        }
+        if (n == -1 && errno == EAGAIN) {
+            // Either the pipe is empty or the socket is full
+            sub->out_blocked = ioctl(sub->pipe[0], FIONREAD, &queued) == 0 && queued > 0;
+        } else if (n == -1 && errno != EINTR) {
+            fanout_close_sub(route, i, 0);
+            return -1;
+        }
+        break;
+    }
+    if (ioctl(fanout_target(route, i), FIONREAD, &queued) == 0) {
+        sub->lag = (size_t)queued + sub->backlog_len;
+    }
+    return 0;
+}
+
+// Bytes subscriber 'i' can take before it passes its lag limit
+static size_t fanout_room(route_t *route, int i) {
+    subscriber_t *sub = &route->fanout->subs[i];
+    int queued = 0;
+
+    if (ioctl(fanout_target(route, i), FIONREAD, &queued) == -1) {
+        queued = 0;
+    }
+    if (sub->capacity <= (size_t)queued + sub->backlog_len) {
+        return 0;
+    }
+    return sub->capacity - queued - sub->backlog_len;
+}
+
+// Deliver what the staging pipe holds to every subscriber and the main buffer.
+// Whatever does not fit stays staged ('pending') and the socket is not read.
+static void fanout_pump(route_t *route) {
+    fanout_t *fo = route->fanout;
+    dir_buffer_t *buf = &route->net_to_app;
+    int policy = route->opts->fanout_policy;
+    size_t copy_from[MAX_SUBSCRIBERS];
+    struct iovec iov[4];
+    size_t k = 0, room, used_before;
+    int staged = 0, cnt;
+    ssize_t n;
+
+    if (ioctl(fo->pipe[0], FIONREAD, &staged) == -1 || staged == 0) {
+        fo->pending = 0;
+        return;
+    }
+    fo->pending = staged;
+    fanout_open_fifos(route);
+
+    // The main buffer takes every byte of a pass, so its space bounds the pass
+    cnt = buffer_fill_iov(buf, iov);
+    for (int c = 0; c < cnt; c++) {
+        k += iov[c].iov_len;
+    }
+    if (k > (size_t)staged) {
+        k = staged;
+    }
+    for (int i = 0; i < MAX_SUBSCRIBERS && policy == FANOUT_BLOCK; i++) {
+        if (route->fds[TAG_SUBSCRIBER + i] != -1 && (room = fanout_room(route, i)) < k) {
+            k = room;
+            fo->subs[i].out_blocked = room == 0; // Resume once it drains
+        }
+    }
+    if (k == 0) {
+        return;
+    }
+
+    for (int i = 0; i < MAX_SUBSCRIBERS; i++) {
+        subscriber_t *sub = &fo->subs[i];
+
+        copy_from[i] = k;
+        if (route->fds[TAG_SUBSCRIBER + i] == -1) {
+            continue;
+        }
+        if (sub->backlog_len > 0) {
+            copy_from[i] = 0; // Still catching up by copy; keep the order
+            continue;
+        }
+        n = tee(fo->pipe[0], fanout_target(route, i), k, SPLICE_F_NONBLOCK);
+        if (n == -1 && errno != EAGAIN) {
+            fanout_close_sub(route, i, 0); // EPIPE: the reader went away
+            continue;
+        }
+        n = n < 0 ? 0 : n;
+        metric_add(&fo->stats[sub->spec].delivered, n);
+        if ((size_t)n == k) {
+            continue;
+        }
+        if (policy == FANOUT_DROP) {
+            metric_add(&fo->stats[sub->spec].dropped, k - n);
+        } else if (policy == FANOUT_DISCONNECT) {
+            fanout_close_sub(route, i, 1);
+        } else {
+            copy_from[i] = n;
+        }
+    }
+
+    // Consume the pass into the main buffer; the subscribers have their copies
+    used_before = buffer_used(buf);
+    cnt = iov_trim(iov, cnt, k);
+    n = readv(fo->pipe[0], iov, cnt);
+    if (n <= 0) {
+        return;
+    }
+    if (capture_log) {
+        capture_chunk(capture_log, route->worker->id, route->capture_id, DIR_NET_TO_APP, iov, cnt, n);
+    }
+    buffer_commit(buf, n);
+    fo->pending = staged - n;
+    for (int i = 0; i < MAX_SUBSCRIBERS; i++) {
+        subscriber_t *sub = &fo->subs[i];
+
+        if (route->fds[TAG_SUBSCRIBER + i] == -1) {
+            continue;
+        }
+        if ((size_t)n > copy_from[i]) {
+            if (sub->backlog == NULL && (sub->backlog = malloc(sub->capacity)) == NULL) {
+                error_exit("malloc subscriber backlog");
+            }
+            buffer_peek(buf, used_before + copy_from[i], sub->backlog + sub->backlog_len, n - copy_from[i]);
+            sub->backlog_len += n - copy_from[i];
+        }
+        fanout_flush_sub(route, i);
+    }
+    frame_committed(route, DIR_NET_TO_APP);
+    flush_net_to_app(route);
+}
+
+static void fanout_update_interest(route_t *route) {
+    for (int i = 0; i < MAX_SUBSCRIBERS; i++) {
+        subscriber_t *sub = &route->fanout->subs[i];
+        uint32_t mask = sub->out_blocked ? EPOLLOUT : 0;
+
+        if (sub->kind == SUB_UNIX) {
+            mask |= EPOLLRDHUP; // Notice an idle client hanging up
+        }
+        set_interest(route, TAG_SUBSCRIBER + i, mask);
+    }
+}
+
+// Publish per-subscriber gauges for the stats socket
+static void fanout_note_gauges(route_t *route) {
+    fanout_t *fo = route->fanout;
+    uint64_t count[MAX_SUBSCRIBERS] = { 0 }, lag[MAX_SUBSCRIBERS] = { 0 };
+
+    for (int i = 0; i < MAX_SUBSCRIBERS; i++) {
+        subscriber_t *sub = &fo->subs[i];
+        if (route->fds[TAG_SUBSCRIBER + i] != -1) {
+            count[sub->spec]++;
+            lag[sub->spec] = sub->lag > lag[sub->spec] ? sub->lag : lag[sub->spec];
+        }
+    }
+    for (int s = 0; s < fo->spec_count; s++) {
+        metric_set(&fo->stats[s].subscribers, count[s]);
+        metric_set(&fo->stats[s].lag, lag[s]);
+    }
+}
+
+static void fanout_event(route_t *route, int tag, uint32_t events) {
+    if (tag < TAG_SUBSCRIBER) {
+        fanout_accept(route, tag - TAG_FANOUT_LISTEN);
+        return;
+    }
+    int i = tag - TAG_SUBSCRIBER;
+    if (route->fanout->subs[i].kind == SUB_UNIX && (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+        fanout_close_sub(route, i, 0);
+    } else {
+        fanout_flush_sub(route, i); // The caller pumps again if this freed the pass
+    }
+}
+
+// Socket -> staging pipe, then out to everyone
+static void fanout_read_socket(route_t *route) {
+    ssize_t n = splice(route->fds[TAG_SOCKET], NULL, route->fanout->pipe[1], NULL, SPLICE_CHUNK_SIZE,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+    metrics_note_read(route, DIR_NET_TO_APP, n);
+    if (n > 0) {
+        if (route->opts->verbose) {
+            printf("[Route %s:%d] Received %zd bytes from socket. Fanning out.\n", route->address, route->port, n);
+        }
+        route->paths[DIR_NET_TO_APP].splice_calls++;
+        route->paths[DIR_NET_TO_APP].splice_bytes += n;
+        fanout_pump(route);
+    } else if (n == 0) {
+        if (route->opts->verbose) {
+            printf("[Route %s:%d] Socket closed by peer. Signalling scheduler for reconnection.\n", route->address, route->port);
+        }
+        invalidate_fd(route, TAG_SOCKET);
+    } else if (errno != EAGAIN && errno != EINTR) {
+        perror("[Worker] Error splicing from socket");
+        invalidate_fd(route, TAG_SOCKET);
+    }
+}
+
+// --- Listen mode (-l) ---
+// Instead of dialling out, accept any number of TCP clients and bridge them to
+// the FIFO pair. Every worker owns one shard: a route with its own
+// SO_REUSEPORT listening socket, so the kernel spreads connections across the
+// workers, and its own write end of the net->app FIFO. Clients live in the
+// worker's epoll set like any other fd; an idle client costs one small struct.
+//
+// Both FIFOs carry --frame=u32len records whose body starts with the client's
+// 32-bit tag: [u32 4 + n][u32 tag][n bytes]. Records are at most PIPE_BUF
+// bytes towards the application, so the kernel writes each shard's batches
+// atomically and the shards never interleave. An empty record (n = 0) from a
+// tag announces that the client connected and, the second time, that it went
+// away. Towards the network the application addresses a client by its tag,
+// tag 0 broadcasts to every client, and an empty record closes the client once
+// its queued data is sent. Shard 0 alone reads the app->net FIFO and passes
+// other shards' records to them through a locked inbox, like worker commands.
+
+static void listen_client_set_interest(route_t *route, listen_client_t *c, uint32_t mask) {
+    struct epoll_event ev;
+
+    if (c->fd == -1 || c->mask == mask) {
+        return;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = mask;
+    ev.data.ptr = &c->handle;
+    if (epoll_ctl(route->worker->epoll_fd, mask == 0 ? EPOLL_CTL_DEL : (c->mask == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD),
+                  c->fd, &ev) == -1) {
+        perror("[Worker] epoll_ctl client");
+        return;
+    }
+    c->mask = mask;
+}
+
+static listen_client_t **listen_bucket(listen_shard_t *shard, uint32_t tag) {
+    return &shard->clients[(tag >> 8) % LISTEN_HASH_SIZE];
+}
+
+static listen_client_t *listen_find(listen_shard_t *shard, uint32_t tag) {
+    listen_client_t *c = *listen_bucket(shard, tag);
+
+    while (c && c->tag != tag) {
+        c = c->hash_next;
+    }
+    return c;
+}
+
+// Copy 'len' bytes into the buffer; the caller has checked there is room
+static void buffer_append(dir_buffer_t *buf, const void *data, size_t len) {
+    struct iovec iov[4];
+    int cnt = buffer_fill_iov(buf, iov);
+    const char *in = data;
+    size_t left = len;
+
+    for (int i = 0; i < cnt && left > 0; i++) {
+        size_t take = iov[i].iov_len < left ? iov[i].iov_len : left;
+        memcpy(iov[i].iov_base, in, take);
+        in += take;
+        left -= take;
+    }
+    buffer_commit(buf, len - left);
+}
+
+// Whether a net->app record with 'payload' bytes fits under the high water mark
+static int listen_has_room(route_t *route, size_t payload) {
+    dir_buffer_t *buf = &route->net_to_app;
+
+    return !buf->paused && buffer_used(buf) + LISTEN_HEADER + payload <= buf->high_water;
+}
+
+// Queue a record from client 'tag' for the application. 'data' starts with
+// LISTEN_HEADER bytes of room for the header.
+static void listen_emit(route_t *route, uint32_t tag, unsigned char *data, size_t payload) {
+    uint32_t len = 4 + payload;
+
+    data[0] = len >> 24;
+    data[1] = len >> 16;
+    data[2] = len >> 8;
+    data[3] = len;
+    data[4] = tag >> 24;
+    data[5] = tag >> 16;
+    data[6] = tag >> 8;
+    data[7] = tag;
+    buffer_append(&route->net_to_app, data, LISTEN_HEADER + payload);
+}
+
+// Close a client. Its closing notice goes out now if there is room, otherwise
+// once the buffer drains; the struct itself is freed after the epoll batch.
+static void listen_client_close(route_t *route, listen_client_t *c) {
+    listen_shard_t *shard = route->listen;
+    unsigned char notice[LISTEN_HEADER];
+
+    if (c->fd == -1) {
+        return;
+    }
+    for (listen_client_t **pp = listen_bucket(shard, c->tag); *pp; pp = &(*pp)->hash_next) {
+        if (*pp == c) {
+            *pp = c->hash_next;
+            break;
+        }
+    }
+    listen_client_set_interest(route, c, 0);
+    close(c->fd);
+    c->fd = -1;
+    free(c->out);
+    c->out = NULL;
+    c->out_len = c->out_cap = 0;
+    shard->accept_blocked = 0; // A descriptor is free again
+    metric_add(&shard->closed, 1);
+    metric_set(&shard->open, metric_read(&shard->open) - 1);
+    if (route->opts->verbose) {
+        printf("[Route %s:%d] Client %08x closed.\n", route->address, route->port, c->tag);
+    }
+    if (c->stalled) {
+        return; // The stalled list sends the notice and frees it
+    }
+    if (listen_has_room(route, 0)) {
+        listen_emit(route, c->tag, notice, 0);
+        c->hash_next = shard->dead;
+        shard->dead = c;
+    } else {
+        c->stalled = 1;
+        c->stalled_next = shard->stalled;
+        shard->stalled = c;
+    }
+}
+
+// Stop reading a client until the net->app buffer has room again
+static void listen_client_stall(route_t *route, listen_client_t *c) {
+    listen_shard_t *shard = route->listen;
+
+    listen_client_set_interest(route, c, c->mask & EPOLLOUT); // EPOLLRDHUP too, or a hangup would spin
+    if (!c->stalled) {
+        c->stalled = 1;
+        c->stalled_next = shard->stalled;
+        shard->stalled = c;
+    }
+}
+
+// Send what is queued for a client. Returns -1 if the client was closed.
+static int listen_client_flush(route_t *route, listen_client_t *c) {
+    while (c->out_len > 0) {
+        ssize_t n = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL);
+        metrics_note_write(route, DIR_APP_TO_NET, n, 0);
+        if (n > 0) {
+            memmove(c->out, c->out + n, c->out_len - n);
+            c->out_len -= n;
+        } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            listen_client_set_interest(route, c, c->mask | EPOLLOUT);
+            return 0;
+        } else if (n == -1 && errno != EINTR) {
+            listen_client_close(route, c);
+            return -1;
+        }
+    }
+    listen_client_set_interest(route, c, c->mask & ~EPOLLOUT);
+    if (c->out_cap > LISTEN_KEEP_OUT) {
+        free(c->out); // Idle clients hold no buffer
+        c->out = NULL;
+        c->out_cap = 0;
+    }
+    if (c->closing) {
+        listen_client_close(route, c);
+        return -1;
+    }
+    return 0;
+}
+
+// Queue an app->net record for a local client ('close' for an empty record)
+static void listen_client_send(route_t *route, listen_client_t *c, const char *data, size_t len, int close) {
+    if (c->fd == -1 || c->closing) {
+        return;
+    }
+    if (close) {
+        c->closing = 1;
+    } else if (c->out_len + len > route->opts->ring_size) {
+        fprintf(stderr, "[Route %s:%d] Client %08x is not reading; more than %zu bytes queued. Disconnecting.\n",
+                route->address, route->port, c->tag, route->opts->ring_size);
+        metric_add(&route->listen->overflows, 1);
+        listen_client_close(route, c);
+        return;
+    } else {
+        if (c->out_len + len > c->out_cap) {
+            size_t cap = c->out_cap ? c->out_cap : 4096;
+            while (cap < c->out_len + len) {
+                cap *= 2;
+            }
+            char *out = realloc(c->out, cap);
+            if (out == NULL) {
+                error_exit("realloc client buffer");
+            }
+            c->out = out;
+            c->out_cap = cap;
+        }
+        memcpy(c->out + c->out_len, data, len);
+        c->out_len += len;
+    }
+    if (!(c->mask & EPOLLOUT)) {
+        listen_client_flush(route, c); // Otherwise EPOLLOUT brings us back
+    }
+}
+
+// Deliver an app->net record to this shard's client 'tag', or to all of them for tag 0
+static void listen_deliver(route_t *route, uint32_t tag, const char *data, size_t len, int close) {
+    listen_shard_t *shard = route->listen;
+
+    if (tag != 0) {
+        listen_client_t *c = listen_find(shard, tag);
+        if (c) {
+            listen_client_send(route, c, data, len, close);
+        } else if (route->opts->verbose) {
+            printf("[Route %s:%d] No client %08x; dropping %zu bytes.\n", route->address, route->port, tag, len);
+        }
+        return;
+    }
+    for (int b = 0; b < LISTEN_HASH_SIZE; b++) {
+        for (listen_client_t *c = shard->clients[b], *next; c; c = next) {
+            next = c->hash_next; // Sending may close the client
+            listen_client_send(route, c, data, len, close);
+        }
+    }
+}
+
+// Hand a record to another shard's worker
+static void listen_post(route_t *target, uint32_t tag, const char *data, size_t len, int close) {
+    listen_shard_t *shard = target->listen;
+    listen_msg_t *msg = malloc(sizeof(*msg) + len);
+
+    if (msg == NULL) {
+        error_exit("malloc listen message");
+    }
+    msg->tag = tag;
+    msg->close = close;
+    msg->len = len;
+    msg->next = NULL;
+    if (len > 0) {
+        memcpy(msg->data, data, len);
+    }
+    pthread_mutex_lock(&shard->inbox_lock);
+    if (shard->inbox_tail) {
+        shard->inbox_tail->next = msg;
+    } else {
+        shard->inbox_head = msg;
+    }
+    shard->inbox_tail = msg;
+    pthread_mutex_unlock(&shard->inbox_lock);
+    wake_fd(target->worker->wake_fd);
+}
+
+// Worker: deliver records other shards posted to this one
+static void listen_take_inbox(route_t *route) {
+    listen_shard_t *shard = route->listen;
+    listen_msg_t *msg;
+
+    pthread_mutex_lock(&shard->inbox_lock);
+    msg = shard->inbox_head;
+    shard->inbox_head = shard->inbox_tail = NULL;
+    pthread_mutex_unlock(&shard->inbox_lock);
+    while (msg) {
+        listen_msg_t *next = msg->next;
+        listen_deliver(route, msg->tag, msg->data, msg->len, msg->close);
+        free(msg);
+        msg = next;
+    }
+}
+
+// Shard 0: route whole records read from the app->net FIFO to their clients
+static void listen_flush_app_to_net(route_t *route) {
+    dir_buffer_t *buf = &route->app_to_net;
+    listen_shard_t *shard = route->listen;
+    unsigned char hdr[LISTEN_HEADER];
+    int complete;
+
+    while (buffer_used(buf) > 0) {
+        size_t rec = frame_record_len(route, DIR_APP_TO_NET, 0, &complete);
+        if (!complete) {
+            if (buf->paused) { // Larger than the buffer: it can never be routed
+                fprintf(stderr, "[Route %s:%d] Dropping a %zu byte record larger than the buffer.\n",
+                        route->address, route->port, rec);
+                route->framers[DIR_APP_TO_NET].discard_left = rec - buffer_used(buf);
+                metric_add(&route->metrics[DIR_APP_TO_NET].torn_bytes, buffer_used(buf));
+                buffer_consume(buf, buffer_used(buf));
+            }
+            return;
+        }
+        if (rec < LISTEN_HEADER) {
+            metric_add(&route->metrics[DIR_APP_TO_NET].torn_bytes, rec); // No room for a tag
+            buffer_consume(buf, rec);
+            continue;
+        }
+        size_t len = rec - LISTEN_HEADER;
+        char *data = len > 0 ? malloc(len) : NULL;
+        if (len > 0 && data == NULL) {
+            error_exit("malloc listen record");
+        }
+        buffer_peek(buf, 0, hdr, LISTEN_HEADER);
+        buffer_peek(buf, LISTEN_HEADER, data, len);
+        buffer_consume(buf, rec);
+        metric_add(&route->metrics[DIR_APP_TO_NET].records, 1);
+
+        uint32_t tag = (uint32_t)hdr[4] << 24 | (uint32_t)hdr[5] << 16 | (uint32_t)hdr[6] << 8 | hdr[7];
+        for (int s = 0; s < shard->shard_count; s++) {
+            if (tag != 0 && (int)(tag & 0xff) != s) {
+                continue;
+            }
+            if (shard->shards[s] == route) {
+                listen_deliver(route, tag, data, len, len == 0);
+            } else {
+                listen_post(shard->shards[s], tag, data, len, len == 0);
+            }
+        }
+        free(data);
+    }
+}
+
+// The fd limit is process-wide, so a shard may be blocked by other shards'
+// clients and never see one of its own leave: retry on a timer as well
+static void listen_arm_retry(route_t *route) {
+    struct itimerspec its = { { 0, 0 }, { LISTEN_RETRY_MS / 1000, (LISTEN_RETRY_MS % 1000) * 1000000L } };
+
+    if (route->fds[TAG_COALESCE_TIMER] != -1 && timerfd_settime(route->fds[TAG_COALESCE_TIMER], 0, &its, NULL) == -1) {
+        perror("[Worker] timerfd_settime");
+    }
+}
+
+// Next tag for a new client, skipping any a long-lived client still holds after seq wrapped
+static uint32_t listen_next_tag(listen_shard_t *shard) {
+    uint32_t tag;
+
+    do {
+        tag = shard->next_seq << 8 | shard->index;
+        shard->next_seq = shard->next_seq == LISTEN_MAX_SEQ ? 1 : shard->next_seq + 1;
+    } while (listen_find(shard, tag) != NULL);
+    return tag;
+}
+
+static void listen_accept(route_t *route) {
+    listen_shard_t *shard = route->listen;
+    unsigned char notice[LISTEN_HEADER];
+
+    for (int i = 0; i < LISTEN_ACCEPT_BATCH && listen_has_room(route, 0); i++) {
+        int fd = accept4(route->fds[TAG_LISTEN], NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EMFILE || errno == ENFILE) {
+                if (!shard->accept_warned) {
+                    fprintf(stderr, "[Route %s:%d] Out of file descriptors; not accepting until one is free.\n",
+                            route->address, route->port);
+                    shard->accept_warned = 1;
+                }
+                shard->accept_blocked = 1;
+                listen_arm_retry(route);
+            } else if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED) {
+                perror("[Worker] accept");
+            }
+            return;
+        }
+        listen_client_t *c = calloc(1, sizeof(*c));
+        if (c == NULL) {
+            error_exit("calloc client");
+        }
+        shard->accept_warned = 0;
+        c->handle.route = route;
+        c->handle.tag = TAG_CLIENT;
+        c->fd = fd;
+        c->tag = listen_next_tag(shard);
+        c->hash_next = *listen_bucket(shard, c->tag);
+        *listen_bucket(shard, c->tag) = c;
+        listen_client_set_interest(route, c, EPOLLIN | EPOLLRDHUP);
+        listen_emit(route, c->tag, notice, 0);
+        metric_add(&shard->accepted, 1);
+        metric_set(&shard->open, metric_read(&shard->open) + 1);
+        if (route->opts->verbose) {
+            printf("[Route %s:%d] Accepted client %08x (FD %d).\n", route->address, route->port, c->tag, fd);
+        }
+    }
+}
+
+// One read from a client, queued as a record for the application
+static void listen_client_read(route_t *route, listen_client_t *c) {
+    unsigned char data[PIPE_BUF];
+    size_t room = route->net_to_app.high_water - buffer_used(&route->net_to_app);
+    size_t want = PIPE_BUF - LISTEN_HEADER;
+    ssize_t n;
+
+    if (!listen_has_room(route, 1)) {
+        listen_client_stall(route, c);
+        return;
+    }
+    if (want > room - LISTEN_HEADER) {
+        want = room - LISTEN_HEADER;
+    }
+    n = read(c->fd, data + LISTEN_HEADER, want);
+    metrics_note_read(route, DIR_NET_TO_APP, n);
+    if (n > 0) {
+        listen_emit(route, c->tag, data, n);
+    } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        listen_client_close(route, c);
+    }
+}
+
+// Let stalled clients go on: send pending closing notices and resume reads
+static void listen_resume(route_t *route) {
+    listen_shard_t *shard = route->listen;
+    unsigned char notice[LISTEN_HEADER];
+
+    while (shard->stalled && listen_has_room(route, 0)) {
+        listen_client_t *c = shard->stalled;
+        shard->stalled = c->stalled_next;
+        c->stalled = 0;
+        if (c->fd == -1) {
+            listen_emit(route, c->tag, notice, 0);
+            c->hash_next = shard->dead;
+            shard->dead = c;
+        } else {
+            listen_client_set_interest(route, c, c->mask | EPOLLIN | EPOLLRDHUP);
+        }
+    }
+}
+
+static void listen_client_event(route_t *route, listen_client_t *c, uint32_t events) {
+    if (c->fd == -1) {
+        return; // Closed earlier in this batch
+    }
+    if ((events & EPOLLOUT) && listen_client_flush(route, c) == -1) {
+        return;
+    }
+    if (c->stalled && (events & (EPOLLHUP | EPOLLERR))) {
+        listen_client_close(route, c); // Reset while we were not reading
+    } else if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        listen_client_read(route, c); // read() reports the EOF or error itself
+    }
+    listen_resume(route);
+    flush_net_to_app(route);
+    metric_set(&route->metrics[DIR_NET_TO_APP].queued, buffer_used(&route->net_to_app));
+    update_interest(route);
+}
+
+static void listen_update_interest(route_t *route) {
+    set_interest(route, TAG_LISTEN, listen_has_room(route, 0) && !route->listen->accept_blocked ? EPOLLIN : 0);
+}
+
+// Free clients closed during the last epoll batch
+static void listen_reap(route_t *route) {
+    listen_shard_t *shard = route->listen;
+
+    while (shard->dead) {
+        listen_client_t *c = shard->dead;
+        shard->dead = c->hash_next;
+        free(c);
+    }
+}
+
+// Worker: close every client and the listening socket
+static void listen_close(route_t *route) {
+    listen_shard_t *shard = route->listen;
+
+    for (int b = 0; b < LISTEN_HASH_SIZE; b++) {
+        while (shard->clients[b]) {
+            listen_client_t *c = shard->clients[b];
+            listen_client_close(route, c);
+        }
+    }
+    while (shard->stalled) { // All closed by now
+        listen_client_t *c = shard->stalled;
+        shard->stalled = c->stalled_next;
+        c->hash_next = shard->dead;
+        shard->dead = c;
+    }
+    while (shard->inbox_head) {
+        listen_msg_t *next = shard->inbox_head->next;
+        free(shard->inbox_head);
+        shard->inbox_head = next;
+    }
+    shard->inbox_tail = NULL;
+    if (route->fds[TAG_LISTEN] != -1) {
+        set_interest(route, TAG_LISTEN, 0);
+        close(route->fds[TAG_LISTEN]);
+        route->fds[TAG_LISTEN] = -1;
+    }
+}
+
+// --- Content demux (--demux) ---
+// The -h/-p route's socket data is cut into records (--frame, lines by
+// default) and each record goes to the first --demux output whose value
+// starts the record, or starts field --demux-field of it. Records that match
+// nothing go to the route's own FIFO as usual. The socket is read into a
+// staging area and split there with the vector scans of netpipe_demux.h;
+// each output then has an ordinary buffer in front of its FIFO. A record only
+// moves on once its destination has room for all of it, so a full output
+// holds back everything behind it and, once the staging area fills, the
+// socket. A record that can never fit (longer than the staging area or than a
+// buffer's high water mark) is passed through in pieces.
+//
+// The output FIFOs are opened read-write, which never fails for want of a
+// reader and never raises EPIPE: what is written while nobody reads waits in
+// the pipe for the next reader.
+
+static void demux_free(demux_t *dm) {
+    if (dm) {
+        for (int i = 0; i < dm->count; i++) {
+            buffer_free(&dm->out[i]);
+            free(dm->fifos[i]);
+        }
+        free(dm->stage);
+        free(dm);
+    }
+}
+
+// Parse the --demux entries, create and open their FIFOs. Returns NULL (after an error message) on failure.
+static demux_t *demux_new(const options_t *opts) {
+    demux_t *dm = calloc(1, sizeof(*dm));
+
+    if (dm == NULL || (dm->stage = malloc(DEMUX_STAGE_SIZE + DEMUX_PAD)) == NULL) {
+        error_exit("calloc demux");
+    }
+    memset(dm->stage + DEMUX_STAGE_SIZE, 0, DEMUX_PAD);
+    dm->carry = DEMUX_NO_CARRY;
+    dm->find = demux_pick_find(&dm->find_name);
+    for (int i = 0; i < MAX_DEMUX_OUTPUTS; i++) {
+        dm->fds[i] = -1;
+    }
+    for (int i = 0; i < opts->demux_count; i++) {
+        const char *spec = opts->demux_specs[i];
+        const char *eq = strrchr(spec, '=');
+
+        if (eq == NULL || eq[1] == '\0' || demux_rule_init(&dm->rules[i], spec, eq - spec) == -1) {
+            fprintf(stderr, "Error: --demux takes <value>=<fifo> with a value of 1 to %d bytes, not '%s'.\n",
+                    DEMUX_MAX_VALUE, spec);
+            demux_free(dm);
+            return NULL;
+        }
+        if ((dm->fifos[i] = strdup(eq + 1)) == NULL || buffer_init(&dm->out[i], opts) == -1) {
+            error_exit("Error allocating demux output");
+        }
+        dm->count++;
+        if (mkfifo(dm->fifos[i], 0666) == -1 && errno != EEXIST) {
+            perror("mkfifo demux output");
+        }
+        dm->fds[i] = open(dm->fifos[i], O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (dm->fds[i] == -1) {
+            fprintf(stderr, "Error: cannot open demux output '%s': %s\n", dm->fifos[i], strerror(errno));
+            for (int j = 0; j < i; j++) {
+                close(dm->fds[j]);
+            }
+            demux_free(dm);
+            return NULL;
+        }
+    }
+    if (opts->verbose) {
+        if (opts->demux_field) {
+            printf("Demux: %d output(s) matching field %d ('%c'-separated), %s scan.\n", dm->count, opts->demux_field,
+                   opts->demux_sep, dm->find_name);
+        } else {
+            printf("Demux: %d output(s) matching the record prefix, %s scan.\n", dm->count, dm->find_name);
+        }
+    }
+    return dm;
+}
+
+// Close the output FIFOs and remove them
+static void demux_close(route_t *route) {
+    demux_t *dm = route->demux;
+
+    for (int i = 0; i < dm->count; i++) {
+        if (route->fds[TAG_DEMUX + i] != -1) {
+            set_interest(route, TAG_DEMUX + i, 0);
+            route->fds[TAG_DEMUX + i] = -1;
+        }
+        if (dm->fds[i] != -1) {
+            close(dm->fds[i]);
+            dm->fds[i] = -1;
+            unlink(dm->fifos[i]);
+        }
+    }
+}
+
+// Length of the record at p[0..avail), as frame_record_len. Sets *complete
+// when all of it is there; otherwise returns 0 or the declared length.
+static size_t demux_record_len(route_t *route, const char *p, size_t avail, int *complete) {
+    const unsigned char *u = (const unsigned char *)p;
+    size_t len;
+
+    *complete = 0;
+    switch (route->opts->frame_mode) {
+    case FRAME_U16LEN:
+        if (avail < 2) {
+            return 0;
+        }
+        len = 2 + ((size_t)u[0] << 8 | u[1]);
+        break;
+    case FRAME_U32LEN:
+        if (avail < 4) {
+            return 0;
+        }
+        len = 4 + ((size_t)u[0] << 24 | (size_t)u[1] << 16 | (size_t)u[2] << 8 | u[3]);
+        break;
+    default: {
+        size_t nl = route->demux->find(p, avail, '\n');
+        if (nl == avail) {
+            return 0;
+        }
+        *complete = 1;
+        return nl + 1;
+    }
+    }
+    *complete = len <= avail;
+    return len;
+}
+
+// How much of p[0..avail) belongs to the record being passed through
+static size_t demux_carry_len(route_t *route, const char *p, size_t avail, int *complete) {
+    demux_t *dm = route->demux;
+    size_t len;
+
+    if (route->opts->frame_mode == FRAME_LINE) {
+        len = dm->find(p, avail, '\n');
+        *complete = len < avail;
+        return *complete ? len + 1 : avail;
+    }
+    *complete = dm->carry_left <= avail;
+    return *complete ? dm->carry_left : avail;
+}
+
+// Output whose rule the record body rec[0..len) matches, or DEMUX_MAIN
+static int demux_target(route_t *route, const char *rec, size_t len) {
+    demux_t *dm = route->demux;
+    int mode = route->opts->frame_mode;
+    size_t hdr = mode == FRAME_U16LEN ? 2 : mode == FRAME_U32LEN ? 4 : 0;
+    int i;
+
+    if (len <= hdr) {
+        return DEMUX_MAIN;
+    }
+    i = demux_classify(dm->rules, dm->count, dm->find, rec + hdr, len - hdr, route->opts->demux_field,
+                       route->opts->demux_sep);
+    return i < 0 ? DEMUX_MAIN : i;
+}
+
+static dir_buffer_t *demux_buffer(route_t *route, int target) {
+    return target == DEMUX_MAIN ? &route->net_to_app : &route->demux->out[target];
+}
+
+// Free space of one destination during a demux_split pass. Records are
+// copied straight into it and committed once at the end of the pass, so the
+// buffer's bookkeeping is paid per pass rather than per record.
+typedef struct {
+    struct iovec iov[4];
+    int cnt;                    // -1 until the destination is first used in the pass
+    size_t room;
+    size_t taken;
+    uint64_t records;
+} demux_fill_t;
+
+static demux_fill_t *demux_fill(route_t *route, demux_fill_t *fills, int target) {
+    demux_fill_t *f = &fills[target + 1];
+
+    if (f->cnt < 0) {
+        f->cnt = buffer_fill_iov(demux_buffer(route, target), f->iov);
+        for (int i = 0; i < f->cnt; i++) {
+            f->room += f->iov[i].iov_len;
+        }
+    }
+    return f;
+}
+
+// Copy 'len' bytes of a record into the destination; 'last' when they end the record
+static void demux_deliver(demux_fill_t *f, const char *data, size_t len, int last) {
+    size_t skip = f->taken;
+
+    for (int i = 0; i < f->cnt && len > 0; i++) {
+        if (skip >= f->iov[i].iov_len) {
+            skip -= f->iov[i].iov_len;
+            continue;
+        }
+        size_t take = f->iov[i].iov_len - skip < len ? f->iov[i].iov_len - skip : len;
+        memcpy((char *)f->iov[i].iov_base + skip, data, take);
+        data += take;
+        len -= take;
+        f->taken += take;
+        skip = 0;
+    }
+    f->records += last;
+}
+
+// Route every record in the staging area whose destination has room for it
+static void demux_split(route_t *route) {
+    demux_t *dm = route->demux;
+    demux_fill_t fills[MAX_DEMUX_OUTPUTS + 1];
+    size_t off = 0;
+
+    for (int t = 0; t <= dm->count; t++) {
+        fills[t].cnt = -1;
+        fills[t].room = fills[t].taken = fills[t].records = 0;
+    }
+    while (off < dm->stage_len) {
+        const char *rec = dm->stage + off;
+        size_t avail = dm->stage_len - off, len, room;
+        int complete, target;
+        demux_fill_t *f;
+
+        if (dm->carry != DEMUX_NO_CARRY) {
+            len = demux_carry_len(route, rec, avail, &complete);
+            f = demux_fill(route, fills, dm->carry);
+            room = f->room - f->taken;
+            if (room == 0) {
+                break;
+            }
+            if (len > room) {
+                len = room;
+                complete = 0;
+            }
+            demux_deliver(f, rec, len, complete);
+            if (route->opts->frame_mode != FRAME_LINE) {
+                dm->carry_left -= len;
+            }
+            if (complete) {
+                dm->carry = DEMUX_NO_CARRY;
+            }
+            off += len;
+            continue;
+        }
+        len = demux_record_len(route, rec, avail, &complete);
+        if (!complete && (off > 0 || dm->stage_len < DEMUX_STAGE_SIZE)) {
+            break; // The rest of the record is still to be read
+        }
+        target = demux_target(route, rec, complete ? len - (route->opts->frame_mode == FRAME_LINE) : avail);
+        f = demux_fill(route, fills, target);
+        room = f->room - f->taken;
+        if (complete && len <= room) {
+            demux_deliver(f, rec, len, 1);
+            off += len;
+            continue;
+        }
+        if ((complete && len <= demux_buffer(route, target)->high_water) || room == 0) {
+            break; // It fits once the destination drains
+        }
+        // Longer than the staging area or than the destination's buffer: send
+        // what fits now and the rest as it comes
+        size_t piece = (complete ? len : avail) < room ? (complete ? len : avail) : room;
+        demux_deliver(f, rec, piece, 0);
+        metric_add(&route->metrics[DIR_NET_TO_APP].oversized, 1);
+        dm->carry = target;
+        dm->carry_left = len > piece ? len - piece : 0; // Unused in line mode
+        off += piece;
+    }
+    for (int target = DEMUX_MAIN; target < dm->count; target++) {
+        demux_fill_t *f = &fills[target + 1];
+        demux_stats_t *st = target == DEMUX_MAIN ? &dm->unmatched : &dm->stats[target];
+
+        if (f->taken == 0) {
+            continue;
+        }
+        buffer_commit(demux_buffer(route, target), f->taken);
+        if (target == DEMUX_MAIN) {
+            frame_committed(route, DIR_NET_TO_APP); // Drops the rest of a record the FIFO's last reader got the start of
+        }
+        metric_add(&st->bytes, f->taken);
+        metric_add(&st->records, f->records);
+    }
+    if (off > 0) {
+        memmove(dm->stage, dm->stage + off, dm->stage_len - off);
+        dm->stage_len -= off;
+    }
+}
+
+// Write queued records to output 'i' until it is empty or full
+static void demux_flush(route_t *route, int i) {
+    demux_t *dm = route->demux;
+    dir_buffer_t *buf = &dm->out[i];
+    struct iovec iov[4];
+
+    dm->write_blocked[i] = 0;
+    while (buffer_used(buf) > 0 && route->fds[TAG_DEMUX + i] != -1) {
+        ssize_t n = writev(route->fds[TAG_DEMUX + i], iov, buffer_drain_iov(buf, iov));
+        if (n > 0) {
+            buffer_consume(buf, n);
+        } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            dm->write_blocked[i] = 1; // Wait for EPOLLOUT
+            break;
+        } else if (n == -1 && errno != EINTR) {
+            perror("[Worker] Error writing to demux output");
+            break;
+        }
+    }
+    metric_set(&dm->stats[i].queued, buffer_used(buf));
+}
+
+// Split what is staged and push it towards every FIFO, until nothing moves
+static void demux_pump(route_t *route) {
+    demux_t *dm = route->demux;
+    size_t before;
+
+    do {
+        before = dm->stage_len;
+        demux_split(route);
+        for (int i = 0; i < dm->count; i++) {
+            if (!dm->write_blocked[i]) {
+                demux_flush(route, i);
+            }
+        }
+        flush_net_to_app(route); // Draining may make room for what is still staged
+    } while (dm->stage_len > 0 && dm->stage_len < before);
+    metric_set(&dm->unmatched.queued, buffer_used(&route->net_to_app));
+}
+
+static void demux_update_interest(route_t *route) {
+    demux_t *dm = route->demux;
+
+    for (int i = 0; i < dm->count; i++) {
+        set_interest(route, TAG_DEMUX + i, dm->write_blocked[i] && buffer_used(&dm->out[i]) > 0 ? EPOLLOUT : 0);
+    }
+}
+
+// The socket closed: drop the record it cut off. Records already complete
+// stay staged for the next connection's data to follow.
+static void demux_socket_lost(route_t *route) {
+    demux_t *dm = route->demux;
+    size_t off = 0, len;
+    int complete = 1;
+
+    if (dm->carry != DEMUX_NO_CARRY) {
+        off = demux_carry_len(route, dm->stage, dm->stage_len, &complete);
+        if (!complete) {
+            // A record being passed through in pieces: its destination keeps
+            // what it has been given (the route's FIFO drops it, as with --frame)
+            metric_add(&route->metrics[DIR_NET_TO_APP].torn_bytes, dm->stage_len);
+            dm->carry = DEMUX_NO_CARRY;
+            dm->carry_left = 0;
+            dm->stage_len = 0;
+            return;
+        }
+    }
+    while (complete && off < dm->stage_len) {
+        len = demux_record_len(route, dm->stage + off, dm->stage_len - off, &complete);
+        if (complete) {
+            off += len;
+        }
+    }
+    metric_add(&route->metrics[DIR_NET_TO_APP].torn_bytes, dm->stage_len - off);
+    dm->stage_len = off;
+}
+
+// Socket -> staging area, then split
+static void demux_read_socket(route_t *route) {
+    demux_t *dm = route->demux;
+    struct iovec iov = { dm->stage + dm->stage_len, DEMUX_STAGE_SIZE - dm->stage_len };
+    ssize_t n;
+
+    if (iov.iov_len == 0) {
+        return; // Full of records waiting for room
+    }
+    n = socket_readv(route, &iov, 1);
+    metrics_note_read(route, DIR_NET_TO_APP, n);
+    if (n > 0) {
+        if (capture_log) {
+            iov.iov_len = n;
+            capture_chunk(capture_log, route->worker->id, route->capture_id, DIR_NET_TO_APP, &iov, 1, n);
+        }
+        if (route->opts->verbose) {
+            printf("[Route %s:%d] Received %zd bytes from socket. Demultiplexing.\n", route->address, route->port, n);
+        }
+        dm->stage_len += n;
+        demux_pump(route);
+    } else if (n == 0) {
+        if (route->opts->verbose) {
+            printf("[Route %s:%d] Socket closed by peer. Signalling scheduler for reconnection.\n", route->address, route->port);
+        }
+        invalidate_fd(route, TAG_SOCKET);
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("[Worker] Error receiving from socket");
+        invalidate_fd(route, TAG_SOCKET);
+    }
+}
+
+static void read_socket(route_t *route) {
+    dir_buffer_t *buf = &route->net_to_app;
+    struct iovec iov[4];
+    int cnt;
+    ssize_t n;
+
+    if (route->shm) {
+        shm_read_socket(route);
+        return;
+    }
+    if (route->fanout) {
+        fanout_read_socket(route);
+        return;
+    }
+    if (route->demux) {
+        demux_read_socket(route);
+        return;
+    }
+
+    if (route->splicing[DIR_NET_TO_APP] && buffer_used(buf) == 0 && route->fds[TAG_PIPE_NET_TO_APP] != -1) {
+        n = splice_direction(route, DIR_NET_TO_APP, TAG_SOCKET, TAG_PIPE_NET_TO_APP);
+        if (n > 0) {
+            if (route->opts->verbose) {
+                printf("[Route %s:%d] Spliced %zd bytes from socket to named pipe '%s'.\n", route->address, route->port, n, route->pipe_net_to_app_name);
+            }
+            return;
+        } else if (n == 0) {
+            if (route->opts->verbose) {
+                printf("[Route %s:%d] Socket closed by peer. Signalling scheduler for reconnection.\n", route->address, route->port);
+            }
+            invalidate_fd(route, TAG_SOCKET);
+            return;
+        } else if (errno == EPIPE) { // Data stays queued in the socket until a reader returns
+            if (route->opts->verbose) printf("[Route %s:%d] Named pipe '%s' has no reader (EPIPE). Signalling scheduler to reopen pipe.\n", route->address, route->port, route->pipe_net_to_app_name);
+            invalidate_fd(route, TAG_PIPE_NET_TO_APP);
+            return;
+        } else if (errno != EINVAL) {
+            if (errno != EAGAIN && errno != EINTR) {
+                perror("[Worker] Error splicing from socket");
+                invalidate_fd(route, TAG_SOCKET);
+            }
+            return;
+        }
+        // EINVAL: fall through to the copy path
+    }
+
+    cnt = buffer_fill_iov(buf, iov);
+    if (cnt == 0) {
+        return; // Paused at the high water mark
+    }
+    n = socket_readv(route, iov, cnt);
+    metrics_note_read(route, DIR_NET_TO_APP, n);
+    if (n > 0) {
+        if (capture_log) {
+            capture_chunk(capture_log, route->worker->id, route->capture_id, DIR_NET_TO_APP, iov, cnt, n);
+        }
+        if (route->opts->verbose) {
+            printf("[Route %s:%d] Received %zd bytes from socket. Writing to named pipe '%s'.\n", route->address, route->port, n, route->pipe_net_to_app_name);
+        }
+        buffer_commit(buf, n);
+        frame_committed(route, DIR_NET_TO_APP);
+        flush_net_to_app(route);
+        tune_note_read(route, DIR_NET_TO_APP, n, iov_total(iov, cnt)); // Last: it may move the buffer
+    } else if (n == 0) {
+        if (route->opts->verbose) {
+            printf("[Route %s:%d] Socket closed by peer. Signalling scheduler for reconnection.\n", route->address, route->port);
+        }
+        invalidate_fd(route, TAG_SOCKET);
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("[Worker] Error receiving from socket");
+        invalidate_fd(route, TAG_SOCKET);
+    }
+}
+
+static void read_pipe(route_t *route) {
+    dir_buffer_t *buf = &route->app_to_net;
+    struct iovec iov[4];
+    int cnt;
+    ssize_t n;
+
+    if (route->splicing[DIR_APP_TO_NET] && buffer_used(buf) == 0 && route->fds[TAG_SOCKET] != -1) {
+        n = splice_direction(route, DIR_APP_TO_NET, TAG_PIPE_APP_TO_NET, TAG_SOCKET);
+        if (n > 0) {
+            if (route->opts->verbose) {
+                printf("[Route %s:%d] Spliced %zd bytes from named pipe '%s' to socket.\n", route->address, route->port, n, route->pipe_app_to_net_name);
+            }
+            return;
+        } else if (n == 0) {
+            if (route->opts->verbose) {
+                printf("[Route %s:%d] Named pipe '%s' writer closed (EOF). Signalling scheduler to reopen pipe.\n", route->address, route->port, route->pipe_app_to_net_name);
+            }
+            invalidate_fd(route, TAG_PIPE_APP_TO_NET);
+            return;
+        } else if (errno != EINVAL) {
+            if (errno != EAGAIN && errno != EINTR) {
+                // The socket is the usual culprit (EPIPE, ECONNRESET); data stays in the FIFO
+                perror("[Worker] Error splicing to socket");
+                invalidate_fd(route, TAG_SOCKET);
+            }
+            return;
+        }
+        // EINVAL: fall through to the copy path
+    }
+
+    cnt = buffer_fill_iov(buf, iov);
+    if (cnt == 0) {
+        return; // Paused at the high water mark
+    }
+    n = readv(route->fds[TAG_PIPE_APP_TO_NET], iov, cnt);
+    metrics_note_read(route, DIR_APP_TO_NET, n);
+    if (n > 0) {
+        if (capture_log) {
+            capture_chunk(capture_log, route->worker->id, route->capture_id, DIR_APP_TO_NET, iov, cnt, n);
+        }
+        if (route->opts->verbose) {
+            printf("[Route %s:%d] Read %zd bytes from named pipe '%s'. Writing to socket.\n", route->address, route->port, n, route->pipe_app_to_net_name);
+        }
+        buffer_commit(buf, n);
+        frame_committed(route, DIR_APP_TO_NET);
+        coalesce_note_arrival(route);
+        flush_app_to_net(route);
+        tune_note_read(route, DIR_APP_TO_NET, n, iov_total(iov, cnt)); // Last: it may move the buffer
+    } else if (n == 0) {
+        if (route->opts->verbose) {
+            printf("[Route %s:%d] Named pipe '%s' writer closed (EOF). Signalling scheduler to reopen pipe.\n", route->address, route->port, route->pipe_app_to_net_name);
+        }
+        invalidate_fd(route, TAG_PIPE_APP_TO_NET);
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("[Worker] Error reading from named pipe");
+        invalidate_fd(route, TAG_PIPE_APP_TO_NET);
+    }
+}
+
+static void handle_route_event(route_t *route, int tag, uint32_t events) {
+    switch (tag) {
+    case TAG_SOCKET:
+        if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+            route->splice_blocked[DIR_APP_TO_NET] = 0;
+        }
+        if (events & EPOLLOUT) {
+            flush_app_to_net(route);
+        }
+        if (route->fds[TAG_SOCKET] == -1) {
+            break;
+        }
+        if (route->masks[TAG_SOCKET] & EPOLLIN) {
+            if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                read_socket(route); // recv() reports the EOF or error itself
+            }
+        } else if (events & (EPOLLHUP | EPOLLERR)) {
+            invalidate_fd(route, TAG_SOCKET);
+        }
+        break;
+    case TAG_PIPE_APP_TO_NET:
+        read_pipe(route); // Only registered while we can accept data
+        break;
+    case TAG_PIPE_NET_TO_APP:
+        route->splice_blocked[DIR_NET_TO_APP] = 0;
+        flush_net_to_app(route); // EPOLLERR surfaces here as EPIPE
+        break;
+    case TAG_COALESCE_TIMER:
+        drain_wake_fd(route->fds[TAG_COALESCE_TIMER]); // Expiry count, read like an eventfd
+        if (route->listen) {
+            route->listen->accept_blocked = 0; // Try again; a new EMFILE re-arms the timer
+            listen_update_interest(route);
+            break;
+        }
+        route->coalesce_due_ns = 0;
+        flush_app_to_net(route);
+        break;
+    case TAG_SHM_BELL:
+        drain_wake_fd(route->fds[TAG_SHM_BELL]);
+        shm_bell_disarm(&route->shm->forwarder_bell);
+        flush_app_to_net(route); // The connector may have produced data or freed space
+        break;
+    case TAG_LISTEN:
+        listen_accept(route);
+        break;
+    default:
+        if (tag >= TAG_DEMUX) {
+            demux_flush(route, tag - TAG_DEMUX);
+        } else {
+            fanout_event(route, tag, events);
+        }
+        break;
+    }
+    if (route->listen) {
+        listen_resume(route);
+        flush_net_to_app(route); // Connect and close notices
+    }
+    if (route->fanout) {
+        if (route->fanout->pending > 0) {
+            fanout_pump(route); // Room may have opened up in the buffer or a subscriber
+        }
+        fanout_note_gauges(route);
+    }
+    if (route->demux) {
+        demux_pump(route); // Records held back by a full output may fit now
+    }
+    if (route->shm) {
+        metric_set(&route->metrics[DIR_NET_TO_APP].queued, shm_ring_used(&route->shm->net_to_app));
+        metric_set(&route->metrics[DIR_APP_TO_NET].queued, shm_ring_used(&route->shm->app_to_net));
+    } else {
+        metric_set(&route->metrics[DIR_NET_TO_APP].queued, buffer_used(&route->net_to_app));
+        metric_set(&route->metrics[DIR_APP_TO_NET].queued, buffer_used(&route->app_to_net));
+    }
+    update_interest(route);
+}
+
+static void route_init_worker_state(route_t *route) {
+    for (int tag = 0; tag < NUM_TAGS; tag++) {
+        route->handles[tag].route = route;
+        route->handles[tag].tag = tag;
+        route->fds[tag] = -1;
+        route->masks[tag] = 0;
+    }
+    for (int dir = 0; dir < NUM_DIRS; dir++) {
+        route->splicing[dir] = route->opts->use_splice && !(dir == DIR_NET_TO_APP && route->fanout);
+        route->splice_blocked[dir] = 0;
+    }
+}
+
+static void free_route(route_t *route) {
+    if (route->opts->autotune && route->worker) {
+        tune_buffers_release(route);
+    }
+    buffer_free(&route->net_to_app);
+    buffer_free(&route->app_to_net);
+    free(route->replay_hist.base);
+    fanout_free(route->fanout);
+    demux_free(route->demux);
+    if (route->listen) {
+        listen_reap(route);
+        pthread_mutex_destroy(&route->listen->inbox_lock);
+        free(route->listen);
+    }
+    for (int i = 0; i < route->upstream_count; i++) {
+        free(route->upstreams[i].host);
+    }
+    free(route->upstream_spec);
+    free(route->pipe_net_to_app_name);
+    free(route->pipe_app_to_net_name);
+    free(route);
+}
+
+// Close every fd the route holds, adopted or only published, and remove its FIFOs
+static void teardown_route(route_t *route) {
+    for (int tag = 0; tag < NUM_SHARED_TAGS; tag++) {
+        int published = __atomic_load_n(shared_slot(route, tag), __ATOMIC_ACQUIRE);
+        if (route->fds[tag] != -1) {
+            set_interest(route, tag, 0);
+            close(route->fds[tag]);
+        }
+        if (published != -1 && published != route->fds[tag]) {
+            close(published);
+        }
+        route->fds[tag] = -1;
+        __atomic_store_n(shared_slot(route, tag), -1, __ATOMIC_RELEASE);
+    }
+    coalesce_timer_close(route);
+    if (route->fanout) {
+        fanout_close(route);
+    }
+    if (route->listen) {
+        listen_close(route);
+    }
+    if (route->demux) {
+        demux_close(route);
+    }
+    if (route->shm) {
+        shm_route_close(route);
+    } else {
+        unlink(route->pipe_net_to_app_name);
+        unlink(route->pipe_app_to_net_name);
+    }
+    if (route->opts->handoff_path) {
+        if (route->opts->verbose) {
+            printf("[Route %s:%d] Socket handed off %lu time(s).\n", route->address, route->port, route->handoffs);
+        }
+        return;
+    }
+
+    for (int dir = 0; dir < NUM_DIRS && (route->opts->use_splice || route->opts->verbose); dir++) {
+        path_stats_t *ps = &route->paths[dir];
+        printf("[Route %s:%d] %s path: %s (splice: %lu calls, %llu bytes; copy: %lu calls, %llu bytes)\n",
+               route->address, route->port, dir_names[dir],
+               route->opts->use_shm ? "shm" : (route->splicing[dir] ? "splice" : "copy"),
+               ps->splice_calls, ps->splice_bytes, ps->copy_calls, ps->copy_bytes);
+    }
+    if (route->opts->verbose) {
+        dir_buffer_t *bufs[NUM_DIRS] = { &route->net_to_app, &route->app_to_net };
+        for (int dir = 0; dir < NUM_DIRS; dir++) {
+            printf("[Route %s:%d] %s buffer: %zu bytes undelivered, %lu high-water pauses, %llu bytes spilled\n",
+                   route->address, route->port, dir_names[dir], buffer_used(bufs[dir]),
+                   bufs[dir]->pauses, bufs[dir]->spilled_bytes);
+        }
+    }
+}
+
+// Hand a route to (or take it back from) a worker. Only called by the scheduler.
+static void post_worker_cmd(worker_t *worker, route_t *route, int detach) {
+    worker_cmd_t *cmd = malloc(sizeof(*cmd));
+
+    if (cmd == NULL) {
+        error_exit("malloc worker command");
+    }
+    cmd->route = route;
+    cmd->detach = detach;
+    cmd->next = NULL;
+    pthread_mutex_lock(&worker->inbox_lock);
+    if (worker->inbox_tail) {
+        worker->inbox_tail->next = cmd;
+    } else {
+        worker->inbox_head = cmd;
+    }
+    worker->inbox_tail = cmd;
+    pthread_mutex_unlock(&worker->inbox_lock);
+    wake_fd(worker->wake_fd);
+}
+
+static void process_worker_inbox(worker_t *worker) {
+    worker_cmd_t *cmd;
+
+    pthread_mutex_lock(&worker->inbox_lock);
+    cmd = worker->inbox_head;
+    worker->inbox_head = worker->inbox_tail = NULL;
+    pthread_mutex_unlock(&worker->inbox_lock);
+
+    while (cmd) {
+        worker_cmd_t *next = cmd->next;
+        route_t *route = cmd->route;
+
+        if (!cmd->detach) {
+            if (route->opts->handoff_path) {
+                // Handoff routes never carry data through the worker
+            } else if (route->opts->use_shm) {
+                if (shm_route_open(route) == -1) {
+                    fprintf(stderr, "[Route %s:%d] Shared-memory transport unavailable; route is idle.\n", route->address, route->port);
+                }
+            } else if (route->opts->autotune ? tune_buffers_init(route) == -1 :
+                       (buffer_init(&route->net_to_app, route->opts) == -1 ||
+                        buffer_init(&route->app_to_net, route->opts) == -1)) {
+                error_exit("Error allocating route buffers");
+            } else {
+                if (route->opts->coalesce_mode == COALESCE_THROUGHPUT || route->opts->coalesce_mode == COALESCE_ADAPTIVE) {
+                    if (coalesce_timer_open(route) == -1) {
+                        error_exit("Error creating coalescing timer");
+                    }
+                    route->coalescing = route->opts->coalesce_mode == COALESCE_THROUGHPUT;
+                }
+                if (route->opts->replay_size > 0) {
+                    route->replay_hist.base = malloc(route->opts->replay_size);
+                    if (route->replay_hist.base == NULL) {
+                        error_exit("Error allocating replay buffer");
+                    }
+                    route->replay_hist.cap = route->opts->replay_size;
+                }
+                if (route->fanout) {
+                    fanout_open(route);
+                }
+                if (route->listen) {
+                    route->fds[TAG_LISTEN] = route->listen->fd;
+                    set_interest(route, TAG_LISTEN, EPOLLIN);
+                    if (coalesce_timer_open(route) == -1) { // -l never coalesces; the timer retries accepts
+                        error_exit("Error creating accept retry timer");
+                    }
+                }
+                for (int i = 0; route->demux && i < route->demux->count; i++) {
+                    route->fds[TAG_DEMUX + i] = route->demux->fds[i];
+                }
+                if (capture_log) {
+                    char name[512];
+                    snprintf(name, sizeof(name), "%s:%d %s", route->address, route->port, route->pipe_net_to_app_name);
+                    capture_route_name(capture_log, worker->id, route->capture_id, name);
+                }
+            }
+            route->worker_next = worker->routes;
+            worker->routes = route;
+        } else {
+            for (route_t **pp = &worker->routes; *pp; pp = &(*pp)->worker_next) {
+                if (*pp == route) {
+                    *pp = route->worker_next;
+                    break;
+                }
+            }
+            if (route->opts->verbose) {
+                printf("[Worker %d] Detaching route %s:%d.\n", worker->id, route->address, route->port);
+            }
+            // Later events of this batch may still point into the route
+            // (or its -l clients), so it is only freed after the batch
+            teardown_route(route);
+            route->detached = 1;
+            route->worker_next = worker->detached;
+            worker->detached = route;
+        }
+        free(cmd);
+        cmd = next;
+    }
+}
+
+// Thread function for one worker: an epoll loop over every route it owns
+void *worker_thread(void *arg) {
+    worker_t *worker = (worker_t *)arg;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    long long idle_since = now_ns();
+
+    while (running()) {
+        // --low-latency: poll without sleeping until spin_ns has passed with nothing to do
+        int spinning = worker->spin_ns > 0 && now_ns() - idle_since < worker->spin_ns;
+        int n = epoll_wait(worker->epoll_fd, events, MAX_EPOLL_EVENTS, spinning ? 0 : -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("[Worker] epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            fd_handle_t *handle = events[i].data.ptr;
+
+            if (handle == &worker->tune_handle) {
+                drain_wake_fd(worker->tune_fd); // Expiry count, read like an eventfd
+                for (route_t *route = worker->routes; route; route = route->worker_next) {
+                    if (route->net_to_app.mem.base) {
+                        tune_route_tick(route);
+                        update_interest(route); // A resized buffer may take reads again
+                    }
+                }
+            } else if (handle->route == NULL) {
+                drain_wake_fd(worker->wake_fd);
+                process_worker_inbox(worker);
+                // Adopt anything the scheduler published for our routes
+                for (route_t *route = worker->routes; route; route = route->worker_next) {
+                    if (route->listen) {
+                        listen_take_inbox(route);
+                    }
+                    if (__atomic_exchange_n(&route->dirty, 0, __ATOMIC_ACQ_REL)) {
+                        adopt_new_fds(route);
+                        update_interest(route);
+                    }
+                }
+            } else if (handle->route->detached) {
+                // Stale event for a route detached earlier in this batch
+            } else if (handle->tag == TAG_CLIENT) {
+                listen_client_event(handle->route, (listen_client_t *)handle, events[i].events);
+            } else if (handle->route->fds[handle->tag] != -1) {
+                handle_route_event(handle->route, handle->tag, events[i].events);
+            }
+        }
+        for (route_t *route = worker->routes; route; route = route->worker_next) {
+            if (route->listen && route->listen->dead) {
+                listen_reap(route); // Nothing in this batch can refer to them any more
+            }
+        }
+        while (worker->detached) {
+            route_t *route = worker->detached;
+            worker->detached = route->worker_next;
+            free_route(route);
+        }
+        if (n > 0 && worker->spin_ns > 0) {
+            idle_since = now_ns(); // Spin again from the end of this batch
+        }
+    }
+    tune_pool_drain(&worker->pool);
+    return NULL;
+}
+
+static int start_workers(worker_t *workers, int count, const options_t *opts) {
+    for (int i = 0; i < count; i++) {
+        worker_t *worker = &workers[i];
+        struct epoll_event ev;
+
+        memset(worker, 0, sizeof(*worker));
+        worker->id = i;
+        worker->spin_ns = opts->low_latency ? opts->spin_us * 1000LL : 0;
+        pthread_mutex_init(&worker->inbox_lock, NULL);
+        worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (worker->epoll_fd == -1 || worker->wake_fd == -1) {
+            perror("Error creating worker epoll/eventfd");
+            return -1;
+        }
+        worker->wake_handle.route = NULL;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = &worker->wake_handle;
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->wake_fd, &ev) == -1) {
+            perror("Error registering worker eventfd");
+            return -1;
+        }
+        worker->tune_fd = -1;
+        if (opts->autotune) {
+            struct itimerspec its = { { 0, TUNE_TICK_MS * 1000000L }, { 0, TUNE_TICK_MS * 1000000L } };
+
+            worker->tune_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+            worker->tune_handle.route = NULL;
+            ev.data.ptr = &worker->tune_handle;
+            if (worker->tune_fd == -1 || timerfd_settime(worker->tune_fd, 0, &its, NULL) == -1 ||
+                epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->tune_fd, &ev) == -1) {
+                perror("Error creating worker tuning timer");
+                return -1;
+            }
+        }
+        if (pthread_create(&worker->tid, NULL, worker_thread, worker) != 0) {
+            perror("Error creating worker thread");
+            return -1;
+        }
+        if (opts->low_latency) {
+            char name[32];
+            snprintf(name, sizeof(name), "worker %d", i);
+            tune_io_thread(worker->tid, i, opts, name);
+        }
+    }
+    if (opts->verbose) {
+        printf("Started %d worker thread(s).\n", count);
+    }
+    return 0;
+}
+
+static void stop_workers(worker_t *workers, int count) {
+    for (int i = 0; i < count; i++) {
+        wake_fd(workers[i].wake_fd);
+    }
+    for (int i = 0; i < count; i++) {
+        pthread_join(workers[i].tid, NULL);
+        process_worker_inbox(&workers[i]); // Free any commands posted during shutdown
+    }
+}
+
+// Helper to open a FIFO, handling EEXIST and blocking until both sides are open
+int open_fifo_robustly(const char *fifo_name, int flags, int verbose) {
+    int fd = -1;
+    if (mkfifo(fifo_name, 0666) == -1 && errno != EEXIST) {
+        perror("mkfifo");
+        return -1;
+    } else if (verbose && errno == EEXIST) {
+        printf("Named pipe '%s' already exists.\n", fifo_name);
+    }
+
+    int attempts = 0;
+    const int max_attempts_open = 10; // Avoid infinite loop if something is truly wrong
+    while (running() && fd == -1) {
+        if (verbose) {
+            printf("Opening '%s' with flags %d...\n", fifo_name, flags);
+        }
+        fd = open(fifo_name, flags);
+        if (fd == -1) {
+            if (errno == ENXIO) { // No readers/writers yet
+                if (verbose) printf("Waiting for other end of pipe '%s' to open (ENXIO).\n", fifo_name);
+                sleep(1); // Wait a second before retrying
+                attempts++;
+                if (max_attempts_open > 0 && attempts >= max_attempts_open) {
+                    fprintf(stderr, "Max open attempts for pipe '%s' reached. Giving up.\n", fifo_name);
+                    return -1;
+                }
+            } else {
+                perror("open fifo_name");
+                sleep(1); // Other error, wait and retry
+                attempts++;
+                 if (max_attempts_open > 0 && attempts >= max_attempts_open) {
+                    fprintf(stderr, "Max open attempts for pipe '%s' reached. Giving up.\n", fifo_name);
+                    return -1;
+                }
+            }
+        } else {
+            if (verbose) printf("Successfully opened '%s'. FD: %d\n", fifo_name, fd);
+        }
+    }
+    return fd;
+}
+
+
+// Open a FIFO without blocking, creating it if needed. Returns -1 with errno
+// ENXIO when opening for writing and no reader is present yet.
+static int open_fifo_nonblocking(const char *fifo_name, int flags, int verbose) {
+    if (mkfifo(fifo_name, 0666) == -1 && errno != EEXIST) {
+        perror("mkfifo");
+        return -1;
+    }
+    int fd = open(fifo_name, flags | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno != ENXIO) {
+            perror("open fifo_name");
+        } else if (verbose) {
+            printf("Waiting for other end of pipe '%s' to open (ENXIO).\n", fifo_name);
+        }
+    } else if (verbose) {
+        printf("Successfully opened '%s'. FD: %d\n", fifo_name, fd);
+    }
+    return fd;
+}
+
+// --- Route scheduler ---
+// Runs in main() and is the only place fds are opened. It keeps one deadline
+// per route and sleeps on main_wake_fd until the earliest one, or until a
+// worker invalidates an fd, or a signal arrives.
+
+// Dialing: each route connects without blocking the scheduler. The upstream is
+// resolved with getaddrinfo (so hostnames and IPv6 work) and the results are
+// raced happy-eyeballs style (RFC 8305): address families alternate, the first
+// attempt starts at once, and another joins every DIAL_STAGGER_MS, or as soon
+// as one fails, until one connects. When every address of an upstream fails the
+// next upstream in the route's list is dialled at once; once the whole list has
+// failed the dial backs off exponentially with jitter, from a fast first retry.
+
+static void dial_abort(dialer_t *dial) {
+    for (int i = 0; i < dial->addr_count; i++) {
+        if (dial->fds[i] != -1) {
+            close(dial->fds[i]);
+            dial->fds[i] = -1;
+        }
+    }
+    dial->started_ns = 0;
+}
+
+// Resolve one upstream into dial->addrs, alternating address families
+static int dial_resolve(dialer_t *dial, const upstream_t *up) {
+    struct addrinfo hints, *res, *ai;
+    struct addrinfo *by_family[2][DIAL_MAX_ADDRS];
+    int counts[2] = { 0, 0 };
+    char port[16];
+    int rc;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", up->port);
+    rc = getaddrinfo(up->host, port, &hints, &res);
+    if (rc != 0) {
+        fprintf(stderr, "Cannot resolve %s:%d: %s\n", up->host, up->port, gai_strerror(rc));
+        return -1;
+    }
+    // Keep the resolver's order within each family; the first family leads
+    for (ai = res; ai; ai = ai->ai_next) {
+        int group = ai->ai_family != res->ai_family;
+        if (counts[group] < DIAL_MAX_ADDRS && ai->ai_addrlen <= sizeof(struct sockaddr_storage)) {
+            by_family[group][counts[group]++] = ai;
+        }
+    }
+    dial->addr_count = 0;
+    for (int i = 0; dial->addr_count < DIAL_MAX_ADDRS && (i < counts[0] || i < counts[1]); i++) {
+        for (int group = 0; group < 2; group++) {
+            if (i < counts[group] && dial->addr_count < DIAL_MAX_ADDRS) {
+                ai = by_family[group][i];
+                memcpy(&dial->addrs[dial->addr_count], ai->ai_addr, ai->ai_addrlen);
+                dial->addr_lens[dial->addr_count++] = ai->ai_addrlen;
+            }
+        }
+    }
+    freeaddrinfo(res);
+    return dial->addr_count;
+}
+
+static const char *dial_addr_name(dialer_t *dial, int i, char *out, size_t len) {
+    struct sockaddr *sa = (struct sockaddr *)&dial->addrs[i];
+    const void *ip = sa->sa_family == AF_INET6 ? (const void *)&((struct sockaddr_in6 *)sa)->sin6_addr
+                                               : (const void *)&((struct sockaddr_in *)sa)->sin_addr;
+
+    if (inet_ntop(sa->sa_family, ip, out, len) == NULL) {
+        snprintf(out, len, "?");
+    }
+    return out;
+}
+
+// Start connecting to the next untried address. Returns a connected fd in the
+// rare case connect() completes at once, otherwise -1.
+static int dial_start_next(route_t *route, dialer_t *dial) {
+    while (dial->next < dial->addr_count) {
+        int i = dial->next++;
+        struct sockaddr *sa = (struct sockaddr *)&dial->addrs[i];
+        int fd = socket(sa->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        char name[INET6_ADDRSTRLEN];
+
+        if (fd == -1) {
+            perror("ERROR creating socket for reconnection");
+            continue;
+        }
+        if (connect(fd, sa, dial->addr_lens[i]) == 0) {
+            return fd;
+        }
+        if (errno == EINPROGRESS) {
+            dial->fds[i] = fd;
+            return -1;
+        }
+        if (route->opts->verbose) {
+            printf("Connecting to %s port %d failed: %s\n", dial_addr_name(dial, i, name, sizeof(name)),
+                   route->upstreams[dial->upstream].port, strerror(errno));
+        }
+        close(fd);
+    }
+    return -1;
+}
+
+// Delay before retry number 'attempts' (1 = the first retry after a failure)
+static long long reconnect_backoff_ms(int attempts) {
+    long long delay = RECONNECT_FIRST_MS;
+
+    for (int i = 1; i < attempts && delay < RECONNECT_MAX_MS; i++) {
+        delay *= 2;
+    }
+    if (delay > RECONNECT_MAX_MS) {
+        delay = RECONNECT_MAX_MS;
+    }
+    // Equal jitter: somewhere in [delay/2, delay], so routes that dropped together spread out
+    return delay / 2 + random() % (delay / 2 + 1);
+}
+
+// Move on after every address of the current upstream failed
+static void dial_failed(route_t *route, dialer_t *dial, long long now) {
+    const upstream_t *up = &route->upstreams[dial->upstream];
+    long long delay;
+
+    dial_abort(dial);
+    if (!dial->one_upstream && dial->upstream + 1 < route->upstream_count) {
+        dial->upstream++; // Try the next upstream straight away
+        dial->retry_ms = now;
+        if (route->opts->verbose) {
+            printf("Socket connection to %s:%d failed. Trying %s:%d...\n", up->host, up->port,
+                   route->upstreams[dial->upstream].host, route->upstreams[dial->upstream].port);
+        }
+        return;
+    }
+    dial->upstream = dial->one_upstream ? dial->upstream : 0;
+    dial->attempts++;
+    delay = reconnect_backoff_ms(dial->attempts);
+    dial->retry_ms = now + delay;
+    if (route->opts->verbose) {
+        printf("Socket connection to %s:%d failed. Attempting reconnect in %lld ms...\n", up->host, up->port, delay);
+    }
+}
+
+// Drive a dial. Returns a connected socket (non-blocking), or -1 with *due set
+// to when the dial next needs attention; in-flight attempts also wake the
+// scheduler through dial_pollfds().
+static int dial_route(route_t *route, dialer_t *dial, long long now, long long *due) {
+    struct pollfd pfds[DIAL_MAX_ADDRS];
+    int idx[DIAL_MAX_ADDRS];
+    int n = 0, in_flight = 0, fd = -1;
+
+    if (dial->started_ns == 0) {
+        const upstream_t *up = &route->upstreams[dial->upstream];
+        if (now < dial->retry_ms) {
+            *due = dial->retry_ms;
+            return -1;
+        }
+        if (route->opts->verbose) {
+            printf("Attempting to connect to %s:%d (Attempt %d)...\n", up->host, up->port, dial->attempts + 1);
+        }
+        if (dial_resolve(dial, up) <= 0) {
+            dial_failed(route, dial, now);
+            *due = dial->retry_ms;
+            return -1;
+        }
+        for (int i = 0; i < dial->addr_count; i++) {
+            dial->fds[i] = -1;
+        }
+        dial->started_ns = now_ns();
+        dial->next = 0;
+        dial->deadline_ms = now + DIAL_TIMEOUT_MS;
+        dial->next_ms = now + DIAL_STAGGER_MS;
+        fd = dial_start_next(route, dial);
+    }
+
+    for (int i = 0; i < dial->addr_count && fd == -1; i++) {
+        if (dial->fds[i] != -1) {
+            pfds[n].fd = dial->fds[i];
+            pfds[n].events = POLLOUT;
+            idx[n++] = i;
+        }
+    }
+    if (fd == -1 && n > 0 && poll(pfds, n, 0) > 0) {
+        for (int k = 0; k < n && fd == -1; k++) {
+            int err = 0, i = idx[k];
+            socklen_t len = sizeof(err);
+            char name[INET6_ADDRSTRLEN];
+
+            if (pfds[k].revents == 0) {
+                continue;
+            }
+            if (getsockopt(pfds[k].fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+                err = errno;
+            }
+            if (err == 0) {
+                fd = pfds[k].fd;
+                dial->fds[i] = -1; // The winner; the rest are closed below
+                break;
+            }
+            if (route->opts->verbose) {
+                printf("Connecting to %s port %d failed: %s\n", dial_addr_name(dial, i, name, sizeof(name)),
+                       route->upstreams[dial->upstream].port, strerror(err));
+            }
+            close(pfds[k].fd);
+            dial->fds[i] = -1;
+            // Do not wait out the stagger when an attempt has already failed
+            fd = dial_start_next(route, dial);
+            dial->next_ms = now + DIAL_STAGGER_MS;
+        }
+    }
+    if (fd == -1 && now >= dial->next_ms && dial->next < dial->addr_count) {
+        fd = dial_start_next(route, dial);
+        dial->next_ms = now + DIAL_STAGGER_MS;
+    }
+
+    if (fd != -1) {
+        metrics_hist_record(&route->connect_ns, now_ns() - dial->started_ns);
+        dial_abort(dial);
+        dial->attempts = 0;
+        if (route->opts->verbose) {
+            printf("Successfully reconnected to %s:%d.\n", route->upstreams[dial->upstream].host,
+                   route->upstreams[dial->upstream].port);
+        }
+        return fd;
+    }
+    for (int i = 0; i < dial->addr_count; i++) {
+        in_flight += dial->fds[i] != -1;
+    }
+    if (now >= dial->deadline_ms || (in_flight == 0 && dial->next >= dial->addr_count)) {
+        dial_failed(route, dial, now);
+        *due = dial->retry_ms;
+        return -1;
+    }
+    *due = dial->next < dial->addr_count && dial->next_ms < dial->deadline_ms ? dial->next_ms : dial->deadline_ms;
+    return -1;
+}
+
+// Append a dial's in-flight connect attempts to a poll set
+static size_t dial_pollfds(dialer_t *dial, struct pollfd *pfds) {
+    size_t n = 0;
+
+    if (dial->started_ns == 0) {
+        return 0;
+    }
+    for (int i = 0; i < dial->addr_count; i++) {
+        if (dial->fds[i] != -1) {
+            pfds[n].fd = dial->fds[i];
+            pfds[n++].events = POLLOUT;
+        }
+    }
+    return n;
+}
+
+// Standby connections (--standby): the scheduler keeps up to standby_count
+// extra sockets connected, spread over the route's upstreams, and parks them
+// in atomic slots. When the worker loses the active socket it takes a standby
+// straight from a slot (standby_promote), so failover costs no dial at all;
+// the scheduler then replaces it in the background. Parked sockets are
+// watched for POLLRDHUP/POLLHUP/POLLERR, and TCP keepalive catches peers that
+// vanish silently.
+
+// Pick the upstream with the fewest connections, avoiding ones that just failed
+static int standby_pick_upstream(route_t *route) {
+    int uses[MAX_UPSTREAMS] = { 0 };
+    int best = -1;
+
+    if ((route->standby_failed & ((1u << route->upstream_count) - 1)) == ((1u << route->upstream_count) - 1)) {
+        route->standby_failed = 0; // Every upstream failed; start over (the dialer is backing off)
+    }
+    uses[__atomic_load_n(&route->active_upstream, __ATOMIC_RELAXED)]++;
+    for (int i = 0; i < route->opts->standby_count; i++) {
+        if (__atomic_load_n(&route->standby_fds[i], __ATOMIC_ACQUIRE) != -1) {
+            uses[route->standby_upstream[i]]++;
+        }
+    }
+    for (int i = 0; i < route->upstream_count; i++) {
+        if (route->standby_failed & (1u << i)) {
+            uses[i] += MAX_STANDBYS + 1;
+        }
+        if (best == -1 || uses[i] < uses[best]) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+static void standby_keepalive(int fd) {
+    int on = 1, idle = STANDBY_KEEPIDLE_S, interval = STANDBY_KEEPINTVL_S, count = STANDBY_KEEPCNT;
+
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+}
+
+// Scheduler: drop dead standbys and dial replacements. Returns when the
+// standby dial next needs attention, or -1.
+static long long service_standbys(route_t *route, long long now) {
+    int parked = 0, empty = -1;
+    long long due = -1;
+
+    for (int i = 0; i < route->opts->standby_count; i++) {
+        int fd = __atomic_load_n(&route->standby_fds[i], __ATOMIC_ACQUIRE);
+        struct pollfd pfd = { .fd = fd, .events = POLLRDHUP };
+
+        if (fd == -1) {
+            empty = i;
+            continue;
+        }
+        if (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR | POLLNVAL))) {
+            // Only close it if the worker has not just taken it
+            if (__atomic_compare_exchange_n(&route->standby_fds[i], &fd, -1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                if (route->opts->verbose) {
+                    printf("[Route %s:%d] Standby connection to %s:%d lost.\n", route->address, route->port,
+                           route->upstreams[route->standby_upstream[i]].host, route->upstreams[route->standby_upstream[i]].port);
+                }
+                close(fd);
+                metric_add(&route->standby_lost, 1);
+                empty = i;
+                continue;
+            }
+        }
+        parked++;
+    }
+    metric_set(&route->standbys_ready, parked);
+    if (empty == -1) {
+        return -1;
+    }
+    if (route->standby_dial.started_ns == 0) {
+        route->standby_dial.upstream = standby_pick_upstream(route);
+    }
+    int attempts = route->standby_dial.attempts;
+    int fd = dial_route(route, &route->standby_dial, now, &due);
+    if (fd == -1) {
+        if (route->standby_dial.attempts != attempts) {
+            route->standby_failed |= 1u << route->standby_dial.upstream;
+        }
+        return due;
+    }
+    standby_keepalive(fd);
+    route->standby_failed = 0;
+    route->standby_upstream[empty] = route->standby_dial.upstream;
+    __atomic_store_n(&route->standby_fds[empty], fd, __ATOMIC_RELEASE);
+    metric_set(&route->standbys_ready, parked + 1);
+    if (route->opts->verbose) {
+        printf("[Route %s:%d] Standby connection %d/%d ready on %s:%d.\n", route->address, route->port, parked + 1,
+               route->opts->standby_count, route->upstreams[route->standby_upstream[empty]].host,
+               route->upstreams[route->standby_upstream[empty]].port);
+    }
+    return parked + 1 < route->opts->standby_count ? now : -1;
+}
+
+// Parked standbys join the scheduler's poll set so a peer closing one is noticed at once
+static size_t standby_pollfds(route_t *route, struct pollfd *pfds) {
+    size_t n = 0;
+
+    for (int i = 0; i < route->opts->standby_count; i++) {
+        int fd = __atomic_load_n(&route->standby_fds[i], __ATOMIC_ACQUIRE);
+        if (fd != -1) {
+            pfds[n].fd = fd;
+            pfds[n++].events = POLLRDHUP;
+        }
+    }
+    return n + dial_pollfds(&route->standby_dial, pfds + n);
+}
+
+static void standby_close_all(route_t *route) {
+    dial_abort(&route->standby_dial);
+    for (int i = 0; i < route->opts->standby_count; i++) {
+        int fd = __atomic_exchange_n(&route->standby_fds[i], -1, __ATOMIC_ACQ_REL);
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+}
+
+// Count a (re)connection and how long the socket was down
+static void note_connected(route_t *route, uint64_t down_since) {
+    if (route->connected_before) {
+        metric_add(&route->reconnects, 1);
+        if (down_since != 0) {
+            metrics_hist_record(&route->reconnect_ns, now_ns() - down_since);
+        }
+    }
+    route->connected_before = 1;
+}
+
+// Hand a freshly opened fd to the route's worker
+static void publish_fd(route_t *route, int tag, int fd) {
+    uint64_t since = metric_read(&route->down_since_ns[tag]);
+
+    // The worker stored down_since before releasing the slot, and will not
+    // touch it again until it adopts the fd below
+    if (since != 0) {
+        metric_add(&route->down_total_ns[tag], now_ns() - since);
+        metric_set(&route->down_since_ns[tag], 0);
+    }
+    if (tag == TAG_SOCKET) {
+        note_connected(route, since);
+    }
+    __atomic_store_n(shared_slot(route, tag), fd, __ATOMIC_RELEASE);
+    __atomic_store_n(&route->dirty, 1, __ATOMIC_RELEASE);
+    wake_fd(route->worker->wake_fd);
+}
+
+// --- Stats socket (--stats) ---
+// Clients of the --stats socket (or the --handoff control socket) send
+// "STATS [text|prometheus]" and get a snapshot of every route's metrics.
+// The snapshot is read with relaxed loads while the workers keep running.
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} strbuf_t;
+
+static void sb_printf(strbuf_t *sb, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(sb->data + sb->len, sb->cap - sb->len, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            return;
+        }
+        if (sb->len + n < sb->cap) {
+            sb->len += n;
+            return;
+        }
+        size_t cap = sb->cap ? sb->cap * 2 : 4096;
+        while (cap <= sb->len + n) {
+            cap *= 2;
+        }
+        char *data = realloc(sb->data, cap);
+        if (data == NULL) {
+            return; // Serve what we have
+        }
+        sb->data = data;
+        sb->cap = cap;
+    }
+}
+
+static const char *fd_names[NUM_SHARED_TAGS] = { "socket", "app_to_net_fifo", "net_to_app_fifo" };
+static const char *dir_labels[NUM_DIRS] = { "net_to_app", "app_to_net" };
+
+// Whether the route's mode uses the fd in slot 'tag' at all
+static int route_uses_fd(const route_t *route, int tag) {
+    if (route->opts->handoff_path) {
+        return 0;
+    }
+    if (route->listen) { // Every shard writes net->app; only shard 0 reads app->net
+        return tag == TAG_PIPE_NET_TO_APP || (tag == TAG_PIPE_APP_TO_NET && route->listen->index == 0);
+    }
+    return tag == TAG_SOCKET || !route->opts->use_shm;
+}
+
+static double route_down_seconds(route_t *route, int tag, long long now) {
+    uint64_t total = metric_read(&route->down_total_ns[tag]);
+    uint64_t since = metric_read(&route->down_since_ns[tag]);
+
+    if (since != 0 && (long long)since < now) {
+        total += now - since;
+    }
+    return total / 1e9;
+}
+
+static const struct {
+    const char *name;
+    const char *help;
+    size_t offset;
+} dir_counters[] = {
+    { "bytes_in", "Bytes read from the source", offsetof(dir_metrics_t, bytes_in) },
+    { "bytes_out", "Bytes accepted by the sink", offsetof(dir_metrics_t, bytes_out) },
+    { "chunks", "Source reads that returned data", offsetof(dir_metrics_t, chunks) },
+    { "syscalls", "read/write/splice calls", offsetof(dir_metrics_t, syscalls) },
+    { "eagain", "Calls that returned EAGAIN", offsetof(dir_metrics_t, eagain) },
+    { "epipe", "Writes that returned EPIPE", offsetof(dir_metrics_t, epipe) },
+    { "records", "Whole records delivered (--frame)", offsetof(dir_metrics_t, records) },
+    { "oversized", "Records delivered in pieces (--frame)", offsetof(dir_metrics_t, oversized) },
+    { "torn_bytes", "Bytes of partial records dropped (--frame)", offsetof(dir_metrics_t, torn_bytes) },
+    { "sends_now", "Sends made without holding data", offsetof(dir_metrics_t, sends_now) },
+    { "sends_size", "Coalesced sends released by --coalesce-bytes", offsetof(dir_metrics_t, sends_size) },
+    { "sends_timer", "Coalesced sends released by --coalesce-us", offsetof(dir_metrics_t, sends_timer) },
+    { "msg_more", "Sends flagged MSG_MORE", offsetof(dir_metrics_t, msg_more) },
+    { "coalesce_switches", "Adaptive coalescing turned on or off", offsetof(dir_metrics_t, coalesce_switches) },
+    { "replayed", "Unacknowledged bytes resent after a reconnect (--replay)", offsetof(dir_metrics_t, replayed) },
+    { "replay_lost", "Unacknowledged bytes beyond the --replay window", offsetof(dir_metrics_t, replay_lost) },
+    { "tune_grows", "Buffer and FIFO doubled (--autotune)", offsetof(dir_metrics_t, tune_grows) },
+    { "tune_shrinks", "Buffer and FIFO halved (--autotune)", offsetof(dir_metrics_t, tune_shrinks) },
+    { "sockbuf_sets", "SO_RCVBUF/SO_SNDBUF raised (--autotune)", offsetof(dir_metrics_t, sockbuf_sets) },
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+    size_t offset;
+} tune_gauges[] = {
+    { "buffer_bytes", "Buffer size per direction (--autotune)", offsetof(dir_metrics_t, buffer_bytes) },
+    { "pipe_bytes", "Capacity of the direction's FIFO (--autotune)", offsetof(dir_metrics_t, pipe_bytes) },
+    { "socket_buffer_bytes", "SO_RCVBUF (net->app) or SO_SNDBUF (app->net) as the kernel reports it (--autotune)",
+      offsetof(dir_metrics_t, sockbuf_bytes) },
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+    const char *type;
+    size_t offset;
+} fanout_counters[] = {
+    { "subscriber_bytes_total", "Bytes handed to --fanout subscribers", "counter", offsetof(fanout_stats_t, delivered) },
+    { "subscriber_dropped_bytes_total", "Bytes --fanout subscribers missed", "counter", offsetof(fanout_stats_t, dropped) },
+    { "subscriber_disconnects_total", "Subscribers closed for falling behind", "counter", offsetof(fanout_stats_t, disconnects) },
+    { "subscribers", "Open --fanout subscribers", "gauge", offsetof(fanout_stats_t, subscribers) },
+    { "subscriber_lag_bytes", "Bytes queued for the furthest-behind subscriber at its last delivery", "gauge", offsetof(fanout_stats_t, lag) },
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+    const char *type;
+    size_t offset;
+} demux_counters[] = {
+    { "demux_records_total", "Records routed to each --demux output (or left for the route's FIFO)", "counter",
+      offsetof(demux_stats_t, records) },
+    { "demux_bytes_total", "Bytes routed to each --demux output (or left for the route's FIFO)", "counter",
+      offsetof(demux_stats_t, bytes) },
+    { "demux_queued_bytes", "Bytes waiting for each --demux output FIFO", "gauge", offsetof(demux_stats_t, queued) },
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+    const char *type;
+    size_t offset;
+} listen_counters[] = {
+    { "listen_clients", "Connected -l clients", "gauge", offsetof(listen_shard_t, open) },
+    { "listen_accepted_total", "Clients accepted (-l)", "counter", offsetof(listen_shard_t, accepted) },
+    { "listen_closed_total", "Clients gone (-l)", "counter", offsetof(listen_shard_t, closed) },
+    { "listen_overflows_total", "Clients closed for not reading what they were sent (-l)", "counter",
+      offsetof(listen_shard_t, overflows) },
+};
+
+static uint64_t dir_counter(dir_metrics_t *m, size_t offset) {
+    return metric_read((uint64_t *)((char *)m + offset));
+}
+
+static const double stat_quantiles[] = { 0.5, 0.99, 0.999 };
+#define NUM_STAT_QUANTILES (sizeof(stat_quantiles) / sizeof(stat_quantiles[0]))
+
+static void format_stats_text(strbuf_t *sb, route_t *routes, long long now) {
+    if (capture_log) {
+        uint64_t chunks, bytes;
+        capture_dropped(capture_log, &chunks, &bytes);
+        sb_printf(sb, "capture records %llu bytes %llu dropped %llu (%llu bytes) log used %llu of %llu\n",
+                  (unsigned long long)metric_read(&capture_log->records), (unsigned long long)metric_read(&capture_log->bytes),
+                  (unsigned long long)chunks, (unsigned long long)bytes,
+                  (unsigned long long)metric_read(&capture_log->used), (unsigned long long)capture_log->size);
+    }
+    for (route_t *r = routes; r; r = r->next) {
+        sb_printf(sb, "route %s:%d %s reconnects %llu\n", r->address, r->port, r->pipe_net_to_app_name,
+                  (unsigned long long)metric_read(&r->reconnects));
+        if (r->upstream_count > 1 || r->opts->standby_count > 0) {
+            const upstream_t *up = &r->upstreams[__atomic_load_n(&r->active_upstream, __ATOMIC_RELAXED)];
+            sb_printf(sb, "  upstream %s:%d standbys %llu/%d failovers %llu standby_lost %llu; failover us p50 %.1f p99 %.1f max %.1f\n",
+                      up->host, up->port, (unsigned long long)metric_read(&r->standbys_ready), r->opts->standby_count,
+                      (unsigned long long)metric_read(&r->failovers), (unsigned long long)metric_read(&r->standby_lost),
+                      metrics_hist_quantile(&r->failover_ns, 0.5) / 1e3,
+                      metrics_hist_quantile(&r->failover_ns, 0.99) / 1e3,
+                      metric_read(&r->failover_ns.max) / 1e3);
+        }
+        if (metric_read(&r->connect_ns.count) > 0) {
+            sb_printf(sb, "  time to reconnect ms p50 %.1f p99 %.1f max %.1f; connect ms p50 %.1f p99 %.1f max %.1f\n",
+                      metrics_hist_quantile(&r->reconnect_ns, 0.5) / 1e6,
+                      metrics_hist_quantile(&r->reconnect_ns, 0.99) / 1e6,
+                      metric_read(&r->reconnect_ns.max) / 1e6,
+                      metrics_hist_quantile(&r->connect_ns, 0.5) / 1e6,
+                      metrics_hist_quantile(&r->connect_ns, 0.99) / 1e6,
+                      metric_read(&r->connect_ns.max) / 1e6);
+        }
+        if (metric_read(&r->wakeup_ns.count) > 0) {
+            sb_printf(sb, "  wakeup us p50 %.1f p99 %.1f p999 %.1f max %.1f\n",
+                      metrics_hist_quantile(&r->wakeup_ns, 0.5) / 1e3,
+                      metrics_hist_quantile(&r->wakeup_ns, 0.99) / 1e3,
+                      metrics_hist_quantile(&r->wakeup_ns, 0.999) / 1e3,
+                      metric_read(&r->wakeup_ns.max) / 1e3);
+        }
+        for (int tag = 0; tag < NUM_SHARED_TAGS; tag++) {
+            if (route_uses_fd(r, tag)) {
+                sb_printf(sb, "  %s down %.3fs\n", fd_names[tag], route_down_seconds(r, tag, now));
+            }
+        }
+        for (int dir = 0; dir < NUM_DIRS; dir++) {
+            dir_metrics_t *m = &r->metrics[dir];
+            sb_printf(sb, "  %s:", dir_names[dir]);
+            for (size_t i = 0; i < sizeof(dir_counters) / sizeof(dir_counters[0]); i++) {
+                sb_printf(sb, " %s %llu", dir_counters[i].name, (unsigned long long)dir_counter(m, dir_counters[i].offset));
+            }
+            sb_printf(sb, " queued %llu\n", (unsigned long long)metric_read(&m->queued));
+            sb_printf(sb, "    chunk bytes p50 %llu p99 %llu max %llu; latency us p50 %.1f p99 %.1f p999 %.1f max %.1f\n",
+                      (unsigned long long)metrics_hist_quantile(&m->chunk_size, 0.5),
+                      (unsigned long long)metrics_hist_quantile(&m->chunk_size, 0.99),
+                      (unsigned long long)metric_read(&m->chunk_size.max),
+                      metrics_hist_quantile(&m->latency_ns, 0.5) / 1e3,
+                      metrics_hist_quantile(&m->latency_ns, 0.99) / 1e3,
+                      metrics_hist_quantile(&m->latency_ns, 0.999) / 1e3,
+                      metric_read(&m->latency_ns.max) / 1e3);
+            if (r->opts->autotune) {
+                const char *reason = __atomic_load_n(&m->tune_reason, __ATOMIC_RELAXED);
+                sb_printf(sb, "    autotune buffer %llu fifo %llu sockbuf %llu", (unsigned long long)metric_read(&m->buffer_bytes),
+                          (unsigned long long)metric_read(&m->pipe_bytes), (unsigned long long)metric_read(&m->sockbuf_bytes));
+                if (reason) {
+                    sb_printf(sb, "; last change %.1fs ago: %s", (now - (long long)metric_read(&m->tune_ns)) / 1e9, reason);
+                }
+                sb_printf(sb, "\n");
+            }
+        }
+        for (int s = 0; r->fanout && s < r->fanout->spec_count; s++) {
+            fanout_stats_t *st = &r->fanout->stats[s];
+            sb_printf(sb, "  subscriber %s: open %llu delivered %llu dropped %llu disconnects %llu lag %llu\n",
+                      r->fanout->specs[s], (unsigned long long)metric_read(&st->subscribers),
+                      (unsigned long long)metric_read(&st->delivered), (unsigned long long)metric_read(&st->dropped),
+                      (unsigned long long)metric_read(&st->disconnects), (unsigned long long)metric_read(&st->lag));
+        }
+        for (int i = 0; r->demux && i <= r->demux->count; i++) {
+            demux_t *dm = r->demux;
+            demux_stats_t *st = i < dm->count ? &dm->stats[i] : &dm->unmatched;
+            if (i < dm->count) {
+                sb_printf(sb, "  demux '%.*s' -> %s:", (int)dm->rules[i].len, dm->rules[i].value, dm->fifos[i]);
+            } else {
+                sb_printf(sb, "  demux unmatched -> %s:", r->pipe_net_to_app_name);
+            }
+            sb_printf(sb, " records %llu bytes %llu queued %llu\n", (unsigned long long)metric_read(&st->records),
+                      (unsigned long long)metric_read(&st->bytes), (unsigned long long)metric_read(&st->queued));
+        }
+        if (r->listen) {
+            sb_printf(sb, "  listen shard %d: clients %llu accepted %llu closed %llu overflows %llu\n", r->listen->index,
+                      (unsigned long long)metric_read(&r->listen->open), (unsigned long long)metric_read(&r->listen->accepted),
+                      (unsigned long long)metric_read(&r->listen->closed), (unsigned long long)metric_read(&r->listen->overflows));
+        }
+    }
+}
+
+// One summary metric (quantiles, sum, count) for every route and direction
+static void format_prometheus_summary(strbuf_t *sb, route_t *routes, const char *name, const char *help,
+                                      size_t offset, double scale) {
+    sb_printf(sb, "# HELP netpipe_%s %s\n# TYPE netpipe_%s summary\n", name, help, name);
+    for (route_t *r = routes; r; r = r->next) {
+        for (int dir = 0; dir < NUM_DIRS; dir++) {
+            metrics_hist_t *h = (metrics_hist_t *)((char *)&r->metrics[dir] + offset);
+            for (size_t q = 0; q < NUM_STAT_QUANTILES; q++) {
+                sb_printf(sb, "netpipe_%s{route=\"%s:%d\",fifo=\"%s\",dir=\"%s\",quantile=\"%g\"} %g\n", name,
+                          r->address, r->port, r->pipe_net_to_app_name, dir_labels[dir], stat_quantiles[q],
+                          metrics_hist_quantile(h, stat_quantiles[q]) * scale);
+            }
+            sb_printf(sb, "netpipe_%s_sum{route=\"%s:%d\",fifo=\"%s\",dir=\"%s\"} %g\n", name, r->address, r->port,
+                      r->pipe_net_to_app_name, dir_labels[dir], metric_read(&h->sum) * scale);
+            sb_printf(sb, "netpipe_%s_count{route=\"%s:%d\",fifo=\"%s\",dir=\"%s\"} %llu\n", name, r->address, r->port,
+                      r->pipe_net_to_app_name, dir_labels[dir], (unsigned long long)metric_read(&h->count));
+        }
+    }
+}
+
+// Same, for a per-route histogram
+static void format_prometheus_route_summary(strbuf_t *sb, route_t *routes, const char *name, const char *help,
+                                            size_t offset, double scale) {
+    sb_printf(sb, "# HELP netpipe_%s %s\n# TYPE netpipe_%s summary\n", name, help, name);
+    for (route_t *r = routes; r; r = r->next) {
+        metrics_hist_t *h = (metrics_hist_t *)((char *)r + offset);
+        for (size_t q = 0; q < NUM_STAT_QUANTILES; q++) {
+            sb_printf(sb, "netpipe_%s{route=\"%s:%d\",fifo=\"%s\",quantile=\"%g\"} %g\n", name, r->address, r->port,
+                      r->pipe_net_to_app_name, stat_quantiles[q], metrics_hist_quantile(h, stat_quantiles[q]) * scale);
+        }
+        sb_printf(sb, "netpipe_%s_sum{route=\"%s:%d\",fifo=\"%s\"} %g\n", name, r->address, r->port,
+                  r->pipe_net_to_app_name, metric_read(&h->sum) * scale);
+        sb_printf(sb, "netpipe_%s_count{route=\"%s:%d\",fifo=\"%s\"} %llu\n", name, r->address, r->port,
+                  r->pipe_net_to_app_name, (unsigned long long)metric_read(&h->count));
+    }
+}
+
+static void format_stats_prometheus(strbuf_t *sb, route_t *routes, long long now) {
+    for (size_t i = 0; i < sizeof(dir_counters) / sizeof(dir_counters[0]); i++) {
+        sb_printf(sb, "# HELP netpipe_%s_total %s\n# TYPE netpipe_%s_total counter\n",
+                  dir_counters[i].name, dir_counters[i].help, dir_counters[i].name);
+        for (route_t *r = routes; r; r = r->next) {
+            for (int dir = 0; dir < NUM_DIRS; dir++) {
+                sb_printf(sb, "netpipe_%s_total{route=\"%s:%d\",fifo=\"%s\",dir=\"%s\"} %llu\n", dir_counters[i].name,
+                          r->address, r->port, r->pipe_net_to_app_name, dir_labels[dir],
+                          (unsigned long long)dir_counter(&r->metrics[dir], dir_counters[i].offset));
+            }
+        }
+    }
+    sb_printf(sb, "# HELP netpipe_queued_bytes Bytes held between source and sink\n# TYPE netpipe_queued_bytes gauge\n");
+    for (route_t *r = routes; r; r = r->next) {
+        for (int dir = 0; dir < NUM_DIRS; dir++) {
+            sb_printf(sb, "netpipe_queued_bytes{route=\"%s:%d\",fifo=\"%s\",dir=\"%s\"} %llu\n", r->address, r->port,
+                      r->pipe_net_to_app_name, dir_labels[dir], (unsigned long long)metric_read(&r->metrics[dir].queued));
+        }
+    }
+    for (size_t i = 0; i < sizeof(tune_gauges) / sizeof(tune_gauges[0]) && routes && routes->opts->autotune; i++) {
+        sb_printf(sb, "# HELP netpipe_%s %s\n# TYPE netpipe_%s gauge\n", tune_gauges[i].name, tune_gauges[i].help,
+                  tune_gauges[i].name);
+        for (route_t *r = routes; r; r = r->next) {
+            for (int dir = 0; dir < NUM_DIRS; dir++) {
+                sb_printf(sb, "netpipe_%s{route=\"%s:%d\",fifo=\"%s\",dir=\"%s\"} %llu\n", tune_gauges[i].name, r->address,
+                          r->port, r->pipe_net_to_app_name, dir_labels[dir],
+                          (unsigned long long)dir_counter(&r->metrics[dir], tune_gauges[i].offset));
+            }
+        }
+    }
+    sb_printf(sb, "# HELP netpipe_reconnects_total Socket connections after the first\n# TYPE netpipe_reconnects_total counter\n");
+    for (route_t *r = routes; r; r = r->next) {
+        sb_printf(sb, "netpipe_reconnects_total{route=\"%s:%d\",fifo=\"%s\"} %llu\n", r->address, r->port,
+                  r->pipe_net_to_app_name, (unsigned long long)metric_read(&r->reconnects));
+    }
+    sb_printf(sb, "# HELP netpipe_failovers_total Active socket replaced by a standby\n# TYPE netpipe_failovers_total counter\n");
+    for (route_t *r = routes; r; r = r->next) {
+        sb_printf(sb, "netpipe_failovers_total{route=\"%s:%d\",fifo=\"%s\"} %llu\n", r->address, r->port,
+                  r->pipe_net_to_app_name, (unsigned long long)metric_read(&r->failovers));
+    }
+    sb_printf(sb, "# HELP netpipe_standby_sockets Connected standby sockets\n# TYPE netpipe_standby_sockets gauge\n");
+    for (route_t *r = routes; r; r = r->next) {
+        sb_printf(sb, "netpipe_standby_sockets{route=\"%s:%d\",fifo=\"%s\"} %llu\n", r->address, r->port,
+                  r->pipe_net_to_app_name, (unsigned long long)metric_read(&r->standbys_ready));
+    }
+    sb_printf(sb, "# HELP netpipe_active_upstream Upstream the route is connected to (or last dialled)\n# TYPE netpipe_active_upstream gauge\n");
+    for (route_t *r = routes; r; r = r->next) {
+        const upstream_t *up = &r->upstreams[__atomic_load_n(&r->active_upstream, __ATOMIC_RELAXED)];
+        sb_printf(sb, "netpipe_active_upstream{route=\"%s:%d\",fifo=\"%s\",upstream=\"%s:%d\"} 1\n", r->address, r->port,
+                  r->pipe_net_to_app_name, up->host, up->port);
+    }
+    sb_printf(sb, "# HELP netpipe_fd_down_seconds_total Time each fd spent closed\n# TYPE netpipe_fd_down_seconds_total counter\n");
+    for (route_t *r = routes; r; r = r->next) {
+        for (int tag = 0; tag < NUM_SHARED_TAGS; tag++) {
+            if (route_uses_fd(r, tag)) {
+                sb_printf(sb, "netpipe_fd_down_seconds_total{route=\"%s:%d\",fifo=\"%s\",fd=\"%s\"} %.3f\n", r->address,
+                          r->port, r->pipe_net_to_app_name, fd_names[tag], route_down_seconds(r, tag, now));
+            }
+        }
+    }
+    for (size_t i = 0; i < sizeof(fanout_counters) / sizeof(fanout_counters[0]); i++) {
+        sb_printf(sb, "# HELP netpipe_%s %s\n# TYPE netpipe_%s %s\n", fanout_counters[i].name, fanout_counters[i].help,
+                  fanout_counters[i].name, fanout_counters[i].type);
+        for (route_t *r = routes; r; r = r->next) {
+            for (int s = 0; r->fanout && s < r->fanout->spec_count; s++) {
+                sb_printf(sb, "netpipe_%s{route=\"%s:%d\",fifo=\"%s\",subscriber=\"%s\"} %llu\n", fanout_counters[i].name,
+                          r->address, r->port, r->pipe_net_to_app_name, r->fanout->specs[s],
+                          (unsigned long long)metric_read((uint64_t *)((char *)&r->fanout->stats[s] + fanout_counters[i].offset)));
+            }
+        }
+    }
+    for (size_t i = 0; i < sizeof(demux_counters) / sizeof(demux_counters[0]); i++) {
+        sb_printf(sb, "# HELP netpipe_%s %s\n# TYPE netpipe_%s %s\n", demux_counters[i].name, demux_counters[i].help,
+                  demux_counters[i].name, demux_counters[i].type);
+        for (route_t *r = routes; r; r = r->next) {
+            for (int o = 0; r->demux && o <= r->demux->count; o++) {
+                demux_stats_t *st = o < r->demux->count ? &r->demux->stats[o] : &r->demux->unmatched;
+                sb_printf(sb, "netpipe_%s{route=\"%s:%d\",fifo=\"%s\",output=\"%s\"} %llu\n", demux_counters[i].name,
+                          r->address, r->port, r->pipe_net_to_app_name,
+                          o < r->demux->count ? r->demux->fifos[o] : r->pipe_net_to_app_name,
+                          (unsigned long long)metric_read((uint64_t *)((char *)st + demux_counters[i].offset)));
+            }
+        }
+    }
+    for (size_t i = 0; i < sizeof(listen_counters) / sizeof(listen_counters[0]) && routes && routes->listen; i++) {
+        sb_printf(sb, "# HELP netpipe_%s %s\n# TYPE netpipe_%s %s\n", listen_counters[i].name, listen_counters[i].help,
+                  listen_counters[i].name, listen_counters[i].type);
+        for (route_t *r = routes; r; r = r->next) {
+            sb_printf(sb, "netpipe_%s{route=\"%s:%d\",fifo=\"%s\"} %llu\n", listen_counters[i].name, r->address, r->port,
+                      r->pipe_net_to_app_name,
+                      (unsigned long long)metric_read((uint64_t *)((char *)r->listen + listen_counters[i].offset)));
+        }
+    }
+    if (capture_log) {
+        uint64_t chunks, bytes;
+        capture_dropped(capture_log, &chunks, &bytes);
+        sb_printf(sb, "# HELP netpipe_capture_records_total Chunks written to the --capture log\n# TYPE netpipe_capture_records_total counter\n");
+        sb_printf(sb, "netpipe_capture_records_total %llu\n", (unsigned long long)metric_read(&capture_log->records));
+        sb_printf(sb, "# HELP netpipe_capture_bytes_total Payload bytes written to the --capture log\n# TYPE netpipe_capture_bytes_total counter\n");
+        sb_printf(sb, "netpipe_capture_bytes_total %llu\n", (unsigned long long)metric_read(&capture_log->bytes));
+        sb_printf(sb, "# HELP netpipe_capture_dropped_total Chunks lost to a full capture queue or log\n# TYPE netpipe_capture_dropped_total counter\n");
+        sb_printf(sb, "netpipe_capture_dropped_total %llu\n", (unsigned long long)chunks);
+        sb_printf(sb, "# HELP netpipe_capture_dropped_bytes_total Payload bytes of the dropped chunks\n# TYPE netpipe_capture_dropped_bytes_total counter\n");
+        sb_printf(sb, "netpipe_capture_dropped_bytes_total %llu\n", (unsigned long long)bytes);
+    }
+    format_prometheus_summary(sb, routes, "chunk_bytes", "Bytes per source read",
+                              offsetof(dir_metrics_t, chunk_size), 1.0);
+    format_prometheus_summary(sb, routes, "forward_latency_seconds", "Source read to sink write",
+                              offsetof(dir_metrics_t, latency_ns), 1e-9);
+    format_prometheus_route_summary(sb, routes, "reconnect_seconds", "Socket lost to connected again",
+                                    offsetof(route_t, reconnect_ns), 1e-9);
+    format_prometheus_route_summary(sb, routes, "connect_seconds", "Start of a dial to connected",
+                                    offsetof(route_t, connect_ns), 1e-9);
+    format_prometheus_route_summary(sb, routes, "failover_seconds", "Active socket lost to standby adopted",
+                                    offsetof(route_t, failover_ns), 1e-9);
+    format_prometheus_route_summary(sb, routes, "wakeup_latency_seconds", "Socket data arrived to read by its worker",
+                                    offsetof(route_t, wakeup_ns), 1e-9);
+}
+
+// Append a full snapshot to a client's reply. The scheduler sends it as the
+// client reads (flush_control_client), so a client that does not read costs
+// the scheduler nothing but the buffer.
+static void queue_stats(strbuf_t *out, route_t *routes, int prometheus) {
+    if (prometheus) {
+        format_stats_prometheus(out, routes, now_ns());
+    } else {
+        format_stats_text(out, routes, now_ns());
+    }
+}
+
+// --- Socket handoff (--handoff) ---
+// Clients connect to a Unix-domain control socket and ask for a route's live
+// TCP fd, which is passed with SCM_RIGHTS. The forwarder then closes its own
+// copy and stays out of the data path; the client holds a lease on the route
+// until it disconnects. When the client reports the socket dead, the
+// scheduler reconnects and passes a fresh fd on the same control connection.
+//
+// Protocol, one line per request:
+//   GET [address:port]   lease a route (default: the first route)
+//   DEAD                 the leased socket failed; send a new one
+// Replies are "OK address:port\n" carrying the fd, or "ERR reason\n".
+
+typedef struct control_client {
+    int fd;
+    char buf[256];
+    size_t len;
+    route_t *lease;             // Route this client holds or is waiting for
+    int waiting;                // Asked for a socket we have not passed yet
+    int stats_only;             // Connected to the --stats socket: one STATS request, then closed
+    int done;                   // Close once 'out' has been sent
+    strbuf_t out;               // Reply not sent yet; the client is not read until it has all gone
+    size_t out_off;
+    struct control_client *next;
+} control_client_t;
+
+static control_client_t *control_clients = NULL; // Scheduler-only list
+
+static int open_control_socket(const char *path) {
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd == -1) {
+        perror("socket (control)");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Control socket path '%s' is too long.\n", path);
+        close(fd);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 16) == -1) {
+        perror("bind/listen (control)");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Listening TCP socket for one listen shard. Every shard binds the same port
+// with SO_REUSEPORT and the kernel spreads new connections across them.
+// Dual-stack where IPv6 is available, IPv4 otherwise.
+static int open_listen_socket(int port) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int one = 1, zero = 0;
+    int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    if (fd != -1) {
+        struct sockaddr_in6 *a6 = (struct sockaddr_in6 *)&addr;
+        a6->sin6_family = AF_INET6;
+        a6->sin6_addr = in6addr_any;
+        a6->sin6_port = htons(port);
+        addr_len = sizeof(*a6);
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    } else {
+        struct sockaddr_in *a4 = (struct sockaddr_in *)&addr;
+        a4->sin_family = AF_INET;
+        a4->sin_addr.s_addr = htonl(INADDR_ANY);
+        a4->sin_port = htons(port);
+        addr_len = sizeof(*a4);
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    }
+    if (fd == -1) {
+        perror("socket (listen)");
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1 ||
+        bind(fd, (struct sockaddr *)&addr, addr_len) == -1 || listen(fd, SOMAXCONN) == -1) {
+        perror("bind/listen (listen)");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Send a reply line, optionally carrying 'pass_fd'
+static int control_reply(int client_fd, const char *line, int pass_fd) {
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctrl;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (void *)line;
+    iov.iov_len = strlen(line);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (pass_fd != -1) {
+        struct cmsghdr *cmsg;
+        memset(&ctrl, 0, sizeof(ctrl));
+        msg.msg_control = ctrl.buf;
+        msg.msg_controllen = sizeof(ctrl.buf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+    }
+    if (sendmsg(client_fd, &msg, MSG_NOSIGNAL) == -1) {
+        perror("sendmsg (control)");
+        return -1;
+    }
+    return 0;
+}
+
+// Pass the route's connected socket to its waiting lease holder, if both exist
+static void handoff_try_pass(route_t *route) {
+    control_client_t *client = route->lease_holder;
+    char line[300];
+
+    if (client == NULL || !client->waiting || route->handoff_fd == -1) {
+        return;
+    }
+    snprintf(line, sizeof(line), "OK %s:%d\n", route->address, route->port);
+    if (control_reply(client->fd, line, route->handoff_fd) == 0) {
+        client->waiting = 0;
+        route->handoffs++;
+        if (route->opts->verbose) {
+            printf("[Route %s:%d] Handed socket to control client (handoff %lu).\n", route->address, route->port, route->handoffs);
+        }
+        // The client owns the connection now; our copy would keep it alive after they close it
+        close(route->handoff_fd);
+        route->handoff_fd = -1;
+    }
+}
+
+// Forget every lease on a route that is going away
+static void handoff_release_route(route_t *route) {
+    for (control_client_t *c = control_clients; c; c = c->next) {
+        if (c->lease == route) {
+            if (c->waiting) {
+                control_reply(c->fd, "ERR route removed\n", -1);
+            }
+            c->lease = NULL;
+            c->waiting = 0;
+        }
+    }
+    route->lease_holder = NULL;
+    if (route->handoff_fd != -1) {
+        close(route->handoff_fd);
+        route->handoff_fd = -1;
+    }
+}
+
+// Keep an idle route pre-connected, and reconnect when the holder reports it dead
+static long long service_handoff_route(route_t *route, long long now) {
+    int needs_socket = route->lease_holder == NULL || route->lease_holder->waiting;
+
+    if (route->handoff_fd == -1 && needs_socket) {
+        long long due = -1;
+        if (now < route->dial.retry_ms) {
+            return route->dial.retry_ms;
+        }
+        route->handoff_fd = dial_route(route, &route->dial, now, &due);
+        if (route->handoff_fd == -1) {
+            return due;
+        }
+        __atomic_store_n(&route->active_upstream, route->dial.upstream, __ATOMIC_RELAXED);
+        route->dial.upstream = 0;
+        // Clients expect an ordinary blocking socket
+        fcntl(route->handoff_fd, F_SETFL, fcntl(route->handoff_fd, F_GETFL, 0) & ~O_NONBLOCK);
+        note_connected(route, route->socket_lost_ns);
+        route->socket_lost_ns = 0;
+    }
+    handoff_try_pass(route);
+    return -1;
+}
+
+static void handle_control_line(control_client_t *client, char *line, route_t *routes) {
+    if (strncmp(line, "STATS", 5) == 0 && (line[5] == '\0' || line[5] == ' ')) {
+        const char *format = line[5] == ' ' ? line + 6 : "text";
+        if (strcmp(format, "text") != 0 && strcmp(format, "prometheus") != 0) {
+            control_reply(client->fd, "ERR unknown format\n", -1);
+        } else {
+            queue_stats(&client->out, routes, strcmp(format, "prometheus") == 0);
+        }
+        if (client->stats_only) {
+            client->done = 1;
+        }
+    } else if (client->stats_only) {
+        control_reply(client->fd, "ERR only STATS is served here\n", -1);
+        client->done = 1;
+    } else if (strncmp(line, "GET", 3) == 0 && (line[3] == '\0' || line[3] == ' ')) {
+        const char *want = line[3] == ' ' ? line + 4 : NULL;
+        route_t *route = NULL;
+
+        if (client->lease) {
+            control_reply(client->fd, "ERR already holding a route\n", -1);
+            return;
+        }
+        for (route_t *r = routes; r; r = r->next) {
+            char key[300];
+            snprintf(key, sizeof(key), "%s:%d", r->address, r->port);
+            if (want == NULL || strcmp(want, key) == 0) {
+                route = r;
+                break;
+            }
+        }
+        if (route == NULL) {
+            control_reply(client->fd, "ERR no such route\n", -1);
+        } else if (route->lease_holder) {
+            control_reply(client->fd, "ERR route busy\n", -1);
+        } else {
+            route->lease_holder = client;
+            client->lease = route;
+            client->waiting = 1;
+            handoff_try_pass(route); // Otherwise passed once the scheduler connects
+        }
+    } else if (strcmp(line, "DEAD") == 0) {
+        route_t *route = client->lease;
+        if (route == NULL) {
+            control_reply(client->fd, "ERR no route held\n", -1);
+            return;
+        }
+        if (route->opts->verbose) {
+            printf("[Route %s:%d] Control client reports socket dead. Reconnecting.\n", route->address, route->port);
+        }
+        client->waiting = 1;
+        route->socket_lost_ns = now_ns();
+        route->dial.retry_ms = 0; // Reconnect at once on the next pass
+    } else {
+        control_reply(client->fd, "ERR unknown request\n", -1);
+    }
+}
+
+// Send what is queued for a client without blocking. Returns -1 if it has gone away.
+static int flush_control_client(control_client_t *client) {
+    while (client->out_off < client->out.len) {
+        ssize_t n = send(client->fd, client->out.data + client->out_off, client->out.len - client->out_off,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n == -1) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        }
+        client->out_off += n;
+    }
+    free(client->out.data);
+    memset(&client->out, 0, sizeof(client->out));
+    client->out_off = 0;
+    return 0;
+}
+
+static void close_control_client(control_client_t *client) {
+    for (control_client_t **pp = &control_clients; *pp; pp = &(*pp)->next) {
+        if (*pp == client) {
+            *pp = client->next;
+            break;
+        }
+    }
+    if (client->lease) {
+        // Their copy of the socket died with them; pre-connect for the next client
+        client->lease->lease_holder = NULL;
+        client->lease->dial.retry_ms = 0;
+    }
+    close(client->fd);
+    free(client->out.data);
+    free(client);
+}
+
+static void accept_control_clients(int control_fd, int stats_only) {
+    int fd;
+
+    while ((fd = accept4(control_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+        control_client_t *client = calloc(1, sizeof(*client));
+        if (client == NULL) {
+            close(fd);
+            continue;
+        }
+        client->fd = fd;
+        client->stats_only = stats_only;
+        client->next = control_clients;
+        control_clients = client;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("accept (control)");
+    }
+}
+
+// Read requests from a control client. Returns -1 once it has gone away.
+static int read_control_client(control_client_t *client, route_t *routes) {
+    ssize_t n = read(client->fd, client->buf + client->len, sizeof(client->buf) - 1 - client->len);
+    char *start, *nl;
+
+    if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+        return -1;
+    }
+    if (n > 0) {
+        client->len += n;
+    }
+    client->buf[client->len] = '\0';
+    start = client->buf;
+    while ((nl = strchr(start, '\n')) != NULL) {
+        *nl = '\0';
+        if (nl > start && nl[-1] == '\r') {
+            nl[-1] = '\0';
+        }
+        handle_control_line(client, start, routes);
+        start = nl + 1;
+        if (client->done) {
+            break;
+        }
+    }
+    // Most replies fit in the socket buffer and go at once; the rest wait for POLLOUT
+    if (flush_control_client(client) == -1 || (client->done && client->out.len == 0)) {
+        return -1;
+    }
+    client->len -= start - client->buf;
+    memmove(client->buf, start, client->len);
+    if (client->len == sizeof(client->buf) - 1) {
+        return -1; // Line too long
+    }
+    return 0;
+}
+
+static void close_all_control_clients(void) {
+    while (control_clients) {
+        close_control_client(control_clients);
+    }
+}
+
+// Reopen whatever the route is missing. Returns the time at which it next
+// needs attention, or -1 if it is fully connected.
+static long long service_route(route_t *route, long long now) {
+    int verbose = route->opts->verbose;
+    long long due = -1;
+
+    if (route->opts->handoff_path) {
+        return service_handoff_route(route, now);
+    }
+
+    if (route_uses_fd(route, TAG_SOCKET) && __atomic_load_n(&route->socket_fd, __ATOMIC_ACQUIRE) == -1) {
+        // A standby parked after the worker last looked beats any dial
+        int fd = standby_take(route);
+        if (fd != -1) {
+            dial_abort(&route->dial);
+            if (verbose) {
+                printf("[Route %s:%d] Using standby connection.\n", route->address, route->port);
+            }
+        } else if (now >= route->dial.retry_ms) {
+            if (MAX_RECONNECT_ATTEMPTS > 0 && route->dial.attempts >= MAX_RECONNECT_ATTEMPTS) {
+                fprintf(stderr, "Maximum socket reconnect attempts (%d) reached for %s:%d. Exiting.\n", MAX_RECONNECT_ATTEMPTS, route->address, route->port);
+                stop_running();
+                return -1;
+            }
+            fd = dial_route(route, &route->dial, now, &due);
+            if (fd != -1) {
+                __atomic_store_n(&route->active_upstream, route->dial.upstream, __ATOMIC_RELAXED);
+                route->dial.upstream = 0; // Next time, start again from the preferred upstream
+            }
+        } else {
+            due = route->dial.retry_ms;
+        }
+        if (fd != -1) {
+            publish_fd(route, TAG_SOCKET, fd);
+            due = -1;
+        }
+    }
+    if (route->opts->standby_count > 0 && __atomic_load_n(&route->socket_fd, __ATOMIC_ACQUIRE) != -1) {
+        long long standby_due = service_standbys(route, now);
+        if (standby_due != -1 && (due == -1 || standby_due < due)) {
+            due = standby_due;
+        }
+    }
+
+    if (route->opts->use_shm) {
+        return due; // No FIFOs; the worker owns the shared-memory segment
+    }
+    int want_app_to_net = route_uses_fd(route, TAG_PIPE_APP_TO_NET);
+    if (__atomic_load_n(&route->pipe_net_to_app_fd, __ATOMIC_ACQUIRE) == -1 ||
+        (want_app_to_net && __atomic_load_n(&route->pipe_app_to_net_fd, __ATOMIC_ACQUIRE) == -1)) {
+        if (now >= route->next_pipe_attempt_ms) {
+            // Pipe: Network to Application (Forwarder writes, external client reads)
+            if (__atomic_load_n(&route->pipe_net_to_app_fd, __ATOMIC_ACQUIRE) == -1) {
+                int fd = open_fifo_nonblocking(route->pipe_net_to_app_name, O_WRONLY, verbose);
+                if (fd != -1) {
+                    publish_fd(route, TAG_PIPE_NET_TO_APP, fd);
+                }
+            }
+            // Pipe: Application to Network (External client writes, forwarder reads)
+            if (want_app_to_net && __atomic_load_n(&route->pipe_app_to_net_fd, __ATOMIC_ACQUIRE) == -1) {
+                int fd = open_fifo_nonblocking(route->pipe_app_to_net_name, O_RDONLY, verbose);
+                if (fd != -1) {
+                    publish_fd(route, TAG_PIPE_APP_TO_NET, fd);
+                }
+            }
+            route->next_pipe_attempt_ms = now + FIFO_RETRY_MS;
+        }
+        if (__atomic_load_n(&route->pipe_net_to_app_fd, __ATOMIC_ACQUIRE) == -1 ||
+            (want_app_to_net && __atomic_load_n(&route->pipe_app_to_net_fd, __ATOMIC_ACQUIRE) == -1)) {
+            if (due == -1 || route->next_pipe_attempt_ms < due) {
+                due = route->next_pipe_attempt_ms;
+            }
+        }
+    }
+    return due;
+}
+
+// Parse "host[:port][,host[:port]...]" into the route's upstream list. IPv6
+// addresses with a port are written [addr]:port; entries without a port use
+// 'port'. Returns -1 if the list is malformed.
+static int parse_upstreams(route_t *route, const char *spec, int port) {
+    char *copy = strdup(spec), *save = NULL;
+    int bad = 0;
+
+    if (copy == NULL) {
+        error_exit("strdup route");
+    }
+    for (char *entry = strtok_r(copy, ",", &save); entry; entry = strtok_r(NULL, ",", &save)) {
+        char *host = entry, *colon;
+        int entry_port = port;
+
+        if (route->upstream_count == MAX_UPSTREAMS) {
+            fprintf(stderr, "Error: At most %d upstreams per route.\n", MAX_UPSTREAMS);
+            free(copy);
+            return -1;
+        }
+        if (*host == '[') {
+            char *close_bracket = strchr(host, ']');
+            if (close_bracket == NULL || (close_bracket[1] != '\0' && close_bracket[1] != ':')) {
+                bad = 1;
+                break;
+            }
+            *close_bracket = '\0';
+            colon = close_bracket[1] == ':' ? close_bracket + 1 : NULL;
+            host++;
+        } else {
+            colon = strchr(host, ':');
+            if (colon && strchr(colon + 1, ':')) {
+                colon = NULL; // Bare IPv6 address
+            }
+        }
+        if (colon) {
+            *colon = '\0';
+            entry_port = atoi(colon + 1);
+        }
+        if (*host == '\0' || entry_port <= 0 || entry_port > 65535) {
+            bad = 1;
+            break;
+        }
+        route->upstreams[route->upstream_count].host = strdup(host);
+        route->upstreams[route->upstream_count++].port = entry_port;
+    }
+    free(copy);
+    if (bad || route->upstream_count == 0) {
+        fprintf(stderr, "Error: Invalid upstream list '%s'.\n", spec);
+        return -1;
+    }
+    return 0;
+}
+
+// Routes are only created by the scheduler thread
+static uint16_t next_capture_id;
+
+static route_t *new_route(const char *address, int port, const char *net_to_app, const char *app_to_net,
+                          int from_config, const options_t *opts) {
+    route_t *route = calloc(1, sizeof(*route));
+
+    if (route == NULL) {
+        error_exit("calloc route");
+    }
+    route->upstream_spec = strdup(address);
+    route->pipe_net_to_app_name = strdup(net_to_app);
+    route->pipe_app_to_net_name = strdup(app_to_net);
+    if (!route->upstream_spec || !route->pipe_net_to_app_name || !route->pipe_app_to_net_name) {
+        error_exit("strdup route");
+    }
+    route->from_config = from_config;
+    route->opts = opts;
+    route->capture_id = next_capture_id++;
+    if (!from_config && opts->fanout_spec && (route->fanout = fanout_new(opts->fanout_spec)) == NULL) {
+        free_route(route);
+        return NULL;
+    }
+    if (!from_config && opts->demux_count > 0 && (route->demux = demux_new(opts)) == NULL) {
+        free_route(route);
+        return NULL;
+    }
+    route_init_worker_state(route);
+    if (parse_upstreams(route, address, port) == -1) {
+        free_route(route);
+        return NULL;
+    }
+    route->address = route->upstreams[0].host; // The preferred upstream names the route
+    route->port = route->upstreams[0].port;
+    route->socket_fd = route->pipe_app_to_net_fd = route->pipe_net_to_app_fd = -1;
+    route->handoff_fd = -1;
+    for (int i = 0; i < MAX_STANDBYS; i++) {
+        route->standby_fds[i] = -1;
+    }
+    route->standby_dial.one_upstream = 1;
+    for (int tag = 0; tag < NUM_SHARED_TAGS; tag++) {
+        route->down_since_ns[tag] = now_ns();
+    }
+    return route;
+}
+
+static int same_route(const route_t *a, const route_t *b) {
+    return a->upstreams[0].port == b->upstreams[0].port && strcmp(a->upstream_spec, b->upstream_spec) == 0 &&
+           strcmp(a->pipe_net_to_app_name, b->pipe_net_to_app_name) == 0 &&
+           strcmp(a->pipe_app_to_net_name, b->pipe_app_to_net_name) == 0;
+}
+
+// Nonzero if 'route' would share a FIFO with any route in 'list'
+static int fifo_in_use(const route_t *list, const route_t *route) {
+    for (const route_t *r = list; r; r = r->next) {
+        if (strcmp(r->pipe_net_to_app_name, route->pipe_net_to_app_name) == 0 ||
+            strcmp(r->pipe_app_to_net_name, route->pipe_app_to_net_name) == 0 ||
+            strcmp(r->pipe_net_to_app_name, route->pipe_app_to_net_name) == 0 ||
+            strcmp(r->pipe_app_to_net_name, route->pipe_net_to_app_name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Parse the route config file into an unattached list. Returns 0 on success.
+static int load_route_file(const char *path, const options_t *opts, route_t **out) {
+    FILE *fp = fopen(path, "r");
+    char line[1024];
+    int line_no = 0;
+    route_t *head = NULL, **tail = &head;
+
+    if (fp == NULL) {
+        perror("Error opening route config");
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        char address[256], net_to_app[512], app_to_net[512];
+        int port;
+        char *p = line;
+
+        line_no++;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '#' || *p == '\n' || *p == '\0') {
+            continue;
+        }
+        if (sscanf(p, "%255s %d %511s %511s", address, &port, net_to_app, app_to_net) != 4 ||
+            port <= 0 || port > 65535) {
+            fprintf(stderr, "%s:%d: expected '<address> <port> <net_to_app_fifo> <app_to_net_fifo>'. Line ignored.\n", path, line_no);
+            continue;
+        }
+        route_t *route = new_route(address, port, net_to_app, app_to_net, 1, opts);
+        if (route == NULL) {
+            fprintf(stderr, "%s:%d: Line ignored.\n", path, line_no);
+            continue;
+        }
+        if (fifo_in_use(head, route)) {
+            fprintf(stderr, "%s:%d: FIFO already used by another route. Line ignored.\n", path, line_no);
+            free_route(route);
+            continue;
+        }
+        *tail = route;
+        tail = &route->next;
+    }
+    fclose(fp);
+    *out = head;
+    return 0;
+}
+
+// Give a route to the least loaded worker and add it to the schedule
+static void attach_route(route_t **routes, route_t *route, worker_t *workers, int worker_count) {
+    worker_t *target = &workers[0];
+
+    for (int i = 1; i < worker_count; i++) {
+        if (workers[i].route_count < target->route_count) {
+            target = &workers[i];
+        }
+    }
+    route->worker = target;
+    target->route_count++;
+    route->next = *routes;
+    *routes = route;
+    post_worker_cmd(target, route, 0);
+    if (route->opts->verbose && route->opts->handoff_path) {
+        printf("Route %s:%d will be handed off through '%s'.\n", route->address, route->port, route->opts->handoff_path);
+    } else if (route->opts->verbose) {
+        printf("Route %s:%d <-> '%s'/'%s' assigned to worker %d.\n", route->address, route->port,
+               route->pipe_net_to_app_name, route->pipe_app_to_net_name, target->id);
+    }
+}
+
+// Apply a changed config: keep identical routes untouched, detach removed
+// ones and attach new ones.
+static void reload_routes(const char *path, const options_t *opts, route_t **routes,
+                          worker_t *workers, int worker_count) {
+    route_t *loaded = NULL;
+
+    if (load_route_file(path, opts, &loaded) == -1) {
+        fprintf(stderr, "Route config reload failed; keeping current routes.\n");
+        return;
+    }
+    for (route_t *r = *routes; r; r = r->next) {
+        r->seen = !r->from_config; // -h/-p routes are never reloaded
+    }
+
+    // Split the loaded list into routes we already run and genuinely new ones
+    route_t *fresh = NULL;
+    while (loaded) {
+        route_t *cand = loaded, *match = NULL;
+        loaded = loaded->next;
+        for (route_t *r = *routes; r; r = r->next) {
+            if (r->from_config && same_route(r, cand)) {
+                match = r;
+                break;
+            }
+        }
+        if (match) {
+            match->seen = 1;
+            free_route(cand);
+        } else {
+            cand->next = fresh;
+            fresh = cand;
+        }
+    }
+    // Detach config routes that are no longer listed
+    for (route_t **pp = routes; *pp;) {
+        route_t *r = *pp;
+        if (!r->seen) {
+            *pp = r->next;
+            r->worker->route_count--;
+            printf("Removing route %s:%d.\n", r->address, r->port);
+            dial_abort(&r->dial);
+            standby_close_all(r);
+            handoff_release_route(r);
+            post_worker_cmd(r->worker, r, 1);
+        } else {
+            pp = &r->next;
+        }
+    }
+
+    // Attach the new ones, refusing any that would share a FIFO with a survivor
+    while (fresh) {
+        route_t *route = fresh;
+        fresh = fresh->next;
+        route->next = NULL;
+        if (fifo_in_use(*routes, route)) {
+            fprintf(stderr, "Route %s:%d uses a FIFO owned by another route. Not added.\n", route->address, route->port);
+            free_route(route);
+            continue;
+        }
+        printf("Adding route %s:%d.\n", route->address, route->port);
+        attach_route(routes, route, workers, worker_count);
+    }
+}
+
+// Main loop for connection management (sockets and pipes) of every route
+static void run_route_scheduler(route_t **routes, const char *config_path, const options_t *opts,
+                                worker_t *workers, int worker_count, int control_fd, int stats_fd) {
+    struct pollfd *pfds = NULL;
+    size_t pfds_cap = 0;
+
+    while (running()) {
+        if (reload_requested) {
+            reload_requested = 0;
+            if (config_path) {
+                printf("SIGHUP received. Reloading routes from '%s'.\n", config_path);
+                reload_routes(config_path, opts, routes, workers, worker_count);
+            }
+        }
+
+        long long now = now_ms();
+        long long due = -1;
+        for (route_t *route = *routes; route && running(); route = route->next) {
+            long long route_due = service_route(route, now);
+            if (route_due != -1 && (due == -1 || route_due < due)) {
+                due = route_due;
+            }
+        }
+        if (!running()) {
+            break;
+        }
+
+        // Sleep until the earliest deadline, a worker invalidates an fd, a
+        // control client speaks, a connect attempt completes, or a signal
+        size_t nfds = 3;
+        for (control_client_t *c = control_clients; c; c = c->next) {
+            nfds++;
+        }
+        for (route_t *route = *routes; route; route = route->next) {
+            nfds += (route->dial.started_ns ? route->dial.addr_count : 0) + route->opts->standby_count +
+                    (route->standby_dial.started_ns ? route->standby_dial.addr_count : 0);
+        }
+        if (nfds > pfds_cap) {
+            pfds_cap = nfds * 2;
+            pfds = realloc(pfds, pfds_cap * sizeof(*pfds));
+            if (pfds == NULL) {
+                error_exit("realloc pollfds");
+            }
+        }
+        pfds[0].fd = main_wake_fd;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = control_fd; // -1 (ignored by poll) unless --handoff
+        pfds[1].events = POLLIN;
+        pfds[2].fd = stats_fd;   // -1 unless --stats
+        pfds[2].events = POLLIN;
+        nfds = 3;
+        for (control_client_t *c = control_clients; c; c = c->next) {
+            pfds[nfds].fd = c->fd;
+            pfds[nfds++].events = c->out.len ? POLLOUT : POLLIN; // One reply in flight at a time
+        }
+        size_t client_end = nfds;
+        for (route_t *route = *routes; route; route = route->next) {
+            // Serviced by the next pass
+            nfds += dial_pollfds(&route->dial, pfds + nfds);
+            nfds += standby_pollfds(route, pfds + nfds);
+        }
+
+        int timeout = -1;
+        if (due != -1) {
+            long long delta = due - now_ms();
+            timeout = delta < 0 ? 0 : (delta > 60000 ? 60000 : (int)delta);
+        }
+        if (poll(pfds, nfds, timeout) <= 0) {
+            continue;
+        }
+        if (pfds[0].revents & POLLIN) {
+            drain_wake_fd(main_wake_fd);
+        }
+        // Clients are matched by fd since the list may change while we walk it
+        for (size_t i = 3; i < client_end; i++) {
+            if (pfds[i].revents == 0) {
+                continue;
+            }
+            for (control_client_t *c = control_clients; c; c = c->next) {
+                if (c->fd == pfds[i].fd) {
+                    int gone = 0;
+                    if (c->out.len && flush_control_client(c) == -1) {
+                        gone = 1;
+                    } else if (c->out.len == 0) {
+                        // Also picks up lines that arrived while a reply was going out
+                        gone = c->done || read_control_client(c, *routes) == -1;
+                    }
+                    if (gone) {
+                        close_control_client(c);
+                    }
+                    break;
+                }
+            }
+        }
+        if (pfds[1].revents & POLLIN) {
+            accept_control_clients(control_fd, 0);
+        }
+        if (pfds[2].revents & POLLIN) {
+            accept_control_clients(stats_fd, 1);
+        }
+    }
+    free(pfds);
+}
+
+// Legacy engine: one route, two polling threads, blocking reconnects in this loop
+static void run_threaded_forwarder(char *address, int port, const options_t *opts) {
+    int verbose = opts->verbose;
+    int socket_fd = -1; // Initialize to -1 to indicate no connection
+    int live_socket = -1; // Last socket published, open until neither thread uses it after it fails
+    int pipe_app_to_net_fd = -1; // From app (external) to network (read by forwarder)
+    int pipe_net_to_app_fd = -1; // From network to app (written by forwarder)
+    struct sockaddr_in serv_addr;
+    pthread_t tid1, tid2;
+    thread_data_t thread_data;
+    int reconnect_socket_attempts = 0;
+
+    // Prepare thread data - pass pointers to main's FDs
+    thread_data.socket_fd_ptr = &socket_fd;
+    thread_data.socket_in_use[0] = thread_data.socket_in_use[1] = -1;
+    thread_data.pipe_app_to_net_fd_ptr = &pipe_app_to_net_fd;
+    thread_data.pipe_net_to_app_fd_ptr = &pipe_net_to_app_fd;
+    thread_data.verbose = verbose;
+    thread_data.spin_ns = opts->low_latency ? opts->spin_us * 1000LL : 0;
+
+    // Create threads (they will continuously check the FD pointers)
+    if (verbose) {
+        printf("Creating communication threads...\n");
+    }
+    if (pthread_create(&tid1, NULL, socket_to_pipe_thread, (void *)&thread_data) != 0) {
+        error_exit("Error creating socket_to_pipe_thread");
+    }
+    if (pthread_create(&tid2, NULL, pipe_to_socket_thread, (void *)&thread_data) != 0) {
+        error_exit("Error creating pipe_to_socket_thread");
+    }
+    if (opts->low_latency) {
+        tune_io_thread(tid1, 0, opts, "socket->pipe thread");
+        tune_io_thread(tid2, 1, opts, "pipe->socket thread");
+    }
+
+    // Main loop for connection management (socket and pipes)
+    while (running()) {
+        // --- Manage Socket Connection ---
+        if (__atomic_load_n(&socket_fd, __ATOMIC_SEQ_CST) == -1) {
+            if (live_socket != -1) {
+                if (__atomic_load_n(&thread_data.socket_in_use[0], __ATOMIC_SEQ_CST) == live_socket ||
+                    __atomic_load_n(&thread_data.socket_in_use[1], __ATOMIC_SEQ_CST) == live_socket) {
+                    usleep(1000); // A thread is still returning from a call on it (it was shut down)
+                    continue;
+                }
+                close(live_socket);
+                live_socket = -1;
+            }
+            if (reconnect_socket_attempts > 0) {
+                if (verbose) {
+                    printf("Socket connection lost. Attempting reconnect in %d seconds...\n", RECONNECT_DELAY_SECONDS);
+                }
+                sleep(RECONNECT_DELAY_SECONDS);
+            }
+
+            if (!running()) break;
+
+            if (MAX_RECONNECT_ATTEMPTS > 0 && reconnect_socket_attempts >= MAX_RECONNECT_ATTEMPTS) {
+                fprintf(stderr, "Maximum socket reconnect attempts (%d) reached. Exiting.\n", MAX_RECONNECT_ATTEMPTS);
+                stop_running();
+                break;
+            }
+
+            if (verbose) {
+                printf("Attempting to connect to %s:%d (Attempt %d)...\n", address, port, reconnect_socket_attempts + 1);
+            }
+
+            // Build the connection on a local fd and publish it only once connected
+            int new_fd = socket(AF_INET, SOCK_STREAM, 0);
+            if (new_fd < 0) {
+                perror("ERROR creating socket for reconnection");
+                reconnect_socket_attempts++;
+                continue;
+            }
+
+            memset(&serv_addr, 0, sizeof(serv_addr));
+            serv_addr.sin_family = AF_INET;
+            serv_addr.sin_port = htons(port);
+            if (inet_pton(AF_INET, address, &serv_addr.sin_addr) <= 0) {
+                close(new_fd);
+                fprintf(stderr, "Invalid address/ Address not supported for reconnection.\n");
+                reconnect_socket_attempts++;
+                continue;
+            }
+
+            if (connect(new_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+                perror("ERROR connecting");
+                close(new_fd);
+                reconnect_socket_attempts++;
+                continue;
+            }
+
+            if (opts->low_latency) {
+                tune_socket_latency(new_fd, opts);
+            }
+            live_socket = new_fd;
+            __atomic_store_n(&socket_fd, new_fd, __ATOMIC_SEQ_CST);
+            if (verbose) {
+                printf("Successfully reconnected to %s:%d.\n", address, port);
+            }
+            reconnect_socket_attempts = 0;
+        }
+
+        // --- Manage Pipe Connections ---
+        // Pipe: Network to Application (Forwarder writes, external client reads)
+        if (__atomic_load_n(&pipe_net_to_app_fd, __ATOMIC_ACQUIRE) == -1) {
+            int new_fd = open_fifo_robustly(PIPE_NET_TO_APP_NAME, O_WRONLY, verbose);
+            if (new_fd == -1) {
+                fprintf(stderr, "Failed to open FIFO for network to application (%s). Retrying...\n", PIPE_NET_TO_APP_NAME);
+                usleep(500000); // Wait before next retry
+                continue; // Loop again immediately to try both pipe and socket if needed
+            }
+            __atomic_store_n(&pipe_net_to_app_fd, new_fd, __ATOMIC_RELEASE);
+        }
+
+        // Pipe: Application to Network (External client writes, forwarder reads)
+        if (__atomic_load_n(&pipe_app_to_net_fd, __ATOMIC_ACQUIRE) == -1) {
+            int new_fd = open_fifo_robustly(PIPE_APP_TO_NET_NAME, O_RDONLY, verbose);
+            if (new_fd == -1) {
+                fprintf(stderr, "Failed to open FIFO for application to network (%s). Retrying...\n", PIPE_APP_TO_NET_NAME);
                 usleep(500000); // Wait before next retry
                 continue; // Loop again immediately to try both pipe and socket if needed
             }
+            __atomic_store_n(&pipe_app_to_net_fd, new_fd, __ATOMIC_RELEASE);
+        }
+
+        // If both socket and pipes are valid, main thread sleeps briefly
+        if (__atomic_load_n(&socket_fd, __ATOMIC_ACQUIRE) != -1 &&
+            __atomic_load_n(&pipe_app_to_net_fd, __ATOMIC_ACQUIRE) != -1 &&
+            __atomic_load_n(&pipe_net_to_app_fd, __ATOMIC_ACQUIRE) != -1) {
+            usleep(500000); // 500 ms to avoid busy-waiting
+        } else {
+             usleep(100000); // Shorter sleep if still waiting for connections
+        }
+    }
+
+    // Signal threads to stop and wait for them
+    stop_running(); // Ensure threads see the stop signal
+    if (verbose) {
+        printf("Main thread: Signalling threads to stop and waiting...\n");
+    }
+    if (live_socket != -1) {
+        shutdown(live_socket, SHUT_RDWR); // Wakes a thread blocked in recv() on an idle connection
+    }
+    pthread_join(tid1, NULL);
+    pthread_join(tid2, NULL);
+
+    // Cleanup
+    if (verbose) {
+        printf("Main thread: Cleaning up resources...\n");
+    }
+    if (live_socket != -1) {
+        close(live_socket);
+    }
+    if (pipe_app_to_net_fd != -1) {
+        close(pipe_app_to_net_fd);
+    }
+    if (pipe_net_to_app_fd != -1) {
+        close(pipe_net_to_app_fd);
+    }
+
+    // Unlink named pipes
+    unlink(PIPE_NET_TO_APP_NAME);
+    unlink(PIPE_APP_TO_NET_NAME);
+}
+
+// --- io_uring engine ---
+// One route served by one thread through one io_uring (--uring). The socket
+// and both FIFOs live in the ring's fixed-file table and both directions'
+// buffers are registered with the kernel, so a busy stream costs one
+// io_uring_enter per batch of completions instead of a syscall per read and
+// write:
+//  - net->app: a single multishot recv fills buffers the kernel takes from a
+//    provided buffer ring; each filled buffer is written to the FIFO and then
+//    handed back to the ring.
+//  - app->net: the FIFO is read into one registered chunk at a time and the
+//    filled chunks are written to the socket.
+// Writes to one fd go out as a linked chain so they land in order. A short
+// write breaks the chain, and whatever it did not write is resubmitted with the
+// next batch. A dial is a connect linked to a timeout. Data that cannot be
+// written (socket down, no FIFO reader) stays queued in its chunk until the fd
+// is back, and reading stops once every chunk is in use.
+
+// One direction's chunks and the queue of filled ones, oldest first
+typedef struct {
+    char *base;              // count * URING_CHUNK_SIZE bytes, registered buffer 'dir'
+    unsigned count;          // Power of two
+    uint32_t *len;           // Bytes held in each chunk...
+    uint32_t *off;           // ...and how many of them are already written
+    uint16_t *queue;         // Filled chunk ids awaiting their write
+    unsigned head, tail;     // Free-running queue positions
+    unsigned in_flight;      // Writes of the current chain not yet completed
+} uring_dir_t;
+
+typedef struct {
+    const options_t *opts;
+    uring_t ring;
+    uring_buf_ring_t recv_bufs; // The net->app chunks, while the kernel owns them
+    uring_dir_t dirs[2];
+    uint16_t *free_chunks;   // app->net chunks not holding data
+    unsigned free_count;
+    int fds[URING_NUM_SLOTS];     // Plain fds behind the fixed-file slots (-1 = closed)
+    int closing[URING_NUM_SLOTS]; // Closed once the ops still using the slot complete
+    int socket_state;        // URING_SOCKET_*
+    int recv_armed;
+    int multishot;           // Cleared if the kernel rejects multishot recv
+    int read_armed;          // FIFO read (and its poll) in flight
+    int reader_fresh;        // FIFO just opened: wait for a writer before reading
+    upstream_t upstream;
+    dialer_t dial;
+    struct __kernel_timespec dial_timeout;
+    long long pipe_retry_ms;
+} uring_route_t;
+
+static uint64_t uring_user_data(int op, unsigned id) {
+    return ((uint64_t)op << 32) | id;
+}
+
+static int uring_dir_init(uring_dir_t *dir, unsigned count) {
+    memset(dir, 0, sizeof(*dir));
+    dir->count = count;
+    dir->base = mmap(NULL, (size_t)count * URING_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    dir->len = calloc(count, sizeof(*dir->len));
+    dir->off = calloc(count, sizeof(*dir->off));
+    dir->queue = calloc(count, sizeof(*dir->queue));
+    if (dir->base == MAP_FAILED) {
+        dir->base = NULL;
+    }
+    return dir->base && dir->len && dir->off && dir->queue ? 0 : -1;
+}
+
+static void uring_dir_free(uring_dir_t *dir) {
+    if (dir->base) {
+        munmap(dir->base, (size_t)dir->count * URING_CHUNK_SIZE);
+    }
+    free(dir->len);
+    free(dir->off);
+    free(dir->queue);
+}
+
+static char *uring_chunk(uring_dir_t *dir, unsigned id) {
+    return dir->base + (size_t)id * URING_CHUNK_SIZE;
+}
+
+static void uring_queue_push(uring_dir_t *dir, unsigned id, uint32_t len) {
+    dir->len[id] = len;
+    dir->off[id] = 0;
+    dir->queue[dir->tail++ & (dir->count - 1)] = id;
+}
+
+static void uring_give_recv_buffer(uring_route_t *u, unsigned id) {
+    uring_buf_ring_add(&u->recv_bufs, uring_chunk(&u->dirs[DIR_NET_TO_APP], id), URING_CHUNK_SIZE, id);
+    uring_buf_ring_advance(&u->recv_bufs);
+}
+
+// Point a fixed-file slot at a freshly opened fd
+static int uring_install(uring_route_t *u, int slot, int fd) {
+    if (uring_set_file(&u->ring, slot, fd) == -1) {
+        perror("io_uring: updating fixed file");
+        close(fd);
+        return -1;
+    }
+    u->fds[slot] = fd;
+    u->closing[slot] = 0;
+    return 0;
+}
+
+// Release a slot once nothing in flight refers to it any more
+static void uring_close_if_idle(uring_route_t *u, int slot, long long now) {
+    int busy;
+
+    if (!u->closing[slot] || u->fds[slot] == -1) {
+        return;
+    }
+    if (slot == URING_SLOT_SOCKET) {
+        busy = u->recv_armed || u->dirs[DIR_APP_TO_NET].in_flight > 0;
+    } else if (slot == URING_SLOT_NET_TO_APP) {
+        busy = u->dirs[DIR_NET_TO_APP].in_flight > 0;
+    } else {
+        busy = u->read_armed;
+    }
+    if (busy) {
+        return;
+    }
+    uring_set_file(&u->ring, slot, -1);
+    close(u->fds[slot]);
+    u->fds[slot] = -1;
+    u->closing[slot] = 0;
+    if (slot == URING_SLOT_SOCKET) {
+        u->socket_state = URING_SOCKET_DOWN;
+        u->dial.retry_ms = now; // The first redial is immediate; failures back off
+    } else if (slot == URING_SLOT_NET_TO_APP) {
+        u->pipe_retry_ms = now + FIFO_RETRY_MS;
+    }
+}
+
+// Start closing a slot. Shutting the socket down completes its pending recv
+// and writes at once; queued data stays in its chunks for the next connection.
+static void uring_fd_lost(uring_route_t *u, int slot, long long now) {
+    if (u->fds[slot] == -1 || u->closing[slot]) {
+        return;
+    }
+    if (slot == URING_SLOT_SOCKET) {
+        if (u->opts->verbose) {
+            printf("[uring] Socket connection to %s:%d lost.\n", u->upstream.host, u->upstream.port);
+        }
+        shutdown(u->fds[slot], SHUT_RDWR);
+    }
+    u->closing[slot] = 1;
+    uring_close_if_idle(u, slot, now);
+}
+
+// Queue one linked chain of writes of 'dir's filled chunks to 'slot', unless a
+// chain is still in flight. Bounded by the free SQ slots, never split.
+static void uring_flush_dir(uring_route_t *u, int dir_index, int slot) {
+    uring_dir_t *dir = &u->dirs[dir_index];
+    unsigned queued = dir->tail - dir->head;
+    unsigned space = uring_sq_space(&u->ring);
+    unsigned n = queued < space ? queued : space;
+
+    if (dir->in_flight > 0 || n == 0 || u->fds[slot] == -1 || u->closing[slot] ||
+        (slot == URING_SLOT_SOCKET && u->socket_state != URING_SOCKET_UP)) {
+        return;
+    }
+    for (unsigned i = 0; i < n; i++) {
+        unsigned id = dir->queue[(dir->head + i) & (dir->count - 1)];
+        struct io_uring_sqe *sqe = uring_get_sqe(&u->ring);
+
+        uring_prep_rw(sqe, IORING_OP_WRITE_FIXED, slot, uring_chunk(dir, id) + dir->off[id],
+                      dir->len[id] - dir->off[id], uring_user_data(URING_OP_WRITE + dir_index, id));
+        sqe->buf_index = dir_index;
+        if (i + 1 < n) {
+            sqe->flags |= IOSQE_IO_LINK;
+        }
+    }
+    dir->in_flight = n;
+}
+
+static void uring_write_done(uring_route_t *u, int dir_index, unsigned id, int res, long long now) {
+    uring_dir_t *dir = &u->dirs[dir_index];
+    int slot = dir_index == DIR_NET_TO_APP ? URING_SLOT_NET_TO_APP : URING_SLOT_SOCKET;
+
+    dir->in_flight--;
+    if (res > 0) {
+        dir->off[id] += res;
+        if (dir->off[id] == dir->len[id]) {
+            dir->head++; // Chains complete in order, so this was the oldest chunk
+            if (dir_index == DIR_NET_TO_APP) {
+                uring_give_recv_buffer(u, id);
+            } else {
+                u->free_chunks[u->free_count++] = id;
+            }
+        }
+        // A short write cancels the rest of its chain; they are resent next batch
+    } else if (res != -ECANCELED) {
+        if (u->opts->verbose || (res != -EPIPE && res != -ECONNRESET)) {
+            fprintf(stderr, "[uring] Write to %s failed: %s\n",
+                    slot == URING_SLOT_SOCKET ? "socket" : "named pipe", strerror(-res));
+        }
+        uring_fd_lost(u, slot, now);
+    }
+    uring_close_if_idle(u, slot, now);
+}
+
+static void uring_arm_recv(uring_route_t *u) {
+    uring_dir_t *dir = &u->dirs[DIR_NET_TO_APP];
+    struct io_uring_sqe *sqe;
+
+    if (u->recv_armed || u->socket_state != URING_SOCKET_UP || u->closing[URING_SLOT_SOCKET] ||
+        dir->tail - dir->head == dir->count) { // Every buffer is waiting for the FIFO
+        return;
+    }
+    sqe = uring_get_sqe(&u->ring);
+    if (sqe == NULL) {
+        return;
+    }
+    uring_prep_rw(sqe, IORING_OP_RECV, URING_SLOT_SOCKET, NULL, u->multishot ? 0 : URING_CHUNK_SIZE,
+                  uring_user_data(URING_OP_RECV, 0));
+    sqe->off = 0;
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->ioprio = u->multishot ? IORING_RECV_MULTISHOT : 0;
+    u->recv_armed = 1;
+}
+
+static void uring_recv_done(uring_route_t *u, int res, unsigned flags, long long now) {
+    if (res > 0) {
+        unsigned id = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (u->opts->verbose) {
+            printf("[uring] Received %d bytes from socket. Writing to named pipe.\n", res);
+        }
+        uring_queue_push(&u->dirs[DIR_NET_TO_APP], id, res);
+    }
+    if (!(flags & IORING_CQE_F_MORE)) {
+        u->recv_armed = 0; // Re-armed next batch, once a buffer is free if that was the problem
+    }
+    if (res == -EINVAL && u->multishot) {
+        u->multishot = 0; // Before 6.0: one recv per buffer
+        if (u->opts->verbose) {
+            printf("[uring] Multishot recv unsupported; using single-shot recv.\n");
+        }
+    } else if (res == 0 || (res < 0 && res != -ENOBUFS && res != -ECANCELED)) {
+        if (res < 0 && (u->opts->verbose || res != -ECONNRESET)) {
+            fprintf(stderr, "[uring] Error receiving from socket: %s\n", strerror(-res));
+        }
+        uring_fd_lost(u, URING_SLOT_SOCKET, now);
+    }
+    uring_close_if_idle(u, URING_SLOT_SOCKET, now);
+}
+
+// Read the FIFO into a free chunk. Right after opening, the read is linked
+// behind a poll: a FIFO that has never had a writer reads as EOF at once, but
+// polls as idle until one shows up.
+static void uring_arm_read(uring_route_t *u) {
+    struct io_uring_sqe *sqe;
+    unsigned id;
+
+    if (u->read_armed || u->fds[URING_SLOT_APP_TO_NET] == -1 || u->closing[URING_SLOT_APP_TO_NET] ||
+        u->free_count == 0 || uring_sq_space(&u->ring) < 2) {
+        return;
+    }
+    if (u->reader_fresh) {
+        sqe = uring_get_sqe(&u->ring);
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = URING_SLOT_APP_TO_NET;
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = uring_user_data(URING_OP_POLL, 0);
+    }
+    id = u->free_chunks[--u->free_count];
+    sqe = uring_get_sqe(&u->ring);
+    uring_prep_rw(sqe, IORING_OP_READ_FIXED, URING_SLOT_APP_TO_NET, uring_chunk(&u->dirs[DIR_APP_TO_NET], id),
+                  URING_CHUNK_SIZE, uring_user_data(URING_OP_READ, id));
+    sqe->buf_index = DIR_APP_TO_NET;
+    u->read_armed = 1;
+}
+
+static void uring_read_done(uring_route_t *u, unsigned id, int res, long long now) {
+    u->read_armed = 0;
+    if (res > 0) {
+        if (u->opts->verbose) {
+            printf("[uring] Read %d bytes from named pipe. Writing to socket.\n", res);
+        }
+        u->reader_fresh = 0;
+        uring_queue_push(&u->dirs[DIR_APP_TO_NET], id, res);
+        return;
+    }
+    u->free_chunks[u->free_count++] = id;
+    if (res == 0) {
+        if (u->opts->verbose) {
+            printf("[uring] Named pipe '%s' writer closed (EOF). Reopening.\n", PIPE_APP_TO_NET_NAME);
+        }
+        u->pipe_retry_ms = now; // The fresh poll waits for the next writer
+    } else {
+        fprintf(stderr, "[uring] Error reading from named pipe: %s\n", strerror(-res));
+        u->pipe_retry_ms = now + FIFO_RETRY_MS;
+    }
+    uring_fd_lost(u, URING_SLOT_APP_TO_NET, now);
+}
+
+// Open whichever FIFOs are missing. Both are opened non-blocking, so a missing
+// reader fails fast, then switched to blocking for the ring.
+static void uring_open_pipes(uring_route_t *u, long long now) {
+    int fd;
+
+    if (now < u->pipe_retry_ms) {
+        return;
+    }
+    if (u->fds[URING_SLOT_NET_TO_APP] == -1) {
+        fd = open_fifo_nonblocking(PIPE_NET_TO_APP_NAME, O_WRONLY, u->opts->verbose);
+        if (fd != -1 && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) != -1) {
+            uring_install(u, URING_SLOT_NET_TO_APP, fd);
+        } else if (fd != -1) {
+            close(fd);
+        }
+    }
+    if (u->fds[URING_SLOT_APP_TO_NET] == -1) {
+        fd = open_fifo_nonblocking(PIPE_APP_TO_NET_NAME, O_RDONLY, u->opts->verbose);
+        if (fd != -1 && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) != -1 &&
+            uring_install(u, URING_SLOT_APP_TO_NET, fd) == 0) {
+            u->reader_fresh = 1;
+        } else if (fd != -1) {
+            close(fd);
+        }
+    }
+    if (u->fds[URING_SLOT_NET_TO_APP] == -1 || u->fds[URING_SLOT_APP_TO_NET] == -1) {
+        u->pipe_retry_ms = now + FIFO_RETRY_MS;
+    }
+}
+
+// Back off after every address of the upstream failed
+static void uring_dial_failed(uring_route_t *u, long long now) {
+    long long delay;
+
+    u->dial.addr_count = 0;
+    u->dial.attempts++;
+    delay = reconnect_backoff_ms(u->dial.attempts);
+    u->dial.retry_ms = now + delay;
+    if (u->opts->verbose) {
+        printf("[uring] Socket connection to %s:%d failed. Attempting reconnect in %lld ms...\n",
+               u->upstream.host, u->upstream.port, delay);
+    }
+}
+
+// Submit a connect to the next resolved address, linked to a timeout that
+// cancels it. Addresses are tried one at a time, splitting DIAL_TIMEOUT_MS.
+static void uring_dial(uring_route_t *u, long long now) {
+    struct io_uring_sqe *sqe;
+    struct sockaddr *sa;
+    long long timeout_ms;
+    int fd;
+
+    if (u->socket_state != URING_SOCKET_DOWN || now < u->dial.retry_ms || uring_sq_space(&u->ring) < 2) {
+        return;
+    }
+    if (u->dial.addr_count == 0) {
+        if (MAX_RECONNECT_ATTEMPTS > 0 && u->dial.attempts >= MAX_RECONNECT_ATTEMPTS) {
+            fprintf(stderr, "Maximum socket reconnect attempts (%d) reached. Exiting.\n", MAX_RECONNECT_ATTEMPTS);
+            stop_running();
+            return;
+        }
+        if (u->opts->verbose) {
+            printf("Attempting to connect to %s:%d (Attempt %d)...\n", u->upstream.host, u->upstream.port,
+                   u->dial.attempts + 1);
+        }
+        if (dial_resolve(&u->dial, &u->upstream) <= 0) {
+            uring_dial_failed(u, now);
+            return;
+        }
+        u->dial.next = 0;
+    }
+    if (u->dial.next >= u->dial.addr_count) {
+        uring_dial_failed(u, now);
+        return;
+    }
+    sa = (struct sockaddr *)&u->dial.addrs[u->dial.next];
+    fd = socket(sa->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || uring_install(u, URING_SLOT_SOCKET, fd) == -1) {
+        if (fd == -1) {
+            perror("ERROR creating socket for reconnection");
+        }
+        u->dial.next++;
+        return;
+    }
+    timeout_ms = DIAL_TIMEOUT_MS / u->dial.addr_count;
+    u->dial_timeout.tv_sec = timeout_ms / 1000;
+    u->dial_timeout.tv_nsec = (timeout_ms % 1000) * 1000000;
+
+    sqe = uring_get_sqe(&u->ring);
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = URING_SLOT_SOCKET;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    sqe->addr = (uint64_t)(uintptr_t)sa;
+    sqe->off = u->dial.addr_lens[u->dial.next];
+    sqe->user_data = uring_user_data(URING_OP_CONNECT, 0);
+    sqe = uring_get_sqe(&u->ring);
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&u->dial_timeout;
+    sqe->len = 1;
+    sqe->user_data = uring_user_data(URING_OP_TIMEOUT, 0);
+    u->socket_state = URING_SOCKET_CONNECTING;
+}
+
+static void uring_connect_done(uring_route_t *u, int res, long long now) {
+    char name[INET6_ADDRSTRLEN];
+    int i = u->dial.next++;
+
+    if (res == 0) {
+        u->socket_state = URING_SOCKET_UP;
+        u->dial.addr_count = 0;
+        u->dial.attempts = 0;
+        if (u->opts->coalesce_mode == COALESCE_LATENCY) {
+            int one = 1;
+            setsockopt(u->fds[URING_SLOT_SOCKET], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        if (u->opts->verbose) {
+            printf("Successfully reconnected to %s:%d.\n", u->upstream.host, u->upstream.port);
+        }
+        return;
+    }
+    if (u->opts->verbose) {
+        printf("Connecting to %s port %d failed: %s\n", dial_addr_name(&u->dial, i, name, sizeof(name)),
+               u->upstream.port, strerror(res == -ECANCELED ? ETIMEDOUT : -res));
+    }
+    uring_set_file(&u->ring, URING_SLOT_SOCKET, -1);
+    close(u->fds[URING_SLOT_SOCKET]);
+    u->fds[URING_SLOT_SOCKET] = -1;
+    u->socket_state = URING_SOCKET_DOWN;
+    if (u->dial.next >= u->dial.addr_count) {
+        uring_dial_failed(u, now);
+    }
+}
+
+static int uring_route_init(uring_route_t *u, char *address, int port, const options_t *opts) {
+    static const int ops[] = { IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_RECV, IORING_OP_CONNECT,
+                               IORING_OP_LINK_TIMEOUT, IORING_OP_POLL_ADD };
+    unsigned count = 2;
+    struct iovec regions[2];
+
+    memset(u, 0, sizeof(*u));
+    u->ring.fd = -1;
+    u->opts = opts;
+    u->multishot = 1;
+    u->upstream.host = address;
+    u->upstream.port = port;
+    for (int i = 0; i < URING_NUM_SLOTS; i++) {
+        u->fds[i] = -1;
+    }
+    while (count * 2 <= URING_MAX_CHUNKS && count * 2 * URING_CHUNK_SIZE <= opts->ring_size) {
+        count *= 2;
+    }
+    if (uring_init(&u->ring, opts->queue_depth, opts->queue_depth * 4) == -1) {
+        return -1;
+    }
+    if (!uring_probe_ops(&u->ring, ops, sizeof(ops) / sizeof(ops[0]))) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    if (uring_dir_init(&u->dirs[DIR_NET_TO_APP], count) == -1 || uring_dir_init(&u->dirs[DIR_APP_TO_NET], count) == -1 ||
+        (u->free_chunks = calloc(count, sizeof(*u->free_chunks))) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (unsigned id = 0; id < count; id++) {
+        u->free_chunks[u->free_count++] = id;
+    }
+    // Registered buffer index == direction
+    regions[DIR_NET_TO_APP].iov_base = u->dirs[DIR_NET_TO_APP].base;
+    regions[DIR_APP_TO_NET].iov_base = u->dirs[DIR_APP_TO_NET].base;
+    regions[0].iov_len = regions[1].iov_len = (size_t)count * URING_CHUNK_SIZE;
+    if (uring_register(&u->ring, IORING_REGISTER_BUFFERS, regions, 2) != 0 ||
+        uring_register_files(&u->ring, URING_NUM_SLOTS) != 0 ||
+        uring_buf_ring_setup(&u->ring, &u->recv_bufs, count, URING_BUF_GROUP) == -1) {
+        return -1;
+    }
+    for (unsigned id = 0; id < count; id++) {
+        uring_buf_ring_add(&u->recv_bufs, uring_chunk(&u->dirs[DIR_NET_TO_APP], id), URING_CHUNK_SIZE, id);
+    }
+    uring_buf_ring_advance(&u->recv_bufs);
+    return 0;
+}
+
+static void uring_route_free(uring_route_t *u) {
+    uring_exit(&u->ring); // Cancels whatever is still in flight
+    uring_buf_ring_free(&u->recv_bufs);
+    for (int i = 0; i < URING_NUM_SLOTS; i++) {
+        if (u->fds[i] != -1) {
+            close(u->fds[i]);
+        }
+    }
+    uring_dir_free(&u->dirs[DIR_NET_TO_APP]);
+    uring_dir_free(&u->dirs[DIR_APP_TO_NET]);
+    free(u->free_chunks);
+}
+
+// Run the -h/-p route on io_uring until stopped. Returns -1, having touched
+// nothing, if this kernel cannot run the engine; the caller falls back to epoll.
+static int run_uring_forwarder(char *address, int port, const options_t *opts) {
+    uring_route_t u;
+    sigset_t wait_mask;
+
+    if (uring_route_init(&u, address, port, opts) == -1) {
+        fprintf(stderr, "io_uring engine unavailable (%s). Falling back to the epoll engine.\n", strerror(errno));
+        uring_route_free(&u);
+        return -1;
+    }
+    if (opts->verbose) {
+        printf("io_uring engine: queue depth %u, %u x %d KB buffers per direction.\n", u.ring.sq_entries,
+               u.dirs[0].count, URING_CHUNK_SIZE / 1024);
+    }
+    // SIGINT and SIGHUP stay blocked except while waiting in the ring, so a
+    // signal can never slip in between checking keep_running and sleeping
+    pthread_sigmask(SIG_SETMASK, NULL, &wait_mask);
+    sigdelset(&wait_mask, SIGINT);
+    sigdelset(&wait_mask, SIGHUP);
+
+    while (running()) {
+        long long now = now_ms(), due = -1;
+        struct io_uring_cqe *cqe;
+
+        uring_open_pipes(&u, now);
+        uring_dial(&u, now);
+        uring_flush_dir(&u, DIR_APP_TO_NET, URING_SLOT_SOCKET);
+        uring_flush_dir(&u, DIR_NET_TO_APP, URING_SLOT_NET_TO_APP);
+        uring_arm_recv(&u);
+        uring_arm_read(&u);
+        if (!running()) {
+            break;
+        }
+
+        if (u.fds[URING_SLOT_NET_TO_APP] == -1 || u.fds[URING_SLOT_APP_TO_NET] == -1) {
+            due = u.pipe_retry_ms;
+        }
+        if (u.socket_state == URING_SOCKET_DOWN && (due == -1 || u.dial.retry_ms < due)) {
+            due = u.dial.retry_ms;
+        }
+        if (uring_submit_and_wait(&u.ring, 1, due == -1 ? -1 : (due > now ? due - now : 0), &wait_mask) == -1 &&
+            errno != EINTR && errno != ETIME && errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter");
+            break;
+        }
+
+        now = now_ms();
+        while ((cqe = uring_peek_cqe(&u.ring)) != NULL) {
+            int op = (int)(cqe->user_data >> 32), res = cqe->res;
+            unsigned id = (unsigned)cqe->user_data, flags = cqe->flags;
+
+            uring_cqe_seen(&u.ring);
+            switch (op) {
+            case URING_OP_RECV:
+                uring_recv_done(&u, res, flags, now);
+                break;
+            case URING_OP_WRITE + DIR_NET_TO_APP:
+            case URING_OP_WRITE + DIR_APP_TO_NET:
+                uring_write_done(&u, op - URING_OP_WRITE, id, res, now);
+                break;
+            case URING_OP_READ:
+                uring_read_done(&u, id, res, now);
+                break;
+            case URING_OP_CONNECT:
+                uring_connect_done(&u, res, now);
+                break;
+            default: // The poll and timeout halves of linked pairs
+                break;
+            }
+        }
+    }
+
+    if (opts->verbose) {
+        printf("Main thread: Cleaning up resources...\n");
+    }
+    uring_route_free(&u);
+    unlink(PIPE_NET_TO_APP_NAME);
+    unlink(PIPE_APP_TO_NET_NAME);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    char *address = NULL;
+    int port = -1;
+    char *config_path = NULL;
+    int worker_count = 0;
+    int ring_size_given = 0;
+    int engine = ENGINE_EPOLL;
+    options_t opts;
+    worker_t *workers;
+    route_t *routes = NULL;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.pipe_size = DEFAULT_SPLICE_PIPE_SIZE;
+    opts.ring_size = DEFAULT_RING_SIZE;
+    opts.spill_dir = DEFAULT_SPILL_DIR;
+
+    // Register signal handlers. No SA_RESTART, so a blocking FIFO open() in
+    // main is interrupted rather than resumed.
+    struct sigaction sa;
+    sigset_t main_signals;
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = sigint_handler;
+    sigaction(SIGINT, &sa, NULL);
+    sa.sa_handler = sighup_handler;
+    sigaction(SIGHUP, &sa, NULL);
+    sigemptyset(&main_signals);
+    sigaddset(&main_signals, SIGINT);
+    sigaddset(&main_signals, SIGHUP);
+    // A vanished FIFO reader or peer must surface as EPIPE, not kill the process
+    signal(SIGPIPE, SIG_IGN);
+
+    // Parse command line arguments (same as before)
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--help") == 0) {
+            print_usage();
+            exit(EXIT_SUCCESS);
+        } else if (strcmp(argv[i], "-h") == 0) {
+            if (i + 1 < argc) {
+                address = argv[++i];
+            } else {
+                fprintf(stderr, "Error: -h requires an address argument.\n");
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "-p") == 0) {
+            if (i + 1 < argc) {
+                port = atoi(argv[++i]);
+                if (port <= 0 || port > 65535) {
+                    fprintf(stderr, "Error: Invalid port number.\n");
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+            } else {
+                fprintf(stderr, "Error: -p requires a port number argument.\n");
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "-l") == 0) {
+            if (i + 1 < argc) {
+                opts.listen_port = atoi(argv[++i]);
+                if (opts.listen_port <= 0 || opts.listen_port > 65535) {
+                    fprintf(stderr, "Error: Invalid listen port number.\n");
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+            } else {
+                fprintf(stderr, "Error: -l requires a port number argument.\n");
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "-c") == 0) {
+            if (i + 1 < argc) {
+                config_path = argv[++i];
+            } else {
+                fprintf(stderr, "Error: -c requires a file argument.\n");
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--workers") == 0) {
+            if (i + 1 < argc) {
+                worker_count = atoi(argv[++i]);
+                if (worker_count <= 0 || worker_count > MAX_WORKERS) {
+                    fprintf(stderr, "Error: Invalid worker count (1-%d).\n", MAX_WORKERS);
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+            } else {
+                fprintf(stderr, "Error: --workers requires a count argument.\n");
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "-v") == 0) {
+            opts.verbose = 1;
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            engine = ENGINE_THREADS;
+        } else if (strcmp(argv[i], "--uring") == 0) {
+            engine = ENGINE_URING;
+        } else if (strcmp(argv[i], "--queue-depth") == 0) {
+            if (i + 1 < argc) {
+                int depth = atoi(argv[++i]);
+                if (depth < 4 || depth > URING_MAX_QUEUE_DEPTH) {
+                    fprintf(stderr, "Error: Invalid queue depth (4-%d).\n", URING_MAX_QUEUE_DEPTH);
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+                opts.queue_depth = depth;
+            } else {
+                fprintf(stderr, "Error: --queue-depth requires a count argument.\n");
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--splice") == 0) {
+            opts.use_splice = 1;
+        } else if (strcmp(argv[i], "--latency") == 0) {
+            opts.coalesce_mode = COALESCE_LATENCY;
+        } else if (strcmp(argv[i], "--throughput") == 0) {
+            opts.coalesce_mode = COALESCE_THROUGHPUT;
+        } else if (strcmp(argv[i], "--adaptive") == 0) {
+            opts.coalesce_mode = COALESCE_ADAPTIVE;
+        } else if (strcmp(argv[i], "--coalesce-us") == 0 || strcmp(argv[i], "--coalesce-bytes") == 0) {
+            const char *opt = argv[i];
+            long value = i + 1 < argc ? strtol(argv[++i], NULL, 10) : 0;
+            if (value <= 0) {
+                fprintf(stderr, "Error: %s requires a positive number.\n", opt);
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+            if (strcmp(opt, "--coalesce-us") == 0) {
+                opts.coalesce_us = value;
+            } else {
+                opts.coalesce_bytes = value;
+            }
+        } else if (strncmp(argv[i], "--frame=", 8) == 0 || strcmp(argv[i], "--frame") == 0) {
+            const char *mode = argv[i][7] == '=' ? argv[i] + 8 : (i + 1 < argc ? argv[++i] : "");
+            if (strcmp(mode, "line") == 0) {
+                opts.frame_mode = FRAME_LINE;
+            } else if (strcmp(mode, "u16len") == 0) {
+                opts.frame_mode = FRAME_U16LEN;
+            } else if (strcmp(mode, "u32len") == 0) {
+                opts.frame_mode = FRAME_U32LEN;
+            } else {
+                fprintf(stderr, "Error: --frame must be line, u16len or u32len.\n");
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--shm") == 0) {
+            opts.use_shm = 1;
+        } else if (strcmp(argv[i], "--fanout") == 0) {
+            if (i + 1 < argc) {
+                opts.fanout_spec = argv[++i];
+            } else {
+                fprintf(stderr, "Error: --fanout requires a list of FIFO paths or unix:<path> entries.\n");
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--fanout-policy") == 0) {
+            const char *policy = i + 1 < argc ? argv[++i] : "";
+            if (strcmp(policy, "drop") == 0) {
+                opts.fanout_policy = FANOUT_DROP;
+            } else if (strcmp(policy, "block") == 0) {
+                opts.fanout_policy = FANOUT_BLOCK;
+            } else if (strcmp(policy, "disconnect") == 0) {
+                opts.fanout_policy = FANOUT_DISCONNECT;
+            } else {
+                fprintf(stderr, "Error: --fanout-policy must be drop, block or disconnect.\n");
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--demux") == 0) {
+            if (i + 1 < argc && opts.demux_count < MAX_DEMUX_OUTPUTS) {
+                opts.demux_specs[opts.demux_count++] = argv[++i];
+            } else {
+                fprintf(stderr, "Error: --demux requires <value>=<fifo> and can be given up to %d times.\n", MAX_DEMUX_OUTPUTS);
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--demux-field") == 0) {
+            char *end = NULL;
+            long field = i + 1 < argc ? strtol(argv[++i], &end, 10) : -1;
+            if (end == NULL || *end != '\0' || field < 0 || field > 255) {
+                fprintf(stderr, "Error: --demux-field must be 0 (the record prefix) or a field number up to 255.\n");
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+            opts.demux_field = (int)field;
+        } else if (strcmp(argv[i], "--demux-sep") == 0) {
+            const char *sep = i + 1 < argc ? argv[++i] : "";
+            if (strcmp(sep, "\\t") == 0) {
+                opts.demux_sep = '\t';
+            } else if (strlen(sep) == 1 && sep[0] != '\n') {
+                opts.demux_sep = sep[0];
+            } else {
+                fprintf(stderr, "Error: --demux-sep must be a single character (or \\t).\n");
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--standby") == 0) {
+            if (i + 1 < argc) {
+                opts.standby_count = atoi(argv[++i]);
+                if (opts.standby_count <= 0 || opts.standby_count > MAX_STANDBYS) {
+                    fprintf(stderr, "Error: Invalid standby count (1-%d).\n", MAX_STANDBYS);
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+            } else {
+                fprintf(stderr, "Error: --standby requires a count argument.\n");
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            if (i + 1 < argc) {
+                opts.stats_path = argv[++i];
+            } else {
+                fprintf(stderr, "Error: --stats requires a socket path argument.\n");
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--handoff") == 0) {
+            if (i + 1 < argc) {
+                opts.handoff_path = argv[++i];
+            } else {
+                fprintf(stderr, "Error: --handoff requires a socket path argument.\n");
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--pipe-size") == 0) {
+            if (i + 1 < argc) {
+                opts.pipe_size = atoi(argv[++i]);
+                if (opts.pipe_size <= 0) {
+                    fprintf(stderr, "Error: Invalid pipe size.\n");
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+            } else {
+                fprintf(stderr, "Error: --pipe-size requires a byte count argument.\n");
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--ring-size") == 0 || strcmp(argv[i], "--spill-size") == 0 ||
+                   strcmp(argv[i], "--high-water") == 0 || strcmp(argv[i], "--low-water") == 0 ||
+                   strcmp(argv[i], "--replay") == 0 || strcmp(argv[i], "--fanout-lag") == 0 ||
+                   strcmp(argv[i], "--capture-size") == 0) {
+            if (i + 1 < argc) {
+                const char *opt = argv[i];
+                char *end;
+                unsigned long long bytes = strtoull(argv[++i], &end, 10);
+                if (*end != '\0' || (bytes == 0 && strcmp(opt, "--spill-size") != 0 && strcmp(opt, "--low-water") != 0)) {
+                    fprintf(stderr, "Error: Invalid byte count for %s.\n", opt);
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+                if (strcmp(opt, "--ring-size") == 0) {
+                    opts.ring_size = bytes;
+                    ring_size_given = 1;
+                } else if (strcmp(opt, "--spill-size") == 0) {
+                    opts.spill_size = bytes;
+                } else if (strcmp(opt, "--high-water") == 0) {
+                    opts.high_water = bytes;
+                } else if (strcmp(opt, "--replay") == 0) {
+                    opts.replay_size = bytes;
+                } else if (strcmp(opt, "--fanout-lag") == 0) {
+                    opts.fanout_lag = bytes;
+                } else if (strcmp(opt, "--capture-size") == 0) {
+                    opts.capture_size = bytes;
+                } else {
+                    opts.low_water = bytes;
+                }
+            } else {
+                fprintf(stderr, "Error: %s requires a byte count argument.\n", argv[i]);
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--autotune") == 0) {
+            opts.autotune = 1;
+        } else if (strcmp(argv[i], "--low-latency") == 0) {
+            opts.low_latency = 1;
+        } else if (strcmp(argv[i], "--spin-us") == 0) {
+            long value = i + 1 < argc ? strtol(argv[++i], NULL, 10) : 0;
+            if (value <= 0 || value > MAX_SPIN_US) {
+                fprintf(stderr, "Error: --spin-us requires a number of microseconds (1-%d).\n", MAX_SPIN_US);
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+            opts.spin_us = value;
+        } else if (strcmp(argv[i], "--cpus") == 0) {
+            opts.cpu_count = i + 1 < argc ? parse_cpu_list(argv[++i], opts.cpus, MAX_WORKERS) : -1;
+            if (opts.cpu_count <= 0) {
+                fprintf(stderr, "Error: --cpus requires a core list such as 2,3 or 4-7.\n");
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--sched-fifo") == 0) {
+            opts.sched_priority = i + 1 < argc ? atoi(argv[++i]) : 0;
+            if (opts.sched_priority < 1 || opts.sched_priority > 99) {
+                fprintf(stderr, "Error: --sched-fifo requires a priority (1-99).\n");
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--capture") == 0) {
+            if (i + 1 < argc) {
+                opts.capture_path = argv[++i];
+            } else {
+                fprintf(stderr, "Error: --capture requires a file argument.\n");
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--spill-dir") == 0) {
+            if (i + 1 < argc) {
+                opts.spill_dir = argv[++i];
+            } else {
+                fprintf(stderr, "Error: --spill-dir requires a directory argument.\n");
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            fprintf(stderr, "Error: Unknown option '%s'\n", argv[i]);
+            print_usage();
+            exit(EXIT_FAILURE);
         }
+    }
 
-        // If both socket and pipes are valid, main thread sleeps briefly
-        if (socket_fd != -1 && pipe_app_to_net_fd != -1 && pipe_net_to_app_fd != -1) {
-            usleep(500000); // 500 ms to avoid busy-waiting
-        } else {
-             usleep(100000); // Shorter sleep if still waiting for connections
+    if ((address == NULL) != (port == -1)) {
+        fprintf(stderr, "Error: -h (address) and -p (port) must be given together.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    if (opts.listen_port && (address || config_path)) {
+        fprintf(stderr, "Error: -l cannot be combined with -h/-p or -c.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    if (opts.listen_port && (engine != ENGINE_EPOLL || opts.use_splice || opts.use_shm || opts.handoff_path ||
+                             opts.standby_count > 0 || opts.replay_size > 0 || opts.fanout_spec ||
+                             opts.coalesce_mode == COALESCE_THROUGHPUT || opts.coalesce_mode == COALESCE_ADAPTIVE ||
+                             (opts.frame_mode != FRAME_NONE && opts.frame_mode != FRAME_U32LEN))) {
+        fprintf(stderr, "Error: -l runs on the epoll engine's copy path with u32len records; it cannot be combined with --threads, --uring, --splice, --shm, --handoff, --standby, --replay, --fanout, --throughput, --adaptive or another --frame.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    if (opts.listen_port) {
+        opts.frame_mode = FRAME_U32LEN;
+    }
+    if (address == NULL && config_path == NULL && opts.listen_port == 0) {
+        fprintf(stderr, "Error: Either -h/-p, -c (route config) or -l is required.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    if (opts.use_shm && opts.use_splice) {
+        fprintf(stderr, "Error: --shm and --splice cannot be combined.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    if (opts.frame_mode != FRAME_NONE && (opts.use_splice || opts.use_shm || opts.handoff_path)) {
+        fprintf(stderr, "Error: --frame needs the buffered copy path; it cannot be combined with --splice, --shm or --handoff.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    if (opts.handoff_path && (opts.use_shm || opts.use_splice)) {
+        fprintf(stderr, "Error: --handoff takes the forwarder out of the data path; --shm and --splice do not apply.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    if ((opts.coalesce_mode == COALESCE_THROUGHPUT || opts.coalesce_mode == COALESCE_ADAPTIVE) &&
+        (opts.use_splice || opts.use_shm)) {
+        fprintf(stderr, "Error: --throughput and --adaptive gather data in the forwarder's buffers; they cannot be combined with --splice or --shm.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    if (opts.replay_size > 0 && (opts.use_splice || opts.use_shm || opts.handoff_path || opts.frame_mode != FRAME_NONE)) {
+        fprintf(stderr, "Error: --replay keeps a copy of what the copy path sends; it cannot be combined with --splice, --shm, --handoff or --frame.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    if (opts.standby_count > 0 && opts.handoff_path) {
+        fprintf(stderr, "Error: --handoff already keeps each route pre-connected; --standby does not apply.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    if (opts.coalesce_mode != COALESCE_DEFAULT && opts.handoff_path) {
+        fprintf(stderr, "Error: --handoff takes the forwarder out of the data path; coalescing modes do not apply.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    if (opts.fanout_spec && (address == NULL || opts.use_shm || opts.handoff_path || engine != ENGINE_EPOLL)) {
+        fprintf(stderr, "Error: --fanout applies to the -h/-p route of the epoll engine; it cannot be combined with --shm, --handoff, --threads or --uring.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    if (engine == ENGINE_THREADS && (config_path != NULL || opts.use_splice || opts.use_shm || opts.handoff_path ||
+                                     opts.stats_path || opts.frame_mode != FRAME_NONE ||
+                                     opts.coalesce_mode != COALESCE_DEFAULT || opts.standby_count > 0 || opts.replay_size > 0 ||
+                                     (address && strchr(address, ',')))) {
+        fprintf(stderr, "Error: --threads supports a single -h/-p peer without --splice, --shm, --handoff, --stats, --frame, coalescing, --standby or --replay.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    if (engine == ENGINE_URING && (config_path != NULL || opts.use_splice || opts.use_shm || opts.handoff_path ||
+                                   opts.stats_path || opts.frame_mode != FRAME_NONE ||
+                                   opts.coalesce_mode == COALESCE_THROUGHPUT || opts.coalesce_mode == COALESCE_ADAPTIVE ||
+                                   opts.standby_count > 0 || opts.replay_size > 0 || opts.spill_size > 0 ||
+                                   (address && strchr(address, ',')))) {
+        fprintf(stderr, "Error: --uring supports a single -h/-p peer without --splice, --shm, --handoff, --stats, --frame, --throughput, --adaptive, --standby, --replay or --spill-size.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    if (opts.capture_path && (engine != ENGINE_EPOLL || opts.use_splice || opts.use_shm || opts.handoff_path ||
+                              opts.listen_port)) {
+        fprintf(stderr, "Error: --capture records what the epoll engine's copy path reads; it cannot be combined with --threads, --uring, --splice, --shm, --handoff or -l.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    if (opts.demux_count > 0 && (address == NULL || engine != ENGINE_EPOLL || opts.use_splice || opts.use_shm ||
+                                 opts.handoff_path || opts.fanout_spec)) {
+        fprintf(stderr, "Error: --demux splits the -h/-p route's net->app stream on the epoll engine's copy path; it cannot be combined with -l, --threads, --uring, --splice, --shm, --handoff or --fanout.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    if (opts.demux_count == 0 && (opts.demux_field != 0 || opts.demux_sep != 0)) {
+        fprintf(stderr, "Error: --demux-field and --demux-sep only apply to --demux.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    if (opts.demux_count > 0 && opts.frame_mode == FRAME_NONE) {
+        opts.frame_mode = FRAME_LINE;
+    }
+    if (opts.demux_sep == 0) {
+        opts.demux_sep = ',';
+    }
+    if (opts.capture_size != 0 && opts.capture_path == NULL) {
+        fprintf(stderr, "Error: --capture-size only applies to --capture.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    if (opts.capture_size == 0) {
+        opts.capture_size = CAPTURE_DEFAULT_SIZE;
+    } else if (opts.capture_size <= sizeof(capture_header_t)) {
+        fprintf(stderr, "Error: --capture-size must exceed the %zu-byte log header.\n", sizeof(capture_header_t));
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    if ((opts.spin_us || opts.cpu_count || opts.sched_priority) && !opts.low_latency) {
+        fprintf(stderr, "Error: --spin-us, --cpus and --sched-fifo only apply to --low-latency.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    if (opts.low_latency && (engine == ENGINE_URING || opts.handoff_path ||
+                             opts.coalesce_mode == COALESCE_THROUGHPUT || opts.coalesce_mode == COALESCE_ADAPTIVE)) {
+        fprintf(stderr, "Error: --low-latency tunes the epoll workers or the --threads pair; it cannot be combined with --uring, --handoff, --throughput or --adaptive.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    if (opts.low_latency && opts.spin_us == 0) {
+        opts.spin_us = DEFAULT_SPIN_US;
+    }
+    if (opts.low_latency && opts.cpu_count == 0) {
+        // Default to the cores we are allowed on, one thread per core in order
+        cpu_set_t allowed;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE && opts.cpu_count < MAX_WORKERS; cpu++) {
+                if (CPU_ISSET(cpu, &allowed)) {
+                    opts.cpus[opts.cpu_count++] = cpu;
+                }
+            }
         }
     }
+    if (opts.queue_depth != 0 && engine != ENGINE_URING) {
+        fprintf(stderr, "Error: --queue-depth only applies to --uring.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    if (opts.queue_depth == 0) {
+        opts.queue_depth = URING_DEFAULT_QUEUE_DEPTH;
+    }
+    if (opts.fanout_lag == 0) {
+        opts.fanout_lag = DEFAULT_FANOUT_LAG;
+    }
 
-    // Signal threads to stop and wait for them
-    keep_running = 0; // Ensure threads see the stop signal
-    if (verbose) {
-        printf("Main thread: Signalling threads to stop and waiting...\n");
+    if (opts.autotune && (engine != ENGINE_EPOLL || opts.use_shm || opts.handoff_path || opts.listen_port ||
+                          opts.demux_count > 0)) {
+        fprintf(stderr, "Error: --autotune sizes the epoll engine's buffers and FIFOs; it cannot be combined with --threads, --uring, --shm, --handoff, -l or --demux.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    if (opts.autotune) {
+        if (!ring_size_given) {
+            opts.ring_size = TUNE_MAX_RING; // The ceiling; buffers start at TUNE_MIN_CHUNK
+        }
+        opts.pipe_max = read_proc_int("/proc/sys/fs/pipe-max-size", DEFAULT_SPLICE_PIPE_SIZE);
+        opts.rmem_max = read_proc_int("/proc/sys/net/core/rmem_max", 212992);
+        opts.wmem_max = read_proc_int("/proc/sys/net/core/wmem_max", 212992);
+        if (opts.verbose) {
+            printf("Autotuning buffers up to %zu bytes, FIFOs up to %d, socket buffers up to %d/%d (rcv/snd).\n",
+                   opts.ring_size, opts.pipe_max, opts.rmem_max, opts.wmem_max);
+        }
+    }
+
+    if (opts.high_water == 0 || opts.high_water > opts.ring_size + opts.spill_size) {
+        opts.high_water = opts.ring_size + opts.spill_size;
+    }
+    if (opts.coalesce_us == 0) {
+        opts.coalesce_us = DEFAULT_COALESCE_US;
+    }
+    if (opts.coalesce_bytes == 0) {
+        opts.coalesce_bytes = DEFAULT_COALESCE_BYTES;
+    }
+    if (opts.coalesce_bytes > opts.high_water) {
+        opts.coalesce_bytes = opts.high_water; // Reading stops at high water, so never wait past it
+    }
+    if (opts.low_water == 0) {
+        opts.low_water = opts.high_water / 2;
+    } else if (opts.low_water >= opts.high_water) {
+        fprintf(stderr, "Error: --low-water must be below the high water mark (%zu).\n", opts.high_water);
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+
+    if (opts.verbose && address) {
+        printf("Configuring: Address=%s, Port=%d, Verbose=%d\n", address, port, opts.verbose);
+    }
+
+    // Worker threads inherit a mask with SIGINT/SIGHUP blocked so they always go to main
+    pthread_sigmask(SIG_BLOCK, &main_signals, NULL);
+
+    if (engine == ENGINE_THREADS) {
+        pthread_sigmask(SIG_UNBLOCK, &main_signals, NULL);
+        run_threaded_forwarder(address, port, &opts);
+        if (opts.verbose) {
+            printf("Program finished.\n");
+        }
+        return 0;
+    }
+    if (engine == ENGINE_URING && run_uring_forwarder(address, port, &opts) == 0) {
+        if (opts.verbose) {
+            printf("Program finished.\n");
+        }
+        return 0;
+    }
+
+    route_t *cli_route = NULL;
+    if (address) {
+        cli_route = new_route(address, port, PIPE_NET_TO_APP_NAME, PIPE_APP_TO_NET_NAME, 0, &opts);
+        if (cli_route == NULL) {
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+    srandom((unsigned)now_ns() ^ (unsigned)getpid()); // Reconnect jitter
+    main_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (main_wake_fd == -1) {
+        error_exit("Error creating eventfd");
+    }
+    if (worker_count == 0 && opts.cpu_count > 0) {
+        worker_count = opts.cpu_count; // One worker per --low-latency core
+    } else if (worker_count == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        worker_count = cores < 1 ? 1 : (cores > MAX_WORKERS ? MAX_WORKERS : (int)cores);
+    }
+    if (opts.capture_path) {
+        capture_log = capture_open(opts.capture_path, opts.capture_size, worker_count);
+        if (capture_log == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        if (opts.verbose) {
+            printf("Capturing traffic to '%s' (up to %llu bytes).\n", opts.capture_path, (unsigned long long)opts.capture_size);
+        }
+    }
+    workers = calloc(worker_count, sizeof(*workers));
+    if (workers == NULL || start_workers(workers, worker_count, &opts) == -1) {
+        error_exit("Error starting workers");
+    }
+    pthread_sigmask(SIG_UNBLOCK, &main_signals, NULL);
+
+    if (cli_route) {
+        attach_route(&routes, cli_route, workers, worker_count);
+    }
+    route_t **listen_shards = NULL;
+    if (opts.listen_port) {
+        // Thousands of clients need thousands of descriptors
+        struct rlimit nofile;
+        if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < nofile.rlim_max) {
+            nofile.rlim_cur = nofile.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &nofile);
+        }
+        listen_shards = calloc(worker_count, sizeof(*listen_shards));
+        if (listen_shards == NULL) {
+            error_exit("calloc listen shards");
+        }
+        for (int i = 0; i < worker_count; i++) {
+            char name[32];
+            snprintf(name, sizeof(name), "listen-%d", i);
+            route_t *route = new_route(name, opts.listen_port, PIPE_NET_TO_APP_NAME, PIPE_APP_TO_NET_NAME, 0, &opts);
+            if (route == NULL || (route->listen = calloc(1, sizeof(*route->listen))) == NULL) {
+                error_exit("Error creating listen shard");
+            }
+            route->listen->index = i;
+            route->listen->shards = listen_shards;
+            route->listen->shard_count = worker_count;
+            route->listen->next_seq = 1;
+            pthread_mutex_init(&route->listen->inbox_lock, NULL);
+            route->listen->fd = open_listen_socket(opts.listen_port);
+            if (route->listen->fd == -1) {
+                exit(EXIT_FAILURE);
+            }
+            listen_shards[i] = route;
+        }
+        for (int i = 0; i < worker_count; i++) {
+            attach_route(&routes, listen_shards[i], workers, worker_count); // One per worker
+        }
+        if (opts.verbose) {
+            printf("Listening on port %d with %d shard(s).\n", opts.listen_port, worker_count);
+        }
+    }
+    if (config_path) {
+        reload_routes(config_path, &opts, &routes, workers, worker_count);
+    }
+
+    int control_fd = -1;
+    if (opts.handoff_path) {
+        control_fd = open_control_socket(opts.handoff_path);
+        if (control_fd == -1) {
+            stop_running();
+        } else if (opts.verbose) {
+            printf("Handing off sockets through control socket '%s'.\n", opts.handoff_path);
+        }
+    }
+
+    int stats_fd = -1;
+    if (opts.stats_path) {
+        stats_fd = open_control_socket(opts.stats_path);
+        if (stats_fd == -1) {
+            stop_running();
+        }
+    }
+
+    run_route_scheduler(&routes, config_path, &opts, workers, worker_count, control_fd, stats_fd);
+
+    stop_running(); // Ensure workers see the stop signal
+    if (opts.verbose) {
+        printf("Main thread: Signalling workers to stop and waiting...\n");
+    }
+    stop_workers(workers, worker_count);
+    if (capture_log) {
+        capture_close(capture_log); // Workers are gone, so the queues hold everything they read
+        capture_log = NULL;
     }
-    pthread_join(tid1, NULL);
-    pthread_join(tid2, NULL);
 
     // Cleanup
-    if (verbose) {
+    if (opts.verbose) {
         printf("Main thread: Cleaning up resources...\n");
     }
-    if (socket_fd != -1) {
-        close(socket_fd);
+    close_all_control_clients();
+    if (control_fd != -1) {
+        close(control_fd);
+        unlink(opts.handoff_path);
     }
-    if (pipe_app_to_net_fd != -1) {
-        close(pipe_app_to_net_fd);
+    if (stats_fd != -1) {
+        close(stats_fd);
+        unlink(opts.stats_path);
     }
-    if (pipe_net_to_app_fd != -1) {
-        close(pipe_net_to_app_fd);
+    while (routes) {
+        route_t *next = routes->next;
+        dial_abort(&routes->dial);
+        standby_close_all(routes);
+        handoff_release_route(routes);
+        teardown_route(routes);
+        free_route(routes);
+        routes = next;
     }
+    for (int i = 0; i < worker_count; i++) {
+        close(workers[i].epoll_fd);
+        close(workers[i].wake_fd);
+        pthread_mutex_destroy(&workers[i].inbox_lock);
+    }
+    free(workers);
+    free(listen_shards);
+    close(main_wake_fd);
 
-    // Unlink named pipes
-    unlink(PIPE_NET_TO_APP_NAME);
-    unlink(PIPE_APP_TO_NET_NAME);
-
-    if (verbose) {
+    if (opts.verbose) {
         printf("Program finished.\n");
     }
 
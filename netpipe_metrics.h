@@ -0,0 +1,101 @@
+// Counters and histograms for netpipe_forwarder's stats socket.
+//
+// Every metric has exactly one writer thread (the worker that owns the route,
+// or the scheduler for connection state), so updates are a relaxed load and
+// store rather than a locked read-modify-write, and cost about as much as a
+// plain increment. Readers on other threads use relaxed loads; a snapshot may
+// be a few events stale but is never torn.
+//
+// Histograms are log-linear in the style of HdrHistogram: values below 16 get
+// a bucket each, and every power of two above that is split into 8 linear
+// sub-buckets, so any recorded value is reported to within 12.5%.
+
+#ifndef NETPIPE_METRICS_H
+#define NETPIPE_METRICS_H
+
+#include <stdint.h>
+
+#define METRICS_HIST_LINEAR 16 // Values below this are exact
+#define METRICS_HIST_SUB_BITS 3 // 8 sub-buckets per power of two
+#define METRICS_HIST_BUCKETS (METRICS_HIST_LINEAR + (64 - 4) * (1 << METRICS_HIST_SUB_BITS))
+
+typedef struct {
+    uint64_t counts[METRICS_HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+} metrics_hist_t;
+
+// Single-writer counter update
+static inline void metric_add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline void metric_set(uint64_t *gauge, uint64_t value) {
+    __atomic_store_n(gauge, value, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t metric_read(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static inline int metrics_hist_index(uint64_t value) {
+    int exp;
+
+    if (value < METRICS_HIST_LINEAR) {
+        return (int)value;
+    }
+    exp = 63 - __builtin_clzll(value); // >= 4
+    return METRICS_HIST_LINEAR + ((exp - 4) << METRICS_HIST_SUB_BITS) +
+           (int)((value >> (exp - METRICS_HIST_SUB_BITS)) & ((1 << METRICS_HIST_SUB_BITS) - 1));
+}
+
+// Midpoint of the values that land in bucket 'index'
+static inline uint64_t metrics_hist_value(int index) {
+    int exp, sub;
+    uint64_t width;
+
+    if (index < METRICS_HIST_LINEAR) {
+        return (uint64_t)index;
+    }
+    exp = ((index - METRICS_HIST_LINEAR) >> METRICS_HIST_SUB_BITS) + 4;
+    sub = (index - METRICS_HIST_LINEAR) & ((1 << METRICS_HIST_SUB_BITS) - 1);
+    width = 1ULL << (exp - METRICS_HIST_SUB_BITS);
+    return ((uint64_t)((1 << METRICS_HIST_SUB_BITS) + sub) << (exp - METRICS_HIST_SUB_BITS)) + width / 2;
+}
+
+static inline void metrics_hist_record(metrics_hist_t *hist, uint64_t value) {
+    metric_add(&hist->counts[metrics_hist_index(value)], 1);
+    metric_add(&hist->count, 1);
+    metric_add(&hist->sum, value);
+    if (value > metric_read(&hist->max)) {
+        metric_set(&hist->max, value);
+    }
+}
+
+// Value at quantile 'q' (0..1) of everything recorded so far; 0 when empty
+static inline uint64_t metrics_hist_quantile(const metrics_hist_t *hist, double q) {
+    uint64_t total = 0, seen = 0, rank;
+
+    for (int i = 0; i < METRICS_HIST_BUCKETS; i++) {
+        total += metric_read(&hist->counts[i]);
+    }
+    if (total == 0) {
+        return 0;
+    }
+    rank = (uint64_t)(q * (double)total);
+    if (rank >= total) {
+        rank = total - 1;
+    }
+    for (int i = 0; i < METRICS_HIST_BUCKETS; i++) {
+        seen += metric_read(&hist->counts[i]);
+        if (seen > rank) {
+            uint64_t value = metrics_hist_value(i);
+            uint64_t max = metric_read(&hist->max);
+            return value < max ? value : max;
+        }
+    }
+    return metric_read(&hist->max);
+}
+
+#endif // NETPIPE_METRICS_H
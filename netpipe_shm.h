@@ -0,0 +1,256 @@
+// Shared-memory transport between netpipe_forwarder and netpipe_connector.
+//
+// One POSIX shm segment holds two lock-free single-producer/single-consumer
+// byte rings, one per direction, plus a doorbell per process. A process only
+// sleeps after arming its doorbell and re-checking its rings; the other side
+// rings the bell (a futex wake) only when it finds it armed, so wakeups cost a
+// syscall only on the empty->non-empty (or full->not-full) transition.
+//
+// Both programs wait in poll/epoll, which cannot wait on a futex directly, so
+// each runs a small bridge thread that blocks on its bell's futex word and
+// turns every ring into an eventfd wakeup for the main loop.
+
+#ifndef NETPIPE_SHM_H
+#define NETPIPE_SHM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define NETPIPE_SHM_MAGIC 0x4e505348u // "NPSH"
+#define NETPIPE_SHM_VERSION 1
+#define NETPIPE_SHM_DEFAULT_NAME "/netpipe_net_to_pipe" // Segment for the default -h/-p route
+#define NETPIPE_SHM_MAX_NAME 256
+
+// One direction. head and tail count every byte ever written and read; only
+// the producer stores head and only the consumer stores tail. Each sits on
+// its own cache line so the two sides do not false-share.
+typedef struct {
+    _Alignas(64) uint64_t head;
+    _Alignas(64) uint64_t tail;
+    _Alignas(64) uint64_t cap;         // Power of two
+    uint64_t data_offset;              // From the start of the segment
+} shm_ring_t;
+
+// Doorbell owned by one process
+typedef struct {
+    _Alignas(64) uint32_t seq;         // Futex word, bumped on every ring
+    uint32_t sleeping;                 // Owner is about to block (or blocked)
+} shm_bell_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t segment_size;
+    uint32_t forwarder_closed;         // Set when the forwarder tears the route down
+    uint32_t connector_attached;
+    shm_bell_t forwarder_bell;         // Rung by the connector
+    shm_bell_t connector_bell;         // Rung by the forwarder
+    shm_ring_t net_to_app;             // Forwarder produces, connector consumes
+    shm_ring_t app_to_net;             // Connector produces, forwarder consumes
+} shm_header_t;
+
+// Turns rings of a bell into eventfd wakeups for a poll/epoll loop
+typedef struct {
+    shm_bell_t *bell;
+    int event_fd;
+    int stop;
+    pthread_t tid;
+} shm_bridge_t;
+
+static inline long shm_futex(uint32_t *word, int op, uint32_t val) {
+    return syscall(SYS_futex, word, op, val, NULL, NULL, 0);
+}
+
+static inline char *shm_ring_data(shm_header_t *hdr, shm_ring_t *ring) {
+    return (char *)hdr + ring->data_offset;
+}
+
+static inline uint64_t shm_ring_used(shm_ring_t *ring) {
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+// Contiguous runs of 'len' bytes starting at absolute position 'pos'
+static inline int shm_ring_span(shm_header_t *hdr, shm_ring_t *ring, uint64_t pos, uint64_t len, struct iovec *iov) {
+    uint64_t off = pos & (ring->cap - 1);
+    uint64_t first = ring->cap - off < len ? ring->cap - off : len;
+    int cnt = 0;
+
+    if (len == 0) {
+        return 0;
+    }
+    iov[cnt].iov_base = shm_ring_data(hdr, ring) + off;
+    iov[cnt++].iov_len = first;
+    if (len > first) {
+        iov[cnt].iov_base = shm_ring_data(hdr, ring);
+        iov[cnt++].iov_len = len - first;
+    }
+    return cnt;
+}
+
+// Producer: free space as up to two iovecs, capped at 'limit'
+static inline int shm_ring_free_iov(shm_header_t *hdr, shm_ring_t *ring, struct iovec *iov, uint64_t limit) {
+    uint64_t head = ring->head; // Only we write it
+    uint64_t space = ring->cap - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+    return shm_ring_span(hdr, ring, head, space < limit ? space : limit, iov);
+}
+
+// Consumer: held bytes, oldest first, as up to two iovecs
+static inline int shm_ring_used_iov(shm_header_t *hdr, shm_ring_t *ring, struct iovec *iov) {
+    uint64_t tail = ring->tail; // Only we write it
+    return shm_ring_span(hdr, ring, tail, __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail, iov);
+}
+
+static inline void shm_ring_produce(shm_ring_t *ring, uint64_t n) {
+    __atomic_store_n(&ring->head, ring->head + n, __ATOMIC_RELEASE);
+}
+
+static inline void shm_ring_consume(shm_ring_t *ring, uint64_t n) {
+    __atomic_store_n(&ring->tail, ring->tail + n, __ATOMIC_RELEASE);
+}
+
+// The doorbell is a store-then-check handshake on both sides: the owner sets
+// 'sleeping' and then re-checks the rings, the peer publishes progress and then
+// checks 'sleeping'. Every access to 'sleeping' on those paths is a seq_cst
+// read-modify-write, so the two sides are ordered by that one location instead
+// of by standalone fences (which ThreadSanitizer cannot model): if the peer's
+// check comes first, the owner's arm reads from it and sees the progress.
+
+// Owner: announce we are about to sleep. Re-check the rings afterwards.
+static inline void shm_bell_arm(shm_bell_t *bell) {
+    __atomic_exchange_n(&bell->sleeping, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline void shm_bell_disarm(shm_bell_t *bell) {
+    __atomic_exchange_n(&bell->sleeping, 0, __ATOMIC_SEQ_CST);
+}
+
+// Peer: call after publishing progress. Costs a syscall only if the owner is armed.
+static inline void shm_bell_ring(shm_bell_t *bell) {
+    if (__atomic_fetch_or(&bell->sleeping, 0, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&bell->sleeping, 0, __ATOMIC_ACQ_REL)) {
+        __atomic_add_fetch(&bell->seq, 1, __ATOMIC_RELEASE);
+        shm_futex(&bell->seq, FUTEX_WAKE, INT_MAX);
+    }
+}
+
+static inline void *shm_bridge_thread(void *arg) {
+    shm_bridge_t *bridge = (shm_bridge_t *)arg;
+    uint32_t seen = __atomic_load_n(&bridge->bell->seq, __ATOMIC_ACQUIRE);
+    uint64_t one = 1;
+
+    while (!__atomic_load_n(&bridge->stop, __ATOMIC_ACQUIRE)) {
+        uint32_t cur = __atomic_load_n(&bridge->bell->seq, __ATOMIC_ACQUIRE);
+        if (cur != seen) {
+            seen = cur;
+            if (write(bridge->event_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+                perror("shm bridge: eventfd write");
+            }
+            continue;
+        }
+        shm_futex(&bridge->bell->seq, FUTEX_WAIT, seen); // Returns at once if seq moved on
+    }
+    return NULL;
+}
+
+static inline int shm_bridge_start(shm_bridge_t *bridge, shm_bell_t *bell, int event_fd) {
+    bridge->bell = bell;
+    bridge->event_fd = event_fd;
+    bridge->stop = 0;
+    return pthread_create(&bridge->tid, NULL, shm_bridge_thread, bridge) == 0 ? 0 : -1;
+}
+
+static inline void shm_bridge_stop(shm_bridge_t *bridge) {
+    __atomic_store_n(&bridge->stop, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&bridge->bell->seq, 1, __ATOMIC_RELEASE);
+    shm_futex(&bridge->bell->seq, FUTEX_WAKE, INT_MAX);
+    pthread_join(bridge->tid, NULL);
+}
+
+// Forwarder: create a fresh segment with two rings of at least 'ring_size'
+// bytes. Any stale segment of the same name is replaced; a connector still
+// mapping it keeps its own copy and is not disturbed.
+static inline shm_header_t *shm_segment_create(const char *name, uint64_t ring_size) {
+    uint64_t cap = 4096, hdr_size = (sizeof(shm_header_t) + 4095) & ~(uint64_t)4095;
+    uint64_t size;
+    shm_header_t *hdr;
+    int fd;
+
+    while (cap < ring_size) {
+        cap <<= 1;
+    }
+    size = hdr_size + 2 * cap;
+    shm_unlink(name);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        perror("shm_open");
+        return NULL;
+    }
+    if (ftruncate(fd, size) == -1) {
+        perror("ftruncate shm segment");
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        perror("mmap shm segment");
+        shm_unlink(name);
+        return NULL;
+    }
+    hdr->segment_size = size;
+    hdr->net_to_app.cap = cap;
+    hdr->net_to_app.data_offset = hdr_size;
+    hdr->app_to_net.cap = cap;
+    hdr->app_to_net.data_offset = hdr_size + cap;
+    hdr->version = NETPIPE_SHM_VERSION;
+    __atomic_store_n(&hdr->magic, NETPIPE_SHM_MAGIC, __ATOMIC_RELEASE); // Last: marks the segment ready
+    return hdr;
+}
+
+// Connector: map an existing segment created by the forwarder
+static inline shm_header_t *shm_segment_attach(const char *name) {
+    struct stat st;
+    shm_header_t *hdr;
+    int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+
+    if (fd == -1) {
+        perror("shm_open");
+        return NULL;
+    }
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(shm_header_t)) {
+        fprintf(stderr, "Shared memory segment '%s' is not initialised.\n", name);
+        close(fd);
+        return NULL;
+    }
+    hdr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        perror("mmap shm segment");
+        return NULL;
+    }
+    if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != NETPIPE_SHM_MAGIC ||
+        hdr->version != NETPIPE_SHM_VERSION || hdr->segment_size != (uint64_t)st.st_size) {
+        fprintf(stderr, "Shared memory segment '%s' has an unexpected layout.\n", name);
+        munmap(hdr, st.st_size);
+        return NULL;
+    }
+    return hdr;
+}
+
+static inline void shm_segment_detach(shm_header_t *hdr) {
+    munmap(hdr, hdr->segment_size);
+}
+
+#endif // NETPIPE_SHM_H
@@ -0,0 +1,1024 @@
+// Reconnect-churn and fault-injection stress test for netpipe_forwarder.
+//
+// Starts the forwarder against a stand-in TCP server on loopback that ends
+// every connection after a short random lifetime, in one of these ways:
+//   reset       close with SO_LINGER 0, so the forwarder sees a RST
+//   close       orderly close: shutdown(SHUT_WR), read to EOF, then close
+//   halfclose   shutdown(SHUT_WR), then keep reading until the forwarder hangs up
+//   stall       stop reading and writing for a while, then carry on
+//   slowaccept  orderly close, then leave the next connection in the backlog
+// Meanwhile the app side's FIFO writer and reader close and reopen their ends
+// at random. Both directions carry fixed-size records, each with a sequence
+// number and a checksum, so the receiving end can count what was lost,
+// duplicated or delivered late, and resynchronises after a record torn by a
+// fault. The report has those counts, how long the forwarder took to reconnect
+// and to get data moving again after each fault, and the CPU time it used.
+// With -c the forwarder also runs routes from a config file, which is
+// rewritten and re-read with SIGHUP every ~100 ms while those routes carry
+// data, so routes are attached and detached under load.
+//
+// Exits non-zero if the forwarder dies, stops recovering, or exits with an
+// error status, which includes a ThreadSanitizer report (see `make stress-tsan`).
+// Loss and duplicates are reported, not failed: without --replay a reset
+// legitimately loses what was in flight, and with it some bytes arrive twice.
+// Faults that close in order (close, slowaccept, halfclose, stall) lose
+// nothing, so --lossless fails a run with those alone that loses a record.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "netpipe_metrics.h"
+
+#define PIPE_NET_TO_APP_NAME "/tmp/net_to_pipe" // FIFOs of the forwarder's -h/-p route
+#define PIPE_APP_TO_NET_NAME "/tmp/pipe_to_net"
+#define RECORD_SIZE 64
+#define RECORD_MAGIC 0x4e505352u
+#define BATCH_RECORDS (4096 / RECORD_SIZE) // One write; within PIPE_BUF, so a FIFO takes all of it or none
+#define READ_CHUNK (64 * 1024)
+#define STARTUP_TIMEOUT_MS 5000
+#define STALL_TIMEOUT_MS 10000   // No reconnect, or no records in one direction, for this long fails the run
+#define HALF_CLOSE_TIMEOUT_MS 1000 // A half-closed connection the forwarder keeps longer is reset
+#define QUIET_MS 1000            // The drain ends once nothing has arrived for this long
+#define DEFAULT_DURATION_MS 20000
+#define DEFAULT_LIFETIME_MS 20   // Mean connection lifetime: ~3000 faults a minute at most
+#define DEFAULT_FIFO_LIFETIME_MS 200
+#define DEFAULT_RATE 20000       // Records per second in each direction
+#define DEFAULT_RELOAD_MS 100    // -c: mean time between route file rewrites
+#define CONFIG_ROUTES 8          // -c: route file slots, each listed or not
+#define MAX_CHURN_CONNS (4 * CONFIG_ROUTES) // -c: connections held open on the routes' server
+#define CHURN_CHUNK 1024         // -c: bytes sent on each of them before a reload
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long now_ms(void) {
+    return now_ns() / 1000000;
+}
+
+static void sleep_ms(int ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+static uint64_t rng_state;
+
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+// Uniform in [mean / 2, mean * 3 / 2]
+static long long jitter_ms(int mean) {
+    return mean / 2 + (long long)(rng_next() % (uint64_t)(mean + 1));
+}
+
+// --- Records ---
+
+typedef struct {
+    uint32_t magic;
+    uint32_t check;          // FNV-1a of everything after it
+    uint64_t seq;
+    unsigned char fill[RECORD_SIZE - 16];
+} record_t;
+
+_Static_assert(sizeof(record_t) == RECORD_SIZE, "record_t must be RECORD_SIZE bytes");
+
+static uint32_t record_check(const record_t *rec) {
+    const unsigned char *p = (const unsigned char *)&rec->seq;
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < RECORD_SIZE - 8; i++) {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void record_make(record_t *rec, uint64_t seq) {
+    rec->magic = RECORD_MAGIC;
+    rec->seq = seq;
+    for (size_t i = 0; i < sizeof(rec->fill); i++) {
+        rec->fill[i] = (unsigned char)(seq * 7 + i);
+    }
+    rec->check = record_check(rec);
+}
+
+// One direction: what the sending end wrote and what the receiving end made of it
+typedef struct {
+    const char *name;
+    uint64_t sent;           // Records written whole; also the next sequence number
+    uint64_t unique;         // Distinct records received
+    uint64_t dups;           // Records received again
+    uint64_t late;           // Records first seen after a later one
+    uint64_t torn;           // Received bytes that were not part of a valid record
+    uint64_t next_max;       // One past the highest sequence number received
+    uint8_t *seen;           // Bitmap by sequence number
+    size_t seen_bytes;
+    double credit;           // Records the rate limit allows now
+    long long last_rx_ms;    // When a record last arrived
+    size_t len;              // Bytes in buf not yet scanned
+    char buf[READ_CHUNK + RECORD_SIZE];
+} stream_t;
+
+static int stream_note(stream_t *s, uint64_t seq) {
+    size_t byte = seq / 8;
+
+    if (byte >= s->seen_bytes) {
+        size_t size = s->seen_bytes ? s->seen_bytes : 4096;
+        uint8_t *seen;
+        while (size <= byte) {
+            size *= 2;
+        }
+        seen = realloc(s->seen, size);
+        if (seen == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        memset(seen + s->seen_bytes, 0, size - s->seen_bytes);
+        s->seen = seen;
+        s->seen_bytes = size;
+    }
+    if (s->seen[byte] & (1u << (seq % 8))) {
+        s->dups++;
+        return 0;
+    }
+    s->seen[byte] |= 1u << (seq % 8);
+    s->unique++;
+    if (seq + 1 < s->next_max) {
+        s->late++;
+    } else {
+        s->next_max = seq + 1;
+    }
+    return 1;
+}
+
+// Pick the whole records out of buf, skipping bytes that do not form one.
+// Returns how many new (not duplicate) records were found.
+static int stream_scan(stream_t *s) {
+    size_t off = 0;
+    int fresh = 0;
+
+    while (s->len - off >= RECORD_SIZE) {
+        record_t rec;
+        memcpy(&rec, s->buf + off, RECORD_SIZE);
+        if (rec.magic == RECORD_MAGIC && rec.seq < s->sent && rec.check == record_check(&rec)) {
+            fresh += stream_note(s, rec.seq);
+            off += RECORD_SIZE;
+        } else {
+            s->torn++;
+            off++;
+        }
+    }
+    memmove(s->buf, s->buf + off, s->len - off);
+    s->len -= off;
+    if (fresh > 0) {
+        s->last_rx_ms = now_ms();
+    }
+    return fresh;
+}
+
+// The byte stream broke (new connection or FIFO reader): drop a partial record
+static void stream_restart(stream_t *s) {
+    s->torn += s->len;
+    s->len = 0;
+}
+
+// Refill the rate limit's credit, allowing bursts of up to 100 ms worth
+static void stream_refill(stream_t *s, int rate, long long elapsed_ns) {
+    double cap = rate / 10.0 > BATCH_RECORDS ? rate / 10.0 : BATCH_RECORDS;
+
+    if (rate == 0) {
+        s->credit = BATCH_RECORDS;
+        return;
+    }
+    s->credit += rate * (elapsed_ns / 1e9);
+    if (s->credit > cap) {
+        s->credit = cap;
+    }
+}
+
+// Build up to one batch of the stream's next records in 'out'; returns the count
+static int stream_batch(stream_t *s, record_t *out) {
+    int n = s->credit < BATCH_RECORDS ? (int)s->credit : BATCH_RECORDS;
+
+    for (int i = 0; i < n; i++) {
+        record_make(&out[i], s->sent + i);
+    }
+    return n;
+}
+
+static stream_t up = { .name = "app->net" };   // FIFO writer -> forwarder -> server
+static stream_t down = { .name = "net->app" }; // Server -> forwarder -> FIFO reader
+
+// --- Fault-injecting server ---
+// One connection at a time, as the forwarder's route only ever has one.
+
+#define FAULT_RESET 0
+#define FAULT_CLOSE 1
+#define FAULT_HALF_CLOSE 2
+#define FAULT_STALL 3
+#define FAULT_SLOW_ACCEPT 4
+#define NUM_FAULTS 5
+
+static const char *fault_names[NUM_FAULTS] = { "reset", "close", "halfclose", "stall", "slowaccept" };
+
+typedef struct {
+    int listen_fd;
+    int port;
+    int fd;                  // Current connection, -1 between connections
+    int fault;               // FAULT_* that ends it
+    long long fault_at;      // When (ms)
+    long long stall_until;   // No reads or writes before this
+    long long half_closed_at; // When shutdown(SHUT_WR) was sent (halfclose, close, slowaccept), 0 if not
+    long long accept_after;  // slowaccept: leave the next connection in the backlog until then
+    long long faulted_ns;    // When a connection was last broken, 0 once data flows on the next one
+    int reconnected;         // The connection after that break has been accepted
+    record_t out[BATCH_RECORDS];
+    size_t out_len, out_off; // Bytes of 'out' built and sent
+    uint64_t out_first;      // Sequence number of out[0]
+    uint64_t connections;
+    uint64_t faults[NUM_FAULTS];
+    uint64_t hangups;        // Connections the forwarder closed without being asked to
+    uint64_t ignored_half_closes; // Half-closed connections it kept past HALF_CLOSE_TIMEOUT_MS
+    metrics_hist_t reconnect_us; // Break -> next connection accepted
+    metrics_hist_t recover_us;   // Break -> first new app->net record on the next connection
+} server_t;
+
+static server_t server = { .listen_fd = -1, .fd = -1 };
+static int fault_mask = (1 << NUM_FAULTS) - 1;
+static int lifetime_ms = DEFAULT_LIFETIME_MS;
+
+// Listen on an ephemeral loopback port; returns the fd and sets *port, or -1
+static int listen_loopback(int *port) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 16) == -1 ||
+        getsockname(fd, (struct sockaddr *)&addr, &len) == -1) {
+        perror("bind/listen");
+        close(fd);
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static int server_start(void) {
+    server.listen_fd = listen_loopback(&server.port);
+    return server.listen_fd == -1 ? -1 : 0;
+}
+
+static int pick_fault(void) {
+    int fault;
+
+    do {
+        fault = (int)(rng_next() % NUM_FAULTS);
+    } while (!(fault_mask & (1 << fault)));
+    return fault;
+}
+
+// Close the connection. A RST discards whatever either side still had queued.
+static void server_drop(int reset) {
+    if (reset) {
+        struct linger lin = { .l_onoff = 1, .l_linger = 0 };
+        setsockopt(server.fd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+    }
+    close(server.fd);
+    server.fd = -1;
+    server.out_len = server.out_off = 0; // Records not fully sent are built again next time
+    server.half_closed_at = 0;
+    server.stall_until = 0;
+    if (server.faulted_ns == 0 || server.reconnected) {
+        server.faulted_ns = now_ns();
+        server.reconnected = 0;
+    }
+    stream_restart(&up);
+}
+
+static void server_accept(int draining) {
+    int fd = accept4(server.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (fd == -1) {
+        return;
+    }
+    server.fd = fd;
+    server.connections++;
+    server.fault = pick_fault();
+    server.fault_at = draining ? LLONG_MAX : now_ms() + jitter_ms(lifetime_ms);
+    if (server.faulted_ns != 0 && !server.reconnected) {
+        metrics_hist_record(&server.reconnect_us, (now_ns() - server.faulted_ns) / 1000);
+        server.reconnected = 1;
+    }
+}
+
+// Send a FIN after whatever is queued and keep reading until the forwarder
+// hangs up (or HALF_CLOSE_TIMEOUT_MS passes). A plain close() with data still
+// unread on either side would send a RST, which throws away records the
+// forwarder was never given a chance to deliver and makes them look lost.
+static void server_shutdown(long long now) {
+    shutdown(server.fd, SHUT_WR);
+    server.half_closed_at = now;
+    server.fault_at = LLONG_MAX;
+}
+
+static void server_fault(long long now) {
+    server.faults[server.fault]++;
+    switch (server.fault) {
+    case FAULT_RESET:
+        server_drop(1);
+        break;
+    case FAULT_CLOSE:
+        server_shutdown(now);
+        break;
+    case FAULT_SLOW_ACCEPT:
+        server_shutdown(now);
+        server.accept_after = now + jitter_ms(lifetime_ms * 2);
+        break;
+    case FAULT_HALF_CLOSE:
+        // Nothing more is sent on this connection until the forwarder hangs up
+        server_shutdown(now);
+        break;
+    case FAULT_STALL:
+        // The forwarder has to hold both directions until this ends; the
+        // connection then lives on until its next fault
+        server.stall_until = now + jitter_ms(lifetime_ms * 2);
+        server.fault = pick_fault();
+        server.fault_at = server.stall_until + jitter_ms(lifetime_ms);
+        break;
+    }
+}
+
+// Read what the forwarder sent; returns -1 once the connection is gone
+static int server_read(void) {
+    ssize_t n = recv(server.fd, up.buf + up.len, sizeof(up.buf) - up.len, MSG_DONTWAIT);
+
+    if (n > 0) {
+        up.len += n;
+        if (stream_scan(&up) > 0 && server.faulted_ns != 0 && server.reconnected) {
+            metrics_hist_record(&server.recover_us, (now_ns() - server.faulted_ns) / 1000);
+            server.faulted_ns = 0;
+        }
+        return 0;
+    }
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return 0;
+    }
+    if (server.half_closed_at == 0) {
+        server.hangups++;
+    }
+    server_drop(0);
+    return -1;
+}
+
+static void server_write(void) {
+    ssize_t n;
+
+    if (server.out_off == server.out_len) {
+        int count = stream_batch(&down, server.out);
+        down.credit -= count;
+        server.out_first = down.sent;
+        server.out_len = (size_t)count * RECORD_SIZE;
+        server.out_off = 0;
+    }
+    n = send(server.fd, (char *)server.out + server.out_off, server.out_len - server.out_off, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n > 0) {
+        server.out_off += n;
+        down.sent = server.out_first + server.out_off / RECORD_SIZE;
+    } else if (n == -1 && errno != EAGAIN && errno != EINTR) {
+        server.hangups++;
+        server_drop(0);
+    }
+}
+
+// --- App side of the FIFOs ---
+
+typedef struct {
+    int fd;
+    long long close_at;      // End of this session (ms)
+    long long open_at;       // Next open attempt while closed
+    uint64_t opens;
+} fifo_end_t;
+
+static fifo_end_t writer = { .fd = -1 };
+static fifo_end_t reader = { .fd = -1 };
+static int fifo_lifetime_ms = DEFAULT_FIFO_LIFETIME_MS;
+static int fifo_churn = 1;
+static record_t writer_out[BATCH_RECORDS];
+
+static void fifo_close(fifo_end_t *end, long long now) {
+    close(end->fd);
+    end->fd = -1;
+    end->open_at = now + (long long)(rng_next() % (uint64_t)(fifo_lifetime_ms / 4 + 1));
+}
+
+static void fifo_open(fifo_end_t *end, const char *path, int flags, int draining, long long now) {
+    end->fd = open(path, flags | O_NONBLOCK | O_CLOEXEC);
+    if (end->fd == -1) {
+        end->open_at = now + 1; // ENOENT or ENXIO: the forwarder has not created or opened it yet
+        return;
+    }
+    end->opens++;
+    end->close_at = draining || !fifo_churn ? LLONG_MAX : now + jitter_ms(fifo_lifetime_ms);
+    if (end == &reader) {
+        stream_restart(&down);
+    }
+}
+
+static void writer_write(long long now) {
+    int count = stream_batch(&up, writer_out);
+    ssize_t n = write(writer.fd, writer_out, (size_t)count * RECORD_SIZE);
+
+    if (n > 0) {
+        // Whole records only: the write is at most PIPE_BUF bytes
+        up.sent += n / RECORD_SIZE;
+        up.credit -= n / RECORD_SIZE;
+    } else if (n == -1 && errno == EPIPE) {
+        fifo_close(&writer, now); // The forwarder closed its read end
+    }
+}
+
+static void reader_read(long long now) {
+    ssize_t n = read(reader.fd, down.buf + down.len, sizeof(down.buf) - down.len);
+
+    if (n > 0) {
+        down.len += n;
+        stream_scan(&down);
+    } else if (n == 0) {
+        fifo_close(&reader, now); // The forwarder closed its write end
+        reader.open_at = now + 1;
+    }
+}
+
+// --- Route file churn (-c) ---
+
+// Config routes all go to a second server that holds their connections open,
+// sends a chunk on each before every reload and discards what comes back, so
+// the forwarder's workers have events pending on the routes a reload removes.
+typedef struct {
+    int enabled;
+    int listen_fd;
+    int port;
+    char path[64];           // The route file
+    int listed[CONFIG_ROUTES];
+    int fds[MAX_CHURN_CONNS];
+    int num_fds;
+    long long reload_at;     // Next rewrite and SIGHUP (ms)
+    uint64_t reloads, added, removed;
+    uint64_t connections;
+    uint64_t hangups;        // Connections the forwarder closed, normally because their route was removed
+} churn_t;
+
+static churn_t churn = { .listen_fd = -1 };
+static int reload_ms = DEFAULT_RELOAD_MS;
+static char churn_out[CHURN_CHUNK];
+
+static void churn_fifo(char *buf, size_t size, int slot, const char *dir) {
+    snprintf(buf, size, "/tmp/netpipe_stress.%d.%d.%s", (int)getpid(), slot, dir);
+}
+
+// Write the route file in one step, so a reload never sees half of it
+static int churn_write_config(void) {
+    char tmp[80], n2p[64], p2n[64];
+    FILE *f;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", churn.path);
+    f = fopen(tmp, "w");
+    if (f == NULL) {
+        perror(tmp);
+        return -1;
+    }
+    fprintf(f, "# Written by netpipe_stress\n");
+    for (int i = 0; i < CONFIG_ROUTES; i++) {
+        if (churn.listed[i]) {
+            churn_fifo(n2p, sizeof(n2p), i, "n2p");
+            churn_fifo(p2n, sizeof(p2n), i, "p2n");
+            fprintf(f, "127.0.0.1 %d %s %s\n", churn.port, n2p, p2n);
+        }
+    }
+    if (fclose(f) != 0 || rename(tmp, churn.path) == -1) {
+        perror(churn.path);
+        return -1;
+    }
+    return 0;
+}
+
+static int churn_start(void) {
+    snprintf(churn.path, sizeof(churn.path), "/tmp/netpipe_stress.%d.routes", (int)getpid());
+    churn.listen_fd = listen_loopback(&churn.port);
+    if (churn.listen_fd == -1) {
+        return -1;
+    }
+    for (int i = 0; i < CONFIG_ROUTES; i++) {
+        churn.listed[i] = i % 2;
+    }
+    return churn_write_config();
+}
+
+// Put data in flight on every config route, flip about half of the slots and
+// have the forwarder re-read the file
+static void churn_reload(pid_t forwarder, long long now) {
+    for (int i = 0; i < churn.num_fds; i++) {
+        if (write(churn.fds[i], churn_out, sizeof(churn_out)) == -1 && errno != EAGAIN) {
+            shutdown(churn.fds[i], SHUT_RDWR); // Noticed and closed by churn_read
+        }
+    }
+    for (int i = 0; i < CONFIG_ROUTES; i++) {
+        if (rng_next() % 2) {
+            churn.listed[i] = !churn.listed[i];
+            if (churn.listed[i]) {
+                churn.added++;
+            } else {
+                churn.removed++;
+            }
+        }
+    }
+    if (churn_write_config() == 0) {
+        kill(forwarder, SIGHUP);
+        churn.reloads++;
+    }
+    churn.reload_at = now + jitter_ms(reload_ms);
+}
+
+static void churn_accept(void) {
+    int fd = accept4(churn.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (fd == -1) {
+        return;
+    }
+    churn.connections++;
+    if (churn.num_fds == MAX_CHURN_CONNS) {
+        close(fd); // The forwarder will dial again
+        return;
+    }
+    churn.fds[churn.num_fds++] = fd;
+}
+
+// Discard what arrives on connection 'i'; drop it once the forwarder closes it
+static void churn_read(int i) {
+    char buf[4096];
+    ssize_t n = read(churn.fds[i], buf, sizeof(buf));
+
+    if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+        close(churn.fds[i]);
+        churn.fds[i] = churn.fds[--churn.num_fds];
+        churn.hangups++;
+    }
+}
+
+static void churn_stop(void) {
+    char name[64];
+
+    for (int i = 0; i < churn.num_fds; i++) {
+        close(churn.fds[i]);
+    }
+    churn.num_fds = 0;
+    unlink(churn.path);
+    for (int i = 0; i < CONFIG_ROUTES; i++) {
+        churn_fifo(name, sizeof(name), i, "n2p");
+        unlink(name);
+        churn_fifo(name, sizeof(name), i, "p2n");
+        unlink(name);
+    }
+}
+
+// --- Forwarder process ---
+
+static const char *forwarder_bin = "./netpipe_forwarder";
+static int verbose = 0;
+static int lossless = 0;
+
+static pid_t spawn_forwarder(char **extra, int num_extra) {
+    char port[16];
+    char **argv = calloc(num_extra + 8, sizeof(char *));
+    int argc = 0;
+    pid_t pid;
+
+    if (argv == NULL) {
+        return -1;
+    }
+    snprintf(port, sizeof(port), "%d", server.port);
+    argv[argc++] = (char *)forwarder_bin;
+    argv[argc++] = "-h";
+    argv[argc++] = "127.0.0.1";
+    argv[argc++] = "-p";
+    argv[argc++] = port;
+    if (churn.enabled) {
+        argv[argc++] = "-c";
+        argv[argc++] = churn.path;
+    }
+    for (int i = 0; i < num_extra; i++) {
+        argv[argc++] = extra[i];
+    }
+    pid = fork();
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_RDWR);
+        dup2(null_fd, STDIN_FILENO);
+        if (!verbose) {
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+        execv(argv[0], argv);
+        perror("execv");
+        _exit(127);
+    }
+    free(argv);
+    return pid;
+}
+
+// User plus system CPU time of 'pid' in ms, or -1
+static long long proc_cpu_ms(pid_t pid) {
+    char path[64], buf[1024];
+    unsigned long long utime, stime;
+    ssize_t n;
+    char *p;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+    p = strrchr(buf, ')'); // The command name may contain spaces
+    if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2) {
+        return -1;
+    }
+    return (long long)((utime + stime) * 1000 / sysconf(_SC_CLK_TCK));
+}
+
+// Stop the forwarder and return its wait status (-1 if it had to be killed)
+static int stop_forwarder(pid_t pid) {
+    long long deadline = now_ms() + 10000; // ThreadSanitizer takes a while to write its report
+    int status;
+
+    kill(pid, SIGINT);
+    while (waitpid(pid, &status, WNOHANG) == 0) {
+        if (now_ms() > deadline) {
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+            return -1;
+        }
+        sleep_ms(5);
+    }
+    return status;
+}
+
+// --- Report ---
+
+static void print_stream(const stream_t *s) {
+    uint64_t lost = s->sent > s->unique ? s->sent - s->unique : 0;
+
+    printf("%-9s %10llu %10llu %9llu %7.3f%% %8llu %8llu %12llu\n", s->name, (unsigned long long)s->sent,
+           (unsigned long long)s->unique, (unsigned long long)lost, s->sent ? 100.0 * lost / s->sent : 0.0,
+           (unsigned long long)s->dups * RECORD_SIZE, (unsigned long long)s->late, (unsigned long long)s->torn);
+}
+
+static void print_hist(const char *name, const metrics_hist_t *hist) {
+    printf("%-13s", name);
+    if (hist->count == 0) {
+        printf(" -\n");
+        return;
+    }
+    printf(" p50 %.2f  p99 %.2f  p999 %.2f  max %.2f  (%llu samples)\n", metrics_hist_quantile(hist, 0.5) / 1e3,
+           metrics_hist_quantile(hist, 0.99) / 1e3, metrics_hist_quantile(hist, 0.999) / 1e3, hist->max / 1e3,
+           (unsigned long long)hist->count);
+}
+
+static void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--duration ms] [--lifetime ms] [--faults f1,f2,...] [--fifo-lifetime ms]\n", prog);
+    fprintf(stderr, "       [--rate records/s] [-c] [--reload ms] [--lossless] [--seed n] [--forwarder path] [-v]\n");
+    fprintf(stderr, "       [-- forwarder options]\n\n");
+    fprintf(stderr, "Runs netpipe_forwarder against a built-in TCP server that breaks every connection\n");
+    fprintf(stderr, "after a short random lifetime, while the FIFO ends on the app side close and reopen,\n");
+    fprintf(stderr, "and reports data lost, duplicated and delivered late, time to reconnect and recover,\n");
+    fprintf(stderr, "and forwarder CPU time. Uses the default FIFOs %s and %s.\n\n", PIPE_NET_TO_APP_NAME, PIPE_APP_TO_NET_NAME);
+    fprintf(stderr, "  --duration       Milliseconds of faults (default %d), followed by a drain.\n", DEFAULT_DURATION_MS);
+    fprintf(stderr, "  --lifetime       Mean connection lifetime in ms (default %d).\n", DEFAULT_LIFETIME_MS);
+    fprintf(stderr, "  --faults         Faults to inject (default all):");
+    for (int i = 0; i < NUM_FAULTS; i++) {
+        fprintf(stderr, " %s", fault_names[i]);
+    }
+    fprintf(stderr, "\n  --fifo-lifetime  Mean FIFO reader/writer session in ms (default %d, 0 = keep open).\n", DEFAULT_FIFO_LIFETIME_MS);
+    fprintf(stderr, "  --rate           Records of %d bytes per second, each way (default %d, 0 = unlimited).\n", RECORD_SIZE, DEFAULT_RATE);
+    fprintf(stderr, "  -c               Also run %d routes from a route file, and rewrite it and send SIGHUP\n", CONFIG_ROUTES);
+    fprintf(stderr, "                   during the run, adding and removing routes while they carry data.\n");
+    fprintf(stderr, "  --reload         Mean time between -c reloads in ms (default %d).\n", DEFAULT_RELOAD_MS);
+    fprintf(stderr, "  --lossless       Fail if any record is lost (use with --fifo-lifetime 0 and no reset).\n");
+    fprintf(stderr, "  --seed           Random seed, to repeat a run (default: time).\n");
+    fprintf(stderr, "  --forwarder      Forwarder binary (default ./netpipe_forwarder).\n");
+    fprintf(stderr, "  -v               Show forwarder output.\n");
+}
+
+int main(int argc, char *argv[]) {
+    int duration_ms = DEFAULT_DURATION_MS;
+    int rate = DEFAULT_RATE;
+    char **extra = NULL;
+    int num_extra = 0;
+    long long start_ms, end_ms, drain_end_ms, last_ns, cpu_start, cpu_end = -1;
+    pid_t forwarder;
+    int status = 0, exited = 0, draining = 0;
+    const char *failure = NULL;
+
+    signal(SIGPIPE, SIG_IGN);
+    rng_state = (uint64_t)now_ns() | 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            extra = argv + i + 1;
+            num_extra = argc - i - 1;
+            break;
+        } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+            duration_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lifetime") == 0 && i + 1 < argc) {
+            lifetime_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--faults") == 0 && i + 1 < argc) {
+            char *list = argv[++i], *tok, *save = NULL;
+            fault_mask = 0;
+            for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+                int f;
+                for (f = 0; f < NUM_FAULTS && strcmp(tok, fault_names[f]) != 0; f++) {
+                }
+                if (f == NUM_FAULTS) {
+                    fprintf(stderr, "Unknown fault '%s'.\n", tok);
+                    return EXIT_FAILURE;
+                }
+                fault_mask |= 1 << f;
+            }
+        } else if (strcmp(argv[i], "--fifo-lifetime") == 0 && i + 1 < argc) {
+            fifo_lifetime_ms = atoi(argv[++i]);
+            fifo_churn = fifo_lifetime_ms > 0;
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            rate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-c") == 0) {
+            churn.enabled = 1;
+        } else if (strcmp(argv[i], "--reload") == 0 && i + 1 < argc) {
+            reload_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lossless") == 0) {
+            lossless = 1;
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            rng_state = strtoull(argv[++i], NULL, 10) | 1;
+        } else if (strcmp(argv[i], "--forwarder") == 0 && i + 1 < argc) {
+            forwarder_bin = argv[++i];
+        } else if (strcmp(argv[i], "-v") == 0) {
+            verbose = 1;
+        } else {
+            print_usage(argv[0]);
+            return strcmp(argv[i], "--help") == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (duration_ms <= 0 || lifetime_ms <= 0 || fault_mask == 0 || fifo_lifetime_ms < 0 || rate < 0 || reload_ms <= 0) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    printf("Seed %llu\n", (unsigned long long)rng_state);
+
+    if (server_start() == -1 || (churn.enabled && churn_start() == -1)) {
+        return EXIT_FAILURE;
+    }
+    unlink(PIPE_NET_TO_APP_NAME);
+    unlink(PIPE_APP_TO_NET_NAME);
+    forwarder = spawn_forwarder(extra, num_extra);
+    if (forwarder == -1) {
+        perror("fork");
+        return EXIT_FAILURE;
+    }
+
+    start_ms = now_ms();
+    end_ms = start_ms + duration_ms;
+    drain_end_ms = LLONG_MAX;
+    last_ns = now_ns();
+    cpu_start = proc_cpu_ms(forwarder);
+    up.last_rx_ms = down.last_rx_ms = start_ms + STARTUP_TIMEOUT_MS;
+    server.faulted_ns = last_ns; // Time to the first connection counts as a reconnect
+    while (failure == NULL) {
+        struct pollfd pfds[5 + MAX_CHURN_CONNS];
+        long long now = now_ms(), ns = now_ns();
+        int stalled = server.stall_until > now;
+
+        if (!draining) {
+            stream_refill(&up, rate, ns - last_ns);
+            stream_refill(&down, rate, ns - last_ns);
+        }
+        last_ns = ns;
+
+        // Timed events
+        if (!draining && now >= end_ms) {
+            // Stop the faults and the churn, and wait for what is in flight
+            draining = 1;
+            cpu_end = proc_cpu_ms(forwarder);
+            up.credit = down.credit = 0;
+            server.accept_after = 0;
+            server.stall_until = 0;
+            if (server.fd != -1 && server.half_closed_at == 0) {
+                server.fault_at = LLONG_MAX;
+            }
+            writer.close_at = reader.close_at = LLONG_MAX;
+            drain_end_ms = now + STALL_TIMEOUT_MS;
+        }
+        if (server.fd != -1 && now >= server.fault_at) {
+            server_fault(now);
+        }
+        if (server.fd != -1 && server.half_closed_at != 0 && now - server.half_closed_at > HALF_CLOSE_TIMEOUT_MS) {
+            server.ignored_half_closes++;
+            server_drop(1);
+        }
+        if (writer.fd != -1 && now >= writer.close_at) {
+            fifo_close(&writer, now);
+        }
+        if (writer.fd == -1 && now >= writer.open_at) {
+            fifo_open(&writer, PIPE_APP_TO_NET_NAME, O_WRONLY, draining, now);
+        }
+        if (reader.fd != -1 && now >= reader.close_at) {
+            fifo_close(&reader, now);
+        }
+        if (reader.fd == -1 && now >= reader.open_at) {
+            fifo_open(&reader, PIPE_NET_TO_APP_NAME, O_RDONLY, draining, now);
+        }
+        // Not before the first connection: until then SIGHUP may still be fatal to the forwarder
+        if (churn.enabled && !draining && server.connections > 0 && now >= churn.reload_at) {
+            churn_reload(forwarder, now);
+        }
+
+        // Health
+        if (waitpid(forwarder, &status, WNOHANG) == forwarder) {
+            exited = 1;
+            failure = "the forwarder exited during the run";
+            break;
+        }
+        if (server.faulted_ns != 0 && ns - server.faulted_ns > STALL_TIMEOUT_MS * 1000000LL) {
+            failure = server.reconnected ? "no data on the new connection" : "the forwarder did not reconnect";
+            break;
+        }
+        if (!draining && (now - up.last_rx_ms > STALL_TIMEOUT_MS || now - down.last_rx_ms > STALL_TIMEOUT_MS)) {
+            failure = now - up.last_rx_ms > STALL_TIMEOUT_MS ? "app->net stalled" : "net->app stalled";
+            break;
+        }
+        if (draining && ((up.unique >= up.sent && down.unique >= down.sent) ||
+                         (now - up.last_rx_ms > QUIET_MS && now - down.last_rx_ms > QUIET_MS) || now >= drain_end_ms)) {
+            break;
+        }
+
+        // I/O
+        pfds[0].fd = server.fd == -1 && now >= server.accept_after ? server.listen_fd : -1;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = stalled ? -1 : server.fd;
+        pfds[1].events = POLLIN;
+        if (server.half_closed_at == 0 && (server.out_off < server.out_len || down.credit >= 1)) {
+            pfds[1].events |= POLLOUT;
+        }
+        pfds[2].fd = writer.fd != -1 && up.credit >= 1 ? writer.fd : -1;
+        pfds[2].events = POLLOUT;
+        pfds[3].fd = reader.fd;
+        pfds[3].events = POLLIN;
+        pfds[4].fd = churn.listen_fd;
+        pfds[4].events = POLLIN;
+        for (int i = 0; i < churn.num_fds; i++) {
+            pfds[5 + i].fd = churn.fds[i];
+            pfds[5 + i].events = POLLIN;
+        }
+        if (poll(pfds, 5 + churn.num_fds, 1) <= 0) {
+            continue;
+        }
+        now = now_ms();
+        if (pfds[0].revents & POLLIN) {
+            server_accept(draining);
+        }
+        if (pfds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            if (server_read() == 0 && (pfds[1].revents & POLLOUT) && server.fd != -1) {
+                server_write();
+            }
+        } else if (pfds[1].revents & POLLOUT) {
+            server_write();
+        }
+        if (pfds[2].revents & (POLLOUT | POLLERR)) {
+            writer_write(now);
+        }
+        if (pfds[3].revents & (POLLIN | POLLHUP)) {
+            reader_read(now);
+        }
+        // Last to first: churn_read moves the last connection into the slot it frees
+        for (int i = churn.num_fds - 1; i >= 0; i--) {
+            if (pfds[5 + i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                churn_read(i);
+            }
+        }
+        if (pfds[4].revents & POLLIN) {
+            churn_accept();
+        }
+    }
+
+    if (cpu_end == -1) {
+        cpu_end = proc_cpu_ms(forwarder);
+    }
+    end_ms = draining ? end_ms : now_ms();
+    // The app goes away first, so no forwarder thread is left blocked on a full FIFO
+    if (writer.fd != -1) {
+        close(writer.fd);
+    }
+    if (reader.fd != -1) {
+        close(reader.fd);
+    }
+    if (!exited) {
+        status = stop_forwarder(forwarder);
+    }
+    if (failure == NULL && status != 0) {
+        failure = "the forwarder exited with an error";
+    }
+    if (failure == NULL && lossless && (up.unique < up.sent || down.unique < down.sent)) {
+        failure = up.unique < up.sent ? "app->net records lost" : "net->app records lost";
+    }
+    if (failure == NULL && churn.reloads > 0 && churn.connections == 0) {
+        failure = "no connections on routes from the route file";
+    }
+    if (server.fd != -1) {
+        close(server.fd);
+    }
+
+    {
+        double minutes = (end_ms - start_ms) / 60000.0;
+        uint64_t faults = 0;
+
+        for (int i = 0; i < NUM_FAULTS; i++) {
+            faults += server.faults[i];
+        }
+        printf("Connections %llu (%.0f/min), faults %llu:", (unsigned long long)server.connections,
+               server.connections / minutes, (unsigned long long)faults);
+        for (int i = 0; i < NUM_FAULTS; i++) {
+            if (fault_mask & (1 << i)) {
+                printf(" %s %llu", fault_names[i], (unsigned long long)server.faults[i]);
+            }
+        }
+        printf("\nForwarder hang-ups %llu, half-closes ignored %llu; FIFO opens: writer %llu, reader %llu\n",
+               (unsigned long long)server.hangups, (unsigned long long)server.ignored_half_closes,
+               (unsigned long long)writer.opens, (unsigned long long)reader.opens);
+        if (churn.enabled) {
+            printf("Route file reloads %llu (%llu routes added, %llu removed), connections %llu, closed by forwarder %llu\n",
+                   (unsigned long long)churn.reloads, (unsigned long long)churn.added,
+                   (unsigned long long)churn.removed, (unsigned long long)churn.connections,
+                   (unsigned long long)churn.hangups);
+        }
+        printf("%-9s %10s %10s %9s %8s %8s %8s %12s\n", "records", "sent", "received", "lost", "lost%", "dup B",
+               "late", "torn B");
+        print_stream(&up);
+        print_stream(&down);
+        print_hist("reconnect ms", &server.reconnect_us);
+        print_hist("recover ms", &server.recover_us);
+        if (cpu_start >= 0 && cpu_end >= 0) {
+            printf("Forwarder CPU %.2f s (%.1f%% of one core, %.3f ms per connection)\n", (cpu_end - cpu_start) / 1e3,
+                   100.0 * (cpu_end - cpu_start) / (end_ms - start_ms),
+                   server.connections ? (double)(cpu_end - cpu_start) / server.connections : 0.0);
+        }
+        if (status == -1) {
+            printf("Forwarder killed after not exiting on SIGINT\n");
+        } else if (WIFSIGNALED(status)) {
+            printf("Forwarder killed by signal %d\n", WTERMSIG(status));
+        } else {
+            printf("Forwarder exit status %d\n", WEXITSTATUS(status));
+        }
+    }
+    unlink(PIPE_NET_TO_APP_NAME);
+    unlink(PIPE_APP_TO_NET_NAME);
+    if (churn.enabled) {
+        churn_stop();
+    }
+    free(up.seen);
+    free(down.seen);
+    if (failure != NULL) {
+        printf("FAILED: %s\n", failure);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,281 @@
+// Minimal io_uring plumbing for netpipe_forwarder's --uring engine.
+//
+// Talks to the kernel through the raw io_uring_setup/enter/register system
+// calls, so there is no liburing dependency. One submission queue and one
+// completion queue are mapped into the process; the caller fills SQEs, and a
+// single io_uring_enter both submits everything queued since the last call and
+// waits for completions.
+//
+// Provided buffer rings (IORING_REGISTER_PBUF_RING) hand the kernel a pool of
+// receive buffers it picks from itself, which is what lets one multishot recv
+// keep completing without being re-armed.
+
+#ifndef NETPIPE_URING_H
+#define NETPIPE_URING_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+typedef struct {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_local_tail;            // SQEs filled in but not yet published to the kernel
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size, sqes_size;
+} uring_t;
+
+// Kernel-visible ring of provided buffers for one buffer group
+typedef struct {
+    struct io_uring_buf_ring *br;
+    unsigned entries;                  // Power of two
+    uint16_t tail;                     // Local tail, published by uring_buf_ring_advance
+    size_t map_size;
+} uring_buf_ring_t;
+
+static inline int uring_register(uring_t *ring, unsigned opcode, const void *arg, unsigned nr) {
+    return (int)syscall(__NR_io_uring_register, ring->fd, opcode, arg, nr);
+}
+
+static inline void uring_exit(uring_t *ring) {
+    if (ring->sqes && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_map && ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    if (ring->sq_map && ring->sq_map != MAP_FAILED) {
+        munmap(ring->sq_map, ring->sq_map_size);
+    }
+    if (ring->fd != -1) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+// Set up a ring with 'entries' SQEs and 'cq_entries' CQEs. Returns -1 with
+// errno set when io_uring is missing, disabled, or too old (no EXT_ARG waits
+// or single-mmap rings, i.e. before 5.11).
+static inline int uring_init(uring_t *ring, unsigned entries, unsigned cq_entries) {
+    struct io_uring_params p;
+    unsigned *sq_array;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+    // One thread submits and reaps, so completions can be run only when we wait
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = cq_entries;
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd == -1 && errno == EINVAL) { // Before 6.1
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = cq_entries;
+        ring->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    }
+    if (ring->fd == -1) {
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(p.features & IORING_FEAT_NODROP)) {
+        uring_exit(ring);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    ring->sq_entries = p.sq_entries;
+    ring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (ring->cq_map_size > ring->sq_map_size) {
+        ring->sq_map_size = ring->cq_map_size;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    ring->cq_map = ring->sq_map; // Single mmap: both rings share one mapping
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->sq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        uring_exit(ring);
+        return -1;
+    }
+
+    ring->sq_head = (unsigned *)((char *)ring->sq_map + p.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_map + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_map + p.sq_off.ring_mask);
+    sq_array = (unsigned *)((char *)ring->sq_map + p.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_map + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_map + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_map + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_map + p.cq_off.cqes);
+    // SQEs are always submitted in slot order, so the index array is the identity
+    for (unsigned i = 0; i < p.sq_entries; i++) {
+        sq_array[i] = i;
+    }
+    ring->sq_local_tail = *ring->sq_tail;
+    return 0;
+}
+
+// Free SQ slots, counting SQEs filled in but not yet submitted as used
+static inline unsigned uring_sq_space(uring_t *ring) {
+    return ring->sq_entries - (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE));
+}
+
+// Next free SQE, zeroed, or NULL when the queue is full (submit first)
+static inline struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+    struct io_uring_sqe *sqe;
+
+    if (uring_sq_space(ring) == 0) {
+        return NULL;
+    }
+    sqe = &ring->sqes[ring->sq_local_tail & *ring->sq_mask];
+    ring->sq_local_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// Submit everything queued and, if 'wait' is set, block until a completion
+// arrives, 'timeout_ms' passes (-1 = no limit) or a signal outside 'sigmask'
+// is delivered. Returns the number submitted, or -1 with errno (EINTR, ETIME).
+static inline int uring_submit_and_wait(uring_t *ring, int wait, long long timeout_ms, const sigset_t *sigmask) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE); // Incl. any left over
+    unsigned flags = 0;
+
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    if (!wait && submit == 0) {
+        return 0;
+    }
+    memset(&arg, 0, sizeof(arg));
+    if (wait) {
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        if (sigmask) {
+            arg.sigmask = (uint64_t)(uintptr_t)sigmask;
+            arg.sigmask_sz = _NSIG / 8;
+        }
+        if (timeout_ms >= 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+    }
+    return (int)syscall(__NR_io_uring_enter, ring->fd, submit, wait ? 1 : 0, flags, wait ? &arg : NULL,
+                        wait ? sizeof(arg) : 0);
+}
+
+// Oldest unreaped completion, or NULL; release it with uring_cqe_seen
+static inline struct io_uring_cqe *uring_peek_cqe(uring_t *ring) {
+    unsigned head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+static inline void uring_cqe_seen(uring_t *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// Fixed-file table with 'count' empty slots, filled later by uring_set_file
+static inline int uring_register_files(uring_t *ring, int count) {
+    int fds[count];
+
+    for (int i = 0; i < count; i++) {
+        fds[i] = -1;
+    }
+    return uring_register(ring, IORING_REGISTER_FILES, fds, count);
+}
+
+// Point fixed-file slot 'slot' at 'fd' (-1 empties it). The ring holds its own
+// reference, so the caller closes 'fd' as usual once the slot no longer needs it.
+static inline int uring_set_file(uring_t *ring, int slot, int fd) {
+    struct io_uring_files_update up;
+
+    memset(&up, 0, sizeof(up));
+    up.offset = slot;
+    up.fds = (uint64_t)(uintptr_t)&fd;
+    return uring_register(ring, IORING_REGISTER_FILES_UPDATE, &up, 1) == 1 ? 0 : -1;
+}
+
+// Whether every opcode in 'ops' is supported by the running kernel
+static inline int uring_probe_ops(uring_t *ring, const int *ops, int count) {
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    int ok = probe != NULL && uring_register(ring, IORING_REGISTER_PROBE, probe, 256) == 0;
+
+    for (int i = 0; ok && i < count; i++) {
+        ok = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
+
+static inline int uring_buf_ring_setup(uring_t *ring, uring_buf_ring_t *bufs, unsigned entries, int group) {
+    struct io_uring_buf_reg reg;
+
+    memset(bufs, 0, sizeof(*bufs));
+    bufs->entries = entries;
+    bufs->map_size = entries * sizeof(struct io_uring_buf);
+    bufs->br = mmap(NULL, bufs->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufs->br == MAP_FAILED) {
+        bufs->br = NULL;
+        return -1;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)bufs->br;
+    reg.ring_entries = entries;
+    reg.bgid = group;
+    if (uring_register(ring, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        munmap(bufs->br, bufs->map_size);
+        bufs->br = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static inline void uring_buf_ring_free(uring_buf_ring_t *bufs) {
+    if (bufs->br) {
+        munmap(bufs->br, bufs->map_size);
+        bufs->br = NULL;
+    }
+}
+
+// Queue buffer 'bid' for the kernel; it becomes visible at the next advance
+static inline void uring_buf_ring_add(uring_buf_ring_t *bufs, void *addr, unsigned len, uint16_t bid) {
+    struct io_uring_buf *buf = &bufs->br->bufs[bufs->tail & (bufs->entries - 1)];
+
+    buf->addr = (uint64_t)(uintptr_t)addr;
+    buf->len = len;
+    buf->bid = bid;
+    bufs->tail++;
+}
+
+static inline void uring_buf_ring_advance(uring_buf_ring_t *bufs) {
+    __atomic_store_n(&bufs->br->tail, bufs->tail, __ATOMIC_RELEASE);
+}
+
+static inline void uring_prep_rw(struct io_uring_sqe *sqe, int op, int slot, const void *addr, unsigned len,
+                                 uint64_t user_data) {
+    sqe->opcode = op;
+    sqe->fd = slot;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->off = (uint64_t)-1; // Streams: no file position
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->user_data = user_data;
+}
+
+#endif // NETPIPE_URING_H